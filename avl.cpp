@@ -145,3 +145,110 @@ AVLNode *avl_offset(AVLNode *node, int64_t offset) {
     }
     return node;
 }
+
+// Joins `left`, `mid` and `right`, where every node of `left` is ordered
+// before `mid` and every node of `right` after it. `mid` is attached where
+// the spine of the taller tree reaches the height of the shorter one, then
+// the path above it is rebalanced, so this is O(|height difference|).
+AVLNode *avl_join(AVLNode *left, AVLNode *mid, AVLNode *right) {
+    uint32_t hl = avl_height(left);
+    uint32_t hr = avl_height(right);
+    AVLNode *parent = NULL;
+    if (hl > hr + 1) {
+        while (avl_height(left) > hr + 1) {
+            parent = left;
+            left = left->right;
+        }
+    } else if (hr > hl + 1) {
+        while (avl_height(right) > hl + 1) {
+            parent = right;
+            right = right->left;
+        }
+    }
+    mid->left = left;
+    mid->right = right;
+    mid->parent = parent;
+    if (left) {
+        left->parent = mid;
+    }
+    if (right) {
+        right->parent = mid;
+    }
+    if (!parent) {
+        avl_update(mid);
+        return mid;
+    }
+    if (hl > hr + 1) {
+        parent->right = mid;
+    } else {
+        parent->left = mid;
+    }
+    return avl_fix(mid);
+}
+
+// Splits the tree into its first `rank` nodes and the rest, by cutting the
+// path to the split point and joining the pieces on each side back up.
+void avl_split(AVLNode *root, uint64_t rank, AVLNode **left, AVLNode **right) {
+    if (!root) {
+        *left = *right = NULL;
+        return;
+    }
+    AVLNode *l = root->left;
+    AVLNode *r = root->right;
+    if (l) {
+        l->parent = NULL;
+    }
+    if (r) {
+        r->parent = NULL;
+    }
+    if (rank <= avl_cnt(l)) {
+        AVLNode *rest = NULL;
+        avl_split(l, rank, left, &rest);
+        *right = avl_join(rest, root, r);
+    } else {
+        AVLNode *rest = NULL;
+        avl_split(r, rank - avl_cnt(l) - 1, &rest, right);
+        *left = avl_join(l, root, rest);
+    }
+}
+
+// concatenates two trees, with every node of `left` ordered first
+AVLNode *avl_concat(AVLNode *left, AVLNode *right) {
+    if (!left || !right) {
+        return left ? left : right;
+    }
+    AVLNode *mid = right;
+    while (mid->left) {
+        mid = mid->left;
+    }
+    right = avl_del(mid);
+    return avl_join(left, mid, right);
+}
+
+// the number of nodes ordered before `node`
+uint64_t avl_rank(AVLNode *node) {
+    uint64_t rank = avl_cnt(node->left);
+    for (; node->parent; node = node->parent) {
+        if (node->parent->right == node) {
+            rank += avl_cnt(node->parent->left) + 1;
+        }
+    }
+    return rank;
+}
+
+void avl_move(AVLNode *from, AVLNode *to, AVLNode **root) {
+    if (!to->parent) {
+        assert(*root == from);
+        *root = to;
+    } else if (to->parent->left == from) {
+        to->parent->left = to;
+    } else {
+        to->parent->right = to;
+    }
+    if (to->left) {
+        to->left->parent = to;
+    }
+    if (to->right) {
+        to->right->parent = to;
+    }
+}
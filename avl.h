@@ -24,3 +24,9 @@ inline uint32_t avl_cnt(AVLNode *node) { return node ? node->cnt : 0; }
 AVLNode *avl_fix(AVLNode *node);
 AVLNode *avl_del(AVLNode *node);
 AVLNode *avl_offset(AVLNode *node, int64_t offset);
+uint64_t avl_rank(AVLNode *node);
+AVLNode *avl_join(AVLNode *left, AVLNode *mid, AVLNode *right);
+AVLNode *avl_concat(AVLNode *left, AVLNode *right);
+void     avl_split(AVLNode *root, uint64_t rank, AVLNode **left, AVLNode **right);
+// points the parent and children of `from` at `to`, a copy of it
+void     avl_move(AVLNode *from, AVLNode *to, AVLNode **root);
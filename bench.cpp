@@ -0,0 +1,761 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "common.h"
+#include "hashtable.h"
+#include "zset.h"
+#include "heap.h"
+#include "hist.h"
+#include "set.h"
+#include "hll.h"
+#include "bitmap.h"
+#include "qlist.h"
+#include "ts.h"
+#include "bloom.h"
+
+
+// Microbenchmarks for the core data structures. Each result is one JSON
+// object per line on stdout so that runs can be diffed or post-processed;
+// progress goes to stderr.
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static uint64_t g_rng = 1;
+
+static uint64_t rng_next() {
+    g_rng ^= g_rng >> 12;
+    g_rng ^= g_rng << 25;
+    g_rng ^= g_rng >> 27;
+    return g_rng * 0x2545F4914F6CDD1Dull;
+}
+
+static struct {
+    uint64_t max_size = 1000000;
+    uint64_t min_ops = 1 << 20;     // repeat small benchmarks up to this
+    const char *filter = NULL;
+} g_opt;
+
+// keep results alive so the compiler cannot drop the measured work
+static volatile uint64_t g_sink;
+
+static bool bench_enabled(const char *name) {
+    return !g_opt.filter || strstr(name, g_opt.filter);
+}
+
+static void emit(const char *name, uint64_t n, uint64_t ops, uint64_t ns,
+    const char *extra = "")
+{
+    printf("{\"bench\":\"%s\",\"n\":%llu,\"ops\":%llu,\"ns_per_op\":%.2f%s}\n",
+        name, (unsigned long long)n, (unsigned long long)ops,
+        ops ? (double)ns / (double)ops : 0.0, extra);
+    fflush(stdout);
+}
+
+static void emit_hist(const char *name, uint64_t n, const Hist *h) {
+    char extra[256];
+    snprintf(extra, sizeof(extra),
+        ",\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu",
+        (unsigned long long)hist_percentile(h, 50),
+        (unsigned long long)hist_percentile(h, 99),
+        (unsigned long long)hist_percentile(h, 99.9),
+        (unsigned long long)h->max);
+    emit(name, n, h->count, h->sum, extra);
+}
+
+static uint64_t ops_for(uint64_t n) {
+    return n > g_opt.min_ops ? n : g_opt.min_ops;
+}
+
+// hashtable
+
+struct BNode {
+    HNode node;
+    uint64_t key = 0;
+};
+
+static bool bnode_eq(HNode *lhs, HNode *rhs) {
+    return container_of(lhs, BNode, node)->key
+        == container_of(rhs, BNode, node)->key;
+}
+
+static uint64_t key_hash(uint64_t key) {
+    return str_hash((uint8_t *)&key, sizeof(key));
+}
+
+static void bench_hashtable(uint64_t n) {
+    std::vector<BNode> nodes(n);
+    for (uint64_t i = 0; i < n; i++) {
+        nodes[i].key = i;
+        nodes[i].node.hcode = key_hash(i);
+    }
+
+    HMap hmap;
+    if (bench_enabled("hm_insert")) {
+        uint64_t t0 = get_monotonic_nsec();
+        for (uint64_t i = 0; i < n; i++) {
+            hm_insert(&hmap, &nodes[i].node);
+        }
+        emit("hm_insert", n, n, get_monotonic_nsec() - t0);
+
+        // the same growth again, timing every insert to expose rehash spikes
+        hm_clear(&hmap);
+        Hist hist;
+        for (uint64_t i = 0; i < n; i++) {
+            uint64_t t = get_monotonic_nsec();
+            hm_insert(&hmap, &nodes[i].node);
+            hist_add(&hist, get_monotonic_nsec() - t);
+        }
+        emit_hist("hm_insert_latency", n, &hist);
+    } else {
+        for (uint64_t i = 0; i < n; i++) {
+            hm_insert(&hmap, &nodes[i].node);
+        }
+    }
+
+    uint64_t ops = ops_for(n);
+    if (bench_enabled("hm_lookup_hit")) {
+        BNode key;
+        uint64_t found = 0;
+        uint64_t t0 = get_monotonic_nsec();
+        for (uint64_t i = 0; i < ops; i++) {
+            key.key = rng_next() % n;
+            key.node.hcode = key_hash(key.key);
+            found += hm_lookup(&hmap, &key.node, &bnode_eq) != NULL;
+        }
+        emit("hm_lookup_hit", n, ops, get_monotonic_nsec() - t0);
+        assert(found == ops);
+        g_sink = found;
+    }
+    if (bench_enabled("hm_lookup_miss")) {
+        BNode key;
+        uint64_t found = 0;
+        uint64_t t0 = get_monotonic_nsec();
+        for (uint64_t i = 0; i < ops; i++) {
+            key.key = n + rng_next() % n;
+            key.node.hcode = key_hash(key.key);
+            found += hm_lookup(&hmap, &key.node, &bnode_eq) != NULL;
+        }
+        emit("hm_lookup_miss", n, ops, get_monotonic_nsec() - t0);
+        assert(found == 0);
+        g_sink = found;
+    }
+    if (bench_enabled("hm_delete")) {
+        std::vector<uint64_t> order(n);
+        for (uint64_t i = 0; i < n; i++) {
+            order[i] = i;
+        }
+        for (uint64_t i = n; i > 1; i--) {
+            std::swap(order[i - 1], order[rng_next() % i]);
+        }
+        BNode key;
+        uint64_t t0 = get_monotonic_nsec();
+        for (uint64_t i = 0; i < n; i++) {
+            key.key = order[i];
+            key.node.hcode = key_hash(key.key);
+            HNode *node = hm_delete(&hmap, &key.node, &bnode_eq);
+            assert(node);
+            (void)node;
+        }
+        emit("hm_delete", n, n, get_monotonic_nsec() - t0);
+    }
+    hm_clear(&hmap);
+}
+
+// sorted set
+
+static std::string member_name(uint64_t id) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "m%llu", (unsigned long long)id);
+    return buf;
+}
+
+static void bench_zset(uint64_t n) {
+    std::vector<std::string> names(n);
+    std::vector<double> scores(n);
+    for (uint64_t i = 0; i < n; i++) {
+        names[i] = member_name(i);
+        scores[i] = (double)(rng_next() % (n * 4));
+    }
+
+    ZSet zset;
+    uint64_t t0 = get_monotonic_nsec();
+    for (uint64_t i = 0; i < n; i++) {
+        zset_insert(&zset, names[i].data(), names[i].size(), scores[i]);
+    }
+    if (bench_enabled("zset_insert")) {
+        emit("zset_insert", n, n, get_monotonic_nsec() - t0);
+    }
+
+    uint64_t ops = ops_for(n);
+    if (bench_enabled("zset_lookup")) {
+        uint64_t found = 0;
+        t0 = get_monotonic_nsec();
+        for (uint64_t i = 0; i < ops; i++) {
+            const std::string &name = names[rng_next() % n];
+            found += zset_lookup(&zset, name.data(), name.size()) != NULL;
+        }
+        emit("zset_lookup", n, ops, get_monotonic_nsec() - t0);
+        g_sink = found;
+    }
+    if (bench_enabled("zset_seekge")) {
+        uint64_t found = 0;
+        t0 = get_monotonic_nsec();
+        for (uint64_t i = 0; i < ops; i++) {
+            double score = (double)(rng_next() % (n * 4));
+            found += zset_seekge(&zset, score, "", 0) != NULL;
+        }
+        emit("zset_seekge", n, ops, get_monotonic_nsec() - t0);
+        g_sink = found;
+    }
+    if (bench_enabled("zset_count")) {
+        uint64_t found = 0;
+        t0 = get_monotonic_nsec();
+        for (uint64_t i = 0; i < ops; i++) {
+            double lo = (double)(rng_next() % (n * 4));
+            double hi = lo + (double)(rng_next() % (n * 4));
+            found += zset_count_below(&zset, hi, true)
+                - zset_count_below(&zset, lo, false);
+        }
+        emit("zset_count", n, ops, get_monotonic_nsec() - t0);
+        g_sink = found;
+    }
+    if (bench_enabled("avl_offset")) {
+        std::vector<ZNode *> starts(1024);
+        for (ZNode *&node : starts) {
+            const std::string &name = names[rng_next() % n];
+            node = zset_lookup(&zset, name.data(), name.size());
+        }
+        for (uint64_t dist = 1; dist < n; dist *= 16) {
+            uint64_t found = 0;
+            t0 = get_monotonic_nsec();
+            for (uint64_t i = 0; i < ops; i++) {
+                AVLNode *node = &starts[i % starts.size()]->tree;
+                int64_t offset = (i & 1) ? (int64_t)dist : -(int64_t)dist;
+                found += avl_offset(node, offset) != NULL;
+            }
+            char extra[64];
+            snprintf(extra, sizeof(extra), ",\"dist\":%llu",
+                (unsigned long long)dist);
+            emit("avl_offset", n, ops, get_monotonic_nsec() - t0, extra);
+            g_sink = found;
+        }
+    }
+    if (bench_enabled("zset_trim")) {
+        // drop the lowest half, one member at a time and as a single range
+        ZSet copy;
+        for (uint64_t i = 0; i < n; i++) {
+            zset_insert(&copy, names[i].data(), names[i].size(), scores[i]);
+        }
+        t0 = get_monotonic_nsec();
+        for (uint64_t i = 0; i < n / 2; i++) {
+            zset_delete(&copy, zset_at(&copy, 0));
+        }
+        emit("zset_trim_each", n, n / 2, get_monotonic_nsec() - t0);
+        zset_clear(&copy);
+
+        for (uint64_t i = 0; i < n; i++) {
+            zset_insert(&copy, names[i].data(), names[i].size(), scores[i]);
+        }
+        t0 = get_monotonic_nsec();
+        AVLNode *tree = zset_detach_range(&copy, 0, n / 2);
+        emit("zset_trim_range", n, n / 2, get_monotonic_nsec() - t0);
+        zset_dispose(tree);
+        zset_clear(&copy);
+    }
+    if (bench_enabled("zset_build")) {
+        // the same members in (score, name) order, inserted one by one
+        // and bulk-built
+        std::vector<ZMember> sorted(n);
+        for (uint64_t i = 0; i < n; i++) {
+            ZNode *node = zset_at(&zset, i);
+            sorted[i].name = node->name;
+            sorted[i].len = node->len;
+            sorted[i].score = node->score;
+        }
+        ZSet copy;
+        t0 = get_monotonic_nsec();
+        for (const ZMember &m : sorted) {
+            zset_insert(&copy, m.name, m.len, m.score);
+        }
+        emit("zset_insert_sorted", n, n, get_monotonic_nsec() - t0);
+        zset_clear(&copy);
+
+        t0 = get_monotonic_nsec();
+        zset_build(&copy, sorted.data(), n);
+        emit("zset_build", n, n, get_monotonic_nsec() - t0);
+        zset_clear(&copy);
+    }
+    if (bench_enabled("zset_delete")) {
+        t0 = get_monotonic_nsec();
+        for (uint64_t i = 0; i < n; i++) {
+            ZNode *node = zset_lookup(&zset, names[i].data(), names[i].size());
+            zset_delete(&zset, node);
+        }
+        emit("zset_delete", n, n, get_monotonic_nsec() - t0);
+    }
+    zset_clear(&zset);
+}
+
+// TTL heap
+
+static void bench_heap(uint64_t n) {
+    if (!bench_enabled("heap_update")) {
+        return;
+    }
+    std::vector<HeapItem> heap(n);
+    std::vector<size_t> refs(n);
+    for (uint64_t i = 0; i < n; i++) {
+        heap[i].val = rng_next() % (n * 4);
+        heap[i].ref = &refs[i];
+        heap_update(heap.data(), i, i + 1);
+    }
+
+    uint64_t ops = ops_for(n);
+    uint64_t t0 = get_monotonic_nsec();
+    for (uint64_t i = 0; i < ops; i++) {
+        size_t pos = rng_next() % n;
+        heap[pos].val = rng_next() % (n * 4);
+        heap_update(heap.data(), pos, n);
+    }
+    emit("heap_update", n, ops, get_monotonic_nsec() - t0);
+    g_sink = heap[0].val;
+}
+
+// sets
+
+// n distinct integers of the given width, each picked from a pair of
+// neighbours so that two sets share about half of their members
+static void set_fill(Set *set, uint64_t n, uint32_t width) {
+    if (width == 2 && n > 32768) {
+        n = 32768;
+    }
+    std::vector<int64_t> vals(n);
+    for (uint64_t i = 0; i < n; i++) {
+        int64_t v = (int64_t)(i * 2 + rng_next() % 2);
+        if (width == 2) {
+            vals[i] = v - 32768;
+        } else if (width == 4) {
+            vals[i] = v - ((int64_t)1 << 30);
+        } else {
+            vals[i] = v << 32;
+        }
+    }
+    set_add_ints(set, vals);
+}
+
+static void bench_set(uint64_t n) {
+    static const uint32_t widths[] = {2, 4, 8};
+    for (uint32_t width : widths) {
+        char name[64];
+        snprintf(name, sizeof(name), "set_inter_w%u", width * 8);
+        if (!bench_enabled(name)) {
+            continue;
+        }
+        Set a, b;
+        set_fill(&a, n, width);
+        set_fill(&b, n, width);
+        uint64_t reps = ops_for(n) / n;
+        for (bool simd : {false, true}) {
+            if (simd && !set_use_simd(true)) {
+                break;
+            }
+            set_use_simd(simd);
+            uint64_t t0 = get_monotonic_nsec();
+            for (uint64_t i = 0; i < reps; i++) {
+                Set *sets[] = {&a, &b};
+                Set out;
+                set_inter(sets, 2, &out);
+                g_sink = set_size(&out);
+                set_clear(&out);
+            }
+            snprintf(name, sizeof(name), "set_inter_w%u_%s", width * 8, simd ? "simd" : "scalar");
+            emit(name, set_size(&a), reps, get_monotonic_nsec() - t0);
+        }
+        set_use_simd(true);
+        set_clear(&a);
+        set_clear(&b);
+    }
+}
+
+// HyperLogLog
+
+static void bench_hll(uint64_t n) {
+    const size_t nkeys = 16;
+    std::vector<Hll> hlls(nkeys);
+    std::vector<Hll *> ptrs;
+    char buf[32];
+    uint64_t t0 = get_monotonic_nsec();
+    for (size_t k = 0; k < nkeys; k++) {
+        for (uint64_t i = 0; i < n; i++) {
+            int len = snprintf(buf, sizeof(buf), "user:%llu", (unsigned long long)(k * n + i));
+            hll_add(&hlls[k], buf, (size_t)len);
+        }
+        ptrs.push_back(&hlls[k]);
+    }
+    if (bench_enabled("hll_add")) {
+        emit("hll_add", n, n * nkeys, get_monotonic_nsec() - t0);
+    }
+
+    for (bool simd : {false, true}) {
+        if (simd && !hll_use_simd(true)) {
+            break;
+        }
+        hll_use_simd(simd);
+        const char *name = simd ? "hll_count_16_simd" : "hll_count_16_scalar";
+        if (!bench_enabled(name)) {
+            continue;
+        }
+        uint64_t ops = 1000, card = 0;
+        t0 = get_monotonic_nsec();
+        for (uint64_t i = 0; i < ops; i++) {
+            card = hll_count(ptrs.data(), nkeys);
+        }
+        uint64_t ns = get_monotonic_nsec() - t0;
+        snprintf(buf, sizeof(buf), ",\"err\":%.4f",
+            ((double)card - (double)(n * nkeys)) / (double)(n * nkeys));
+        emit(name, n, ops, ns, buf);
+    }
+    hll_use_simd(true);
+    for (Hll &hll : hlls) {
+        hll_clear(&hll);
+    }
+}
+
+// bitmaps
+
+static void emit_gbps(const char *name, uint64_t n, uint64_t bytes, uint64_t ns) {
+    char extra[64];
+    snprintf(extra, sizeof(extra), ",\"gb_per_s\":%.2f", (double)bytes / (double)ns);
+    emit(name, n, bytes, ns, extra);
+}
+
+// n * 16 bytes per bitmap; results are per byte
+static void bench_bitmap(uint64_t n) {
+    const size_t nsrcs = 4;
+    size_t len = n * 16;
+    std::vector<std::vector<uint8_t>> srcs(nsrcs, std::vector<uint8_t>(len));
+    for (auto &src : srcs) {
+        for (uint8_t &b : src) {
+            b = (uint8_t)rng_next();
+        }
+    }
+    std::vector<uint8_t> dst(len);
+    std::vector<const uint8_t *> ptrs;
+    std::vector<size_t> lens(nsrcs, len);
+    for (auto &src : srcs) {
+        ptrs.push_back(src.data());
+    }
+    uint64_t reps = std::max(ops_for(n) * 16 / len, (uint64_t)1);
+
+    for (bool simd : {false, true}) {
+        if (simd && !bitmap_use_simd(true)) {
+            break;
+        }
+        bitmap_use_simd(simd);
+        const char *name = simd ? "bitmap_count_simd" : "bitmap_count_scalar";
+        if (bench_enabled(name)) {
+            uint64_t t0 = get_monotonic_nsec();
+            for (uint64_t i = 0; i < reps; i++) {
+                g_sink = bitmap_count(srcs[i % nsrcs].data(), len);
+            }
+            emit_gbps(name, n, reps * len, get_monotonic_nsec() - t0);
+        }
+        name = simd ? "bitmap_and4_simd" : "bitmap_and4_scalar";
+        if (bench_enabled(name)) {
+            uint64_t t0 = get_monotonic_nsec();
+            for (uint64_t i = 0; i < reps; i++) {
+                bitmap_op(BITOP_AND, dst.data(), ptrs.data(), lens.data(), nsrcs, 0, len);
+            }
+            g_sink = dst[0];
+            emit_gbps(name, n, reps * len * nsrcs, get_monotonic_nsec() - t0);
+        }
+    }
+    bitmap_use_simd(true);
+}
+
+// queues: n elements deep, one push at the back and one pop from the
+// front per op, on a list and on a sorted set scored by arrival order
+
+static void bench_queue(uint64_t n) {
+    uint64_t ops = ops_for(n);
+    std::string val;
+    if (bench_enabled("queue_qlist")) {
+        QList list;
+        qlist_init(&list);
+        for (uint64_t i = 0; i < n; i++) {
+            std::string name = member_name(i);
+            qlist_push(&list, false, name.data(), name.size());
+        }
+        uint64_t t0 = get_monotonic_nsec();
+        for (uint64_t i = n; i < n + ops; i++) {
+            std::string name = member_name(i);
+            qlist_push(&list, false, name.data(), name.size());
+            qlist_pop(&list, true, val);
+        }
+        emit("queue_qlist", n, ops, get_monotonic_nsec() - t0);
+        qlist_clear(&list);
+    }
+    if (bench_enabled("queue_zset")) {
+        ZSet zset;
+        for (uint64_t i = 0; i < n; i++) {
+            std::string name = member_name(i);
+            zset_insert(&zset, name.data(), name.size(), (double)i);
+        }
+        uint64_t t0 = get_monotonic_nsec();
+        for (uint64_t i = n; i < n + ops; i++) {
+            std::string name = member_name(i);
+            zset_insert(&zset, name.data(), name.size(), (double)i);
+            ZNode *node = zset_at(&zset, 0);
+            val.assign(node->name, node->len);
+            zset_delete(&zset, node);
+        }
+        emit("queue_zset", n, ops, get_monotonic_nsec() - t0);
+        zset_clear(&zset);
+    }
+    g_sink = val.size();
+}
+
+// time series: n samples 10s apart, with constant, counter and gauge
+// values; the size is per sample
+
+static double ts_value(const char *kind, uint64_t i, double prev) {
+    if (!strcmp(kind, "const")) {
+        return 1.0;
+    } else if (!strcmp(kind, "counter")) {
+        return prev + (double)(rng_next() % 8);
+    }
+    // a random walk by tenths
+    double step = (double)(rng_next() % 21) / 10 - 1.0;
+    return i == 0 ? 20.0 : round((prev + step) * 10) / 10;
+}
+
+static void bench_ts(uint64_t n) {
+    char extra[64];
+    for (const char *kind : {"const", "counter", "gauge"}) {
+        char name[64];
+        snprintf(name, sizeof(name), "ts_add_%s", kind);
+        if (!bench_enabled(name)) {
+            continue;
+        }
+        std::vector<TsSample> samples(n);
+        double val = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            val = ts_value(kind, i, val);
+            samples[i] = {(int64_t)(1700000000000 + i * 10000), val};
+        }
+        TimeSeries series;
+        uint64_t t0 = get_monotonic_nsec();
+        for (const TsSample &s : samples) {
+            ts_add(&series, s.ts, s.val);
+        }
+        uint64_t ns = get_monotonic_nsec() - t0;
+        snprintf(extra, sizeof(extra), ",\"bytes_per_sample\":%.2f",
+            (double)ts_bytes(&series) / (double)n);
+        emit(name, n, n, ns, extra);
+
+        std::vector<TsSample> out;
+        out.reserve(n);
+        t0 = get_monotonic_nsec();
+        ts_range(&series, INT64_MIN, INT64_MAX, out);
+        snprintf(name, sizeof(name), "ts_range_%s", kind);
+        emit(name, n, n, get_monotonic_nsec() - t0);
+        g_sink = out.size();
+
+        out.clear();
+        t0 = get_monotonic_nsec();
+        ts_aggregate(&series, INT64_MIN, INT64_MAX, 3600 * 1000, TS_AGG_AVG, out);
+        snprintf(name, sizeof(name), "ts_agg_avg_%s", kind);
+        emit(name, n, n, get_monotonic_nsec() - t0);
+        g_sink = out.size();
+        ts_clear(&series);
+    }
+    if (bench_enabled("ts_zset")) {
+        // the sorted-set encoding: timestamp score, "timestamp:value" member
+        size_t before = mallinfo2().uordblks;
+        ZSet zset;
+        double val = 0;
+        char buf[64];
+        uint64_t t0 = get_monotonic_nsec();
+        for (uint64_t i = 0; i < n; i++) {
+            val = ts_value("gauge", i, val);
+            int64_t ts = (int64_t)(1700000000000 + i * 10000);
+            int len = snprintf(buf, sizeof(buf), "%lld:%g", (long long)ts, val);
+            zset_insert(&zset, buf, (size_t)len, (double)ts);
+        }
+        uint64_t ns = get_monotonic_nsec() - t0;
+        snprintf(extra, sizeof(extra), ",\"bytes_per_sample\":%.2f",
+            (double)(mallinfo2().uordblks - before) / (double)n);
+        emit("ts_zset_gauge", n, n, ns, extra);
+        zset_clear(&zset);
+    }
+}
+
+// Bloom filters: n IDs added, looked up one at a time and in batches,
+// against the same IDs as string keys of a hashtable
+
+struct BKey {
+    HNode node;
+    std::string key;
+};
+
+static bool bkey_eq(HNode *lhs, HNode *rhs) {
+    return container_of(lhs, BKey, node)->key == container_of(rhs, BKey, node)->key;
+}
+
+static void bench_bloom(uint64_t n) {
+    std::vector<std::string> ids(n), others(n);
+    for (uint64_t i = 0; i < n; i++) {
+        ids[i] = "user:" + std::to_string(i);
+        others[i] = "user:" + std::to_string(n + i);
+    }
+    uint64_t ops = ops_for(n);
+    char extra[96];
+    if (bench_enabled("bloom")) {
+        Bloom bf;
+        bloom_init(&bf, 0.01, n, 2);
+        uint64_t t0 = get_monotonic_nsec();
+        for (const std::string &id : ids) {
+            bloom_add(&bf, id.data(), id.size());
+        }
+        uint64_t ns = get_monotonic_nsec() - t0;
+        snprintf(extra, sizeof(extra), ",\"bytes_per_elem\":%.2f",
+            (double)bloom_bytes(&bf) / (double)n);
+        emit("bloom_add", n, n, ns, extra);
+
+        uint64_t found = 0;
+        t0 = get_monotonic_nsec();
+        for (uint64_t i = 0; i < ops; i++) {
+            const std::string &id = ids[rng_next() % n];
+            found += bloom_exists(&bf, id.data(), id.size());
+        }
+        emit("bloom_exists_hit", n, ops, get_monotonic_nsec() - t0);
+        assert(found == ops);
+
+        found = 0;
+        t0 = get_monotonic_nsec();
+        for (uint64_t i = 0; i < ops; i++) {
+            const std::string &id = others[rng_next() % n];
+            found += bloom_exists(&bf, id.data(), id.size());
+        }
+        ns = get_monotonic_nsec() - t0;
+        snprintf(extra, sizeof(extra), ",\"fp_rate\":%.4f", (double)found / (double)ops);
+        emit("bloom_exists_miss", n, ops, ns, extra);
+
+        // random IDs in batches, as BF.MEXISTS does
+        std::vector<std::string> batch(256);
+        std::vector<uint8_t> out(batch.size());
+        uint64_t batches = std::max((uint64_t)1, ops / batch.size());
+        for (bool prefetch : {false, true}) {
+            found = 0;
+            ns = 0;
+            for (uint64_t b = 0; b < batches; b++) {
+                for (std::string &id : batch) {
+                    id = ids[rng_next() % n];
+                }
+                t0 = get_monotonic_nsec();
+                if (prefetch) {
+                    bloom_mexists(&bf, batch.data(), batch.size(), out.data());
+                } else {
+                    for (size_t j = 0; j < batch.size(); j++) {
+                        out[j] = bloom_exists(&bf, batch[j].data(), batch[j].size());
+                    }
+                }
+                ns += get_monotonic_nsec() - t0;
+                found += std::count(out.begin(), out.end(), 1);
+            }
+            emit(prefetch ? "bloom_mexists" : "bloom_exists_batch", n,
+                batches * batch.size(), ns);
+            g_sink = found;
+        }
+        bloom_clear(&bf);
+
+        // growing from 1% of the capacity
+        bloom_init(&bf, 0.01, std::max((uint64_t)1, n / 100), 2);
+        for (const std::string &id : ids) {
+            bloom_add(&bf, id.data(), id.size());
+        }
+        found = 0;
+        for (const std::string &id : others) {
+            found += bloom_exists(&bf, id.data(), id.size());
+        }
+        snprintf(extra, sizeof(extra), ",\"layers\":%zu,\"bytes_per_elem\":%.2f,\"fp_rate\":%.4f",
+            bf.layers.size(), (double)bloom_bytes(&bf) / (double)n, (double)found / (double)n);
+        emit("bloom_scaled", n, 0, 0, extra);
+        bloom_clear(&bf);
+    }
+    if (bench_enabled("bloom_keys")) {
+        size_t before = mallinfo2().uordblks;
+        HMap map;
+        std::vector<BKey *> nodes(n);
+        for (uint64_t i = 0; i < n; i++) {
+            nodes[i] = new BKey();
+            nodes[i]->key = ids[i];
+            nodes[i]->node.hcode = str_hash((uint8_t *)ids[i].data(), ids[i].size());
+            hm_insert(&map, &nodes[i]->node);
+        }
+        snprintf(extra, sizeof(extra), ",\"bytes_per_elem\":%.2f",
+            (double)(mallinfo2().uordblks - before) / (double)n);
+        uint64_t found = 0;
+        uint64_t t0 = get_monotonic_nsec();
+        for (uint64_t i = 0; i < ops; i++) {
+            BKey key;
+            key.key = others[rng_next() % n];
+            key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+            found += hm_lookup(&map, &key.node, &bkey_eq) != NULL;
+        }
+        emit("bloom_keys_miss", n, ops, get_monotonic_nsec() - t0, extra);
+        g_sink = found;
+        hm_clear(&map);
+        for (BKey *node : nodes) {
+            delete node;
+        }
+    }
+}
+
+static void usage() {
+    fprintf(stderr,
+        "usage: bench [-n max_size] [-o min_ops] [-f filter] [-s seed]\n"
+        "  sizes run from 1000 up to max_size in steps of 10x (1000000)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "n:o:f:s:")) != -1) {
+        switch (opt) {
+        case 'n': g_opt.max_size = strtoull(optarg, NULL, 10); break;
+        case 'o': g_opt.min_ops = strtoull(optarg, NULL, 10); break;
+        case 'f': g_opt.filter = optarg; break;
+        case 's': g_rng = strtoull(optarg, NULL, 10) | 1; break;
+        default: usage();
+        }
+    }
+
+    for (uint64_t n = 1000; n <= g_opt.max_size; n *= 10) {
+        fprintf(stderr, "size %llu\n", (unsigned long long)n);
+        bench_hashtable(n);
+        bench_zset(n);
+        bench_heap(n);
+        bench_set(n);
+        bench_hll(n);
+        bench_bitmap(n);
+        bench_queue(n);
+        bench_ts(n);
+        bench_bloom(n);
+    }
+    return 0;
+}
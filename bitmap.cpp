@@ -0,0 +1,171 @@
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "bitmap.h"
+
+
+static uint64_t count_scalar(const uint8_t *p, size_t len) {
+    uint64_t total = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        total += (uint64_t)__builtin_popcountll(w);
+    }
+    for (; i < len; i++) {
+        total += (uint64_t)__builtin_popcount(p[i]);
+    }
+    return total;
+}
+
+static void combine_scalar(uint32_t op, uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a = op == BITOP_AND ? a & b : op == BITOP_OR ? a | b : a ^ b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+    for (; i < len; i++) {
+        uint8_t b = src[i];
+        dst[i] = op == BITOP_AND ? dst[i] & b : op == BITOP_OR ? dst[i] | b : dst[i] ^ b;
+    }
+}
+
+#if defined(__x86_64__)
+
+// Popcount of each nibble with a 16-entry table lookup (vpshufb), summed
+// per byte for a few blocks, then widened to 64-bit lanes with vpsadbw.
+__attribute__((target("avx2")))
+static uint64_t count_simd(const uint8_t *p, size_t len) {
+    const __m256i table = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    size_t i = 0;
+    while (i + 32 <= len) {
+        // at most 8 per byte per block, so 31 blocks fit in a byte
+        __m256i local = zero;
+        for (int k = 0; k < 31 && i + 32 <= len; k++, i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+            __m256i lo = _mm256_and_si256(v, low);
+            __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+            local = _mm256_add_epi8(local, _mm256_add_epi8(
+                _mm256_shuffle_epi8(table, lo), _mm256_shuffle_epi8(table, hi)));
+        }
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(local, zero));
+    }
+    uint64_t total = (uint64_t)_mm256_extract_epi64(acc, 0) + (uint64_t)_mm256_extract_epi64(acc, 1)
+        + (uint64_t)_mm256_extract_epi64(acc, 2) + (uint64_t)_mm256_extract_epi64(acc, 3);
+    return total + count_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void combine_simd(uint32_t op, uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        a = op == BITOP_AND ? _mm256_and_si256(a, b)
+            : op == BITOP_OR ? _mm256_or_si256(a, b) : _mm256_xor_si256(a, b);
+        _mm256_storeu_si256((__m256i *)(dst + i), a);
+    }
+    combine_scalar(op, dst + i, src + i, len - i);
+}
+
+static bool simd_supported() {
+    return __builtin_cpu_supports("avx2");
+}
+
+#else
+
+static bool simd_supported() {
+    return false;
+}
+
+#endif
+
+static bool g_use_simd = simd_supported();
+
+bool bitmap_use_simd(bool on) {
+    g_use_simd = on && simd_supported();
+    return g_use_simd;
+}
+
+uint64_t bitmap_count(const uint8_t *p, size_t len) {
+#if defined(__x86_64__)
+    if (g_use_simd) {
+        return count_simd(p, len);
+    }
+#endif
+    return count_scalar(p, len);
+}
+
+int64_t bitmap_pos(const uint8_t *p, size_t len, bool bit) {
+    const uint64_t skip = bit ? 0 : ~(uint64_t)0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        if (w != skip) {
+            break;
+        }
+    }
+    for (; i < len; i++) {
+        uint32_t b = bit ? p[i] : (uint8_t)~p[i];
+        if (b) {
+            return (int64_t)(i * 8) + __builtin_clz(b) - 24;
+        }
+    }
+    return -1;
+}
+
+static void combine(uint32_t op, uint8_t *dst, const uint8_t *src, size_t len) {
+#if defined(__x86_64__)
+    if (g_use_simd) {
+        return combine_simd(op, dst, src, len);
+    }
+#endif
+    combine_scalar(op, dst, src, len);
+}
+
+// the output is built in chunks that stay in L1 while every source is
+// combined into them
+const size_t k_bitop_chunk = 4096;
+
+void bitmap_op(uint32_t op, uint8_t *dst, const uint8_t **srcs, const size_t *lens,
+    size_t n, size_t from, size_t to)
+{
+    assert(n >= 1 && (op != BITOP_NOT || n == 1));
+    for (size_t lo = from; lo < to; lo += k_bitop_chunk) {
+        size_t hi = std::min(to, lo + k_bitop_chunk);
+        size_t end = std::min(hi, std::max(lo, lens[0]));
+        if (end > lo) {
+            memcpy(dst + lo, srcs[0] + lo, end - lo);
+        }
+        memset(dst + end, 0, hi - end);
+        if (op == BITOP_NOT) {
+            for (size_t i = lo; i < hi; i++) {
+                dst[i] = (uint8_t)~dst[i];
+            }
+            continue;
+        }
+        for (size_t k = 1; k < n; k++) {
+            end = std::min(hi, std::max(lo, lens[k]));
+            if (end > lo) {
+                combine(op, dst + lo, srcs[k] + lo, end - lo);
+            }
+            // missing bytes read as zeros
+            if (op == BITOP_AND) {
+                memset(dst + end, 0, hi - end);
+            }
+        }
+    }
+}
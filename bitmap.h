@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Bit operations on string values. Bit 0 is the most significant bit of
+// the first byte, and strings read as if padded with zero bytes.
+enum {
+    BITOP_AND = 0,
+    BITOP_OR = 1,
+    BITOP_XOR = 2,
+    BITOP_NOT = 3,
+};
+
+uint64_t bitmap_count(const uint8_t *p, size_t len);
+// the offset of the first bit equal to `bit` in p[0, len), or -1
+int64_t  bitmap_pos(const uint8_t *p, size_t len, bool bit);
+// bytes [from, to) of `op` over the `n` sources (one for BITOP_NOT)
+void     bitmap_op(uint32_t op, uint8_t *dst, const uint8_t **srcs, const size_t *lens,
+    size_t n, size_t from, size_t to);
+
+// the SIMD kernels are used if the CPU supports them and this is on;
+// returns whether they are used
+bool     bitmap_use_simd(bool on);
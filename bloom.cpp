@@ -0,0 +1,167 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include "bloom.h"
+#include "common.h"
+
+
+const uint64_t k_block_bits = 512;
+
+// Bits per element and hash count for an error rate, as for a plain Bloom
+// filter, plus 2% per halving of the error: blocks fill up unevenly, and
+// that costs more as k grows.
+static double layer_bits(double error, double capacity) {
+    return capacity * (-log(error) / (M_LN2 * M_LN2)) * (1 - log2(error) / 50);
+}
+
+// false if over k_bloom_max_layer_bytes or out of memory
+static bool layer_init(BloomLayer *layer, double error, double capacity) {
+    double bits = layer_bits(error, capacity);
+    if (bits / 8 > (double)k_bloom_max_layer_bytes) {
+        return false;
+    }
+    layer->nblocks = std::max((uint64_t)1, (uint64_t)ceil(bits / k_block_bits));
+    layer->k = std::min(16u, (uint32_t)ceil(-log2(error)));
+    layer->capacity = (uint64_t)capacity;
+    layer->count = 0;
+    size_t size = layer->nblocks * 64;
+    layer->blocks = (uint64_t *)aligned_alloc(64, size);
+    if (!layer->blocks) {
+        return false;
+    }
+    memset(layer->blocks, 0, size);
+    return true;
+}
+
+static bool add_layer(Bloom *bf) {
+    size_t i = bf->layers.size();
+    double capacity = (double)bf->capacity;
+    for (size_t j = 0; j < i; j++) {
+        capacity *= bf->expansion;
+    }
+    // error / 2 + error / 4 + ... < error
+    BloomLayer layer;
+    if (!layer_init(&layer, bf->error / (double)(2ull << std::min(i, (size_t)60)), capacity)) {
+        return false;
+    }
+    bf->layers.push_back(layer);
+    return true;
+}
+
+bool bloom_fits(double error, uint64_t capacity) {
+    return layer_bits(error / 2, (double)capacity) / 8 <= (double)k_bloom_max_layer_bytes;
+}
+
+void bloom_init(Bloom *bf, double error, uint64_t capacity, uint32_t expansion) {
+    assert(error > 0 && error < 1 && capacity > 0 && expansion > 0);
+    bloom_clear(bf);
+    bf->error = error;
+    bf->capacity = capacity;
+    bf->expansion = expansion;
+}
+
+// the block comes from the hash, the bits in it from a remix of it, so
+// that each layer picks its own bits
+static const uint64_t *layer_block(const BloomLayer &layer, uint64_t h) {
+    uint64_t i = (uint64_t)(((unsigned __int128)h * layer.nblocks) >> 64);
+    return layer.blocks + i * 8;
+}
+
+static void layer_mask(const BloomLayer &layer, uint64_t h, size_t idx, uint64_t *mask) {
+    h ^= (idx + 1) * 0x9e3779b97f4a7c15ull;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    memset(mask, 0, 8 * sizeof(uint64_t));
+    // each bit from the top of an LCG step; double hashing with 32-bit
+    // halves gives too few distinct patterns for low error rates
+    for (uint32_t i = 0; i < layer.k; i++) {
+        h = h * 0x5851f42d4c957f2dull + 0x14057b7ef767814full;
+        uint32_t bit = (uint32_t)(h >> 55);
+        mask[bit / 64] |= 1ull << (bit % 64);
+    }
+}
+
+static bool layer_test(const BloomLayer &layer, uint64_t h, size_t idx) {
+    uint64_t mask[8];
+    layer_mask(layer, h, idx, mask);
+    const uint64_t *block = layer_block(layer, h);
+    uint64_t miss = 0;
+    for (uint32_t w = 0; w < 8; w++) {
+        miss |= mask[w] & ~block[w];
+    }
+    return miss == 0;
+}
+
+static bool bloom_test(const Bloom *bf, uint64_t h) {
+    // the newest layer holds most of the elements
+    for (size_t i = bf->layers.size(); i-- > 0;) {
+        if (layer_test(bf->layers[i], h, i)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int bloom_add(Bloom *bf, const char *elem, size_t len) {
+    uint64_t h = str_hash64(elem, len);
+    if (bloom_test(bf, h)) {
+        return 0;
+    }
+    if ((bf->layers.empty() || bf->layers.back().count >= bf->layers.back().capacity)
+        && !add_layer(bf))
+    {
+        return -1;
+    }
+    size_t idx = bf->layers.size() - 1;
+    BloomLayer &layer = bf->layers[idx];
+    uint64_t mask[8];
+    layer_mask(layer, h, idx, mask);
+    uint64_t *block = (uint64_t *)layer_block(layer, h);
+    for (uint32_t w = 0; w < 8; w++) {
+        block[w] |= mask[w];
+    }
+    layer.count++;
+    return 1;
+}
+
+bool bloom_exists(const Bloom *bf, const char *elem, size_t len) {
+    return bloom_test(bf, str_hash64(elem, len));
+}
+
+// enough independent cache misses in flight to hide the memory latency
+const size_t k_bloom_batch = 16;
+
+void bloom_mexists(const Bloom *bf, const std::string *elems, size_t n, uint8_t *out) {
+    uint64_t hashes[k_bloom_batch];
+    for (size_t i = 0; i < n; i += k_bloom_batch) {
+        size_t m = std::min(k_bloom_batch, n - i);
+        for (size_t j = 0; j < m; j++) {
+            hashes[j] = str_hash64(elems[i + j].data(), elems[i + j].size());
+            for (const BloomLayer &layer : bf->layers) {
+                __builtin_prefetch(layer_block(layer, hashes[j]));
+            }
+        }
+        for (size_t j = 0; j < m; j++) {
+            out[i + j] = bloom_test(bf, hashes[j]);
+        }
+    }
+}
+
+size_t bloom_bytes(const Bloom *bf) {
+    size_t bytes = mem_usable(bf->layers.data());
+    for (const BloomLayer &layer : bf->layers) {
+        bytes += mem_usable(layer.blocks);
+    }
+    return bytes;
+}
+
+void bloom_clear(Bloom *bf) {
+    for (BloomLayer &layer : bf->layers) {
+        free(layer.blocks);
+    }
+    std::vector<BloomLayer>().swap(bf->layers);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+// Scalable blocked Bloom filter. A layer is an array of 64-byte blocks,
+// and an element sets its k bits within the one block picked by its hash,
+// so a check touches a single cache line per layer. Once a layer holds
+// its capacity, a layer `expansion` times larger with half its error rate
+// is added, which keeps the overall false positive rate under `error`.
+struct BloomLayer {
+    uint64_t *blocks = NULL;    // 8 words per block, cache-line aligned
+    uint64_t nblocks = 0;
+    uint32_t k = 0;
+    uint64_t capacity = 0;
+    uint64_t count = 0;
+};
+
+struct Bloom {
+    std::vector<BloomLayer> layers;
+    double error = 0.01;
+    uint64_t capacity = 100;    // of the first layer
+    uint32_t expansion = 2;
+};
+
+// the largest layer allocated, at reserve time or when growing
+const uint64_t k_bloom_max_layer_bytes = 1ull << 32;
+
+void   bloom_init(Bloom *bf, double error, uint64_t capacity, uint32_t expansion);
+// whether the first layer of such a filter is under k_bloom_max_layer_bytes
+bool   bloom_fits(double error, uint64_t capacity);
+// 1 if added, 0 if it may have been added already, -1 if a new layer
+// could not be allocated
+int    bloom_add(Bloom *bf, const char *elem, size_t len);
+bool   bloom_exists(const Bloom *bf, const char *elem, size_t len);
+// out[i] for elems[i], with the blocks of a batch prefetched together
+void   bloom_mexists(const Bloom *bf, const std::string *elems, size_t n, uint8_t *out);
+// the heap bytes of the layers
+size_t bloom_bytes(const Bloom *bf);
+void   bloom_clear(Bloom *bf);
@@ -0,0 +1,52 @@
+#include "capture.h"
+
+
+const char k_capture_magic[k_capture_magic_len] = {
+    'i', 'm', 'd', 'b', 'c', 'a', 'p', '1',
+};
+
+static void put_varint(std::vector<uint8_t> &buf, uint64_t val) {
+    while (val >= 0x80) {
+        buf.push_back((uint8_t)(val | 0x80));
+        val >>= 7;
+    }
+    buf.push_back((uint8_t)val);
+}
+
+static bool get_varint(const uint8_t *&cur, const uint8_t *end, uint64_t &val) {
+    val = 0;
+    for (uint32_t shift = 0; cur < end && shift < 64; shift += 7) {
+        uint8_t byte = *cur++;
+        val |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void capture_put(
+    std::vector<uint8_t> &buf, uint64_t delta_us, uint64_t conn,
+    const uint8_t *req, uint32_t len)
+{
+    put_varint(buf, delta_us);
+    put_varint(buf, conn);
+    put_varint(buf, len);
+    buf.insert(buf.end(), req, req + len);
+}
+
+bool capture_next(const uint8_t *&cur, const uint8_t *end, CaptureRec &rec) {
+    uint64_t delta = 0, conn = 0, len = 0;
+    if (!get_varint(cur, end, delta) || !get_varint(cur, end, conn)
+        || !get_varint(cur, end, len) || len > (uint64_t)(end - cur)
+        || len > UINT32_MAX)
+    {
+        return false;
+    }
+    rec.time_us += delta;
+    rec.conn = conn;
+    rec.req = cur;
+    rec.len = (uint32_t)len;
+    cur += len;
+    return true;
+}
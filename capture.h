@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+// Traffic capture file (server --capture, read by bin/replay). After the
+// 8-byte magic, one record per request in the order the server ran it:
+//
+//   varint  microseconds since the previous record
+//   varint  connection, numbered from 1 in the order first seen
+//   varint  request length, 0 once the connection is closed
+//   bytes   the request as framed on the wire, without the length prefix
+const size_t k_capture_magic_len = 8;
+extern const char k_capture_magic[k_capture_magic_len];
+
+struct CaptureRec {
+    uint64_t time_us = 0;   // since the start of the capture
+    uint64_t conn = 0;
+    const uint8_t *req = NULL;
+    uint32_t len = 0;       // 0: the connection was closed
+};
+
+void capture_put(
+    std::vector<uint8_t> &buf, uint64_t delta_us, uint64_t conn,
+    const uint8_t *req, uint32_t len);
+// advances `rec` to the next record, false at the end or on a truncated one
+bool capture_next(const uint8_t *&cur, const uint8_t *end, CaptureRec &rec);
@@ -2,6 +2,9 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
+#include <malloc.h>
+#include <string>
 
 // intrusive data structure
 #define container_of(ptr, type, member) ({                  \
@@ -9,6 +12,17 @@
     (type *)((char *)__mptr - offsetof(type, member));      \
 })
 
+// the heap bytes behind a pointer from malloc or new, allocator rounding
+// included; 0 for NULL
+inline size_t mem_usable(const void *ptr) {
+    return ptr ? malloc_usable_size((void *)ptr) : 0;
+}
+
+// the heap bytes of a string; libstdc++ keeps up to 15 bytes inline
+inline size_t str_heap_bytes(const std::string &s) {
+    return s.capacity() > 15 ? mem_usable(s.data()) : 0;
+}
+
 // FNV hash
 inline uint64_t str_hash(const uint8_t *data, size_t len) {
     uint32_t h = 0x811C9DC5;
@@ -16,4 +30,63 @@ inline uint64_t str_hash(const uint8_t *data, size_t len) {
         h = (h + data[i]) * 0x01000193;
     }
     return h;
-}
\ No newline at end of file
+}
+
+// MurmurHash64A, for when 32 bits of FNV are not enough
+inline uint64_t str_hash64(const char *data, size_t len) {
+    const uint64_t m = 0xc6a4a7935bd1e995ull;
+    const int r = 47;
+    uint64_t h = 0xadc83b19ull ^ (len * m);
+    const char *end = data + (len & ~(size_t)7);
+    for (; data != end; data += 8) {
+        uint64_t k;
+        memcpy(&k, data, sizeof(k));
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    switch (len & 7) {
+    case 7: h ^= (uint64_t)(uint8_t)data[6] << 48; [[fallthrough]];
+    case 6: h ^= (uint64_t)(uint8_t)data[5] << 40; [[fallthrough]];
+    case 5: h ^= (uint64_t)(uint8_t)data[4] << 32; [[fallthrough]];
+    case 4: h ^= (uint64_t)(uint8_t)data[3] << 24; [[fallthrough]];
+    case 3: h ^= (uint64_t)(uint8_t)data[2] << 16; [[fallthrough]];
+    case 2: h ^= (uint64_t)(uint8_t)data[1] << 8; [[fallthrough]];
+    case 1: h ^= (uint64_t)(uint8_t)data[0]; h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+// Accepts only the canonical decimal form of an int64 (no sign other than
+// a leading '-', no leading zeros), so GET returns exactly what was SET.
+inline bool str_is_int(const char *s, size_t len, int64_t &out) {
+    if (len == 0 || len > 20) {
+        return false;
+    }
+    bool neg = s[0] == '-';
+    size_t i = neg ? 1 : 0;
+    if (i == len || (s[i] == '0' && len > 1)) {
+        return false;
+    }
+    uint64_t val = 0;
+    for (; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9') {
+            return false;
+        }
+        uint64_t digit = (uint64_t)(s[i] - '0');
+        if (val > (UINT64_MAX - digit) / 10) {
+            return false;
+        }
+        val = val * 10 + digit;
+    }
+    if (val > (uint64_t)INT64_MAX + neg) {
+        return false;
+    }
+    out = neg ? (int64_t)(0 - val) : (int64_t)val;
+    return true;
+}
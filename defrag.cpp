@@ -0,0 +1,70 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include "defrag.h"
+#include "common.h"
+
+
+static size_t page_slot(const PageCensus *census, uintptr_t page) {
+    size_t mask = census->slots.size() - 1;
+    uint64_t h = page * 0x9e3779b97f4a7c15ull;
+    size_t i = (size_t)(h ^ (h >> 32)) & mask;
+    while (census->slots[i].page != 0 && census->slots[i].page != page) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void census_grow(PageCensus *census) {
+    std::vector<PageCount> old(std::max((size_t)1024, census->slots.size() * 2));
+    old.swap(census->slots);
+    for (const PageCount &count : old) {
+        if (count.page) {
+            census->slots[page_slot(census, count.page)] = count;
+        }
+    }
+}
+
+static PageCount *page_find(PageCensus *census, const void *ptr) {
+    if (census->slots.empty()) {
+        return NULL;
+    }
+    PageCount &count = census->slots[page_slot(census, (uintptr_t)ptr / k_page_size)];
+    return count.page ? &count : NULL;
+}
+
+void census_add(PageCensus *census, const void *ptr) {
+    if (2 * (census->npages + 1) > census->slots.size()) {
+        census_grow(census);    // at most half full
+    }
+    uintptr_t page = (uintptr_t)ptr / k_page_size;
+    PageCount &count = census->slots[page_slot(census, page)];
+    if (!count.page) {
+        count.page = page;
+        census->npages++;
+    }
+    count.bytes += mem_usable(ptr);
+}
+
+size_t census_get(PageCensus *census, const void *ptr) {
+    PageCount *count = page_find(census, ptr);
+    return count ? count->bytes : 0;
+}
+
+bool census_move(PageCensus *census, const void *from, const void *to) {
+    PageCount *src = page_find(census, from);
+    PageCount *dst = page_find(census, to);
+    size_t size = mem_usable(from);
+    if (!src || !dst || src == dst || dst->bytes + size <= src->bytes) {
+        return false;
+    }
+    src->bytes -= std::min(src->bytes, size);
+    dst->bytes += mem_usable(to);
+    return true;
+}
+
+void census_clear(PageCensus *census) {
+    std::vector<PageCount>().swap(census->slots);
+    census->npages = 0;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+// Live bytes of the movable allocations by page, for active
+// defragmentation. glibc cannot tell which pages are sparse, so the
+// defragmenter counts them first, then moves data off sparse pages and
+// keeps a copy only if it landed on a denser page than the original.
+struct PageCount {
+    uintptr_t page = 0;     // 0: empty slot
+    size_t bytes = 0;
+};
+
+// open addressing, so that it is a single allocation to free
+struct PageCensus {
+    std::vector<PageCount> slots;
+    size_t npages = 0;
+};
+
+const size_t k_page_size = 4096;
+
+void   census_add(PageCensus *census, const void *ptr);
+size_t census_get(PageCensus *census, const void *ptr);
+// whether moving the block at `from` to `to` leaves it with more live
+// neighbours; if so, the counts are updated for the move
+bool   census_move(PageCensus *census, const void *from, const void *to);
+void   census_clear(PageCensus *census);
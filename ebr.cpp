@@ -0,0 +1,59 @@
+#include <assert.h>
+
+#include "ebr.h"
+
+
+void ebr_init(Ebr *ebr, size_t nreaders) {
+    assert(!ebr->slots);
+    ebr->slots = new EbrSlot[nreaders];
+    ebr->nslots = nreaders;
+}
+
+void ebr_enter(Ebr *ebr, size_t slot) {
+    uint64_t epoch = ebr->epoch.load(std::memory_order_acquire);
+    ebr->slots[slot].epoch.store(epoch, std::memory_order_relaxed);
+    // either the next scan of ebr_collect() sees the slot, or we see
+    // everything the writer unlinked before it
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void ebr_exit(Ebr *ebr, size_t slot) {
+    ebr->slots[slot].epoch.store(0, std::memory_order_release);
+}
+
+void ebr_retire(Ebr *ebr, void (*f)(void *), void *arg) {
+    if (ebr->nslots == 0) {
+        return f(arg);
+    }
+    EbrItem item;
+    item.f = f;
+    item.arg = arg;
+    item.epoch = ebr->epoch.load(std::memory_order_relaxed);
+    ebr->limbo.push_back(item);
+}
+
+// A reader that announced epoch e read the epoch after it was advanced
+// past everything retired before e, so it cannot reach those items.
+void ebr_collect(Ebr *ebr) {
+    if (ebr->limbo.empty()) {
+        return;
+    }
+    uint64_t oldest = ebr->epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (size_t i = 0; i < ebr->nslots; i++) {
+        uint64_t epoch = ebr->slots[i].epoch.load(std::memory_order_acquire);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    // items retired by the callbacks go to the back with a newer epoch
+    while (!ebr->limbo.empty() && ebr->limbo.front().epoch < oldest) {
+        EbrItem item = ebr->limbo.front();
+        ebr->limbo.pop_front();
+        item.f(item.arg);
+    }
+}
+
+size_t ebr_pending(const Ebr *ebr) {
+    return ebr->limbo.size();
+}
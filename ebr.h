@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+
+
+// Epoch-based reclamation for one writer and a fixed set of reader
+// threads. A reader announces the epoch it entered in its slot and clears
+// it when it leaves; memory the writer unlinked is retired with the epoch
+// of the moment and freed once no reader is left in that epoch or before.
+struct alignas(64) EbrSlot {
+    std::atomic<uint64_t> epoch{0};     // 0: not reading
+};
+
+struct EbrItem {
+    void (*f)(void *) = NULL;
+    void *arg = NULL;
+    uint64_t epoch = 0;
+};
+
+struct Ebr {
+    std::atomic<uint64_t> epoch{1};
+    EbrSlot *slots = NULL;
+    size_t nslots = 0;
+    std::deque<EbrItem> limbo;  // oldest first; the writer's only
+};
+
+void ebr_init(Ebr *ebr, size_t nreaders);
+// brackets the accesses of reader `slot` to shared memory
+void ebr_enter(Ebr *ebr, size_t slot);
+void ebr_exit(Ebr *ebr, size_t slot);
+// the writer's side: f(arg) runs once no reader can still see `arg`,
+// right away if there are no readers
+void ebr_retire(Ebr *ebr, void (*f)(void *), void *arg);
+// frees what the readers are done with; called by the writer regularly
+void ebr_collect(Ebr *ebr);
+size_t ebr_pending(const Ebr *ebr);
@@ -0,0 +1,225 @@
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "hash.h"
+#include "common.h"
+
+
+static HField *hfield_new(Hash *hash,
+    const char *field, size_t flen, const char *val, size_t vlen)
+{
+    HField *node = (HField *)malloc(sizeof(HField) + flen + vlen);
+    assert(node);
+    node->node.next = NULL;
+    node->node.hcode = str_hash((uint8_t *)field, flen);
+    node->flen = (uint32_t)flen;
+    node->vlen = (uint32_t)vlen;
+    memcpy(&node->data[0], field, flen);
+    memcpy(&node->data[flen], val, vlen);
+    hash->bytes += mem_usable(node);
+    return node;
+}
+
+static void hfield_del(Hash *hash, HField *node) {
+    hash->bytes -= mem_usable(node);
+    free(node);
+}
+
+struct HKey {
+    HNode node;
+    const char *name = NULL;
+    size_t len = 0;
+};
+
+static bool hcmp(HNode *node, HNode *key) {
+    HField *hf = container_of(node, HField, node);
+    HKey *hkey = container_of(key, HKey, node);
+    return hf->flen == hkey->len && 0 == memcmp(hf->data, hkey->name, hf->flen);
+}
+
+static bool hcmp_same(HNode *node, HNode *key) {
+    return node == key;
+}
+
+static HField *table_lookup(Hash *hash, const char *field, size_t flen) {
+    HKey key;
+    key.node.hcode = str_hash((uint8_t *)field, flen);
+    key.name = field;
+    key.len = flen;
+    HNode *found = hm_lookup(&hash->hmap, &key.node, &hcmp);
+    return found ? container_of(found, HField, node) : NULL;
+}
+
+// packed entries
+
+static size_t packed_entry_len(const std::string &packed, size_t pos) {
+    return 2 + (uint8_t)packed[pos] + (uint8_t)packed[pos + 1];
+}
+
+static size_t packed_find(Hash *hash, const char *field, size_t flen) {
+    const std::string &p = hash->packed;
+    for (size_t pos = 0; pos < p.size(); pos += packed_entry_len(p, pos)) {
+        if ((uint8_t)p[pos] == flen && 0 == memcmp(&p[pos + 2], field, flen)) {
+            return pos;
+        }
+    }
+    return std::string::npos;
+}
+
+static std::string packed_entry(const char *field, size_t flen, const char *val, size_t vlen) {
+    std::string entry(2 + flen + vlen, '\0');
+    entry[0] = (char)(uint8_t)flen;
+    entry[1] = (char)(uint8_t)vlen;
+    memcpy(&entry[2], field, flen);
+    memcpy(&entry[2 + flen], val, vlen);
+    return entry;
+}
+
+static void hash_convert(Hash *hash) {
+    assert(hash->enc == HASH_PACKED);
+    const std::string &p = hash->packed;
+    hm_reserve(&hash->hmap, hash->count);
+    for (size_t pos = 0; pos < p.size(); pos += packed_entry_len(p, pos)) {
+        size_t flen = (uint8_t)p[pos];
+        size_t vlen = (uint8_t)p[pos + 1];
+        HField *node = hfield_new(hash, &p[pos + 2], flen, &p[pos + 2 + flen], vlen);
+        hm_insert(&hash->hmap, &node->node);
+    }
+    std::string().swap(hash->packed);
+    hash->count = 0;
+    hash->enc = HASH_TABLE;
+}
+
+bool hash_get(Hash *hash, const char *field, size_t flen, const char **val, size_t *vlen) {
+    if (hash->enc == HASH_PACKED) {
+        size_t pos = packed_find(hash, field, flen);
+        if (pos == std::string::npos) {
+            return false;
+        }
+        *val = &hash->packed[pos + 2 + flen];
+        *vlen = (uint8_t)hash->packed[pos + 1];
+        return true;
+    }
+    HField *node = table_lookup(hash, field, flen);
+    if (!node) {
+        return false;
+    }
+    *val = &node->data[node->flen];
+    *vlen = node->vlen;
+    return true;
+}
+
+// returns true if the field is new
+bool hash_set(Hash *hash, const char *field, size_t flen, const char *val, size_t vlen) {
+    if (hash->enc == HASH_PACKED) {
+        size_t pos = packed_find(hash, field, flen);
+        bool fits = flen <= k_hash_packed_max_len && vlen <= k_hash_packed_max_len;
+        if (fits && pos != std::string::npos) {
+            hash->packed.replace(pos, packed_entry_len(hash->packed, pos),
+                packed_entry(field, flen, val, vlen));
+            return false;
+        } else if (fits && hash->count < k_hash_packed_max_fields) {
+            hash->packed += packed_entry(field, flen, val, vlen);
+            hash->count++;
+            return true;
+        }
+        hash_convert(hash);
+    }
+
+    HField *old = table_lookup(hash, field, flen);
+    if (old && old->vlen == vlen) {
+        memcpy(&old->data[old->flen], val, vlen);
+        return false;
+    }
+    if (old) {
+        HNode *found = hm_delete(&hash->hmap, &old->node, &hcmp_same);
+        assert(found);
+        (void)found;
+        hfield_del(hash, old);
+    }
+    HField *node = hfield_new(hash, field, flen, val, vlen);
+    hm_insert(&hash->hmap, &node->node);
+    return !old;
+}
+
+bool hash_del(Hash *hash, const char *field, size_t flen) {
+    if (hash->enc == HASH_PACKED) {
+        size_t pos = packed_find(hash, field, flen);
+        if (pos == std::string::npos) {
+            return false;
+        }
+        hash->packed.erase(pos, packed_entry_len(hash->packed, pos));
+        hash->count--;
+        return true;
+    }
+    HKey key;
+    key.node.hcode = str_hash((uint8_t *)field, flen);
+    key.name = field;
+    key.len = flen;
+    HNode *found = hm_delete(&hash->hmap, &key.node, &hcmp);
+    if (found) {
+        hfield_del(hash, container_of(found, HField, node));
+    }
+    return found != NULL;
+}
+
+size_t hash_len(Hash *hash) {
+    return hash->enc == HASH_PACKED ? hash->count : hm_size(&hash->hmap);
+}
+
+size_t hash_bytes(const Hash *hash) {
+    return str_heap_bytes(hash->packed) + hash->bytes + hm_bytes(&hash->hmap);
+}
+
+struct HashForeachArg {
+    bool (*f)(const char *, size_t, const char *, size_t, void *) = NULL;
+    void *arg = NULL;
+};
+
+static bool cb_foreach(HNode *node, void *arg) {
+    HashForeachArg *fa = (HashForeachArg *)arg;
+    HField *hf = container_of(node, HField, node);
+    return fa->f(hf->data, hf->flen, &hf->data[hf->flen], hf->vlen, fa->arg);
+}
+
+void hash_foreach(Hash *hash,
+    bool (*f)(const char *field, size_t flen, const char *val, size_t vlen, void *arg),
+    void *arg)
+{
+    if (hash->enc == HASH_PACKED) {
+        const std::string &p = hash->packed;
+        for (size_t pos = 0; pos < p.size(); pos += packed_entry_len(p, pos)) {
+            size_t flen = (uint8_t)p[pos];
+            size_t vlen = (uint8_t)p[pos + 1];
+            if (!f(&p[pos + 2], flen, &p[pos + 2 + flen], vlen, arg)) {
+                return;
+            }
+        }
+        return;
+    }
+    HashForeachArg fa;
+    fa.f = f;
+    fa.arg = arg;
+    hm_foreach(&hash->hmap, &cb_foreach, &fa);
+}
+
+static void htab_dispose(Hash *hash, HTab *htab) {
+    for (size_t i = 0; htab->tab && i <= htab->mask; i++) {
+        HNode *node = htab->tab[i];
+        while (node) {
+            HNode *next = node->next;
+            hfield_del(hash, container_of(node, HField, node));
+            node = next;
+        }
+    }
+}
+
+void hash_clear(Hash *hash) {
+    htab_dispose(hash, &hash->hmap.newer);
+    htab_dispose(hash, &hash->hmap.older);
+    hm_clear(&hash->hmap);
+    std::string().swap(hash->packed);
+    hash->count = 0;
+    hash->enc = HASH_PACKED;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "hashtable.h"
+
+
+// Field/value map. Small hashes keep their pairs packed in one buffer as
+// [u8 field len][u8 value len][field][value] and are searched linearly;
+// they are converted to a table of HField nodes once they grow past
+// k_hash_packed_max_fields or store a field or value over
+// k_hash_packed_max_len bytes, and stay converted.
+enum {
+    HASH_PACKED = 0,
+    HASH_TABLE = 1,
+};
+
+const size_t k_hash_packed_max_fields = 64;
+const size_t k_hash_packed_max_len = 64;
+
+struct Hash {
+    uint32_t enc = HASH_PACKED;
+    uint32_t count = 0;     // HASH_PACKED
+    std::string packed;     // HASH_PACKED
+    HMap hmap;              // HASH_TABLE
+    size_t bytes = 0;       // HASH_TABLE: of the HField nodes
+};
+
+struct HField {
+    HNode   node;
+    uint32_t flen = 0;
+    uint32_t vlen = 0;
+    char    data[0];        // field, then value
+};
+
+bool   hash_get(Hash *hash, const char *field, size_t flen, const char **val, size_t *vlen);
+bool   hash_set(Hash *hash, const char *field, size_t flen, const char *val, size_t vlen);
+bool   hash_del(Hash *hash, const char *field, size_t flen);
+size_t hash_len(Hash *hash);
+// the heap bytes of the pairs and the hash table
+size_t hash_bytes(const Hash *hash);
+void   hash_foreach(Hash *hash,
+    bool (*f)(const char *field, size_t flen, const char *val, size_t vlen, void *arg),
+    void *arg);
+void   hash_clear(Hash *hash);
@@ -1,21 +1,50 @@
 #include <assert.h>
 #include <stdlib.h>     
 #include "hashtable.h"
+#include "common.h"
 
 
 
+// The stores that hm_find_shared() may race with are atomic. The links
+// are published with release stores, so that a reader that finds a node
+// also sees what was written to it before. Swapping the tables and moving
+// nodes between them is bracketed by hm_write_begin() and hm_write_end().
+static void hm_write_begin(HMap *hmap) {
+    __atomic_store_n(&hmap->version, hmap->version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void hm_write_end(HMap *hmap) {
+    __atomic_store_n(&hmap->version, hmap->version + 1, __ATOMIC_RELEASE);
+}
+
+static void h_assign(HTab *htab, const HTab &from) {
+    __atomic_store_n(&htab->tab, from.tab, __ATOMIC_RELAXED);
+    __atomic_store_n(&htab->mask, from.mask, __ATOMIC_RELAXED);
+    htab->size = from.size;
+}
+
 static void h_init(HTab *htab, size_t n) {
     assert(n > 0 && ((n - 1) & n) == 0);
-    htab->tab = (HNode **)calloc(n, sizeof(HNode *));
-    htab->mask = n - 1;
-    htab->size = 0;
+    HTab init;
+    init.tab = (HNode **)calloc(n, sizeof(HNode *));
+    init.mask = n - 1;
+    h_assign(htab, init);
+}
+
+static void hm_free_tab(HMap *hmap, HNode **tab) {
+    if (tab && hmap->free_tab) {
+        hmap->free_tab(tab);
+    } else {
+        free(tab);
+    }
 }
 
 static void h_insert(HTab *htab, HNode *node) {
     size_t pos = node->hcode & htab->mask;
     HNode *next = htab->tab[pos];
-    node->next = next;
-    htab->tab[pos] = node;
+    __atomic_store_n(&node->next, next, __ATOMIC_RELAXED);
+    __atomic_store_n(&htab->tab[pos], node, __ATOMIC_RELEASE);
     htab->size++;
 }
 
@@ -36,7 +65,7 @@ static HNode **h_lookup(HTab *htab, HNode *key, bool (*eq)(HNode *, HNode *)) {
 
 static HNode *h_detach(HTab *htab, HNode **from) {
     HNode *node = *from;    
-    *from = node->next;     
+    __atomic_store_n(from, node->next, __ATOMIC_RELEASE);
     htab->size--;
     return node;
 }
@@ -44,6 +73,10 @@ static HNode *h_detach(HTab *htab, HNode **from) {
 const size_t k_rehashing_work = 128;    
 
 static void hm_help_rehashing(HMap *hmap) {
+    if (!hmap->older.tab) {
+        return;
+    }
+    hm_write_begin(hmap);
     size_t nwork = 0;
     while (nwork < k_rehashing_work && hmap->older.size > 0) {
         
@@ -57,18 +90,20 @@ static void hm_help_rehashing(HMap *hmap) {
         nwork++;
     }
     
-    if (hmap->older.size == 0 && hmap->older.tab) {
-        free(hmap->older.tab);
-        hmap->older = HTab{};
+    if (hmap->older.size == 0) {
+        hm_free_tab(hmap, hmap->older.tab);
+        h_assign(&hmap->older, HTab{});
     }
+    hm_write_end(hmap);
 }
 
 static void hm_trigger_rehashing(HMap *hmap) {
     assert(hmap->older.tab == NULL);
-    
-    hmap->older = hmap->newer;
+    hm_write_begin(hmap);
+    h_assign(&hmap->older, hmap->newer);
     h_init(&hmap->newer, (hmap->newer.mask + 1) * 2);
     hmap->migrate_pos = 0;
+    hm_write_end(hmap);
 }
 
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
@@ -80,15 +115,71 @@ HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
     return from ? *from : NULL;
 }
 
+HNode *hm_find(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    HNode **from = h_lookup(&hmap->newer, key, eq);
+    if (!from) {
+        from = h_lookup(&hmap->older, key, eq);
+    }
+    return from ? *from : NULL;
+}
+
+static HNode *h_find_shared(HNode **tab, size_t mask, HNode *key,
+    bool (*eq)(HNode *, HNode *))
+{
+    if (!tab) {
+        return NULL;
+    }
+    HNode *cur = __atomic_load_n(&tab[key->hcode & mask], __ATOMIC_ACQUIRE);
+    for (; cur; cur = __atomic_load_n(&cur->next, __ATOMIC_ACQUIRE)) {
+        if (cur->hcode == key->hcode && eq(cur, key)) {
+            return cur;
+        }
+    }
+    return NULL;
+}
+
+// A seqlock read of the two tables. A node that moves to the newer table
+// takes its link along, so a search that overlapped a migration may miss
+// the rest of a chain; a hit is always right, a miss is retried.
+HNode *hm_find_shared(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    while (true) {
+        uint32_t version = __atomic_load_n(&hmap->version, __ATOMIC_ACQUIRE);
+        if (version & 1) {
+            continue;   // a batch of at most k_rehashing_work nodes
+        }
+        HNode **newer = __atomic_load_n(&hmap->newer.tab, __ATOMIC_RELAXED);
+        size_t newer_mask = __atomic_load_n(&hmap->newer.mask, __ATOMIC_RELAXED);
+        HNode **older = __atomic_load_n(&hmap->older.tab, __ATOMIC_RELAXED);
+        size_t older_mask = __atomic_load_n(&hmap->older.mask, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&hmap->version, __ATOMIC_RELAXED) != version) {
+            continue;
+        }
+        HNode *found = h_find_shared(newer, newer_mask, key, eq);
+        if (!found) {
+            found = h_find_shared(older, older_mask, key, eq);
+        }
+        if (found) {
+            return found;
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&hmap->version, __ATOMIC_RELAXED) == version) {
+            return NULL;
+        }
+    }
+}
+
 const size_t k_max_load_factor = 8;
 
 void hm_insert(HMap *hmap, HNode *node) {
     if (!hmap->newer.tab) {
+        hm_write_begin(hmap);
         h_init(&hmap->newer, 4);    
+        hm_write_end(hmap);
     }
     h_insert(&hmap->newer, node);   
 
-    if (!hmap->older.tab) {         
+    if (!hmap->older.tab) {
         size_t shreshold = (hmap->newer.mask + 1) * k_max_load_factor;
         if (hmap->newer.size >= shreshold) {
             hm_trigger_rehashing(hmap);
@@ -97,6 +188,28 @@ void hm_insert(HMap *hmap, HNode *node) {
     hm_help_rehashing(hmap);        
 }
 
+void hm_reserve(HMap *hmap, size_t n) {
+    size_t nslots = 4;
+    while (nslots * k_max_load_factor <= n) {
+        nslots *= 2;
+    }
+    if (hmap->newer.tab && (hmap->older.tab || hmap->newer.mask + 1 >= nslots)) {
+        return;
+    }
+    hm_write_begin(hmap);
+    if (hmap->newer.tab) {
+        h_assign(&hmap->older, hmap->newer);
+        hmap->migrate_pos = 0;
+    }
+    h_init(&hmap->newer, nslots);
+    hm_write_end(hmap);
+}
+
+bool hm_rehash_step(HMap *hmap) {
+    hm_help_rehashing(hmap);
+    return hmap->older.tab != NULL;
+}
+
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
     hm_help_rehashing(hmap);
     if (HNode **from = h_lookup(&hmap->newer, key, eq)) {
@@ -109,15 +222,59 @@ HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
 }
 
 void hm_clear(HMap *hmap) {
-    free(hmap->newer.tab);
-    free(hmap->older.tab);
+    hm_free_tab(hmap, hmap->newer.tab);
+    hm_free_tab(hmap, hmap->older.tab);
+    void (*free_tab)(void *) = hmap->free_tab;
     *hmap = HMap{};
+    hmap->free_tab = free_tab;
 }
 
 size_t hm_size(HMap *hmap) {
     return hmap->newer.size + hmap->older.size;
 }
 
+HNode *hm_sample(HMap *hmap, uint64_t r) {
+    size_t n = hm_size(hmap);
+    if (n == 0) {
+        return NULL;
+    }
+    HTab *htab = (r >> 32) % n < hmap->newer.size ? &hmap->newer : &hmap->older;
+    for (size_t i = 0; i <= htab->mask; i++) {
+        if (HNode *node = htab->tab[(r + i) & htab->mask]) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+static size_t h_bytes(const HTab *htab) {
+    return htab->tab ? (htab->mask + 1) * sizeof(HNode *) : 0;
+}
+
+// from the masks, without touching the (cold) arrays
+size_t hm_bytes(const HMap *hmap) {
+    return h_bytes(&hmap->newer) + h_bytes(&hmap->older);
+}
+
+static bool h_move(HTab *htab, HNode *from, HNode *to) {
+    if (!htab->tab) {
+        return false;
+    }
+    for (HNode **cur = &htab->tab[from->hcode & htab->mask]; *cur; cur = &(*cur)->next) {
+        if (*cur == from) {
+            *cur = to;
+            return true;
+        }
+    }
+    return false;
+}
+
+void hm_move(HMap *hmap, HNode *from, HNode *to) {
+    bool found = h_move(&hmap->newer, from, to) || h_move(&hmap->older, from, to);
+    assert(found);
+    (void)found;
+}
+
 static bool h_foreach(HTab *htab, bool (*f)(HNode *, void *), void *arg) {
     for (size_t i = 0; htab->mask != 0 && i <= htab->mask; i++) {
         for (HNode *node = htab->tab[i]; node != NULL; node = node->next) {
@@ -132,3 +289,77 @@ static bool h_foreach(HTab *htab, bool (*f)(HNode *, void *), void *arg) {
 void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg) {
     h_foreach(&hmap->newer, f, arg) && h_foreach(&hmap->older, f, arg);
 }
+
+static void h_prefetch_slot(HTab *htab, uint64_t hcode) {
+    if (htab->tab) {
+        __builtin_prefetch(&htab->tab[hcode & htab->mask]);
+    }
+}
+
+static void h_prefetch_node(HTab *htab, uint64_t hcode) {
+    if (htab->tab) {
+        HNode *node = htab->tab[hcode & htab->mask];
+        if (node) {
+            __builtin_prefetch(node);
+        }
+    }
+}
+
+void hm_prefetch_slot(HMap *hmap, uint64_t hcode) {
+    h_prefetch_slot(&hmap->newer, hcode);
+    h_prefetch_slot(&hmap->older, hcode);
+}
+
+void hm_prefetch_node(HMap *hmap, uint64_t hcode) {
+    h_prefetch_node(&hmap->newer, hcode);
+    h_prefetch_node(&hmap->older, hcode);
+}
+
+static bool h_foreach_part(HTab *htab, size_t part, size_t nparts,
+    bool (*f)(HNode *, void *), void *arg)
+{
+    if (!htab->tab) {
+        return true;
+    }
+    size_t nslots = htab->mask + 1;
+    size_t end = nslots * (part + 1) / nparts;
+    for (size_t i = nslots * part / nparts; i < end; i++) {
+        for (HNode *node = htab->tab[i]; node != NULL; node = node->next) {
+            if (!f(node, arg)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void hm_foreach_part(HMap *hmap, size_t part, size_t nparts,
+    bool (*f)(HNode *, void *), void *arg)
+{
+    h_foreach_part(&hmap->newer, part, nparts, f, arg)
+        && h_foreach_part(&hmap->older, part, nparts, f, arg);
+}
+
+static bool h_foreach_bucket(HTab *htab, size_t mask, size_t pos,
+    bool (*f)(HNode *, void *), void *arg)
+{
+    if (!htab->tab) {
+        return true;
+    }
+    assert(mask <= htab->mask);
+    for (size_t i = pos; i <= htab->mask; i += mask + 1) {
+        for (HNode *node = htab->tab[i]; node != NULL; node = node->next) {
+            if (!f(node, arg)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void hm_foreach_bucket(HMap *hmap, size_t mask, size_t pos,
+    bool (*f)(HNode *, void *), void *arg)
+{
+    h_foreach_bucket(&hmap->newer, mask, pos, f, arg)
+        && h_foreach_bucket(&hmap->older, mask, pos, f, arg);
+}
@@ -19,11 +19,52 @@ struct HMap {
     HTab newer;
     HTab older;
     size_t migrate_pos = 0;
+    // odd while the tables are being swapped or nodes move between them
+    uint32_t version = 0;
+    // frees the replaced bucket arrays, free() if NULL
+    void (*free_tab)(void *) = NULL;
 };
 
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void   hm_insert(HMap *hmap, HNode *node);
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void   hm_clear(HMap *hmap);
+// grows the table for `n` nodes up front, so that inserting them does not
+// keep triggering rehashes
+void   hm_reserve(HMap *hmap, size_t n);
+// moves a batch of the nodes of a rehashing over; false once none is left
+bool   hm_rehash_step(HMap *hmap);
 size_t hm_size(HMap *hmap);
+// the bytes of the bucket arrays, both of them while rehashing
+size_t hm_bytes(const HMap *hmap);
 void   hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg);
+// visits the nodes in the `part`-th of `nparts` equal slices of the buckets
+void   hm_foreach_part(HMap *hmap, size_t part, size_t nparts,
+    bool (*f)(HNode *, void *), void *arg);
+// visits the nodes with `hcode & mask == pos`, `mask` being no larger than
+// that of either table. The tables only grow, and a node keeps the low
+// bits of its bucket when it moves, so calls for pos = 0..mask spread over
+// inserts and rehashing see each node that stays in the map exactly once.
+void   hm_foreach_bucket(HMap *hmap, size_t mask, size_t pos,
+    bool (*f)(HNode *, void *), void *arg);
+// the chain of a bucket picked by `r`, or of the next non-empty one after
+// it; NULL if the map is empty. The tables are picked in proportion to
+// their sizes, so this is a cheap, slightly biased way to sample nodes.
+HNode *hm_sample(HMap *hmap, uint64_t r);
+// hm_lookup() without helping the rehashing along, so that several threads
+// can search a table that nobody is writing
+HNode *hm_find(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
+
+// hm_find() for reader threads while one writer keeps modifying the map
+// with the other functions. The writer must defer freeing the nodes it
+// deletes, and the bucket arrays through `free_tab`, until the readers are
+// done with them.
+HNode *hm_find_shared(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
+
+// points the link to `from` at `to`, a copy of it in a new place
+void   hm_move(HMap *hmap, HNode *from, HNode *to);
+
+// software prefetch for batched lookups: first the bucket slots of `hcode`,
+// then (once the slots are cached) the head node of each chain
+void   hm_prefetch_slot(HMap *hmap, uint64_t hcode);
+void   hm_prefetch_node(HMap *hmap, uint64_t hcode);
@@ -0,0 +1,77 @@
+#include "hist.h"
+
+
+static uint32_t hist_index(uint64_t val) {
+    if (val < k_hist_sub_count) {
+        return (uint32_t)val;
+    }
+    uint32_t msb = 63 - (uint32_t)__builtin_clzll(val);
+    uint32_t shift = msb - k_hist_sub_bits;
+    uint32_t sub = (uint32_t)(val >> shift) & (k_hist_sub_count - 1);
+    return (shift + 1) * k_hist_sub_count + sub;
+}
+
+// the largest value that maps to the bucket
+static uint64_t hist_upper(uint32_t idx) {
+    uint32_t mag = idx / k_hist_sub_count;
+    uint64_t sub = idx % k_hist_sub_count;
+    if (mag == 0) {
+        return sub;
+    }
+    uint32_t shift = mag - 1;
+    uint64_t low = (k_hist_sub_count + sub) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+void hist_add(Hist *hist, uint64_t val) {
+    hist->buckets[hist_index(val)]++;
+    hist->count++;
+    hist->sum += val;
+    if (val < hist->min) {
+        hist->min = val;
+    }
+    if (val > hist->max) {
+        hist->max = val;
+    }
+}
+
+void hist_merge(Hist *dst, const Hist *src) {
+    for (uint32_t i = 0; i < k_hist_buckets; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+void hist_reset(Hist *hist) {
+    *hist = Hist{};
+}
+
+// pct in [0, 100]; the result is clamped to the recorded min/max
+uint64_t hist_percentile(const Hist *hist, double pct) {
+    if (hist->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(pct / 100.0 * (double)hist->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < k_hist_buckets; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            uint64_t val = hist_upper(i);
+            if (val < hist->min) {
+                val = hist->min;
+            }
+            return val < hist->max ? val : hist->max;
+        }
+    }
+    return hist->max;
+}
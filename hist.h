@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Log-linear latency histogram (HDR style): every power of two is split
+// into 2^k_hist_sub_bits linear sub-buckets, so the relative error of a
+// recorded value is bounded by ~3% over the full uint64_t range.
+const uint32_t k_hist_sub_bits = 5;
+const uint32_t k_hist_sub_count = 1u << k_hist_sub_bits;
+const uint32_t k_hist_buckets = (64 - k_hist_sub_bits + 1) * k_hist_sub_count;
+
+struct Hist {
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t min = (uint64_t)-1;
+    uint64_t max = 0;
+    uint64_t buckets[k_hist_buckets] = {};
+};
+
+void     hist_add(Hist *hist, uint64_t val);
+void     hist_merge(Hist *dst, const Hist *src);
+void     hist_reset(Hist *hist);
+uint64_t hist_percentile(const Hist *hist, double pct);
@@ -0,0 +1,256 @@
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "hll.h"
+#include "common.h"
+
+
+// the highest register value: one plus the longest run of zeros
+const uint32_t k_hll_q = 64 - k_hll_p;
+
+// dense registers: register i is at bit 6 * i, so 4 registers take 3 bytes
+
+static uint32_t dense_get(const uint8_t *p, uint32_t i) {
+    uint32_t bit = i * 6, byte = bit / 8, shift = bit % 8;
+    uint32_t val = p[byte] >> shift;
+    if (shift > 2) {
+        val |= (uint32_t)p[byte + 1] << (8 - shift);
+    }
+    return val & 63;
+}
+
+static void dense_set(uint8_t *p, uint32_t i, uint32_t val) {
+    uint32_t bit = i * 6, byte = bit / 8, shift = bit % 8;
+    p[byte] = (uint8_t)((p[byte] & ~(63u << shift)) | (val << shift));
+    if (shift > 2) {
+        p[byte + 1] = (uint8_t)((p[byte + 1] & ~(63u >> (8 - shift))) | (val >> (8 - shift)));
+    }
+}
+
+static void hll_densify(Hll *hll) {
+    assert(hll->enc == HLL_SPARSE);
+    hll->dense.assign(k_hll_dense_size, 0);
+    for (uint32_t e : hll->sparse) {
+        dense_set(hll->dense.data(), e >> 8, e & 0xff);
+    }
+    std::vector<uint32_t>().swap(hll->sparse);
+    hll->enc = HLL_DENSE;
+}
+
+bool hll_add(Hll *hll, const char *elem, size_t len) {
+    // str_hash is too short and too weak for the register index and the
+    // run of zeros to be independent
+    uint64_t h = str_hash64(elem, len);
+    uint32_t idx = (uint32_t)(h & (k_hll_registers - 1));
+    // the guard bit caps the value at k_hll_q + 1
+    uint32_t val = (uint32_t)__builtin_ctzll((h >> k_hll_p) | (1ull << k_hll_q)) + 1;
+
+    if (hll->enc == HLL_DENSE) {
+        if (dense_get(hll->dense.data(), idx) >= val) {
+            return false;
+        }
+        dense_set(hll->dense.data(), idx, val);
+        hll->card = -1;
+        return true;
+    }
+    std::vector<uint32_t> &sp = hll->sparse;
+    auto it = std::lower_bound(sp.begin(), sp.end(), idx << 8);
+    if (it != sp.end() && (*it >> 8) == idx) {
+        if ((*it & 0xff) >= val) {
+            return false;
+        }
+        *it = idx << 8 | val;
+    } else {
+        sp.insert(it, idx << 8 | val);
+        if (sp.size() > k_hll_sparse_max) {
+            hll_densify(hll);
+        }
+    }
+    hll->card = -1;
+    return true;
+}
+
+// register max-merge of the dense array into one byte per register
+
+static void dense_max_scalar(const uint8_t *p, uint8_t *regs, uint32_t from) {
+    for (uint32_t i = from; i < k_hll_registers; i++) {
+        regs[i] = std::max(regs[i], (uint8_t)dense_get(p, i));
+    }
+}
+
+#if defined(__x86_64__)
+
+// Each 128-bit lane spreads 12 bytes into 4 dwords of 3 bytes, then moves
+// the 4 registers of each dword into its 4 bytes with shifts and masks.
+__attribute__((target("avx2")))
+static void dense_max_simd(const uint8_t *p, uint8_t *regs) {
+    const __m256i spread = _mm256_setr_epi8(
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i m0 = _mm256_set1_epi32(0x3f);
+    const __m256i m1 = _mm256_set1_epi32(0x3f00);
+    const __m256i m2 = _mm256_set1_epi32(0x3f0000);
+    const __m256i m3 = _mm256_set1_epi32(0x3f000000);
+    size_t in = 0;
+    uint32_t out = 0;
+    // the 16-byte loads read 4 bytes past their 12
+    for (; in + 28 <= k_hll_dense_size; in += 24, out += 32) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)(p + in));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(p + in + 12));
+        __m256i x = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        x = _mm256_shuffle_epi8(x, spread);
+        __m256i r = _mm256_or_si256(
+            _mm256_or_si256(_mm256_and_si256(x, m0),
+                _mm256_and_si256(_mm256_slli_epi32(x, 2), m1)),
+            _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi32(x, 4), m2),
+                _mm256_and_si256(_mm256_slli_epi32(x, 6), m3)));
+        __m256i cur = _mm256_loadu_si256((const __m256i *)(regs + out));
+        _mm256_storeu_si256((__m256i *)(regs + out), _mm256_max_epu8(cur, r));
+    }
+    dense_max_scalar(p, regs, out);
+}
+
+static bool simd_supported() {
+    return __builtin_cpu_supports("avx2");
+}
+
+#else
+
+static bool simd_supported() {
+    return false;
+}
+
+#endif
+
+static bool g_use_simd = simd_supported();
+
+bool hll_use_simd(bool on) {
+    g_use_simd = on && simd_supported();
+    return g_use_simd;
+}
+
+static void hll_max(const Hll *hll, uint8_t *regs) {
+    if (hll->enc == HLL_SPARSE) {
+        for (uint32_t e : hll->sparse) {
+            regs[e >> 8] = std::max(regs[e >> 8], (uint8_t)(e & 0xff));
+        }
+        return;
+    }
+#if defined(__x86_64__)
+    if (g_use_simd) {
+        return dense_max_simd(hll->dense.data(), regs);
+    }
+#endif
+    dense_max_scalar(hll->dense.data(), regs, 0);
+}
+
+// estimation from the histogram of register values, with Ertl's improved
+// estimator ("New cardinality estimation algorithms for HyperLogLog
+// sketches", 2017), which needs no bias correction at any cardinality
+
+static double hll_sigma(double x) {
+    if (x == 1.0) {
+        return INFINITY;
+    }
+    double y = 1.0, z = x, prev = 0.0;
+    do {
+        x *= x;
+        prev = z;
+        z += x * y;
+        y += y;
+    } while (prev != z);
+    return z;
+}
+
+static double hll_tau(double x) {
+    if (x == 0.0 || x == 1.0) {
+        return 0.0;
+    }
+    double y = 1.0, z = 1.0 - x, prev = 0.0;
+    do {
+        x = sqrt(x);
+        prev = z;
+        y *= 0.5;
+        z -= (1.0 - x) * (1.0 - x) * y;
+    } while (prev != z);
+    return z / 3.0;
+}
+
+static uint64_t hll_estimate(const uint32_t *histo) {
+    const double m = k_hll_registers;
+    const double alpha = 0.5 / log(2.0);
+    double z = m * hll_tau((m - histo[k_hll_q + 1]) / m);
+    for (uint32_t k = k_hll_q; k >= 1; k--) {
+        z = 0.5 * (z + histo[k]);
+    }
+    z += m * hll_sigma(histo[0] / m);
+    return (uint64_t)llround(alpha * m * m / z);
+}
+
+uint64_t hll_count(Hll **hlls, size_t n) {
+    if (n == 1 && hlls[0]->card >= 0) {
+        return (uint64_t)hlls[0]->card;
+    }
+    uint32_t histo[64] = {};
+    if (n == 1 && hlls[0]->enc == HLL_SPARSE) {
+        histo[0] = k_hll_registers - (uint32_t)hlls[0]->sparse.size();
+        for (uint32_t e : hlls[0]->sparse) {
+            histo[e & 0xff]++;
+        }
+        return hll_estimate(histo);
+    }
+    alignas(32) uint8_t regs[k_hll_registers] = {};
+    for (size_t i = 0; i < n; i++) {
+        hll_max(hlls[i], regs);
+    }
+    for (uint32_t i = 0; i < k_hll_registers; i++) {
+        histo[regs[i]]++;
+    }
+    uint64_t card = hll_estimate(histo);
+    if (n == 1) {
+        // sparse counters are not cached, so a shared empty one is never written
+        hlls[0]->card = (int64_t)card;
+    }
+    return card;
+}
+
+void hll_merge(Hll *dst, Hll **srcs, size_t n) {
+    alignas(32) uint8_t regs[k_hll_registers] = {};
+    hll_max(dst, regs);
+    for (size_t i = 0; i < n; i++) {
+        hll_max(srcs[i], regs);
+    }
+    size_t used = k_hll_registers - std::count(regs, regs + k_hll_registers, 0);
+    if (dst->enc == HLL_SPARSE && used <= k_hll_sparse_max) {
+        dst->sparse.clear();
+        for (uint32_t i = 0; i < k_hll_registers; i++) {
+            if (regs[i]) {
+                dst->sparse.push_back(i << 8 | regs[i]);
+            }
+        }
+    } else {
+        std::vector<uint32_t>().swap(dst->sparse);
+        dst->dense.assign(k_hll_dense_size, 0);
+        for (uint32_t i = 0; i < k_hll_registers; i++) {
+            dense_set(dst->dense.data(), i, regs[i]);
+        }
+        dst->enc = HLL_DENSE;
+    }
+    dst->card = -1;
+}
+
+size_t hll_bytes(const Hll *hll) {
+    return mem_usable(hll->sparse.data()) + mem_usable(hll->dense.data());
+}
+
+void hll_clear(Hll *hll) {
+    std::vector<uint32_t>().swap(hll->sparse);
+    std::vector<uint8_t>().swap(hll->dense);
+    hll->enc = HLL_SPARSE;
+    hll->card = -1;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+// HyperLogLog cardinality estimator with 2^14 registers (0.81% standard
+// error). Small counters keep only their non-zero registers, sorted by
+// index; past k_hll_sparse_max of them they switch to the dense array of
+// 6-bit registers packed into 12KB, and stay dense.
+enum {
+    HLL_SPARSE = 0,
+    HLL_DENSE = 1,
+};
+
+const uint32_t k_hll_p = 14;
+const uint32_t k_hll_registers = 1 << k_hll_p;
+const size_t k_hll_dense_size = k_hll_registers * 6 / 8;
+const size_t k_hll_sparse_max = 2048;
+
+struct Hll {
+    uint32_t enc = HLL_SPARSE;
+    std::vector<uint32_t> sparse;   // HLL_SPARSE: index << 8 | value
+    std::vector<uint8_t> dense;     // HLL_DENSE
+    int64_t card = -1;              // cached estimate, -1 if stale
+};
+
+// returns true if a register changed
+bool     hll_add(Hll *hll, const char *elem, size_t len);
+// the estimated cardinality of the union of `n` counters
+uint64_t hll_count(Hll **hlls, size_t n);
+// merges `n` counters into `dst`
+void     hll_merge(Hll *dst, Hll **srcs, size_t n);
+// the heap bytes of the registers
+size_t   hll_bytes(const Hll *hll);
+void     hll_clear(Hll *hll);
+
+// the SIMD kernels are used if the CPU supports them and this is on;
+// returns whether they are used
+bool     hll_use_simd(bool on);
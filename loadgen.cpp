@@ -0,0 +1,1139 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+
+#include "hist.h"
+#include "shmring.h"
+
+
+static void die(const char *msg) {
+    int err = errno;
+    fprintf(stderr, "[%d] %s\n", err, msg);
+    abort();
+}
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static void fd_set_nb(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        die("fcntl error");
+    }
+}
+
+// deterministic per-connection random numbers (xorshift64*)
+static uint64_t rng_next(uint64_t &state) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1Dull;
+}
+
+enum {
+    OP_GET,
+    OP_SET,
+    OP_DEL,
+    OP_MGET,
+    OP_ZADD,
+    OP_ZSCORE,
+    OP_ZREM,
+    OP_ZQUERY,
+    OP_INCR,
+    OP_PUBLISH,
+    OP_MAX,
+};
+
+static const char *k_op_names[OP_MAX] = {
+    "get", "set", "del", "mget", "zadd", "zscore", "zrem", "zquery", "incr",
+    "publish",
+};
+
+static struct {
+    const char *host = "127.0.0.1";
+    uint16_t port = 1234;
+    const char *unix_path = NULL;
+    bool shm = false;
+    uint32_t conns = 50;
+    uint32_t depth = 1;         // pipelined requests in flight per connection
+    uint64_t requests = 0;      // stop after this many (0: use duration)
+    double duration = 10;
+    uint64_t keyspace = 100000;
+    uint32_t value_size = 16;
+    uint32_t mget_keys = 10;
+    uint32_t zsets = 1;
+    uint32_t zquery_limit = 10;
+    uint32_t subscribers = 0;
+    uint64_t seed = 1;
+    bool prefill = false;
+    bool csv = false;
+    uint64_t check_rounds = 0;  // check mode (-V)
+    uint32_t weights[OP_MAX] = {90, 10};
+} g_opt;
+
+typedef std::vector<uint8_t> Buffer;
+
+struct Pending {
+    uint64_t start_ns = 0;
+    uint32_t op = 0;
+};
+
+// the client side of the shared-memory transport
+struct ShmClient {
+    void *base = NULL;
+    size_t map_size = 0;
+    int server_efd = -1;
+    int efd = -1;
+    ShmEnd req;
+    ShmEnd resp;
+};
+
+struct Conn {
+    int fd = -1;
+    ShmClient *shm = NULL;
+    bool subscriber = false;
+    uint64_t rng = 0;
+    Buffer outgoing;
+    size_t out_pos = 0;
+    Buffer incoming;
+    std::deque<Pending> inflight;
+};
+
+struct OpStats {
+    Hist hist;
+    uint64_t errors = 0;
+};
+
+static OpStats g_stats[OP_MAX];
+
+// pub/sub: publish to subscribe latency, and deliveries still expected
+static OpStats g_deliver;
+static uint64_t g_deliver_pending = 0;
+
+static void put_u32(Buffer &buf, uint32_t val) {
+    buf.insert(buf.end(), (uint8_t *)&val, (uint8_t *)&val + 4);
+}
+
+// request framing: total len, nstr, then len + data for each string
+static void put_req(Buffer &buf, const std::vector<std::string> &cmd) {
+    uint32_t len = 4;
+    for (const std::string &s : cmd) {
+        len += 4 + (uint32_t)s.size();
+    }
+    put_u32(buf, len);
+    put_u32(buf, (uint32_t)cmd.size());
+    for (const std::string &s : cmd) {
+        put_u32(buf, (uint32_t)s.size());
+        buf.insert(buf.end(), s.begin(), s.end());
+    }
+}
+
+static std::string key_name(const char *prefix, uint64_t id) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s:%012llu", prefix, (unsigned long long)id);
+    return buf;
+}
+
+static std::string g_value;
+
+static void gen_request(Conn *conn, uint32_t op, std::vector<std::string> &cmd) {
+    uint64_t &rng = conn->rng;
+    std::string key = key_name("key", rng_next(rng) % g_opt.keyspace);
+    std::string zkey = key_name("zset", rng_next(rng) % g_opt.zsets);
+    std::string member = key_name("m", rng_next(rng) % g_opt.keyspace);
+    std::string score = std::to_string(rng_next(rng) % g_opt.keyspace);
+
+    cmd.clear();
+    cmd.push_back(k_op_names[op]);
+    switch (op) {
+    case OP_GET:
+    case OP_DEL:
+        cmd.push_back(key);
+        break;
+    case OP_INCR:
+        cmd.push_back(key_name("counter", rng_next(rng) % g_opt.keyspace));
+        break;
+    case OP_PUBLISH:
+        // the payload starts with the send time, for the delivery latency
+        cmd.push_back("channel");
+        cmd.push_back(std::to_string(get_monotonic_nsec()));
+        if (cmd.back().size() < g_value.size()) {
+            cmd.back().resize(g_value.size(), 'x');
+        }
+        break;
+    case OP_SET:
+        cmd.push_back(key);
+        cmd.push_back(g_value);
+        break;
+    case OP_MGET:
+        for (uint32_t i = 0; i < g_opt.mget_keys; i++) {
+            cmd.push_back(key_name("key", rng_next(rng) % g_opt.keyspace));
+        }
+        break;
+    case OP_ZADD:
+        cmd.push_back(zkey);
+        cmd.push_back(score);
+        cmd.push_back(member);
+        break;
+    case OP_ZSCORE:
+    case OP_ZREM:
+        cmd.push_back(zkey);
+        cmd.push_back(member);
+        break;
+    case OP_ZQUERY:
+        cmd.push_back(zkey);
+        cmd.push_back(score);
+        cmd.push_back("");
+        cmd.push_back("0");
+        cmd.push_back(std::to_string(g_opt.zquery_limit * 2));
+        break;
+    default:
+        assert(!"unreachable");
+    }
+}
+
+static uint32_t pick_op(Conn *conn) {
+    uint32_t total = 0;
+    for (uint32_t w : g_opt.weights) {
+        total += w;
+    }
+    uint32_t r = (uint32_t)(rng_next(conn->rng) % total);
+    for (uint32_t op = 0; op < OP_MAX; op++) {
+        if (r < g_opt.weights[op]) {
+            return op;
+        }
+        r -= g_opt.weights[op];
+    }
+    return OP_GET;
+}
+
+static int conn_open_unix() {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", g_opt.unix_path);
+    if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr))) {
+        die("connect");
+    }
+    return fd;
+}
+
+static int conn_open() {
+    if (g_opt.unix_path) {
+        int fd = conn_open_unix();
+        fd_set_nb(fd);
+        return fd;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(g_opt.port);
+    if (inet_pton(AF_INET, g_opt.host, &addr.sin_addr) != 1) {
+        die("bad host");
+    }
+    if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr))) {
+        die("connect");
+    }
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    fd_set_nb(fd);
+    return fd;
+}
+
+// Connects over the Unix socket and sends `shm`; the reply carries the
+// memfd with the rings and the server's and our eventfds.
+static void conn_open_shm(Conn *conn) {
+    conn->fd = conn_open_unix();
+    Buffer req;
+    put_req(req, {"shm"});
+    if (write(conn->fd, req.data(), req.size()) != (ssize_t)req.size()) {
+        die("write()");
+    }
+
+    uint8_t resp[4 + 1 + 8];
+    int fds[3] = {-1, -1, -1};
+    size_t got = 0;
+    while (got < sizeof(resp)) {
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(sizeof(fds))];
+        } ctrl = {};
+        struct iovec iov = {resp + got, sizeof(resp) - got};
+        struct msghdr mh = {};
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = ctrl.buf;
+        mh.msg_controllen = sizeof(ctrl.buf);
+        ssize_t rv = recvmsg(conn->fd, &mh, MSG_CMSG_CLOEXEC);
+        if (rv <= 0) {
+            die("recvmsg()");
+        }
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        if (cm && cm->cmsg_type == SCM_RIGHTS
+            && cm->cmsg_len == CMSG_LEN(sizeof(fds)))
+        {
+            memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+        }
+        got += (size_t)rv;
+    }
+    int64_t ring_size = 0;
+    memcpy(&ring_size, resp + 5, 8);
+    if (resp[4] != 3 /* TAG_INT */ || fds[0] < 0) {
+        fprintf(stderr, "shm negotiation failed\n");
+        exit(1);
+    }
+
+    ShmClient *shm = new ShmClient();
+    shm->map_size = shm_map_size((size_t)ring_size);
+    shm->base = mmap(NULL, shm->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+        fds[0], 0);
+    if (shm->base == MAP_FAILED) {
+        die("mmap()");
+    }
+    close(fds[0]);
+    const ShmHeader *hdr = (const ShmHeader *)shm->base;
+    if (hdr->magic != k_shm_magic || hdr->version != k_shm_version
+        || hdr->ring_size != (uint64_t)ring_size)
+    {
+        fprintf(stderr, "bad shm header\n");
+        exit(1);
+    }
+    shm->server_efd = fds[1];
+    shm->efd = fds[2];
+    fd_set_nb(shm->efd);
+    shm_end_init(&shm->req, shm->base, (size_t)ring_size, 0);
+    shm_end_init(&shm->resp, shm->base, (size_t)ring_size, 1);
+    conn->shm = shm;
+}
+
+static void conn_close(Conn *conn) {
+    if (conn->shm) {
+        munmap(conn->shm->base, conn->shm->map_size);
+        close(conn->shm->server_efd);
+        close(conn->shm->efd);
+        delete conn->shm;
+        conn->shm = NULL;
+    }
+    close(conn->fd);
+}
+
+static void efd_signal(int efd) {
+    uint64_t one = 1;
+    (void)write(efd, &one, sizeof(one));
+}
+
+// the fd to poll, after asking the server to wake us if we must wait
+static int shm_prepare_poll(Conn *conn) {
+    ShmClient *shm = conn->shm;
+    uint64_t val = 0;
+    (void)read(shm->efd, &val, sizeof(val));
+    bool sleep = true;
+    if (!conn->inflight.empty()) {
+        sleep = shm_park_reader(&shm->resp);
+    }
+    if (sleep && conn->out_pos < conn->outgoing.size()) {
+        sleep = shm_park_writer(&shm->req);
+    }
+    if (!sleep) {
+        efd_signal(shm->efd);
+    }
+    return shm->efd;
+}
+
+// write(2) and read(2) on the connection's transport
+static ssize_t conn_write_raw(Conn *conn, const uint8_t *data, size_t len) {
+    ShmClient *shm = conn->shm;
+    if (!shm) {
+        return write(conn->fd, data, len);
+    }
+    struct iovec iov = {(void *)data, len};
+    int64_t rv = shm_writev(&shm->req, &iov, 1);
+    if (rv <= 0) {
+        errno = rv < 0 ? EPROTO : EAGAIN;
+        return -1;
+    }
+    if (shm_wake_reader(&shm->req)) {
+        efd_signal(shm->server_efd);
+    }
+    return (ssize_t)rv;
+}
+
+static ssize_t conn_read_raw(Conn *conn, uint8_t *buf, size_t len) {
+    ShmClient *shm = conn->shm;
+    if (!shm) {
+        return read(conn->fd, buf, len);
+    }
+    int64_t rv = shm_read(&shm->resp, buf, len);
+    if (rv <= 0) {
+        errno = rv < 0 ? EPROTO : EAGAIN;
+        return -1;
+    }
+    if (shm_wake_writer(&shm->resp)) {
+        efd_signal(shm->server_efd);
+    }
+    return (ssize_t)rv;
+}
+
+// returns false on a fatal error
+static bool conn_write(Conn *conn) {
+    while (conn->out_pos < conn->outgoing.size()) {
+        ssize_t rv = conn_write_raw(conn, &conn->outgoing[conn->out_pos],
+            conn->outgoing.size() - conn->out_pos);
+        if (rv < 0 && errno == EAGAIN) {
+            return true;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        conn->out_pos += (size_t)rv;
+    }
+    conn->outgoing.clear();
+    conn->out_pos = 0;
+    return true;
+}
+
+// a ["message", channel, payload] push on a subscriber connection
+static void sub_push(const uint8_t *msg, uint32_t len, uint64_t now_ns) {
+    const uint8_t *end = msg + len;
+    const uint8_t *cur = msg + 1 + 4;   // TAG_ARR, count
+    uint32_t n = 0;
+    int i = 0;
+    for (; i < 3 && cur + 5 <= end; i++) {
+        memcpy(&n, cur + 1, 4);     // TAG_STR, length
+        cur += 5 + (i < 2 ? n : 0);
+    }
+    g_deliver_pending--;
+    if (msg[0] != 5 /* TAG_ARR */ || i < 3 || cur + n > end) {
+        g_deliver.errors++;
+        return;
+    }
+    uint64_t sent_ns = strtoull(std::string((const char *)cur, n).c_str(), NULL, 10);
+    hist_add(&g_deliver.hist, now_ns - sent_ns);
+}
+
+// consume complete responses; returns the number completed or -1
+static int64_t conn_read(Conn *conn, uint64_t now_ns) {
+    uint8_t buf[64 * 1024];
+    ssize_t rv = conn_read_raw(conn, buf, sizeof(buf));
+    if (rv < 0 && errno == EAGAIN) {
+        return 0;
+    }
+    if (rv <= 0) {
+        return -1;
+    }
+    conn->incoming.insert(conn->incoming.end(), buf, buf + rv);
+
+    int64_t done = 0;
+    size_t pos = 0;
+    while (conn->incoming.size() - pos >= 4) {
+        uint32_t len = 0;
+        memcpy(&len, &conn->incoming[pos], 4);
+        if (conn->incoming.size() - pos < 4 + (size_t)len) {
+            break;
+        }
+        const uint8_t *msg = &conn->incoming[pos + 4];
+        if (conn->inflight.empty() && conn->subscriber) {
+            sub_push(msg, len, now_ns);
+            pos += 4 + len;
+            continue;
+        }
+        if (conn->inflight.empty()) {
+            return -1;  // response without a request
+        }
+        Pending p = conn->inflight.front();
+        conn->inflight.pop_front();
+        OpStats &st = g_stats[p.op];
+        hist_add(&st.hist, now_ns - p.start_ns);
+        if (len == 0 || msg[0] == 1 /* TAG_ERR */) {
+            st.errors++;
+        } else if (p.op == OP_PUBLISH && len == 9 && msg[0] == 3 /* TAG_INT */) {
+            int64_t receivers = 0;
+            memcpy(&receivers, msg + 1, 8);
+            g_deliver_pending += (uint64_t)receivers;
+        }
+        pos += 4 + len;
+        done++;
+    }
+    conn->incoming.erase(conn->incoming.begin(), conn->incoming.begin() + pos);
+    return done;
+}
+
+// populate the keyspace and the zsets over a single blocking connection
+static void prefill() {
+    Conn conn;
+    conn.fd = conn_open();
+    // keys per mset, keeping each request around 1MB for large values
+    const uint64_t k_batch = std::max<uint64_t>(1,
+        std::min<uint64_t>(100, (1 << 20) / (g_opt.value_size + 32)));
+    std::vector<std::string> cmd;
+    uint64_t sent = 0;
+    uint64_t nkeys = g_opt.keyspace;
+    for (uint64_t i = 0; i < nkeys; i += k_batch) {
+        cmd.assign(1, "mset");
+        for (uint64_t j = i; j < i + k_batch && j < nkeys; j++) {
+            cmd.push_back(key_name("key", j));
+            cmd.push_back(g_value);
+        }
+        put_req(conn.outgoing, cmd);
+        conn.inflight.push_back(Pending{0, OP_SET});
+        sent++;
+        if (g_opt.weights[OP_ZADD] + g_opt.weights[OP_ZSCORE]
+            + g_opt.weights[OP_ZREM] + g_opt.weights[OP_ZQUERY])
+        {
+            for (uint32_t z = 0; z < g_opt.zsets; z++) {
+                cmd.assign(1, "zadd");
+                cmd.push_back(key_name("zset", z));
+                for (uint64_t j = i; j < i + k_batch && j < nkeys; j++) {
+                    cmd.push_back(std::to_string(j));
+                    cmd.push_back(key_name("m", j));
+                }
+                put_req(conn.outgoing, cmd);
+                conn.inflight.push_back(Pending{0, OP_ZADD});
+                sent++;
+            }
+        }
+        while (!conn.outgoing.empty() || conn.inflight.size() > 64) {
+            struct pollfd pfd = {conn.fd, POLLIN, 0};
+            if (!conn.outgoing.empty()) {
+                pfd.events |= POLLOUT;
+            }
+            poll(&pfd, 1, -1);
+            if ((pfd.revents & POLLOUT) && !conn_write(&conn)) {
+                die("prefill write");
+            }
+            if ((pfd.revents & POLLIN) && conn_read(&conn, 0) < 0) {
+                die("prefill read");
+            }
+        }
+    }
+    while (!conn.inflight.empty()) {
+        struct pollfd pfd = {conn.fd, POLLIN, 0};
+        poll(&pfd, 1, -1);
+        if (conn_read(&conn, 0) < 0) {
+            die("prefill read");
+        }
+    }
+    close(conn.fd);
+    for (OpStats &st : g_stats) {
+        st = OpStats{};
+    }
+    fprintf(stderr, "prefilled %llu keys (%llu requests)\n",
+        (unsigned long long)nkeys, (unsigned long long)sent);
+}
+
+// opens the subscribers, all on the channel used by publish
+static void subscribe_all(Conn *subs, uint32_t n) {
+    std::vector<struct pollfd> poll_args(n);
+    for (uint32_t i = 0; i < n; i++) {
+        subs[i].fd = conn_open();
+        subs[i].subscriber = true;
+        put_req(subs[i].outgoing, {"subscribe", "channel"});
+        subs[i].inflight.push_back(Pending{0, OP_PUBLISH});
+        poll_args[i] = {subs[i].fd, POLLIN | POLLOUT, 0};
+    }
+    uint32_t waiting = n;
+    while (waiting) {
+        poll(poll_args.data(), (nfds_t)n, -1);
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t ready = poll_args[i].revents;
+            if ((ready & POLLOUT) && !conn_write(&subs[i])) {
+                die("subscribe");
+            }
+            if (subs[i].outgoing.empty()) {
+                poll_args[i].events = POLLIN;
+            }
+            if (ready & (POLLIN | POLLERR | POLLHUP)) {
+                int64_t done = conn_read(&subs[i], 0);
+                if (done < 0) {
+                    die("subscribe");
+                }
+                waiting -= (uint32_t)done;
+                if (done) {
+                    poll_args[i].fd = -1;
+                }
+            }
+        }
+    }
+    for (OpStats &st : g_stats) {
+        st = OpStats{};
+    }
+    g_deliver_pending = 0;
+    fprintf(stderr, "%u subscribers\n", n);
+}
+
+// check mode: sends the requests over a blocking connection and returns
+// each response without its length
+static void check_call(Conn *conn, const std::vector<std::vector<std::string>> &cmds,
+    std::vector<std::string> &replies)
+{
+    for (const std::vector<std::string> &cmd : cmds) {
+        put_req(conn->outgoing, cmd);
+    }
+    replies.clear();
+    size_t pos = 0;
+    while (replies.size() < cmds.size()) {
+        struct pollfd pfd = {conn->fd, POLLIN, 0};
+        if (!conn->outgoing.empty()) {
+            pfd.events |= POLLOUT;
+        }
+        poll(&pfd, 1, -1);
+        if ((pfd.revents & POLLOUT) && !conn_write(conn)) {
+            die("check write");
+        }
+        if (!(pfd.revents & (POLLIN | POLLERR | POLLHUP))) {
+            continue;
+        }
+        uint8_t buf[64 * 1024];
+        ssize_t rv = conn_read_raw(conn, buf, sizeof(buf));
+        if (rv < 0 && errno == EAGAIN) {
+            continue;
+        }
+        if (rv <= 0) {
+            die("check read");
+        }
+        conn->incoming.insert(conn->incoming.end(), buf, buf + rv);
+        while (conn->incoming.size() - pos >= 4) {
+            uint32_t len = 0;
+            memcpy(&len, &conn->incoming[pos], 4);
+            if (conn->incoming.size() - pos < 4 + (size_t)len) {
+                break;
+            }
+            const char *msg = (const char *)&conn->incoming[pos + 4];
+            replies.emplace_back(msg, len);
+            pos += 4 + len;
+        }
+    }
+    conn->incoming.clear();
+}
+
+// a response being decoded; each read fails on a value of another type
+struct Reply {
+    const uint8_t *p = NULL;
+    const uint8_t *end = NULL;
+    explicit Reply(const std::string &s)
+        : p((const uint8_t *)s.data()), end((const uint8_t *)s.data() + s.size()) {}
+};
+
+static bool rd_fixed(Reply &r, uint8_t tag, void *val, size_t size) {
+    if ((size_t)(r.end - r.p) < 1 + size || r.p[0] != tag) {
+        return false;
+    }
+    memcpy(val, r.p + 1, size);
+    r.p += 1 + size;
+    return true;
+}
+
+static bool rd_int(Reply &r, int64_t &val) {
+    return rd_fixed(r, 3 /* TAG_INT */, &val, 8);
+}
+
+static bool rd_dbl(Reply &r, double &val) {
+    return rd_fixed(r, 4 /* TAG_DBL */, &val, 8);
+}
+
+static bool rd_arr(Reply &r, uint32_t &n) {
+    return rd_fixed(r, 5 /* TAG_ARR */, &n, 4);
+}
+
+static bool rd_str(Reply &r, std::string &val) {
+    uint32_t len = 0;
+    if (!rd_fixed(r, 2 /* TAG_STR */, &len, 4) || (size_t)(r.end - r.p) < len) {
+        return false;
+    }
+    val.assign((const char *)r.p, len);
+    r.p += len;
+    return true;
+}
+
+// the int fields of a [name, value, ...] reply (INFO, MEMORY STATS)
+static bool rd_stats(const std::string &msg, std::vector<std::pair<std::string, int64_t>> &out) {
+    Reply r(msg);
+    uint32_t n = 0;
+    if (!rd_arr(r, n) || n % 2) {
+        return false;
+    }
+    out.clear();
+    std::string name;
+    for (uint32_t i = 0; i < n; i += 2) {
+        int64_t val = 0;
+        double dval = 0;
+        if (!rd_str(r, name)) {
+            return false;
+        }
+        if (rd_int(r, val)) {
+            out.emplace_back(name, val);
+        } else if (!rd_dbl(r, dval)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int64_t stat_get(const std::vector<std::pair<std::string, int64_t>> &stats,
+    const char *name)
+{
+    for (const auto &kv : stats) {
+        if (kv.first == name) {
+            return kv.second;
+        }
+    }
+    return -1;
+}
+
+static uint64_t g_check_errors = 0;
+
+static void check_fail(const char *what, const std::string &key) {
+    if (g_check_errors++ < 10) {
+        fprintf(stderr, "check: %s: %s\n", what, key.c_str());
+    }
+}
+
+// keys of uneven length, so that entries land in different size classes
+static std::string check_key(uint64_t id) {
+    return key_name("chk", id) + std::string(id % 20, 'p');
+}
+
+// Random set/del/pexpire/zadd/zrem rounds over one connection, each one
+// starting a MEMORY DEFRAG cycle that runs between the writes of the next
+// rounds, against a model kept here. Then checks the values, the TTLs,
+// the order of the sorted sets, and that the sizes of the keys add up to
+// the per-type totals of MEMORY STATS. Returns the exit status.
+static int check_model(uint64_t rounds) {
+    const uint32_t k_batch = 3000;
+    const uint64_t k_members = 3000;    // zsets past the first stay small
+    Conn conn;
+    conn.fd = conn_open();
+    uint64_t rng = g_opt.seed * 0x9E3779B97F4A7C15ull + 1;
+
+    struct Ttl {
+        int64_t ms = 0;
+        uint64_t sent_ns = 0;
+    };
+    std::vector<std::string> strs(g_opt.keyspace);
+    std::vector<bool> live(g_opt.keyspace, false);
+    std::vector<Ttl> ttls(g_opt.keyspace);
+    std::vector<std::map<std::string, double>> zsets(g_opt.zsets);
+
+    std::vector<std::vector<std::string>> cmds;
+    std::vector<std::string> replies;
+    for (uint64_t i = 0; i < g_opt.keyspace; i++) {
+        cmds.push_back({"del", check_key(i)});
+    }
+    for (uint32_t z = 0; z < g_opt.zsets; z++) {
+        cmds.push_back({"del", key_name("chkz", z)});
+    }
+    check_call(&conn, cmds, replies);
+
+    for (uint64_t round = 0; round < rounds; round++) {
+        uint64_t now_ns = get_monotonic_nsec();
+        cmds.assign(1, {"memory", "defrag"});
+        for (uint32_t i = 0; i < k_batch; i++) {
+            uint64_t r = rng_next(rng) % 100;
+            uint64_t id = rng_next(rng) % g_opt.keyspace;
+            uint32_t z = (uint32_t)(rng_next(rng) % g_opt.zsets);
+            if (r < 30) {
+                strs[id].assign(1 + rng_next(rng) % 80, (char)('a' + id % 26));
+                live[id] = true;
+                cmds.push_back({"set", check_key(id), strs[id]});
+            } else if (r < 45) {
+                live[id] = false;
+                ttls[id] = Ttl{};
+                cmds.push_back({"del", check_key(id)});
+            } else if (r < 75) {
+                uint64_t m = rng_next(rng) % (z ? k_members : g_opt.keyspace);
+                uint64_t score = rng_next(rng) % 1000;
+                zsets[z][key_name("m", m)] = (double)score;
+                cmds.push_back({"zadd", key_name("chkz", z), std::to_string(score),
+                    key_name("m", m)});
+            } else if (r < 87) {
+                std::string member = key_name("m", rng_next(rng) % k_members);
+                zsets[z].erase(member);
+                cmds.push_back({"zrem", key_name("chkz", z), member});
+            } else if (live[id]) {
+                ttls[id] = Ttl{(int64_t)(1000000000 + rng_next(rng) % 1000000), now_ns};
+                cmds.push_back({"pexpire", check_key(id), std::to_string(ttls[id].ms)});
+            }
+        }
+        check_call(&conn, cmds, replies);
+        for (size_t i = 0; i < replies.size(); i++) {
+            if (replies[i].empty() || replies[i][0] == 1 /* TAG_ERR */) {
+                check_fail("error reply", cmds[i][0]);
+            }
+        }
+    }
+
+    // values and TTLs
+    cmds.clear();
+    for (uint64_t i = 0; i < g_opt.keyspace; i++) {
+        cmds.push_back({"get", check_key(i)});
+        cmds.push_back({"pttl", check_key(i)});
+    }
+    check_call(&conn, cmds, replies);
+    uint64_t now_ns = get_monotonic_nsec();
+    for (uint64_t i = 0; i < g_opt.keyspace; i++) {
+        Reply get(replies[2 * i]);
+        Reply pttl(replies[2 * i + 1]);
+        std::string val;
+        int64_t ms = 0;
+        if (live[i] ? !rd_str(get, val) || val != strs[i] : replies[2 * i] != std::string(1, 0)) {
+            check_fail("value", check_key(i));
+        }
+        int64_t elapsed_ms = (int64_t)((now_ns - ttls[i].sent_ns) / 1000000) + 1;
+        bool ok = rd_int(pttl, ms) && (!live[i] ? ms == -2 : !ttls[i].ms ? ms == -1
+            : ms <= ttls[i].ms && ms >= ttls[i].ms - elapsed_ms);
+        if (!ok) {
+            check_fail("ttl", check_key(i));
+        }
+    }
+
+    // sorted sets, by score then name
+    cmds.clear();
+    for (uint32_t z = 0; z < g_opt.zsets; z++) {
+        cmds.push_back({"zquery", key_name("chkz", z), "-1", "", "0",
+            std::to_string(2 * zsets[z].size() + 2)});
+    }
+    check_call(&conn, cmds, replies);
+    for (uint32_t z = 0; z < g_opt.zsets; z++) {
+        std::vector<std::pair<double, std::string>> want;
+        for (const auto &kv : zsets[z]) {
+            want.emplace_back(kv.second, kv.first);
+        }
+        std::sort(want.begin(), want.end());
+        Reply r(replies[z]);
+        uint32_t n = 0;
+        bool ok = rd_arr(r, n) && n == 2 * want.size();
+        for (size_t i = 0; ok && i < want.size(); i++) {
+            std::string name;
+            double score = 0;
+            ok = rd_str(r, name) && rd_dbl(r, score)
+                && name == want[i].second && score == want[i].first;
+        }
+        if (!ok) {
+            check_fail("zset order", key_name("chkz", z));
+        }
+    }
+
+    // the accounting, once the last cycle is done
+    std::vector<std::pair<std::string, int64_t>> info;
+    while (true) {
+        cmds.assign(1, {"info"});
+        check_call(&conn, cmds, replies);
+        if (!rd_stats(replies[0], info)) {
+            die("check info");
+        }
+        if (stat_get(info, "defrag_running") == 0) {
+            break;
+        }
+        usleep(10000);
+    }
+    cmds.assign(1, {"keys"});
+    check_call(&conn, cmds, replies);
+    Reply keys(replies[0]);
+    uint32_t nkeys = 0;
+    if (!rd_arr(keys, nkeys)) {
+        die("check keys");
+    }
+    cmds.assign(1, {"memory", "stats"});
+    for (uint32_t i = 0; i < nkeys; i++) {
+        std::string key;
+        if (!rd_str(keys, key)) {
+            die("check keys");
+        }
+        cmds.push_back({"memory", "usage", key});
+    }
+    check_call(&conn, cmds, replies);
+    std::vector<std::pair<std::string, int64_t>> stats;
+    if (!rd_stats(replies[0], stats)) {
+        die("check stats");
+    }
+    int64_t values = 0;
+    for (const auto &kv : stats) {
+        values += kv.first.compare(0, 7, "values_") ? 0 : kv.second;
+    }
+    int64_t usage = 0;
+    for (uint32_t i = 0; i < nkeys; i++) {
+        Reply r(replies[1 + i]);
+        int64_t bytes = 0;
+        usage += rd_int(r, bytes) ? bytes : 0;
+    }
+    if (usage != values) {
+        check_fail("memory usage of the keys differs from MEMORY STATS",
+            std::to_string(usage) + " != " + std::to_string(values));
+    }
+
+    conn_close(&conn);
+    printf("%llu rounds of %u requests, %lld defrag cycles, %lld moved: %s\n",
+        (unsigned long long)rounds, k_batch, (long long)stat_get(info, "defrag_cycles"),
+        (long long)stat_get(info, "defrag_moved"), g_check_errors ? "FAILED" : "ok");
+    return g_check_errors ? 1 : 0;
+}
+
+static void parse_mix(const char *spec) {
+    memset(g_opt.weights, 0, sizeof(g_opt.weights));
+    std::string s = spec;
+    size_t pos = 0;
+    uint64_t total = 0;
+    while (pos < s.size()) {
+        size_t end = s.find(',', pos);
+        if (end == std::string::npos) {
+            end = s.size();
+        }
+        std::string item = s.substr(pos, end - pos);
+        size_t eq = item.find('=');
+        std::string name = item.substr(0, eq);
+        uint32_t w = eq == std::string::npos ? 1 : atoi(item.c_str() + eq + 1);
+        uint32_t op = 0;
+        while (op < OP_MAX && name != k_op_names[op]) {
+            op++;
+        }
+        if (op == OP_MAX) {
+            fprintf(stderr, "unknown command in mix: %s\n", name.c_str());
+            exit(1);
+        }
+        total = total - g_opt.weights[op] + w;
+        g_opt.weights[op] = w;
+        pos = end + 1;
+    }
+    // pick_op() draws from the sum of the weights
+    if (total == 0 || total > UINT32_MAX) {
+        fprintf(stderr, "bad mix weights: %s\n", spec);
+        exit(1);
+    }
+}
+
+static void usage() {
+    fprintf(stderr,
+        "usage: loadgen [options]\n"
+        "  -h host          server address (127.0.0.1)\n"
+        "  -p port          server port (1234)\n"
+        "  -u path          connect over a Unix socket instead of TCP\n"
+        "  -M               use the shared-memory rings, negotiated over the\n"
+        "                   Unix socket (-u, default /tmp/in-memory-db.sock)\n"
+        "  -c conns         number of connections (50)\n"
+        "  -P depth         pipelined requests per connection (1)\n"
+        "  -n requests      total requests, overrides -d\n"
+        "  -d seconds       run duration (10)\n"
+        "  -k keys          key space size (100000)\n"
+        "  -s bytes         value size for set (16)\n"
+        "  -b keys          keys per mget (10)\n"
+        "  -z zsets         number of zset keys (1)\n"
+        "  -l limit         pairs returned per zquery (10)\n"
+        "  -W subscribers   extra connections subscribed to the channel that\n"
+        "                   publish sends to, always over a socket (0)\n"
+        "  -m mix           weighted command mix (get=90,set=10)\n"
+        "                   commands: get set del mget zadd zscore zrem zquery incr\n"
+        "                   publish\n"
+        "  -S seed          random seed (1)\n"
+        "  -f               prefill keys and zsets before the run\n"
+        "  -C               print CSV\n"
+        "  -V rounds        check mode: rounds of random set/del/pexpire/zadd/zrem\n"
+        "                   with a MEMORY DEFRAG cycle started in each, then checks\n"
+        "                   values, TTLs, zset order and the memory accounting\n"
+        "                   against a local model over -k keys and -z zsets\n");
+    exit(1);
+}
+
+static void report(uint64_t elapsed_ns) {
+    double secs = (double)elapsed_ns / 1e9;
+    Hist all;
+    uint64_t errors = 0;
+    for (const OpStats &st : g_stats) {
+        hist_merge(&all, &st.hist);
+        errors += st.errors;
+    }
+    if (g_opt.csv) {
+        printf("op,count,errors,ops_per_sec,mean_us,p50_us,p99_us,p999_us,max_us\n");
+    } else {
+        printf("%llu requests in %.2fs, %u conns, depth %u, seed %llu\n",
+            (unsigned long long)all.count, secs, g_opt.conns, g_opt.depth,
+            (unsigned long long)g_opt.seed);
+        printf("%-8s %10s %8s %12s %9s %9s %9s %9s %9s\n", "op", "count",
+            "errors", "ops/s", "mean_us", "p50_us", "p99_us", "p99.9_us",
+            "max_us");
+    }
+    // then "all", and the publish to delivery latency of the subscribers
+    for (uint32_t op = 0; op <= OP_MAX + 1; op++) {
+        const Hist *h = op < OP_MAX ? &g_stats[op].hist
+            : op == OP_MAX ? &all : &g_deliver.hist;
+        uint64_t err = op < OP_MAX ? g_stats[op].errors
+            : op == OP_MAX ? errors : g_deliver.errors;
+        const char *name = op < OP_MAX ? k_op_names[op]
+            : op == OP_MAX ? "all" : "deliver";
+        if (h->count == 0) {
+            continue;
+        }
+        double mean = (double)h->sum / (double)h->count / 1e3;
+        printf(g_opt.csv ? "%s,%llu,%llu,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f\n"
+            : "%-8s %10llu %8llu %12.0f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+            name, (unsigned long long)h->count, (unsigned long long)err,
+            (double)h->count / secs, mean,
+            hist_percentile(h, 50) / 1e3, hist_percentile(h, 99) / 1e3,
+            hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+    }
+}
+
+int main(int argc, char **argv) {
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "h:p:u:Mc:P:n:d:k:s:b:z:l:W:m:S:fCV:")) != -1) {
+        switch (opt) {
+        case 'h': g_opt.host = optarg; break;
+        case 'p': g_opt.port = (uint16_t)atoi(optarg); break;
+        case 'u': g_opt.unix_path = optarg; break;
+        case 'M': g_opt.shm = true; break;
+        case 'c': g_opt.conns = (uint32_t)atoi(optarg); break;
+        case 'P': g_opt.depth = (uint32_t)atoi(optarg); break;
+        case 'n': g_opt.requests = strtoull(optarg, NULL, 10); break;
+        case 'd': g_opt.duration = atof(optarg); break;
+        case 'k': g_opt.keyspace = strtoull(optarg, NULL, 10); break;
+        case 's': g_opt.value_size = (uint32_t)atoi(optarg); break;
+        case 'b': g_opt.mget_keys = (uint32_t)atoi(optarg); break;
+        case 'z': g_opt.zsets = (uint32_t)atoi(optarg); break;
+        case 'l': g_opt.zquery_limit = (uint32_t)atoi(optarg); break;
+        case 'W': g_opt.subscribers = (uint32_t)atoi(optarg); break;
+        case 'm': parse_mix(optarg); break;
+        case 'S': g_opt.seed = strtoull(optarg, NULL, 10); break;
+        case 'f': g_opt.prefill = true; break;
+        case 'C': g_opt.csv = true; break;
+        case 'V': g_opt.check_rounds = strtoull(optarg, NULL, 10); break;
+        default: usage();
+        }
+    }
+    if (!g_opt.conns || !g_opt.depth || !g_opt.keyspace || !g_opt.zsets) {
+        usage();
+    }
+    if (g_opt.shm && !g_opt.unix_path) {
+        g_opt.unix_path = "/tmp/in-memory-db.sock";
+    }
+    g_value.assign(g_opt.value_size, 'x');
+    if (g_opt.check_rounds) {
+        return check_model(g_opt.check_rounds);
+    }
+
+    if (g_opt.prefill) {
+        prefill();
+    }
+
+    // the subscribers come after the connections issuing requests
+    uint32_t nconns = g_opt.conns + g_opt.subscribers;
+    std::vector<Conn> conns(nconns);
+    if (g_opt.subscribers) {
+        // first, so that the others are not reaped as idle meanwhile
+        subscribe_all(&conns[g_opt.conns], g_opt.subscribers);
+    }
+    for (uint32_t i = 0; i < g_opt.conns; i++) {
+        if (g_opt.shm) {
+            conn_open_shm(&conns[i]);
+        } else {
+            conns[i].fd = conn_open();
+        }
+        conns[i].rng = g_opt.seed * 0x9E3779B97F4A7C15ull + i + 1;
+    }
+
+    uint64_t start_ns = get_monotonic_nsec();
+    uint64_t stop_ns = start_ns + (uint64_t)(g_opt.duration * 1e9);
+    uint64_t drain_ns = 0;  // when to give up on pending deliveries
+    uint64_t issued = 0;
+    uint64_t inflight = 0;
+    std::vector<std::string> cmd;
+    std::vector<struct pollfd> poll_args(nconns);
+    while (true) {
+        uint64_t now_ns = get_monotonic_nsec();
+        bool issuing = g_opt.requests ? issued < g_opt.requests : now_ns < stop_ns;
+        if (!issuing && inflight == 0) {
+            if (!drain_ns) {
+                drain_ns = now_ns + 5000000000ull;
+            }
+            if (g_deliver_pending == 0 || now_ns > drain_ns) {
+                break;
+            }
+        }
+
+        for (uint32_t i = 0; i < nconns; i++) {
+            Conn &conn = conns[i];
+            while (issuing && !conn.subscriber
+                && conn.inflight.size() < g_opt.depth)
+            {
+                uint32_t op = pick_op(&conn);
+                gen_request(&conn, op, cmd);
+                put_req(conn.outgoing, cmd);
+                conn.inflight.push_back(Pending{now_ns, op});
+                inflight++;
+                issued++;
+                issuing = g_opt.requests ? issued < g_opt.requests : true;
+            }
+            if (!conn.outgoing.empty() && !conn_write(&conn)) {
+                die("write()");
+            }
+            if (conn.shm) {
+                poll_args[i] = {shm_prepare_poll(&conn), POLLIN, 0};
+                continue;
+            }
+            poll_args[i] = {conn.fd, POLLIN, 0};
+            if (!conn.outgoing.empty()) {
+                poll_args[i].events |= POLLOUT;
+            }
+        }
+
+        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), 100);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0) {
+            die("poll");
+        }
+        now_ns = get_monotonic_nsec();
+        for (uint32_t i = 0; i < nconns; i++) {
+            uint32_t ready = poll_args[i].revents;
+            if (conns[i].shm && ready) {
+                ready = POLLIN | POLLOUT;
+            }
+            if ((ready & POLLOUT) && !conn_write(&conns[i])) {
+                die("write()");
+            }
+            if (ready & (POLLIN | POLLERR | POLLHUP)) {
+                int64_t done = conn_read(&conns[i], now_ns);
+                if (done < 0) {
+                    die("connection lost");
+                }
+                inflight -= (uint64_t)done;
+            }
+        }
+    }
+
+    report(get_monotonic_nsec() - start_ns);
+    if (g_deliver_pending) {
+        fprintf(stderr, "%llu deliveries missing\n",
+            (unsigned long long)g_deliver_pending);
+    }
+    for (Conn &conn : conns) {
+        conn_close(&conn);
+    }
+    return 0;
+}
@@ -0,0 +1,168 @@
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include "qlist.h"
+#include "common.h"
+
+
+// the bytes taken by an element of `len` bytes
+static size_t elem_size(size_t len) {
+    return len + 8;
+}
+
+static uint32_t elem_len(const uint8_t *p) {
+    uint32_t len = 0;
+    memcpy(&len, p, 4);
+    return len;
+}
+
+static QChunk *chunk_new(QList *list, size_t need, bool front) {
+    size_t cap = std::max(k_qchunk_size, need);
+    QChunk *c = (QChunk *)malloc(sizeof(QChunk) + cap);
+    assert(c);
+    c->cap = (uint32_t)cap;
+    // a chunk fills up away from the end it was added at
+    c->head = c->tail = front ? c->cap : 0;
+    c->count = 0;
+    if (front) {
+        dlist_insert_before(list->chunks.next, &c->node);
+    } else {
+        dlist_insert_before(&list->chunks, &c->node);
+    }
+    list->nchunks++;
+    list->bytes += mem_usable(c);
+    return c;
+}
+
+static void chunk_del(QList *list, QChunk *c) {
+    dlist_detach(&c->node);
+    list->bytes -= mem_usable(c);
+    free(c);
+    list->nchunks--;
+}
+
+static QChunk *first_chunk(QList *list) {
+    return container_of(list->chunks.next, QChunk, node);
+}
+
+static QChunk *last_chunk(QList *list) {
+    return container_of(list->chunks.prev, QChunk, node);
+}
+
+void qlist_init(QList *list) {
+    dlist_init(&list->chunks);
+    list->count = 0;
+    list->nchunks = 0;
+    list->bytes = 0;
+}
+
+void qlist_push(QList *list, bool front, const char *val, size_t len) {
+    size_t need = elem_size(len);
+    QChunk *c = NULL;
+    if (!dlist_empty(&list->chunks)) {
+        c = front ? first_chunk(list) : last_chunk(list);
+        if ((front ? c->head : c->cap - c->tail) < need) {
+            c = NULL;
+        }
+    }
+    if (!c) {
+        c = chunk_new(list, need, front);
+    }
+    uint32_t pos = front ? c->head - (uint32_t)need : c->tail;
+    uint32_t len32 = (uint32_t)len;
+    memcpy(&c->data[pos], &len32, 4);
+    memcpy(&c->data[pos + 4], val, len);
+    memcpy(&c->data[pos + 4 + len], &len32, 4);
+    if (front) {
+        c->head = pos;
+    } else {
+        c->tail = pos + (uint32_t)need;
+    }
+    c->count++;
+    list->count++;
+}
+
+bool qlist_pop(QList *list, bool front, std::string &val) {
+    if (list->count == 0) {
+        return false;
+    }
+    QChunk *c = front ? first_chunk(list) : last_chunk(list);
+    if (front) {
+        uint32_t len = elem_len(&c->data[c->head]);
+        val.assign((const char *)&c->data[c->head + 4], len);
+        c->head += (uint32_t)elem_size(len);
+    } else {
+        uint32_t len = elem_len(&c->data[c->tail - 4]);
+        c->tail -= (uint32_t)elem_size(len);
+        val.assign((const char *)&c->data[c->tail + 4], len);
+    }
+    list->count--;
+    if (--c->count == 0) {
+        chunk_del(list, c);
+    }
+    return true;
+}
+
+void qlist_range(QList *list, size_t start, size_t stop,
+    bool (*f)(const uint8_t *val, size_t len, void *arg), void *arg)
+{
+    assert(stop < list->count);
+    size_t idx = 0;
+    for (DList *node = list->chunks.next; node != &list->chunks; node = node->next) {
+        QChunk *c = container_of(node, QChunk, node);
+        if (idx + c->count <= start) {
+            idx += c->count;
+            continue;
+        }
+        for (uint32_t pos = c->head; pos < c->tail; idx++) {
+            uint32_t len = elem_len(&c->data[pos]);
+            if (idx > stop) {
+                return;
+            }
+            if (idx >= start && !f(&c->data[pos + 4], len, arg)) {
+                return;
+            }
+            pos += (uint32_t)elem_size(len);
+        }
+    }
+}
+
+// drops n elements from one end, whole chunks at a time where possible
+static void qlist_drop(QList *list, bool front, size_t n) {
+    while (n > 0) {
+        QChunk *c = front ? first_chunk(list) : last_chunk(list);
+        if (c->count <= n) {
+            n -= c->count;
+            list->count -= c->count;
+            chunk_del(list, c);
+            continue;
+        }
+        for (; n > 0; n--) {
+            if (front) {
+                c->head += (uint32_t)elem_size(elem_len(&c->data[c->head]));
+            } else {
+                c->tail -= (uint32_t)elem_size(elem_len(&c->data[c->tail - 4]));
+            }
+            c->count--;
+            list->count--;
+        }
+    }
+}
+
+void qlist_trim(QList *list, size_t start, size_t stop) {
+    if (start > stop || start >= list->count) {
+        return qlist_clear(list);
+    }
+    stop = std::min(stop, list->count - 1);
+    qlist_drop(list, false, list->count - 1 - stop);
+    qlist_drop(list, true, start);
+}
+
+void qlist_clear(QList *list) {
+    while (!dlist_empty(&list->chunks)) {
+        chunk_del(list, first_chunk(list));
+    }
+    list->count = 0;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "list.h"
+
+
+// Double-ended queue of strings: a DList of chunks, each packing its
+// elements as [u32 len][bytes][u32 len] so that both ends can be walked.
+// Chunks have k_qchunk_size bytes, or room for one larger element, and
+// are freed as soon as they are empty.
+const size_t k_qchunk_size = 4096;
+
+struct QChunk {
+    DList node;
+    uint32_t cap = 0;
+    uint32_t head = 0;      // the elements are in data[head, tail)
+    uint32_t tail = 0;
+    uint32_t count = 0;
+    uint8_t data[0];
+};
+
+struct QList {
+    DList chunks;
+    size_t count = 0;
+    size_t nchunks = 0;
+    size_t bytes = 0;       // of the chunks
+};
+
+void qlist_init(QList *list);
+void qlist_push(QList *list, bool front, const char *val, size_t len);
+bool qlist_pop(QList *list, bool front, std::string &val);
+// calls `f` on the elements [start, stop], with stop < count
+void qlist_range(QList *list, size_t start, size_t stop,
+    bool (*f)(const uint8_t *val, size_t len, void *arg), void *arg);
+// keeps only the elements [start, stop], none if start > stop
+void qlist_trim(QList *list, size_t start, size_t stop);
+void qlist_clear(QList *list);
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <atomic>
+#include <new>
+
+
+// Immutable, reference-counted byte buffer. Large values live in one so that
+// responses can point at them instead of copying, and so that a value being
+// sent stays valid after it is overwritten or deleted from the keyspace.
+struct RcBuf {
+    std::atomic<uint32_t> refs;
+    size_t len;
+    uint8_t data[0];
+};
+
+inline RcBuf *rcbuf_new(const void *data, size_t len) {
+    RcBuf *buf = (RcBuf *)malloc(sizeof(RcBuf) + len);
+    assert(buf);
+    new (&buf->refs) std::atomic<uint32_t>(1);
+    buf->len = len;
+    memcpy(buf->data, data, len);
+    return buf;
+}
+
+inline RcBuf *rcbuf_ref(RcBuf *buf) {
+    buf->refs.fetch_add(1, std::memory_order_relaxed);
+    return buf;
+}
+
+inline void rcbuf_unref(RcBuf *buf) {
+    if (buf->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        free(buf);
+    }
+}
@@ -0,0 +1,515 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+
+#include "capture.h"
+#include "hist.h"
+
+
+static void die(const char *msg) {
+    int err = errno;
+    fprintf(stderr, "[%d] %s\n", err, msg);
+    abort();
+}
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static void fd_set_nb(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        die("fcntl error");
+    }
+}
+
+static struct {
+    const char *host = "127.0.0.1";
+    uint16_t port = 1234;
+    const char *unix_path = NULL;
+    double speed = 1;           // 0: as fast as the server answers
+    uint32_t depth = 1;         // requests in flight per connection at speed 0
+    uint32_t conns = 0;         // 0: one per captured connection
+    double drain = 5;           // seconds to wait for the last replies
+    bool csv = false;
+} g_opt;
+
+typedef std::vector<uint8_t> Buffer;
+
+// a captured request, or the end of its connection (len 0)
+struct Req {
+    uint64_t time_us = 0;
+    const uint8_t *data = NULL;
+    uint32_t len = 0;
+    uint32_t op = 0;
+};
+
+struct Pending {
+    uint64_t start_ns = 0;
+    uint32_t op = 0;
+};
+
+struct Conn {
+    int fd = -1;
+    bool subscriber = false;    // replies may be interleaved with pushes
+    std::vector<Req> reqs;
+    size_t next = 0;
+    Buffer outgoing;
+    size_t out_pos = 0;
+    Buffer incoming;
+    std::deque<Pending> inflight;
+};
+
+// by command name, in the order first seen
+struct OpStats {
+    std::string name;
+    Hist hist;
+    uint64_t errors = 0;
+};
+
+static std::vector<OpStats> g_ops;
+static uint64_t g_pushes = 0;
+static uint64_t g_lost = 0;         // in flight when the server hung up
+static uint64_t g_reconnects = 0;
+static uint64_t g_start_ns = 0;
+
+static void put_u32(Buffer &buf, uint32_t val) {
+    buf.insert(buf.end(), (uint8_t *)&val, (uint8_t *)&val + 4);
+}
+
+// the first argument of a request: nstr, then len + data for each string
+static std::string req_name(const uint8_t *req, uint32_t len) {
+    uint32_t nstr = 0, n = 0;
+    if (len < 8) {
+        return "?";
+    }
+    memcpy(&nstr, req, 4);
+    memcpy(&n, req + 4, 4);
+    if (nstr == 0 || n > len - 8) {
+        return "?";
+    }
+    return std::string((const char *)req + 8, n);
+}
+
+// Maps the file and splits it by connection. With -c, captured connection
+// i is replayed on connection i % conns, and the closes are dropped.
+static void load(const char *path, std::vector<Conn> &conns) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st = {};
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        die(path);
+    }
+    size_t size = (size_t)st.st_size;
+    if (size < k_capture_magic_len) {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        exit(1);
+    }
+    void *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        die("mmap()");
+    }
+    close(fd);
+    const uint8_t *cur = (const uint8_t *)base;
+    const uint8_t *end = cur + size;
+    if (memcmp(cur, k_capture_magic, k_capture_magic_len) != 0) {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        exit(1);
+    }
+    cur += k_capture_magic_len;
+
+    if (g_opt.conns) {
+        conns.resize(g_opt.conns);
+    }
+    std::map<std::string, uint32_t> ops;
+    uint64_t skipped = 0;
+    CaptureRec rec;
+    while (cur < end) {
+        if (!capture_next(cur, end, rec) || rec.conn == 0) {
+            fprintf(stderr, "truncated capture, replaying up to it\n");
+            break;
+        }
+        size_t slot = (size_t)(rec.conn - 1);
+        if (g_opt.conns) {
+            slot %= g_opt.conns;
+            if (rec.len == 0) {
+                continue;
+            }
+        }
+        Req r;
+        r.time_us = rec.time_us;
+        r.data = rec.req;
+        r.len = rec.len;
+        if (r.len) {
+            std::string name = req_name(r.data, r.len);
+            if (name == "shm" || name == "capture") {
+                skipped++;  // would change the transport or the capture
+                continue;
+            }
+            auto it = ops.find(name);
+            if (it == ops.end()) {
+                it = ops.insert({name, (uint32_t)g_ops.size()}).first;
+                g_ops.emplace_back();
+                g_ops.back().name = name;
+            }
+            r.op = it->second;
+        }
+        if (slot >= conns.size()) {
+            conns.resize(slot + 1);
+        }
+        conns[slot].reqs.push_back(r);
+    }
+    if (skipped) {
+        fprintf(stderr, "skipped %llu shm and capture requests\n",
+            (unsigned long long)skipped);
+    }
+}
+
+static int conn_open() {
+    if (g_opt.unix_path) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            die("socket()");
+        }
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", g_opt.unix_path);
+        if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr))) {
+            die("connect");
+        }
+        fd_set_nb(fd);
+        return fd;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(g_opt.port);
+    if (inet_pton(AF_INET, g_opt.host, &addr.sin_addr) != 1) {
+        die("bad host");
+    }
+    if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr))) {
+        die("connect");
+    }
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    fd_set_nb(fd);
+    return fd;
+}
+
+// what is still in flight is lost; the next request reconnects
+static void conn_close(Conn *conn) {
+    close(conn->fd);
+    conn->fd = -1;
+    conn->subscriber = false;
+    g_lost += conn->inflight.size();
+    conn->inflight.clear();
+    conn->outgoing.clear();
+    conn->out_pos = 0;
+    conn->incoming.clear();
+}
+
+// Queues the requests that are due: those whose time, scaled by the
+// speed, has come, or at speed 0 up to -P in flight. A close waits for
+// the replies before it. Latency counts from the time the request was
+// due, so a server that falls behind is not hidden by a client that
+// waits for it.
+static void conn_issue(Conn *conn, uint64_t now_ns, uint64_t &wake_ns) {
+    while (conn->next < conn->reqs.size()) {
+        const Req &r = conn->reqs[conn->next];
+        uint64_t due_ns = now_ns;
+        if (g_opt.speed > 0) {
+            due_ns = g_start_ns + (uint64_t)((double)r.time_us * 1e3 / g_opt.speed);
+            if (due_ns > now_ns) {
+                wake_ns = std::min(wake_ns, due_ns);
+                return;
+            }
+        } else if (conn->inflight.size() >= g_opt.depth) {
+            return;
+        }
+        if (r.len == 0) {
+            if (!conn->inflight.empty()) {
+                return;
+            }
+            if (conn->fd >= 0) {
+                conn_close(conn);
+            }
+            conn->next++;
+            continue;
+        }
+        if (conn->fd < 0) {
+            conn->fd = conn_open();
+        }
+        put_u32(conn->outgoing, r.len);
+        conn->outgoing.insert(conn->outgoing.end(), r.data, r.data + r.len);
+        conn->inflight.push_back(Pending{due_ns, r.op});
+        const std::string &name = g_ops[r.op].name;
+        if (name == "subscribe" || name == "psubscribe") {
+            conn->subscriber = true;
+        }
+        conn->next++;
+    }
+}
+
+// returns false on a fatal error
+static bool conn_write(Conn *conn) {
+    while (conn->out_pos < conn->outgoing.size()) {
+        ssize_t rv = write(conn->fd, &conn->outgoing[conn->out_pos],
+            conn->outgoing.size() - conn->out_pos);
+        if (rv < 0 && errno == EAGAIN) {
+            return true;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        conn->out_pos += (size_t)rv;
+    }
+    conn->outgoing.clear();
+    conn->out_pos = 0;
+    return true;
+}
+
+// a ["message", ...] or ["pmessage", ...] push
+static bool is_push(const uint8_t *msg, uint32_t len) {
+    uint32_t n = 0;
+    if (len < 10 || msg[0] != 5 /* TAG_ARR */ || msg[5] != 2 /* TAG_STR */) {
+        return false;
+    }
+    memcpy(&n, msg + 6, 4);
+    return (n == 7 && len >= 17 && memcmp(msg + 10, "message", 7) == 0)
+        || (n == 8 && len >= 18 && memcmp(msg + 10, "pmessage", 8) == 0);
+}
+
+// consume complete responses; returns false if the connection is gone
+static bool conn_read(Conn *conn, uint64_t now_ns) {
+    uint8_t buf[64 * 1024];
+    ssize_t rv = read(conn->fd, buf, sizeof(buf));
+    if (rv < 0 && errno == EAGAIN) {
+        return true;
+    }
+    if (rv <= 0) {
+        return false;
+    }
+    conn->incoming.insert(conn->incoming.end(), buf, buf + rv);
+
+    size_t pos = 0;
+    while (conn->incoming.size() - pos >= 4) {
+        uint32_t len = 0;
+        memcpy(&len, &conn->incoming[pos], 4);
+        if (conn->incoming.size() - pos < 4 + (size_t)len) {
+            break;
+        }
+        const uint8_t *msg = &conn->incoming[pos + 4];
+        pos += 4 + len;
+        if (conn->subscriber && is_push(msg, len)) {
+            g_pushes++;
+            continue;
+        }
+        if (conn->inflight.empty()) {
+            die("response without a request");
+        }
+        Pending p = conn->inflight.front();
+        conn->inflight.pop_front();
+        OpStats &st = g_ops[p.op];
+        hist_add(&st.hist, now_ns - p.start_ns);
+        if (len == 0 || msg[0] == 1 /* TAG_ERR */) {
+            st.errors++;
+        }
+    }
+    conn->incoming.erase(conn->incoming.begin(), conn->incoming.begin() + pos);
+    return true;
+}
+
+static void usage() {
+    fprintf(stderr,
+        "usage: replay [options] FILE\n"
+        "  replays a capture of server --capture, each captured connection on\n"
+        "  its own connection, in the order of its requests\n"
+        "  -h host          server address (127.0.0.1)\n"
+        "  -p port          server port (1234)\n"
+        "  -u path          connect over a Unix socket instead of TCP\n"
+        "  -s speed         times the original pace, 0: as fast as possible (1)\n"
+        "  -P depth         requests in flight per connection at -s 0 (1)\n"
+        "  -c conns         replay on this many connections, 0: as captured (0)\n"
+        "  -w seconds       wait for the last replies at most this long (5)\n"
+        "  -C               print CSV\n");
+    exit(1);
+}
+
+static void report(uint64_t elapsed_ns, size_t nconns) {
+    double secs = (double)elapsed_ns / 1e9;
+    Hist all;
+    uint64_t errors = 0;
+    std::vector<const OpStats *> ops;
+    for (const OpStats &st : g_ops) {
+        hist_merge(&all, &st.hist);
+        errors += st.errors;
+        if (st.hist.count) {
+            ops.push_back(&st);
+        }
+    }
+    std::stable_sort(ops.begin(), ops.end(), [](const OpStats *a, const OpStats *b) {
+        return a->hist.count > b->hist.count;
+    });
+    OpStats total;
+    total.name = "all";
+    total.hist = all;
+    total.errors = errors;
+    ops.push_back(&total);
+
+    if (g_opt.csv) {
+        printf("op,count,errors,ops_per_sec,mean_us,p50_us,p99_us,p999_us,max_us\n");
+    } else {
+        printf("%llu requests in %.2fs, %zu conns, speed %g\n",
+            (unsigned long long)all.count, secs, nconns, g_opt.speed);
+        printf("%-16s %10s %8s %12s %9s %9s %9s %9s %9s\n", "op", "count",
+            "errors", "ops/s", "mean_us", "p50_us", "p99_us", "p99.9_us",
+            "max_us");
+    }
+    for (const OpStats *st : ops) {
+        const Hist *h = &st->hist;
+        if (h->count == 0) {
+            continue;
+        }
+        double mean = (double)h->sum / (double)h->count / 1e3;
+        printf(g_opt.csv ? "%s,%llu,%llu,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f\n"
+            : "%-16s %10llu %8llu %12.0f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+            st->name.c_str(), (unsigned long long)h->count,
+            (unsigned long long)st->errors, (double)h->count / secs, mean,
+            hist_percentile(h, 50) / 1e3, hist_percentile(h, 99) / 1e3,
+            hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+    }
+}
+
+int main(int argc, char **argv) {
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "h:p:u:s:P:c:w:C")) != -1) {
+        switch (opt) {
+        case 'h': g_opt.host = optarg; break;
+        case 'p': g_opt.port = (uint16_t)atoi(optarg); break;
+        case 'u': g_opt.unix_path = optarg; break;
+        case 's': g_opt.speed = atof(optarg); break;
+        case 'P': g_opt.depth = (uint32_t)atoi(optarg); break;
+        case 'c': g_opt.conns = (uint32_t)atoi(optarg); break;
+        case 'w': g_opt.drain = atof(optarg); break;
+        case 'C': g_opt.csv = true; break;
+        default: usage();
+        }
+    }
+    if (optind + 1 != argc || g_opt.speed < 0 || !g_opt.depth) {
+        usage();
+    }
+    std::vector<Conn> conns;
+    load(argv[optind], conns);
+
+    g_start_ns = get_monotonic_nsec();
+    uint64_t drain_ns = 0;  // when to give up on the last replies
+    std::vector<struct pollfd> poll_args;
+    std::vector<Conn *> poll_conns;
+    while (true) {
+        uint64_t now_ns = get_monotonic_nsec();
+        uint64_t wake_ns = (uint64_t)-1;
+        bool issuing = false;
+        bool waiting = false;
+        poll_args.clear();
+        poll_conns.clear();
+        for (Conn &conn : conns) {
+            conn_issue(&conn, now_ns, wake_ns);
+            issuing |= conn.next < conn.reqs.size();
+            waiting |= !conn.inflight.empty();
+            if (conn.fd < 0) {
+                continue;
+            }
+            if (!conn.outgoing.empty() && !conn_write(&conn)) {
+                conn_close(&conn);
+                g_reconnects++;
+                continue;
+            }
+            struct pollfd pfd = {conn.fd, POLLIN, 0};
+            if (!conn.outgoing.empty()) {
+                pfd.events |= POLLOUT;
+            }
+            poll_args.push_back(pfd);
+            poll_conns.push_back(&conn);
+        }
+        if (!issuing) {
+            if (!drain_ns) {
+                drain_ns = now_ns + (uint64_t)(g_opt.drain * 1e9);
+            }
+            if (!waiting || now_ns > drain_ns) {
+                break;
+            }
+        }
+
+        // the next request may be due within the millisecond
+        uint64_t timeout_ns = 100000000;
+        if (wake_ns != (uint64_t)-1) {
+            timeout_ns = std::min(timeout_ns, wake_ns - now_ns);
+        }
+        struct timespec ts = {(time_t)(timeout_ns / 1000000000), (long)(timeout_ns % 1000000000)};
+        int rv = ppoll(poll_args.data(), (nfds_t)poll_args.size(), &ts, NULL);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0) {
+            die("poll");
+        }
+        now_ns = get_monotonic_nsec();
+        for (size_t i = 0; i < poll_args.size(); i++) {
+            Conn *conn = poll_conns[i];
+            uint32_t ready = poll_args[i].revents;
+            bool ok = true;
+            if (ready & POLLOUT) {
+                ok = conn_write(conn);
+            }
+            if (ok && (ready & (POLLIN | POLLERR | POLLHUP))) {
+                ok = conn_read(conn, now_ns);
+            }
+            if (!ok) {
+                conn_close(conn);   // e.g. reaped as idle over a long pause
+                g_reconnects++;
+            }
+        }
+    }
+
+    uint64_t elapsed_ns = get_monotonic_nsec() - g_start_ns;
+    uint64_t unanswered = 0;
+    for (Conn &conn : conns) {
+        unanswered += conn.inflight.size();
+        if (conn.fd >= 0) {
+            close(conn.fd);
+        }
+    }
+    report(elapsed_ns, conns.size());
+    if (g_pushes) {
+        fprintf(stderr, "%llu pushes received\n", (unsigned long long)g_pushes);
+    }
+    if (unanswered || g_lost) {
+        fprintf(stderr, "%llu requests unanswered, %llu lost over %llu disconnects\n",
+            (unsigned long long)unanswered, (unsigned long long)g_lost,
+            (unsigned long long)g_reconnects);
+    }
+    return 0;
+}
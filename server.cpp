@@ -10,20 +10,43 @@
 #include <time.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <signal.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <getopt.h>
 
 #include <string>
 #include <vector>
+#include <deque>
+#include <algorithm>
 
 #include "common.h"
 #include "hashtable.h"
 #include "zset.h"
+#include "hash.h"
+#include "set.h"
+#include "hll.h"
+#include "bitmap.h"
+#include "qlist.h"
+#include "ts.h"
+#include "bloom.h"
+#include "defrag.h"
+#include "ebr.h"
+#include "task.h"
 #include "list.h"
 #include "heap.h"
 #include "thread_pool.h"
+#include "hist.h"
+#include "rcbuf.h"
+#include "shmring.h"
+#include "capture.h"
 
 
 static void msg(const char *msg) {
@@ -45,6 +68,18 @@ static uint64_t get_monotonic_msec() {
     return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
 }
 
+static uint64_t get_realtime_msec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
+}
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
 static void fd_set_nb(int fd) {
     errno = 0;
     int flags = fcntl(fd, F_GETFL, 0);
@@ -64,19 +99,119 @@ static void fd_set_nb(int fd) {
 
 const size_t k_max_msg = 32 << 20;  
 
-typedef std::vector<uint8_t> Buffer;
+// A reference to a shared buffer, spliced into the byte stream before
+// Buffer::data[pos] when the buffer is written out.
+struct OutRef {
+    size_t pos = 0;
+    RcBuf *buf = NULL;
+};
+
+struct Buffer {
+    std::vector<uint8_t> data;
+    std::deque<OutRef> refs;
+    size_t ref_sent = 0;    // bytes of refs.front() already consumed
+    size_t ref_bytes = 0;   // total length of refs
+};
 
 
 static void buf_append(Buffer &buf, const uint8_t *data, size_t len) {
-    buf.insert(buf.end(), data, data + len);
+    buf.data.insert(buf.data.end(), data, data + len);
+}
+
+// append the bytes of `ref` by reference instead of copying them
+static void buf_append_ref(Buffer &buf, RcBuf *ref) {
+    buf.refs.push_back(OutRef{buf.data.size(), rcbuf_ref(ref)});
+    buf.ref_bytes += ref->len;
+}
+
+// bytes not yet consumed, including the referenced ones
+static size_t buf_size(const Buffer &buf) {
+    return buf.data.size() + buf.ref_bytes - buf.ref_sent;
+}
+
+static bool buf_empty(const Buffer &buf) {
+    return buf.data.empty() && buf.refs.empty();
 }
 
 static void buf_consume(Buffer &buf, size_t n) {
-    buf.erase(buf.begin(), buf.begin() + n);
+    while (n > 0) {
+        if (!buf.refs.empty() && buf.refs.front().pos == 0) {
+            RcBuf *ref = buf.refs.front().buf;
+            size_t left = ref->len - buf.ref_sent;
+            if (n < left) {
+                buf.ref_sent += n;
+                return;
+            }
+            n -= left;
+            buf.ref_sent = 0;
+            buf.ref_bytes -= ref->len;
+            buf.refs.pop_front();
+            rcbuf_unref(ref);
+            continue;
+        }
+        size_t k = buf.refs.empty() ? n : std::min(n, buf.refs.front().pos);
+        assert(k > 0 && k <= buf.data.size());
+        buf.data.erase(buf.data.begin(), buf.data.begin() + k);
+        for (OutRef &r : buf.refs) {
+            r.pos -= k;
+        }
+        n -= k;
+    }
+}
+
+// appends `src`, none of which was consumed, and leaves it empty
+static void buf_move(Buffer &dst, Buffer &src) {
+    assert(src.ref_sent == 0);
+    size_t base = dst.data.size();
+    for (OutRef &r : src.refs) {
+        dst.refs.push_back(OutRef{base + r.pos, r.buf});
+    }
+    dst.ref_bytes += src.ref_bytes;
+    buf_append(dst, src.data.data(), src.data.size());
+    src = Buffer{};
+}
+
+static void buf_clear(Buffer &buf) {
+    for (OutRef &r : buf.refs) {
+        rcbuf_unref(r.buf);
+    }
+    buf = Buffer{};
 }
 
+// Shared-memory transport of a Unix socket connection. The request and
+// response streams move to the rings once the reply carrying the fds has
+// been sent; the socket is then only watched for hangup.
+struct ShmConn {
+    void *base = NULL;
+    size_t map_size = 0;
+    int memfd = -1;
+    int efd = -1;       // the server sleeps on it
+    int peer_efd = -1;  // the client sleeps on it
+    ShmEnd req;
+    ShmEnd resp;
+    bool fds_sent = false;
+    bool active = false;
+};
+
+struct Conn;
+struct BlockedKey;
+
+// a connection blocked in BLPOP, waiting on one of its keys
+struct BlockWaiter {
+    DList node;         // BlockedKey::waiters
+    Conn *conn = NULL;
+    BlockedKey *bkey = NULL;
+};
+
+struct Entry;
+struct KeyScan;
+struct Stream;
+struct CmdTask;
+struct Command;
+
 struct Conn {
     int fd = -1;
+    bool is_unix = false;
     
     bool want_read = false;
     bool want_write = false;
@@ -86,12 +221,159 @@ struct Conn {
     Buffer outgoing;    
     
     uint64_t last_active_ms = 0;
-    DList idle_node;
+    DList idle_node;    // not linked while subscribed
+
+    ShmConn *shm = NULL;
+
+    DList subs;         // Subscription::conn_node
+    size_t nsubs = 0;
+
+    // blpop/brpop; no requests run while blocked
+    bool blocked = false;
+    bool block_front = true;
+    std::vector<BlockWaiter> waits;     // one per key
+    size_t block_heap_idx = -1;         // the timeout in g_data.block_heap
+    DList resume_node;  // in g_data.resume_list once the wait is over
+
+    // a reply generated as the client reads it; requests wait behind it
+    Stream *stream = NULL;
+    // a command suspended between slices; requests wait behind it
+    CmdTask *task = NULL;
+    // a write waiting for the streams and suspended commands of other
+    // clients that read what it may change; requests wait behind it
+    bool waiting = false;
+    DList wait_node;    // in g_data.waiters
+
+    // its number in the capture file, if recorded in the current capture
+    uint32_t capture_gen = 0;
+    uint64_t capture_id = 0;
+};
+
+// KEYS and ZQUERY replies over --client-output-limit are not built at
+// once: the handler writes up to the limit and leaves where to continue
+// here, and the rest is generated each time the socket drains below the
+// limit. The length of the rest is computed up front, for the length
+// prefix and to refuse a reply over k_max_msg before building it. The
+// source must stay as it was: KEYS does not mind writes (KeyScan), and a
+// write to the sorted set of ZQUERY waits for the reply to be done
+// (streams_busy()), which is then generated a slice at a time without
+// waiting for the client to read (process_streams()).
+struct Stream {
+    Conn *conn = NULL;
+    DList node;             // in g_data.streams
+    size_t bytes = 0;       // yet to be generated
+    bool waited = false;    // a write or an expiry waits for it
+    Entry *ent = NULL;      // the sorted set of ZQUERY, NULL for KEYS
+    KeyScan *scan = NULL;   // KEYS: where it is in the keyspace
+    // ZQUERY: the next member and the number left
+    double score = 0;
+    std::string name;
+    int64_t left = 0;
+};
+
+// A KEYS reply that is sized or generated over several steps lists the
+// keys as they were when it started, while writes go on. It lists them by
+// their bucket in the table of that time (hm_foreach_bucket()), which
+// stays valid while the table grows; the keys inserted since then are
+// skipped by their Entry::gen, and those deleted from a bucket not listed
+// yet are kept in `gone`, to be listed after the last bucket.
+struct KeyScan {
+    DList node;             // in g_data.key_scans
+    uint32_t gen = 0;       // the keys it lists have a lower Entry::gen
+    size_t mask = 0;        // of the smaller table when it started
+    size_t pos = 0;         // the next bucket to list
+    size_t sized = 0;       // the buckets below are counted in `bytes`
+    size_t bytes = 0;       // the size of the rest of the reply, so far
+    std::vector<std::string> gone;
+    size_t gone_pos = 0;    // the next one to list
+};
+
+// A long command (Command::task_handler) runs in slices of
+// --command-slice-us, with the other clients served in between. Only
+// read-only commands run this way, and they read either one key (`ent`)
+// or the set of keys (KEYS, see KeyScan). A write that may modify the key
+// a suspended one reads waits for it to finish (tasks_busy()), so the
+// reply is that of the data when the command started, as if it ran at
+// once.
+struct CmdTask {
+    Task task;
+    Conn *conn = NULL;
+    Command *cmd = NULL;
+    DList node;             // in g_data.tasks, the next to run first
+    Buffer out;             // the response so far
+    Entry *ent = NULL;
+    KeyScan *scan = NULL;   // KEYS, until it is handed to a stream
+    uint64_t ns = 0;        // spent in its slices
+    std::string req;        // for the slow log
+};
+
+
+struct SlowLogEntry {
+    uint64_t id = 0;
+    uint64_t time_ms = 0;
+    uint64_t duration_ns = 0;
+    size_t resp_size = 0;
+    int fd = -1;
+    uint32_t nargs = 0;
+    std::vector<std::string> args;
+};
+
+struct Stats {
+    uint64_t start_ms = 0;
+    uint64_t conns_accepted = 0;
+    uint64_t conns_idle_closed = 0;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    uint64_t expired_keys = 0;
+    uint64_t pubsub_messages = 0;
+    uint64_t pubsub_dropped = 0;    // subscribers over the output limit
+    uint64_t stream_replies = 0;    // generated as the client read them
+    uint64_t stream_flushes = 0;    // finished early, the source changed
+    uint64_t stream_waits = 0;      // writes that waited for one
+    uint64_t task_slices = 0;       // of suspended commands
+    uint64_t task_flushes = 0;      // run to the end, the source changed
+    uint64_t task_waits = 0;        // writes that waited for one
+    uint64_t defrag_cycles = 0;
+    uint64_t defrag_scanned = 0;    // entries and members visited
+    uint64_t defrag_moved = 0;      // allocations moved to denser pages
+    uint64_t defrag_moved_bytes = 0;
+    uint64_t defrag_kept = 0;       // copies dropped, no denser than the original
+    uint64_t defrag_time_ns = 0;
+    int64_t defrag_last_freed = 0;  // RSS given back by the last cycle
+};
+
+// Reader threads (--readers N). Each one accepts on the read port through
+// its own SO_REUSEPORT socket and serves GET, MGET and ZSCORE straight from
+// g_data.db with its own poll loop, while the main thread keeps writing.
+// The lookups take no locks: the hash tables are searched with
+// hm_find_shared(), string values are read under Entry::seq, and what the
+// main thread unlinks is freed through g_data.ebr once no reader can still
+// be looking at it. A reader sees each key as of some moment during its
+// request, not a snapshot of several keys.
+struct ReadConn {
+    int fd = -1;
+    bool want_read = true;
+    bool want_write = false;
+    bool want_close = false;
+    uint64_t last_active_ms = 0;
+    Buffer incoming;
+    Buffer outgoing;
 };
 
+struct Reader {
+    size_t id = 0;      // its slot in g_data.ebr
+    int fd = -1;
+    pthread_t thread;
+    std::vector<ReadConn *> conns;
+    // for INFO
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> nconns{0};
+};
 
 static struct {
     HMap db;
+
+    HMap commands;
     
     std::vector<Conn *> fd2conn;
     
@@ -100,23 +382,149 @@ static struct {
     std::vector<HeapItem> heap;
     
     TheadPool thread_pool;
+
+    Stats stats;
+
+    std::deque<SlowLogEntry> slowlog;
+    uint64_t slowlog_next_id = 0;
+
+    // pub/sub
+    HMap channels;
+    HMap patterns;
+    HMap pat_groups;        // patterns by literal prefix
+    std::vector<size_t> pat_group_lens;     // number of groups by prefix length
+    HMap subscriptions;     // by (conn, channel or pattern)
+
+    // blocking list pops
+    HMap blocked_keys;      // BlockedKey by key
+    std::vector<HeapItem> block_heap;   // timeouts
+    DList resume_list;      // Conn::resume_node, with requests left to run
+    DList streams;          // Stream::node
+    DList tasks;            // CmdTask::node
+    DList waiters;          // Conn::wait_node
+    DList key_scans;        // KeyScan::node
+    uint32_t keys_gen = 0;  // the last KeyScan::gen
+
+    // reader threads
+    std::vector<Reader *> readers;
+    Ebr ebr;                // what the readers may still see, freed later
 } g_data;
 
+// command line options
+static struct {
+    uint16_t port = 1234;
+    std::string unix_path = "/tmp/in-memory-db.sock";
+    uint64_t slowlog_threshold_us = 10000;
+    size_t slowlog_max_len = 128;
+    size_t pubsub_output_limit = 32 << 20;
+    size_t client_output_limit = 1 << 20;   // pending output before requests wait
+    uint64_t command_slice_us = 1000;       // 0: long commands run at once
+    double defrag_threshold = 1.25;     // RSS over allocated bytes, 0: off
+    uint64_t defrag_slice_us = 1000;
+    size_t readers = 0;                 // threads serving the read port
+    uint16_t read_port = 0;             // 0: port + 1
+    std::string capture_path;           // empty: no capture
+} g_opt;
+
+// --capture FILE: the requests run, in order, with the connection and the
+// time (capture.h), buffered and appended to the file for bin/replay
+static struct {
+    int fd = -1;
+    uint32_t gen = 0;           // Conn::capture_gen of the connections in it
+    uint64_t nconns = 0;
+    uint64_t start_ns = 0;
+    uint64_t last_us = 0;
+    uint64_t flushed_ms = 0;
+    uint64_t requests = 0;
+    uint64_t bytes = 0;
+    std::vector<uint8_t> buf;
+} g_capture;
+
+const size_t k_capture_buf_size = 64 << 10;
+const uint64_t k_capture_flush_ms = 100;
+
+// a write error ends the capture
+static void capture_flush() {
+    size_t pos = 0;
+    while (g_capture.fd >= 0 && pos < g_capture.buf.size()) {
+        ssize_t rv = write(g_capture.fd, &g_capture.buf[pos], g_capture.buf.size() - pos);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            msg_errno("capture write() error");
+            (void)close(g_capture.fd);
+            g_capture.fd = -1;
+            break;
+        }
+        pos += (size_t)rv;
+    }
+    g_capture.bytes += pos;
+    g_capture.buf.clear();
+    g_capture.flushed_ms = get_monotonic_msec();
+}
+
+static bool capture_start() {
+    int fd = open(g_opt.capture_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        msg_errno("capture open() error");
+        return false;
+    }
+    g_capture.fd = fd;
+    g_capture.gen++;
+    g_capture.nconns = 0;
+    g_capture.start_ns = get_monotonic_nsec();
+    g_capture.last_us = 0;
+    g_capture.flushed_ms = get_monotonic_msec();
+    g_capture.requests = 0;
+    g_capture.bytes = 0;
+    g_capture.buf.assign(k_capture_magic, k_capture_magic + k_capture_magic_len);
+    return true;
+}
+
+static void capture_stop() {
+    capture_flush();
+    if (g_capture.fd >= 0) {
+        (void)close(g_capture.fd);
+        g_capture.fd = -1;
+    }
+}
+
+// a request, or the end of the connection if len is 0
+static void capture_add(Conn *conn, const uint8_t *req, uint32_t len) {
+    if (conn->capture_gen != g_capture.gen) {
+        conn->capture_gen = g_capture.gen;
+        conn->capture_id = ++g_capture.nconns;
+    }
+    uint64_t now_us = (get_monotonic_nsec() - g_capture.start_ns) / 1000;
+    capture_put(g_capture.buf, now_us - g_capture.last_us, conn->capture_id, req, len);
+    g_capture.last_us = now_us;
+    g_capture.requests += len != 0;
+    if (g_capture.buf.size() >= k_capture_buf_size) {
+        capture_flush();
+    }
+}
+
 
-static int32_t handle_accept(int fd) {
+static int32_t handle_accept(int fd, bool is_unix) {
     
-    struct sockaddr_in client_addr = {};
+    struct sockaddr_storage client_addr = {};
     socklen_t addrlen = sizeof(client_addr);
     int connfd = accept(fd, (struct sockaddr *)&client_addr, &addrlen);
     if (connfd < 0) {
         msg_errno("accept() error");
         return -1;
     }
-    uint32_t ip = client_addr.sin_addr.s_addr;
-    fprintf(stderr, "new client from %u.%u.%u.%u:%u\n",
-        ip & 255, (ip >> 8) & 255, (ip >> 16) & 255, ip >> 24,
-        ntohs(client_addr.sin_port)
-    );
+    if (is_unix) {
+        fprintf(stderr, "new client on %s\n", g_opt.unix_path.c_str());
+    } else {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)&client_addr;
+        uint32_t ip = sin->sin_addr.s_addr;
+        fprintf(stderr, "new client from %u.%u.%u.%u:%u\n",
+            ip & 255, (ip >> 8) & 255, (ip >> 16) & 255, ip >> 24,
+            ntohs(sin->sin_port)
+        );
+    }
 
     
     fd_set_nb(connfd);
@@ -124,6 +532,10 @@ static int32_t handle_accept(int fd) {
     
     Conn *conn = new Conn();
     conn->fd = connfd;
+    conn->is_unix = is_unix;
+    dlist_init(&conn->subs);
+    dlist_init(&conn->resume_node);
+    dlist_init(&conn->wait_node);
     conn->want_read = true;
     conn->last_active_ms = get_monotonic_msec();
     dlist_insert_before(&g_data.idle_list, &conn->idle_node);
@@ -134,11 +546,49 @@ static int32_t handle_accept(int fd) {
     }
     assert(!g_data.fd2conn[conn->fd]);
     g_data.fd2conn[conn->fd] = conn;
+    g_data.stats.conns_accepted++;
     return 0;
 }
 
+static void shm_destroy(ShmConn *shm) {
+    if (shm->base) {
+        munmap(shm->base, shm->map_size);
+    }
+    for (int fd : {shm->memfd, shm->efd, shm->peer_efd}) {
+        if (fd >= 0) {
+            (void)close(fd);
+        }
+    }
+    delete shm;
+}
+
+static void pubsub_unsubscribe_all(Conn *conn, bool patterns);
+static void conn_unblock(Conn *conn, bool resume);
+static void stream_free(Conn *conn);
+static void task_free(CmdTask *t);
+
 static void conn_destroy(Conn *conn) {
+    pubsub_unsubscribe_all(conn, false);
+    pubsub_unsubscribe_all(conn, true);
+    if (conn->blocked) {
+        conn_unblock(conn, false);
+    }
+    dlist_detach(&conn->resume_node);
+    dlist_detach(&conn->wait_node);
+    if (conn->stream) {
+        stream_free(conn);
+    }
+    if (conn->task) {
+        task_free(conn->task);
+    }
+    if (g_capture.fd >= 0 && conn->capture_gen == g_capture.gen) {
+        capture_add(conn, NULL, 0);
+    }
     (void)close(conn->fd);
+    if (conn->shm) {
+        shm_destroy(conn->shm);
+    }
+    buf_clear(conn->outgoing);
     g_data.fd2conn[conn->fd] = NULL;
     dlist_detach(&conn->idle_node);
     delete conn;
@@ -198,6 +648,7 @@ enum {
     ERR_TOO_BIG = 2,    // response too big
     ERR_BAD_TYP = 3,    // unexpected value type
     ERR_BAD_ARG = 4,    // bad arguments
+    ERR_SYSTEM = 5,     // a system call failed on the server
 };
 
 // data types of serialized data
@@ -211,7 +662,7 @@ enum {
 };
 
 static void buf_append_u8(Buffer &buf, uint8_t data) {
-    buf.push_back(data);
+    buf.data.push_back(data);
 }
 static void buf_append_u32(Buffer &buf, uint32_t data) {
     buf_append(buf, (const uint8_t *)&data, 4);
@@ -250,14 +701,19 @@ static void out_arr(Buffer &out, uint32_t n) {
     buf_append_u8(out, TAG_ARR);
     buf_append_u32(out, n);
 }
+static void out_str_ref(Buffer &out, RcBuf *ref) {
+    buf_append_u8(out, TAG_STR);
+    buf_append_u32(out, (uint32_t)ref->len);
+    buf_append_ref(out, ref);
+}
 static size_t out_begin_arr(Buffer &out) {
-    out.push_back(TAG_ARR);
+    out.data.push_back(TAG_ARR);
     buf_append_u32(out, 0);    
-    return out.size() - 4;      
+    return out.data.size() - 4;      
 }
 static void out_end_arr(Buffer &out, size_t ctx, uint32_t n) {
-    assert(out[ctx - 1] == TAG_ARR);
-    memcpy(&out[ctx], &n, 4);
+    assert(out.data[ctx - 1] == TAG_ARR);
+    memcpy(&out.data[ctx], &n, 4);
 }
 
 // value types
@@ -265,6 +721,13 @@ enum {
     T_INIT  = 0,
     T_STR   = 1,    // string
     T_ZSET  = 2,    // sorted set
+    T_HASH  = 3,    // hash
+    T_SET   = 4,    // set
+    T_HLL   = 5,    // HyperLogLog
+    T_LIST  = 6,    // list
+    T_TS    = 7,    // time series
+    T_BLOOM = 8,    // Bloom filter
+    T_NTYPES,
 };
 
 struct Entry {
@@ -274,22 +737,221 @@ struct Entry {
     size_t heap_idx = -1;   
 
     uint32_t type = 0;
+    uint32_t enc = 0;       // encoding of T_STR values
+
+    size_t mem = 0;         // the bytes counted in g_mem
+    size_t mem_idx = -1;    // position in g_mem.dirty, -1: not there
+    uint32_t seq = 0;       // odd while the T_STR value changes
+    uint32_t gen = 0;       // g_data.keys_gen when inserted, see KeyScan
 
     std::string str;
+    union {
+        int64_t ival = 0;
+        RcBuf *ref;
+        Hash *hash;     // T_HASH
+        Set *set;       // T_SET
+        Hll *hll;       // T_HLL
+        QList *list;    // T_LIST
+        TimeSeries *ts; // T_TS
+        Bloom *bloom;   // T_BLOOM
+    };
     ZSet zset;
 };
 
+// Memory accounting. Every container keeps the bytes of its nodes as it
+// allocates and frees them, so the size of an entry is O(1) to compute.
+// Entries looked up or inserted by a command that is not CMD_READONLY are
+// counted again once it returns, which keeps the totals by type exact
+// after every command.
+static struct {
+    size_t by_type[T_NTYPES] = {};
+    std::vector<Entry *> dirty;
+    bool tracking = false;  // off for read-only commands
+} g_mem;
+
+// encodings of T_STR values
+enum {
+    ENC_RAW = 0,    // Entry::str
+    ENC_INT = 1,    // Entry::ival
+    ENC_REF = 2,    // Entry::ref, shared with responses that are being sent
+};
+
+// values at least this large are kept in a RcBuf and never copied on output
+const size_t k_str_ref_min = 16 * 1024;
+
+// With reader threads every value that is not an integer is a RcBuf, which
+// is replaced instead of changed in place, so readers take a reference.
+static size_t str_ref_min() {
+    return g_opt.readers ? 0 : k_str_ref_min;
+}
+
+// memory that reader threads may still be looking at
+static void free_shared(void *ptr) {
+    ebr_retire(&g_data.ebr, &free, ptr);
+}
+
+static void rcbuf_unref_func(void *arg) {
+    rcbuf_unref((RcBuf *)arg);
+}
+
+// Entry::seq brackets the changes of (enc, ival | ref) for the readers.
+static void str_write_begin(Entry *ent) {
+    __atomic_store_n(&ent->seq, ent->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void str_write_end(Entry *ent) {
+    __atomic_store_n(&ent->seq, ent->seq + 1, __ATOMIC_RELEASE);
+}
+
+// drop the current string value
+static void entry_str_release(Entry *ent) {
+    if (ent->enc == ENC_REF) {
+        ebr_retire(&g_data.ebr, &rcbuf_unref_func, ent->ref);
+    } else if (ent->enc == ENC_RAW) {
+        std::string().swap(ent->str);
+    }
+    ent->enc = ENC_RAW;
+    ent->ival = 0;
+}
+
+static void str_set_int(Entry *ent, int64_t val) {
+    if (ent->enc != ENC_INT) {
+        entry_str_release(ent);
+        ent->enc = ENC_INT;
+    }
+    ent->ival = val;
+}
+
+static void entry_set_int(Entry *ent, int64_t val) {
+    str_write_begin(ent);
+    str_set_int(ent, val);
+    str_write_end(ent);
+}
+
+// takes the value from `val`
+static void entry_set_str(Entry *ent, std::string &val) {
+    str_write_begin(ent);
+    int64_t ival = 0;
+    if (str_is_int(val.data(), val.size(), ival)) {
+        str_set_int(ent, ival);
+    } else if (val.size() >= str_ref_min()) {
+        entry_str_release(ent);
+        ent->enc = ENC_REF;
+        ent->ref = rcbuf_new(val.data(), val.size());
+    } else {
+        if (ent->enc != ENC_RAW) {
+            entry_str_release(ent);
+        }
+        ent->str.swap(val);
+    }
+    str_write_end(ent);
+}
+
 static Entry *entry_new(uint32_t type) {
     Entry *ent = new Entry();
     ent->type = type;
+    if (type == T_HASH) {
+        ent->hash = new Hash();
+    } else if (type == T_SET) {
+        ent->set = new Set();
+    } else if (type == T_HLL) {
+        ent->hll = new Hll();
+    } else if (type == T_LIST) {
+        ent->list = new QList();
+        qlist_init(ent->list);
+    } else if (type == T_TS) {
+        ent->ts = new TimeSeries();
+    } else if (type == T_BLOOM) {
+        ent->bloom = new Bloom();
+    }
     return ent;
 }
 
+// the heap bytes of the entry, its key and its value
+static size_t entry_mem(Entry *ent) {
+    size_t bytes = mem_usable(ent) + str_heap_bytes(ent->key);
+    if (ent->type == T_STR) {
+        if (ent->enc == ENC_RAW) {
+            bytes += str_heap_bytes(ent->str);
+        } else if (ent->enc == ENC_REF) {
+            bytes += mem_usable(ent->ref);
+        }
+    } else if (ent->type == T_ZSET) {
+        bytes += zset_bytes(&ent->zset);
+    } else if (ent->type == T_HASH) {
+        bytes += mem_usable(ent->hash) + hash_bytes(ent->hash);
+    } else if (ent->type == T_SET) {
+        bytes += mem_usable(ent->set) + set_bytes(ent->set);
+    } else if (ent->type == T_HLL) {
+        bytes += mem_usable(ent->hll) + hll_bytes(ent->hll);
+    } else if (ent->type == T_LIST) {
+        bytes += mem_usable(ent->list) + ent->list->bytes;
+    } else if (ent->type == T_TS) {
+        bytes += mem_usable(ent->ts) + ts_bytes(ent->ts);
+    } else if (ent->type == T_BLOOM) {
+        bytes += mem_usable(ent->bloom) + bloom_bytes(ent->bloom);
+    }
+    return bytes;
+}
+
+static void entry_touch(Entry *ent) {
+    if (ent->mem_idx == (size_t)-1) {
+        ent->mem_idx = g_mem.dirty.size();
+        g_mem.dirty.push_back(ent);
+    }
+}
+
+// counts the touched entries again
+static void mem_settle() {
+    for (Entry *ent : g_mem.dirty) {
+        size_t mem = entry_mem(ent);
+        g_mem.by_type[ent->type] += mem - ent->mem;
+        ent->mem = mem;
+        ent->mem_idx = -1;
+    }
+    g_mem.dirty.clear();
+}
+
+static void mem_forget(Entry *ent) {
+    g_mem.by_type[ent->type] -= ent->mem;
+    if (ent->mem_idx != (size_t)-1) {
+        std::vector<Entry *> &dirty = g_mem.dirty;
+        dirty[ent->mem_idx] = dirty.back();
+        dirty[ent->mem_idx]->mem_idx = ent->mem_idx;
+        dirty.pop_back();
+        ent->mem_idx = -1;
+    }
+}
+
 static void entry_set_ttl(Entry *ent, int64_t ttl_ms);
 
+// containers above this size are freed by the thread pool
+const size_t k_large_container_size = 1000;
+
 static void entry_del_sync(Entry *ent) {
     if (ent->type == T_ZSET) {
         zset_clear(&ent->zset);
+    } else if (ent->type == T_STR && ent->enc == ENC_REF) {
+        rcbuf_unref(ent->ref);
+    } else if (ent->type == T_HASH) {
+        hash_clear(ent->hash);
+        delete ent->hash;
+    } else if (ent->type == T_SET) {
+        set_clear(ent->set);
+        delete ent->set;
+    } else if (ent->type == T_HLL) {
+        hll_clear(ent->hll);
+        delete ent->hll;
+    } else if (ent->type == T_LIST) {
+        qlist_clear(ent->list);
+        delete ent->list;
+    } else if (ent->type == T_TS) {
+        ts_clear(ent->ts);
+        delete ent->ts;
+    } else if (ent->type == T_BLOOM) {
+        bloom_clear(ent->bloom);
+        delete ent->bloom;
     }
     delete ent;
 }
@@ -298,123 +960,525 @@ static void entry_del_func(void *arg) {
     entry_del_sync((Entry *)arg);
 }
 
-static void entry_del(Entry *ent) {
-   
-    entry_set_ttl(ent, -1);
-   
-    size_t set_size = (ent->type == T_ZSET) ? hm_size(&ent->zset.hmap) : 0;
-    const size_t k_large_container_size = 1000;
-    if (set_size > k_large_container_size) {
+// once no reader can see the entry; large ones are freed by the thread pool
+static void entry_free(void *arg) {
+    Entry *ent = (Entry *)arg;
+    size_t size = 0;
+    if (ent->type == T_ZSET) {
+        ent->zset.free_node = NULL;
+        ent->zset.hmap.free_tab = NULL;
+        size = hm_size(&ent->zset.hmap);
+    } else if (ent->type == T_HASH) {
+        size = hash_len(ent->hash);
+    } else if (ent->type == T_SET && ent->set->enc == SET_TABLE) {
+        size = set_size(ent->set);
+    } else if (ent->type == T_LIST) {
+        size = ent->list->nchunks;
+    } else if (ent->type == T_TS) {
+        size = ent->ts->chunks.size();
+    } else if (ent->type == T_BLOOM) {
+        size = bloom_bytes(ent->bloom) / 4096;
+    }
+    if (size > k_large_container_size) {
         thread_pool_queue(&g_data.thread_pool, &entry_del_func, ent);
     } else {
         entry_del_sync(ent);   
     }
 }
 
-struct LookupKey {
-    struct HNode node; 
-    std::string key;
-};
-
-// equality comparison for the top-level hashstable
-static bool entry_eq(HNode *node, HNode *key) {
-    struct Entry *ent = container_of(node, struct Entry, node);
-    struct LookupKey *keydata = container_of(key, struct LookupKey, node);
-    return ent->key == keydata->key;
+// where a reply stops to wait for the client to read
+static size_t output_high() {
+    return g_opt.client_output_limit ? g_opt.client_output_limit : SIZE_MAX;
 }
 
-static void do_get(std::vector<std::string> &cmd, Buffer &out) {
-   
-    LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-   
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!node) {
-        return out_nil(out);
-    }
-   
-    Entry *ent = container_of(node, Entry, node);
-    if (ent->type != T_STR) {
-        return out_err(out, ERR_BAD_TYP, "not a string value");
-    }
-    return out_str(out, ent->str.data(), ent->str.size());
+static size_t key_reply_size(Entry *ent) {
+    return 1 + 4 + ent->key.size();
+}
+static size_t member_reply_size(ZNode *znode) {
+    return (1 + 4 + znode->len) + (1 + 8);
 }
 
-static void do_set(std::vector<std::string> &cmd, Buffer &out) {
+static KeyScan *key_scan_start() {
+    KeyScan *scan = new KeyScan();
+    scan->gen = ++g_data.keys_gen;
+    const HMap &db = g_data.db;
+    scan->mask = db.older.tab ? db.older.mask : db.newer.mask;
+    dlist_insert_before(&g_data.key_scans, &scan->node);
+    return scan;
+}
 
-    LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+static void key_scan_free(KeyScan *scan) {
+    dlist_detach(&scan->node);
+    delete scan;
+}
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (node) {
-    
-        Entry *ent = container_of(node, Entry, node);
-        if (ent->type != T_STR) {
-            return out_err(out, ERR_BAD_TYP, "a non-string value exists");
+// the key is about to be freed: the scans yet to list it keep its name
+static void key_scans_gone(Entry *ent) {
+    for (DList *cur = g_data.key_scans.next; cur != &g_data.key_scans; cur = cur->next) {
+        KeyScan *scan = container_of(cur, KeyScan, node);
+        size_t bucket = ent->node.hcode & scan->mask;
+        if (ent->gen < scan->gen && bucket >= scan->pos) {
+            scan->gone.push_back(ent->key);
+            if (bucket >= scan->sized) {
+                scan->bytes += key_reply_size(ent);
+            }
         }
-        ent->str.swap(cmd[2]);
-    } else {
-    
-        Entry *ent = entry_new(T_STR);
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        ent->str.swap(cmd[2]);
-        hm_insert(&g_data.db, &ent->node);
     }
-    return out_nil(out);
 }
 
-static void do_del(std::vector<std::string> &cmd, Buffer &out) {
+struct KeyScanArg {
+    KeyScan *scan = NULL;
+    Buffer *out = NULL;     // lists the keys if set, or else sizes them
+};
 
-    LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+static bool cb_key_scan(HNode *node, void *arg) {
+    KeyScanArg *a = (KeyScanArg *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->gen < a->scan->gen) {
+        if (a->out) {
+            out_str(*a->out, ent->key.data(), ent->key.size());
+        } else {
+            a->scan->bytes += key_reply_size(ent);
+        }
+    }
+    return true;
+}
 
-    HNode *node = hm_delete(&g_data.db, &key.node, &entry_eq);
-    if (node) { // deallocate the pair
-        entry_del(container_of(node, Entry, node));
+// whole buckets of g_data.db from scan->pos, then the keys deleted
+// meanwhile, until `out` reaches `high`; true once all are listed
+static bool keys_fill(Buffer &out, KeyScan *scan, size_t high) {
+    KeyScanArg arg;
+    arg.scan = scan;
+    arg.out = &out;
+    while (scan->pos <= scan->mask && buf_size(out) < high) {
+        hm_foreach_bucket(&g_data.db, scan->mask, scan->pos++, &cb_key_scan, &arg);
     }
-    return out_int(out, node ? 1 : 0);
+    if (scan->pos <= scan->mask) {
+        return false;
+    }
+    while (scan->gone_pos < scan->gone.size() && buf_size(out) < high) {
+        const std::string &key = scan->gone[scan->gone_pos++];
+        out_str(out, key.data(), key.size());
+    }
+    return scan->gone_pos == scan->gone.size();
 }
 
-static void heap_delete(std::vector<HeapItem> &a, size_t pos) {
+// up to *left members from `znode` until `out` reaches `high`; the next one
+static ZNode *zquery_fill(Buffer &out, ZNode *znode, int64_t *left, size_t high) {
+    while (znode && *left > 0 && buf_size(out) < high) {
+        out_str(out, znode->name, znode->len);
+        out_dbl(out, znode->score);
+        znode = znode_offset(znode, +1);
+        (*left)--;
+    }
+    return *left > 0 ? znode : NULL;
+}
 
-    a[pos] = a.back();
-    a.pop_back();
+// a stream or suspended command is done: the writes that waited for one
+// run again, and wait again if another still reads what they may change
+static void waiters_resume() {
+    uint64_t now_ms = get_monotonic_msec();
+    while (!dlist_empty(&g_data.waiters)) {
+        Conn *conn = container_of(g_data.waiters.next, Conn, wait_node);
+        dlist_detach(&conn->wait_node);
+        dlist_init(&conn->wait_node);
+        conn->waiting = false;
+        conn->last_active_ms = now_ms;
+        dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+        dlist_detach(&conn->resume_node);   // may be queued already
+        dlist_insert_before(&g_data.resume_list, &conn->resume_node);
+    }
+}
 
-    if (pos < a.size()) {
-        heap_update(a.data(), pos, a.size());
+static void stream_free(Conn *conn) {
+    dlist_detach(&conn->stream->node);
+    if (conn->stream->scan) {
+        key_scan_free(conn->stream->scan);
     }
+    delete conn->stream;
+    conn->stream = NULL;
+    waiters_resume();
 }
 
-static void heap_upsert(std::vector<HeapItem> &a, size_t pos, HeapItem t) {
-    if (pos < a.size()) {
-        a[pos] = t;     
+// generates the next part of the reply, or all of it
+static void stream_fill(Conn *conn, size_t high) {
+    Stream *stream = conn->stream;
+    Buffer &out = conn->outgoing;
+    size_t before = buf_size(out);
+    bool done = false;
+    if (stream->ent) {
+        ZSet *zset = &stream->ent->zset;
+        ZNode *znode = zset_seekge(
+            zset, stream->score, stream->name.data(), stream->name.size());
+        znode = zquery_fill(out, znode, &stream->left, high);
+        if (znode) {
+            stream->score = znode->score;
+            stream->name.assign(znode->name, znode->len);
+        }
+        done = !znode;
     } else {
-        pos = a.size();
-        a.push_back(t); 
+        done = keys_fill(out, stream->scan, high);
+    }
+    assert(buf_size(out) - before <= stream->bytes);
+    stream->bytes -= buf_size(out) - before;
+    if (done) {
+        assert(stream->bytes == 0);
+        stream_free(conn);
     }
-    heap_update(a.data(), pos, a.size());
 }
 
+static void stream_start(Conn *conn, Stream *stream) {
+    assert(!conn->stream);
+    stream->conn = conn;
+    dlist_insert_before(&g_data.streams, &stream->node);
+    conn->stream = stream;
+}
 
-static void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
-    if (ttl_ms < 0 && ent->heap_idx != (size_t)-1) {
-        heap_delete(g_data.heap, ent->heap_idx);
-        ent->heap_idx = -1;
-    } else if (ttl_ms >= 0) {
-        uint64_t expire_at = get_monotonic_msec() + (uint64_t)ttl_ms;
-        HeapItem item = {expire_at, &ent->heap_idx};
-        heap_upsert(g_data.heap, ent->heap_idx, item);
+// finishes the replies that read `ent` before it is modified
+static void streams_flush(Entry *ent) {
+    DList *cur = g_data.streams.next;
+    while (cur != &g_data.streams) {
+        Stream *stream = container_of(cur, Stream, node);
+        cur = cur->next;
+        if (stream->ent == ent) {
+            stream_fill(stream->conn, SIZE_MAX);
+            g_data.stats.stream_flushes++;
+        }
     }
 }
 
-static bool str2int(const std::string &s, int64_t &out) {
-    char *endp = NULL;
-    out = strtoll(s.c_str(), &endp, 10);
-    return endp == s.c_str() + s.size();
+// the entry was moved by the defragmenter
+static void streams_moved(Entry *from, Entry *to) {
+    for (DList *cur = g_data.streams.next; cur != &g_data.streams; cur = cur->next) {
+        Stream *stream = container_of(cur, Stream, node);
+        if (stream->ent == from) {
+            stream->ent = to;
+        }
+    }
+}
+
+static void tasks_flush(Entry *ent);
+
+// `ent` is about to change: the replies still reading it are generated
+// first. A write waits for them instead (tasks_busy(), streams_busy()),
+// so they are only finished here should one get by.
+static void sources_flush(Entry *ent) {
+    if (!dlist_empty(&g_data.tasks)) {
+        tasks_flush(ent);   // may start streams over `ent`
+    }
+    if (!dlist_empty(&g_data.streams)) {
+        streams_flush(ent);
+    }
+}
+
+// whether `src`, the key a stream or suspended command reads (NULL for
+// KEYS, which does not mind), may change by the expiry of `ent` or by a
+// write with the arguments `cmd`
+static bool source_hit(
+    const Entry *src, const Entry *ent, const std::vector<std::string> *cmd)
+{
+    if (!src) {
+        return false;
+    }
+    if (src == ent) {
+        return true;
+    }
+    for (size_t i = 1; cmd && i < cmd->size(); i++) {
+        if ((*cmd)[i] == src->key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// whether the expiry of `ent`, or a write with the arguments `cmd`, must
+// wait for the suspended commands
+static bool tasks_busy(const Entry *ent, const std::vector<std::string> *cmd) {
+    for (DList *cur = g_data.tasks.next; cur != &g_data.tasks; cur = cur->next) {
+        if (source_hit(container_of(cur, CmdTask, node)->ent, ent, cmd)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the same for the streams; those found are then generated without
+// waiting for their clients (process_streams())
+static bool streams_busy(const Entry *ent, const std::vector<std::string> *cmd) {
+    bool busy = false;
+    for (DList *cur = g_data.streams.next; cur != &g_data.streams; cur = cur->next) {
+        Stream *stream = container_of(cur, Stream, node);
+        if (source_hit(stream->ent, ent, cmd)) {
+            stream->waited = true;
+            busy = true;
+        }
+    }
+    return busy;
+}
+
+// the entry must be unlinked from g_data.db
+static void entry_del(Entry *ent) {
+    sources_flush(ent);
+    if (!dlist_empty(&g_data.key_scans)) {
+        key_scans_gone(ent);
+    }
+    entry_set_ttl(ent, -1);
+    mem_forget(ent);
+    ebr_retire(&g_data.ebr, &entry_free, ent);
+}
+
+struct LookupKey {
+    struct HNode node; 
+    std::string key;
+};
+
+// equality comparison for the top-level hashstable
+static bool entry_eq(HNode *node, HNode *key) {
+    struct Entry *ent = container_of(node, struct Entry, node);
+    struct LookupKey *keydata = container_of(key, struct LookupKey, node);
+    return ent->key == keydata->key;
+}
+
+// keyspace access for commands; the entry is counted again afterwards
+static HNode *db_lookup(HNode *key) {
+    HNode *node = hm_lookup(&g_data.db, key, &entry_eq);
+    if (node && g_mem.tracking) {
+        Entry *ent = container_of(node, Entry, node);
+        entry_touch(ent);
+        sources_flush(ent);
+    }
+    return node;
+}
+
+static void db_insert(Entry *ent) {
+    if (ent->type == T_ZSET && g_opt.readers) {
+        ent->zset.free_node = &free_shared;
+        ent->zset.hmap.free_tab = &free_shared;
+    }
+    ent->gen = g_data.keys_gen;
+    hm_insert(&g_data.db, &ent->node);
+    entry_touch(ent);
+}
+
+static HNode *db_delete(HNode *key, bool (*eq)(HNode *, HNode *)) {
+    return hm_delete(&g_data.db, key, eq);
+}
+
+static void out_entry_str(Buffer &out, Entry *ent) {
+    if (ent->enc == ENC_INT) {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "%lld", (long long)ent->ival);
+        return out_str(out, buf, (size_t)len);
+    } else if (ent->enc == ENC_REF) {
+        return out_str_ref(out, ent->ref);
+    }
+    return out_str(out, ent->str.data(), ent->str.size());
+}
+
+static void do_get(std::vector<std::string> &cmd, Buffer &out) {
+   
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+   
+    HNode *node = db_lookup(&key.node);
+    if (!node) {
+        return out_nil(out);
+    }
+   
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type != T_STR) {
+        return out_err(out, ERR_BAD_TYP, "not a string value");
+    }
+    return out_entry_str(out, ent);
+}
+
+static void do_set(std::vector<std::string> &cmd, Buffer &out) {
+
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = db_lookup(&key.node);
+    if (node) {
+    
+        Entry *ent = container_of(node, Entry, node);
+        if (ent->type != T_STR) {
+            return out_err(out, ERR_BAD_TYP, "a non-string value exists");
+        }
+        entry_set_str(ent, cmd[2]);
+    } else {
+    
+        Entry *ent = entry_new(T_STR);
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        entry_set_str(ent, cmd[2]);
+        db_insert(ent);
+    }
+    return out_nil(out);
+}
+
+static void do_del(std::vector<std::string> &cmd, Buffer &out) {
+
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = db_delete(&key.node, &entry_eq);
+    if (node) { // deallocate the pair
+        entry_del(container_of(node, Entry, node));
+    }
+    return out_int(out, node ? 1 : 0);
+}
+
+const size_t k_prefetch_group = 16;
+
+// Batched commands resolve their keys a group at a time: all the bucket
+// slots of the group are prefetched, then all the chain heads, so the cache
+// misses of the group overlap instead of being taken one after another.
+static void db_prefetch(const LookupKey *keys, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        hm_prefetch_slot(&g_data.db, keys[i].node.hcode);
+    }
+    for (size_t i = 0; i < n; i++) {
+        hm_prefetch_node(&g_data.db, keys[i].node.hcode);
+    }
+}
+
+static void lookup_keys_init(
+    std::vector<std::string> &cmd, size_t first, size_t step,
+    std::vector<LookupKey> &keys)
+{
+    keys.resize((cmd.size() - first + step - 1) / step);
+    for (size_t i = 0; i < keys.size(); i++) {
+        LookupKey &key = keys[i];
+        key.key.swap(cmd[first + i * step]);
+        key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    }
+}
+
+// mget key [key ...]
+static void do_mget(std::vector<std::string> &cmd, Buffer &out) {
+    std::vector<LookupKey> keys;
+    lookup_keys_init(cmd, 1, 1, keys);
+
+    out_arr(out, (uint32_t)keys.size());
+    for (size_t i = 0; i < keys.size(); i += k_prefetch_group) {
+        size_t end = std::min(keys.size(), i + k_prefetch_group);
+        db_prefetch(&keys[i], end - i);
+        for (size_t j = i; j < end; j++) {
+            HNode *node = db_lookup(&keys[j].node);
+            Entry *ent = node ? container_of(node, Entry, node) : NULL;
+            if (!ent || ent->type != T_STR) {
+                out_nil(out);
+            } else {
+                out_entry_str(out, ent);
+            }
+        }
+    }
+}
+
+// mset key value [key value ...]
+static void do_mset(std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() % 2 != 1) {
+        return out_err(out, ERR_BAD_ARG, "expect key value pairs");
+    }
+    std::vector<LookupKey> keys;
+    lookup_keys_init(cmd, 1, 2, keys);
+
+    // check the types before modifying anything
+    std::vector<Entry *> ents(keys.size(), NULL);
+    for (size_t i = 0; i < keys.size(); i += k_prefetch_group) {
+        size_t end = std::min(keys.size(), i + k_prefetch_group);
+        db_prefetch(&keys[i], end - i);
+        for (size_t j = i; j < end; j++) {
+            HNode *node = db_lookup(&keys[j].node);
+            if (!node) {
+                continue;
+            }
+            ents[j] = container_of(node, Entry, node);
+            if (ents[j]->type != T_STR) {
+                return out_err(out, ERR_BAD_TYP, "a non-string value exists");
+            }
+        }
+    }
+
+    for (size_t i = 0; i < keys.size(); i++) {
+        Entry *ent = ents[i];
+        if (!ent) {
+            // the key may have been inserted by an earlier pair of this batch
+            HNode *node = db_lookup(&keys[i].node);
+            ent = node ? container_of(node, Entry, node) : NULL;
+        }
+        if (ent) {
+            entry_set_str(ent, cmd[2 + i * 2]);
+        } else {
+            ent = entry_new(T_STR);
+            ent->key.swap(keys[i].key);
+            ent->node.hcode = keys[i].node.hcode;
+            entry_set_str(ent, cmd[2 + i * 2]);
+            db_insert(ent);
+        }
+    }
+    return out_nil(out);
+}
+
+// mdel key [key ...]
+static void do_mdel(std::vector<std::string> &cmd, Buffer &out) {
+    std::vector<LookupKey> keys;
+    lookup_keys_init(cmd, 1, 1, keys);
+
+    int64_t n = 0;
+    for (size_t i = 0; i < keys.size(); i += k_prefetch_group) {
+        size_t end = std::min(keys.size(), i + k_prefetch_group);
+        db_prefetch(&keys[i], end - i);
+        for (size_t j = i; j < end; j++) {
+            HNode *node = db_delete(&keys[j].node, &entry_eq);
+            if (node) {
+                entry_del(container_of(node, Entry, node));
+                n++;
+            }
+        }
+    }
+    return out_int(out, n);
+}
+
+static void heap_delete(std::vector<HeapItem> &a, size_t pos) {
+
+    a[pos] = a.back();
+    a.pop_back();
+
+    if (pos < a.size()) {
+        heap_update(a.data(), pos, a.size());
+    }
+}
+
+static void heap_upsert(std::vector<HeapItem> &a, size_t pos, HeapItem t) {
+    if (pos < a.size()) {
+        a[pos] = t;     
+    } else {
+        pos = a.size();
+        a.push_back(t); 
+    }
+    heap_update(a.data(), pos, a.size());
+}
+
+
+static void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
+    if (ttl_ms < 0 && ent->heap_idx != (size_t)-1) {
+        heap_delete(g_data.heap, ent->heap_idx);
+        ent->heap_idx = -1;
+    } else if (ttl_ms >= 0) {
+        uint64_t expire_at = get_monotonic_msec() + (uint64_t)ttl_ms;
+        HeapItem item = {expire_at, &ent->heap_idx};
+        heap_upsert(g_data.heap, ent->heap_idx, item);
+    }
+}
+
+static bool str2int(const std::string &s, int64_t &out) {
+    char *endp = NULL;
+    out = strtoll(s.c_str(), &endp, 10);
+    return endp == s.c_str() + s.size();
 }
 
 static void do_expire(std::vector<std::string> &cmd, Buffer &out) {
@@ -423,237 +1487,3518 @@ static void do_expire(std::vector<std::string> &cmd, Buffer &out) {
         return out_err(out, ERR_BAD_ARG, "expect int64");
     }
 
-    LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (node) {
-        Entry *ent = container_of(node, Entry, node);
-        entry_set_ttl(ent, ttl_ms);
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = db_lookup(&key.node);
+    if (node) {
+        Entry *ent = container_of(node, Entry, node);
+        entry_set_ttl(ent, ttl_ms);
+    }
+    return out_int(out, node ? 1: 0);
+}
+
+static void do_ttl(std::vector<std::string> &cmd, Buffer &out) {
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = db_lookup(&key.node);
+    if (!node) {
+        return out_int(out, -2);
+    }
+
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->heap_idx == (size_t)-1) {
+        return out_int(out, -1);
+    }
+
+    uint64_t expire_at = g_data.heap[ent->heap_idx].val;
+    uint64_t now_ms = get_monotonic_msec();
+    return out_int(out, expire_at > now_ms ? (expire_at - now_ms) : 0);
+}
+
+static Task do_keys(Conn *conn, std::vector<std::string>, Buffer &out) {
+    out_arr(out, (uint32_t)hm_size(&g_data.db));
+    KeyScan *scan = key_scan_start();
+    if (keys_fill(out, scan, output_high())) {
+        key_scan_free(scan);
+        co_return;
+    }
+    conn->task->scan = scan;    // freed with the task if it is cut short
+    KeyScanArg arg;
+    arg.scan = scan;
+    for (scan->sized = scan->pos; scan->sized <= scan->mask; ) {
+        hm_foreach_bucket(&g_data.db, scan->mask, scan->sized, &cb_key_scan, &arg);
+        scan->sized++;
+        co_await task_yield();
+    }
+    conn->task->scan = NULL;
+    Stream *stream = new Stream();
+    stream->scan = scan;
+    stream->bytes = scan->bytes;
+    stream_start(conn, stream);
+}
+
+static bool str2dbl(const std::string &s, double &out) {
+    char *endp = NULL;
+    out = strtod(s.c_str(), &endp);
+    return endp == s.c_str() + s.size() && !isnan(out);
+}
+
+// returns the string entry of the key, creating it with `init` if missing
+static Entry *expect_str_entry(std::string &s, Buffer &out, int64_t init) {
+    LookupKey key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key.node);
+    if (!node) {
+        Entry *ent = entry_new(T_STR);
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        entry_set_int(ent, init);
+        db_insert(ent);
+        return ent;
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type != T_STR) {
+        out_err(out, ERR_BAD_TYP, "expect string");
+        return NULL;
+    }
+    return ent;
+}
+
+// the bytes of a string value; integers are formatted into `tmp`
+static void entry_str_bytes(Entry *ent, std::string &tmp, const uint8_t **data, size_t *len) {
+    if (ent->enc == ENC_INT) {
+        char buf[32];
+        tmp.assign(buf, (size_t)snprintf(buf, sizeof(buf), "%lld", (long long)ent->ival));
+        *data = (const uint8_t *)tmp.data();
+        *len = tmp.size();
+    } else if (ent->enc == ENC_REF) {
+        *data = ent->ref->data;
+        *len = ent->ref->len;
+    } else {
+        *data = (const uint8_t *)ent->str.data();
+        *len = ent->str.size();
+    }
+}
+
+static void incr_by(std::string &key, int64_t delta, Buffer &out) {
+    Entry *ent = expect_str_entry(key, out, 0);
+    if (!ent) {
+        return;
+    }
+    int64_t val = ent->ival;
+    if (ent->enc != ENC_INT) {
+        std::string tmp;
+        const uint8_t *data = NULL;
+        size_t len = 0;
+        entry_str_bytes(ent, tmp, &data, &len);
+        if (!str_is_int((const char *)data, len, val)) {
+            return out_err(out, ERR_BAD_TYP, "value is not an integer");
+        }
+    }
+    if (__builtin_add_overflow(val, delta, &val)) {
+        return out_err(out, ERR_BAD_ARG, "increment or decrement would overflow");
+    }
+    entry_set_int(ent, val);
+    return out_int(out, val);
+}
+
+// incr key
+static void do_incr(std::vector<std::string> &cmd, Buffer &out) {
+    return incr_by(cmd[1], 1, out);
+}
+
+// decr key
+static void do_decr(std::vector<std::string> &cmd, Buffer &out) {
+    return incr_by(cmd[1], -1, out);
+}
+
+// incrby key delta
+static void do_incrby(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t delta = 0;
+    if (!str2int(cmd[2], delta)) {
+        return out_err(out, ERR_BAD_ARG, "expect int64");
+    }
+    return incr_by(cmd[1], delta, out);
+}
+
+// decrby key delta
+static void do_decrby(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t delta = 0;
+    if (!str2int(cmd[2], delta) || delta == INT64_MIN) {
+        return out_err(out, ERR_BAD_ARG, "expect int64");
+    }
+    return incr_by(cmd[1], -delta, out);
+}
+
+// incrbyfloat key delta
+static void do_incrbyfloat(std::vector<std::string> &cmd, Buffer &out) {
+    double delta = 0;
+    if (!str2dbl(cmd[2], delta) || !isfinite(delta)) {
+        return out_err(out, ERR_BAD_ARG, "expect float");
+    }
+    Entry *ent = expect_str_entry(cmd[1], out, 0);
+    if (!ent) {
+        return;
+    }
+    double val = (double)ent->ival;
+    if (ent->enc != ENC_INT) {
+        std::string tmp;
+        const uint8_t *data = NULL;
+        size_t len = 0;
+        entry_str_bytes(ent, tmp, &data, &len);
+        if (!str2dbl(std::string((const char *)data, len), val)) {
+            return out_err(out, ERR_BAD_TYP, "value is not a valid float");
+        }
+    }
+    val += delta;
+    if (!isfinite(val)) {
+        return out_err(out, ERR_BAD_ARG, "increment would produce NaN or Infinity");
+    }
+
+    // the shortest representation that reads back as the same double
+    char buf[64];
+    int len = 0;
+    for (int prec = 15; prec <= 17; prec++) {
+        len = snprintf(buf, sizeof(buf), "%.*g", prec, val);
+        if (strtod(buf, NULL) == val) {
+            break;
+        }
+    }
+    std::string str(buf, (size_t)len);
+    entry_set_str(ent, str);
+    return out_dbl(out, val);
+}
+
+// converts the value to ENC_RAW so that it can be modified in place; not
+// with reader threads, see str_ref_min()
+static std::string &entry_str_raw(Entry *ent) {
+    assert(!g_opt.readers);
+    if (ent->enc != ENC_RAW) {
+        std::string tmp;
+        const uint8_t *data = NULL;
+        size_t len = 0;
+        entry_str_bytes(ent, tmp, &data, &len);
+        std::string str((const char *)data, len);
+        entry_str_release(ent);
+        ent->str.swap(str);
+    }
+    return ent->str;
+}
+
+// the bytes of the key's string value, empty if missing; false for other types
+static bool expect_bitmap(std::string &s, Buffer &out, std::string &tmp,
+    const uint8_t **data, size_t *len)
+{
+    LookupKey key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key.node);
+    *data = (const uint8_t *)"";
+    *len = 0;
+    if (!node) {
+        return true;
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type != T_STR) {
+        out_err(out, ERR_BAD_TYP, "expect string");
+        return false;
+    }
+    entry_str_bytes(ent, tmp, data, len);
+    return true;
+}
+
+// a bit offset within the largest value a response can carry
+static bool str2bitoff(const std::string &s, uint64_t &out) {
+    int64_t off = 0;
+    if (!str2int(s, off) || off < 0 || (uint64_t)off >= (uint64_t)k_max_msg * 8) {
+        return false;
+    }
+    out = (uint64_t)off;
+    return true;
+}
+
+// setbit key offset 0|1, returning the previous bit
+static void do_setbit(std::vector<std::string> &cmd, Buffer &out) {
+    uint64_t off = 0;
+    if (!str2bitoff(cmd[2], off)) {
+        return out_err(out, ERR_BAD_ARG, "bit offset is not an integer or out of range");
+    }
+    if (cmd[3] != "0" && cmd[3] != "1") {
+        return out_err(out, ERR_BAD_ARG, "bit is not an integer or out of range");
+    }
+
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key.node);
+    Entry *ent = NULL;
+    if (node) {
+        ent = container_of(node, Entry, node);
+        if (ent->type != T_STR) {
+            return out_err(out, ERR_BAD_TYP, "expect string");
+        }
+    } else {
+        ent = entry_new(T_STR);
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+    }
+
+    // reader threads only ever see a whole value, so it is copied
+    std::string copy;
+    if (g_opt.readers) {
+        std::string tmp;
+        const uint8_t *data = NULL;
+        size_t len = 0;
+        entry_str_bytes(ent, tmp, &data, &len);
+        copy.assign((const char *)data, len);
+    }
+    std::string &str = g_opt.readers ? copy : entry_str_raw(ent);
+    size_t byte = (size_t)(off / 8);
+    if (byte >= str.size()) {
+        str.resize(byte + 1, '\0');
+    }
+    uint8_t mask = (uint8_t)(0x80 >> (off % 8));
+    bool old = (uint8_t)str[byte] & mask;
+    if (cmd[3] == "1") {
+        str[byte] = (char)((uint8_t)str[byte] | mask);
+    } else {
+        str[byte] = (char)((uint8_t)str[byte] & ~mask);
+    }
+    if (g_opt.readers) {
+        entry_set_str(ent, copy);
+    }
+    if (!node) {
+        db_insert(ent);
+    }
+    return out_int(out, old);
+}
+
+// getbit key offset
+static void do_getbit(std::vector<std::string> &cmd, Buffer &out) {
+    uint64_t off = 0;
+    if (!str2bitoff(cmd[2], off)) {
+        return out_err(out, ERR_BAD_ARG, "bit offset is not an integer or out of range");
+    }
+    std::string tmp;
+    const uint8_t *data = NULL;
+    size_t len = 0;
+    if (!expect_bitmap(cmd[1], out, tmp, &data, &len)) {
+        return;
+    }
+    size_t byte = (size_t)(off / 8);
+    return out_int(out, byte < len && (data[byte] & (0x80 >> (off % 8))));
+}
+
+// Clamps the inclusive byte range to a value of `len` bytes, counting
+// negative offsets from the end. Returns false if it is empty.
+static bool byte_range(int64_t &start, int64_t &end, size_t len) {
+    if (start < 0) {
+        start += (int64_t)len;
+    }
+    if (end < 0) {
+        end += (int64_t)len;
+    }
+    start = std::max(start, (int64_t)0);
+    end = std::min(end, (int64_t)len - 1);
+    return start <= end;
+}
+
+// bitcount key [start end]
+static void do_bitcount(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t start = 0, end = -1;
+    if (cmd.size() == 4) {
+        if (!str2int(cmd[2], start) || !str2int(cmd[3], end)) {
+            return out_err(out, ERR_BAD_ARG, "expect int64");
+        }
+    } else if (cmd.size() != 2) {
+        return out_err(out, ERR_BAD_ARG, "syntax error");
+    }
+    std::string tmp;
+    const uint8_t *data = NULL;
+    size_t len = 0;
+    if (!expect_bitmap(cmd[1], out, tmp, &data, &len)) {
+        return;
+    }
+    if (!byte_range(start, end, len)) {
+        return out_int(out, 0);
+    }
+    return out_int(out, (int64_t)bitmap_count(data + start, (size_t)(end - start + 1)));
+}
+
+// bitpos key 0|1 [start [end]]
+static void do_bitpos(std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd[2] != "0" && cmd[2] != "1") {
+        return out_err(out, ERR_BAD_ARG, "the bit argument must be 1 or 0");
+    }
+    bool bit = cmd[2] == "1";
+    int64_t start = 0, end = -1;
+    if (cmd.size() > 5) {
+        return out_err(out, ERR_BAD_ARG, "syntax error");
+    } else if ((cmd.size() > 3 && !str2int(cmd[3], start))
+        || (cmd.size() > 4 && !str2int(cmd[4], end)))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect int64");
+    }
+    std::string tmp;
+    const uint8_t *data = NULL;
+    size_t len = 0;
+    if (!expect_bitmap(cmd[1], out, tmp, &data, &len)) {
+        return;
+    }
+    if (len == 0) {
+        return out_int(out, bit ? -1 : 0);
+    }
+    if (!byte_range(start, end, len)) {
+        return out_int(out, -1);
+    }
+    int64_t pos = bitmap_pos(data + start, (size_t)(end - start + 1), bit);
+    if (pos >= 0) {
+        return out_int(out, start * 8 + pos);
+    }
+    // without an end, the value reads as padded with zeros
+    return out_int(out, !bit && cmd.size() <= 4 ? (end + 1) * 8 : -1);
+}
+
+// BITOPs over at least this many input bytes are split across the thread pool
+const size_t k_bitop_parallel_min = 1 << 20;
+
+struct BitOp {
+    uint32_t op = 0;
+    uint8_t *dst = NULL;
+    std::vector<const uint8_t *> srcs;
+    std::vector<size_t> lens;
+    size_t len = 0;
+    size_t nslices = 1;
+};
+
+static void bitop_task(void *arg, size_t i) {
+    BitOp *bop = (BitOp *)arg;
+    // slices on cache line boundaries
+    size_t lines = (bop->len + 63) / 64;
+    size_t from = std::min(bop->len, lines * i / bop->nslices * 64);
+    size_t to = std::min(bop->len, lines * (i + 1) / bop->nslices * 64);
+    bitmap_op(bop->op, bop->dst, bop->srcs.data(), bop->lens.data(), bop->srcs.size(), from, to);
+}
+
+// bitop and|or|xor|not dest key [key ...], returning the length of dest
+static void do_bitop(std::vector<std::string> &cmd, Buffer &out) {
+    BitOp bop;
+    const std::string &op = cmd[1];
+    if (op == "and") {
+        bop.op = BITOP_AND;
+    } else if (op == "or") {
+        bop.op = BITOP_OR;
+    } else if (op == "xor") {
+        bop.op = BITOP_XOR;
+    } else if (op == "not") {
+        bop.op = BITOP_NOT;
+    } else {
+        return out_err(out, ERR_BAD_ARG, "syntax error");
+    }
+    if (bop.op == BITOP_NOT && cmd.size() != 4) {
+        return out_err(out, ERR_BAD_ARG, "BITOP NOT takes a single source key");
+    }
+
+    LookupKey key;
+    key.key.swap(cmd[2]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key.node);
+    Entry *ent = node ? container_of(node, Entry, node) : NULL;
+    if (ent && ent->type != T_STR) {
+        return out_err(out, ERR_BAD_TYP, "a non-string value exists");
+    }
+
+    std::vector<std::string> tmps(cmd.size() - 3);
+    size_t total = 0;
+    for (size_t i = 3; i < cmd.size(); i++) {
+        const uint8_t *data = NULL;
+        size_t len = 0;
+        if (!expect_bitmap(cmd[i], out, tmps[i - 3], &data, &len)) {
+            return;
+        }
+        bop.srcs.push_back(data);
+        bop.lens.push_back(len);
+        bop.len = std::max(bop.len, len);
+        total += len;
+    }
+
+    if (bop.len == 0) {
+        if (ent) {
+            db_delete(&key.node, &entry_eq);
+            entry_del(ent);
+        }
+        return out_int(out, 0);
+    }
+    std::string result(bop.len, '\0');
+    bop.dst = (uint8_t *)&result[0];
+    if (total >= k_bitop_parallel_min) {
+        bop.nslices = 2 * (g_data.thread_pool.threads.size() + 1);
+    }
+    thread_pool_run(&g_data.thread_pool, bop.nslices, &bitop_task, &bop);
+
+    if (ent) {
+        entry_set_str(ent, result);
+    } else {
+        ent = entry_new(T_STR);
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        entry_set_str(ent, result);
+        db_insert(ent);
+    }
+    return out_int(out, (int64_t)bop.len);
+}
+
+static const Hash k_empty_hash;
+
+// the hash of the key, an empty one if missing, or NULL for other types
+static Hash *expect_hash(std::string &s) {
+    LookupKey key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key.node);
+    if (!hnode) {
+        return (Hash *)&k_empty_hash;
+    }
+    Entry *ent = container_of(hnode, Entry, node);
+    return ent->type == T_HASH ? ent->hash : NULL;
+}
+
+// returns the hash entry of the key, creating it if missing
+static Entry *expect_hash_entry(std::string &s, Buffer &out) {
+    LookupKey key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key.node);
+    if (!node) {
+        Entry *ent = entry_new(T_HASH);
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        db_insert(ent);
+        return ent;
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type != T_HASH) {
+        out_err(out, ERR_BAD_TYP, "expect hash");
+        return NULL;
+    }
+    return ent;
+}
+
+// hset key field value [field value ...]
+static void do_hset(std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() % 2 != 0) {
+        return out_err(out, ERR_BAD_ARG, "expect field value pairs");
+    }
+    Entry *ent = expect_hash_entry(cmd[1], out);
+    if (!ent) {
+        return;
+    }
+    int64_t added = 0;
+    for (size_t i = 2; i < cmd.size(); i += 2) {
+        const std::string &field = cmd[i], &val = cmd[i + 1];
+        added += hash_set(ent->hash, field.data(), field.size(), val.data(), val.size());
+    }
+    return out_int(out, added);
+}
+
+// hget key field
+static void do_hget(std::vector<std::string> &cmd, Buffer &out) {
+    Hash *hash = expect_hash(cmd[1]);
+    if (!hash) {
+        return out_err(out, ERR_BAD_TYP, "expect hash");
+    }
+    const char *val = NULL;
+    size_t vlen = 0;
+    if (!hash_get(hash, cmd[2].data(), cmd[2].size(), &val, &vlen)) {
+        return out_nil(out);
+    }
+    return out_str(out, val, vlen);
+}
+
+// hmget key field [field ...]
+static void do_hmget(std::vector<std::string> &cmd, Buffer &out) {
+    Hash *hash = expect_hash(cmd[1]);
+    if (!hash) {
+        return out_err(out, ERR_BAD_TYP, "expect hash");
+    }
+    out_arr(out, (uint32_t)(cmd.size() - 2));
+    for (size_t i = 2; i < cmd.size(); i++) {
+        const char *val = NULL;
+        size_t vlen = 0;
+        if (hash_get(hash, cmd[i].data(), cmd[i].size(), &val, &vlen)) {
+            out_str(out, val, vlen);
+        } else {
+            out_nil(out);
+        }
+    }
+}
+
+// hdel key field [field ...], deleting the key with its last field
+static void do_hdel(std::vector<std::string> &cmd, Buffer &out) {
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key.node);
+    if (!node) {
+        return out_int(out, 0);
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type != T_HASH) {
+        return out_err(out, ERR_BAD_TYP, "expect hash");
+    }
+    int64_t removed = 0;
+    for (size_t i = 2; i < cmd.size(); i++) {
+        removed += hash_del(ent->hash, cmd[i].data(), cmd[i].size());
+    }
+    if (hash_len(ent->hash) == 0) {
+        db_delete(&key.node, &entry_eq);
+        entry_del(ent);
+    }
+    return out_int(out, removed);
+}
+
+// hlen key
+static void do_hlen(std::vector<std::string> &cmd, Buffer &out) {
+    Hash *hash = expect_hash(cmd[1]);
+    if (!hash) {
+        return out_err(out, ERR_BAD_TYP, "expect hash");
+    }
+    return out_int(out, (int64_t)hash_len(hash));
+}
+
+static bool cb_hgetall(const char *field, size_t flen, const char *val, size_t vlen, void *arg) {
+    Buffer &out = *(Buffer *)arg;
+    out_str(out, field, flen);
+    out_str(out, val, vlen);
+    return true;
+}
+
+// hgetall key
+static void do_hgetall(std::vector<std::string> &cmd, Buffer &out) {
+    Hash *hash = expect_hash(cmd[1]);
+    if (!hash) {
+        return out_err(out, ERR_BAD_TYP, "expect hash");
+    }
+    out_arr(out, (uint32_t)(hash_len(hash) * 2));
+    hash_foreach(hash, &cb_hgetall, (void *)&out);
+}
+
+// hincrby key field delta
+static void do_hincrby(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t delta = 0;
+    if (!str2int(cmd[3], delta)) {
+        return out_err(out, ERR_BAD_ARG, "expect int64");
+    }
+    Entry *ent = expect_hash_entry(cmd[1], out);
+    if (!ent) {
+        return;
+    }
+    const std::string &field = cmd[2];
+    const char *cur = NULL;
+    size_t len = 0;
+    int64_t val = 0;
+    if (hash_get(ent->hash, field.data(), field.size(), &cur, &len)
+        && !str_is_int(cur, len, val))
+    {
+        return out_err(out, ERR_BAD_TYP, "value is not an integer");
+    }
+    if (__builtin_add_overflow(val, delta, &val)) {
+        return out_err(out, ERR_BAD_ARG, "increment or decrement would overflow");
+    }
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%lld", (long long)val);
+    hash_set(ent->hash, field.data(), field.size(), buf, (size_t)n);
+    return out_int(out, val);
+}
+
+static const Set k_empty_set;
+
+// the set of the key, an empty one if missing, or NULL for other types
+static Set *expect_set(std::string &s) {
+    LookupKey key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key.node);
+    if (!hnode) {
+        return (Set *)&k_empty_set;
+    }
+    Entry *ent = container_of(hnode, Entry, node);
+    return ent->type == T_SET ? ent->set : NULL;
+}
+
+// returns the set entry of the key, creating it if missing
+static Entry *expect_set_entry(std::string &s, Buffer &out) {
+    LookupKey key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key.node);
+    if (!node) {
+        Entry *ent = entry_new(T_SET);
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        db_insert(ent);
+        return ent;
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type != T_SET) {
+        out_err(out, ERR_BAD_TYP, "expect set");
+        return NULL;
+    }
+    return ent;
+}
+
+// sadd key member [member ...]
+static void do_sadd(std::vector<std::string> &cmd, Buffer &out) {
+    Entry *ent = expect_set_entry(cmd[1], out);
+    if (!ent) {
+        return;
+    }
+    // all-integer batches are merged into an integer set at once
+    std::vector<int64_t> vals;
+    if (ent->set->enc == SET_INTS) {
+        vals.resize(cmd.size() - 2);
+        for (size_t i = 2; i < cmd.size(); i++) {
+            if (!str_is_int(cmd[i].data(), cmd[i].size(), vals[i - 2])) {
+                vals.clear();
+                break;
+            }
+        }
+    }
+    if (!vals.empty()) {
+        return out_int(out, (int64_t)set_add_ints(ent->set, vals));
+    }
+    int64_t added = 0;
+    for (size_t i = 2; i < cmd.size(); i++) {
+        added += set_add(ent->set, cmd[i].data(), cmd[i].size());
+    }
+    return out_int(out, added);
+}
+
+// srem key member [member ...], deleting the key with its last member
+static void do_srem(std::vector<std::string> &cmd, Buffer &out) {
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key.node);
+    if (!node) {
+        return out_int(out, 0);
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type != T_SET) {
+        return out_err(out, ERR_BAD_TYP, "expect set");
+    }
+    int64_t removed = 0;
+    for (size_t i = 2; i < cmd.size(); i++) {
+        removed += set_del(ent->set, cmd[i].data(), cmd[i].size());
+    }
+    if (set_size(ent->set) == 0) {
+        db_delete(&key.node, &entry_eq);
+        entry_del(ent);
+    }
+    return out_int(out, removed);
+}
+
+// sismember key member
+static void do_sismember(std::vector<std::string> &cmd, Buffer &out) {
+    Set *set = expect_set(cmd[1]);
+    if (!set) {
+        return out_err(out, ERR_BAD_TYP, "expect set");
+    }
+    return out_int(out, set_contains(set, cmd[2].data(), cmd[2].size()));
+}
+
+// scard key
+static void do_scard(std::vector<std::string> &cmd, Buffer &out) {
+    Set *set = expect_set(cmd[1]);
+    if (!set) {
+        return out_err(out, ERR_BAD_TYP, "expect set");
+    }
+    return out_int(out, (int64_t)set_size(set));
+}
+
+static bool cb_smembers(const char *name, size_t len, void *arg) {
+    out_str(*(Buffer *)arg, name, len);
+    return true;
+}
+
+static void out_set(Buffer &out, Set *set) {
+    out_arr(out, (uint32_t)set_size(set));
+    set_foreach(set, &cb_smembers, (void *)&out);
+}
+
+// smembers key
+static void do_smembers(std::vector<std::string> &cmd, Buffer &out) {
+    Set *set = expect_set(cmd[1]);
+    if (!set) {
+        return out_err(out, ERR_BAD_TYP, "expect set");
+    }
+    return out_set(out, set);
+}
+
+// sinter key [key ...] or sunion key [key ...]; missing keys are empty sets
+static void do_setop(std::vector<std::string> &cmd, Buffer &out) {
+    std::vector<Set *> sets;
+    for (size_t i = 1; i < cmd.size(); i++) {
+        Set *set = expect_set(cmd[i]);
+        if (!set) {
+            return out_err(out, ERR_BAD_TYP, "expect set");
+        }
+        sets.push_back(set);
+    }
+    Set result;
+    if (cmd[0] == "sinter") {
+        set_inter(sets.data(), sets.size(), &result);
+    } else {
+        set_union(sets.data(), sets.size(), &result);
+    }
+    out_set(out, &result);
+    set_clear(&result);
+}
+
+static const Hll k_empty_hll;
+
+// the counter of the key, an empty one if missing, or NULL for other types
+static Hll *expect_hll(std::string &s) {
+    LookupKey key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key.node);
+    if (!hnode) {
+        return (Hll *)&k_empty_hll;
+    }
+    Entry *ent = container_of(hnode, Entry, node);
+    return ent->type == T_HLL ? ent->hll : NULL;
+}
+
+// returns the counter entry of the key, creating it if missing
+static Entry *expect_hll_entry(std::string &s, Buffer &out, bool *created) {
+    LookupKey key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key.node);
+    *created = !node;
+    if (!node) {
+        Entry *ent = entry_new(T_HLL);
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        db_insert(ent);
+        return ent;
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type != T_HLL) {
+        out_err(out, ERR_BAD_TYP, "expect hyperloglog");
+        return NULL;
+    }
+    return ent;
+}
+
+// pfadd key [element ...]; 1 if the estimate may have changed
+static void do_pfadd(std::vector<std::string> &cmd, Buffer &out) {
+    bool changed = false;
+    Entry *ent = expect_hll_entry(cmd[1], out, &changed);
+    if (!ent) {
+        return;
+    }
+    for (size_t i = 2; i < cmd.size(); i++) {
+        changed |= hll_add(ent->hll, cmd[i].data(), cmd[i].size());
+    }
+    return out_int(out, changed);
+}
+
+// pfcount key [key ...], the estimated cardinality of their union
+static void do_pfcount(std::vector<std::string> &cmd, Buffer &out) {
+    std::vector<Hll *> hlls;
+    for (size_t i = 1; i < cmd.size(); i++) {
+        Hll *hll = expect_hll(cmd[i]);
+        if (!hll) {
+            return out_err(out, ERR_BAD_TYP, "expect hyperloglog");
+        }
+        hlls.push_back(hll);
+    }
+    return out_int(out, (int64_t)hll_count(hlls.data(), hlls.size()));
+}
+
+// pfmerge dest [src ...]
+static void do_pfmerge(std::vector<std::string> &cmd, Buffer &out) {
+    std::vector<Hll *> srcs;
+    for (size_t i = 2; i < cmd.size(); i++) {
+        Hll *hll = expect_hll(cmd[i]);
+        if (!hll) {
+            return out_err(out, ERR_BAD_TYP, "expect hyperloglog");
+        }
+        srcs.push_back(hll);
+    }
+    bool created = false;
+    Entry *ent = expect_hll_entry(cmd[1], out, &created);
+    if (!ent) {
+        return;
+    }
+    hll_merge(ent->hll, srcs.data(), srcs.size());
+    return out_nil(out);
+}
+
+// Time series. TSADD creates the key; retention is set with TSRETENTION,
+// before or after the first samples.
+
+static const TimeSeries k_empty_ts;
+
+// the series of the key, an empty one if missing, or NULL for other types
+static TimeSeries *expect_ts(std::string &s) {
+    LookupKey key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key.node);
+    if (!hnode) {
+        return (TimeSeries *)&k_empty_ts;
+    }
+    Entry *ent = container_of(hnode, Entry, node);
+    return ent->type == T_TS ? ent->ts : NULL;
+}
+
+// returns the series entry of the key, creating it if missing
+static Entry *expect_ts_entry(std::string &s, Buffer &out) {
+    LookupKey key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key.node);
+    if (!node) {
+        Entry *ent = entry_new(T_TS);
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        db_insert(ent);
+        return ent;
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type != T_TS) {
+        out_err(out, ERR_BAD_TYP, "expect time series");
+        return NULL;
+    }
+    return ent;
+}
+
+// tsadd key timestamp value [timestamp value ...]
+// Timestamps are integers past the last sample, in increasing order;
+// otherwise nothing is added.
+static void do_tsadd(std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() % 2 != 0) {
+        return out_err(out, ERR_BAD_ARG, "expect timestamp value pairs");
+    }
+    std::vector<TsSample> samples((cmd.size() - 2) / 2);
+    for (size_t i = 0; i < samples.size(); i++) {
+        if (!str2int(cmd[2 + i * 2], samples[i].ts)
+            || !str2dbl(cmd[3 + i * 2], samples[i].val))
+        {
+            return out_err(out, ERR_BAD_ARG, "expect timestamp value pairs");
+        }
+        if (i > 0 && samples[i].ts <= samples[i - 1].ts) {
+            return out_err(out, ERR_BAD_ARG, "timestamps must increase");
+        }
+    }
+    Entry *ent = expect_ts_entry(cmd[1], out);
+    if (!ent) {
+        return;
+    }
+    const std::deque<TsChunk> &chunks = ent->ts->chunks;
+    if (!chunks.empty() && samples[0].ts <= chunks.back().last_ts) {
+        return out_err(out, ERR_BAD_ARG, "timestamps must increase");
+    }
+    for (const TsSample &s : samples) {
+        ts_add(ent->ts, s.ts, s.val);
+    }
+    return out_int(out, (int64_t)samples.size());
+}
+
+static bool str2agg(const std::string &s, uint32_t &agg) {
+    static const char *names[] = {"min", "max", "avg", "sum", "count"};
+    for (uint32_t i = 0; i < 5; i++) {
+        if (s == names[i]) {
+            agg = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// tsrange key from to [min|max|avg|sum|count bucket]
+// Flat (timestamp, value) pairs in [from, to]; with an aggregate, one
+// pair per non-empty bucket, stamped with the start of the bucket.
+static void do_tsrange(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t from = 0, to = 0, bucket = 0;
+    uint32_t agg = 0;
+    if (!str2int(cmd[2], from) || !str2int(cmd[3], to)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    if (cmd.size() != 4 && (cmd.size() != 6 || !str2agg(cmd[4], agg)
+        || !str2int(cmd[5], bucket) || bucket <= 0))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect: min|max|avg|sum|count bucket");
+    }
+    TimeSeries *series = expect_ts(cmd[1]);
+    if (!series) {
+        return out_err(out, ERR_BAD_TYP, "expect time series");
+    }
+    std::vector<TsSample> samples;
+    if (bucket) {
+        ts_aggregate(series, from, to, bucket, agg, samples);
+    } else {
+        ts_range(series, from, to, samples);
+    }
+    out_arr(out, (uint32_t)(samples.size() * 2));
+    for (const TsSample &s : samples) {
+        out_int(out, s.ts);
+        out_dbl(out, s.val);
+    }
+}
+
+// tsretention key retention; 0 keeps everything
+static void do_tsretention(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t retention = 0;
+    if (!str2int(cmd[2], retention) || retention < 0) {
+        return out_err(out, ERR_BAD_ARG, "expect non-negative int");
+    }
+    Entry *ent = expect_ts_entry(cmd[1], out);
+    if (!ent) {
+        return;
+    }
+    ts_set_retention(ent->ts, retention);
+    return out_nil(out);
+}
+
+static void out_stat(Buffer &out, const char *name, int64_t val);
+
+// tsinfo key; name/value pairs, nil if missing
+static void do_tsinfo(std::vector<std::string> &cmd, Buffer &out) {
+    TimeSeries *series = expect_ts(cmd[1]);
+    if (!series) {
+        return out_err(out, ERR_BAD_TYP, "expect time series");
+    }
+    if (series == &k_empty_ts) {
+        return out_nil(out);
+    }
+    bool empty = series->chunks.empty();
+    out_arr(out, 12);
+    out_stat(out, "samples", (int64_t)series->count);
+    out_stat(out, "chunks", (int64_t)series->chunks.size());
+    out_stat(out, "bytes", (int64_t)ts_bytes(series));
+    out_stat(out, "first_ts", empty ? 0 : series->chunks.front().first_ts);
+    out_stat(out, "last_ts", empty ? 0 : series->chunks.back().last_ts);
+    out_stat(out, "retention", series->retention);
+}
+
+// Bloom filters. BFADD creates the key with an error rate of 1% and room
+// for 100 elements before the first expansion; BFRESERVE picks them.
+
+static const Bloom k_empty_bloom;
+
+// the filter of the key, an empty one if missing, or NULL for other types
+static Bloom *expect_bloom(std::string &s) {
+    LookupKey key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key.node);
+    if (!hnode) {
+        return (Bloom *)&k_empty_bloom;
+    }
+    Entry *ent = container_of(hnode, Entry, node);
+    return ent->type == T_BLOOM ? ent->bloom : NULL;
+}
+
+// returns the filter entry of the key, creating it if missing
+static Entry *expect_bloom_entry(std::string &s, Buffer &out) {
+    LookupKey key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key.node);
+    if (!node) {
+        Entry *ent = entry_new(T_BLOOM);
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        db_insert(ent);
+        return ent;
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type != T_BLOOM) {
+        out_err(out, ERR_BAD_TYP, "expect bloom filter");
+        return NULL;
+    }
+    return ent;
+}
+
+// bfreserve key error capacity [expansion]; fails if the key exists
+static void do_bfreserve(std::vector<std::string> &cmd, Buffer &out) {
+    double error = 0;
+    int64_t capacity = 0, expansion = 2;
+    if (cmd.size() > 5) {
+        return out_err(out, ERR_BAD_ARG, "too many arguments");
+    }
+    if (!str2dbl(cmd[2], error) || !(error > 0 && error < 1)) {
+        return out_err(out, ERR_BAD_ARG, "expect error rate in (0, 1)");
+    }
+    if (!str2int(cmd[3], capacity) || capacity <= 0
+        || (cmd.size() == 5 && (!str2int(cmd[4], expansion)
+            || expansion <= 0 || expansion > 1024)))
+    {
+        return out_err(out, ERR_BAD_ARG, "expect positive int");
+    }
+    if (!bloom_fits(error, (uint64_t)capacity)) {
+        return out_err(out, ERR_BAD_ARG, "capacity too large");
+    }
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    if (db_lookup(&key.node)) {
+        return out_err(out, ERR_BAD_ARG, "key exists");
+    }
+    Entry *ent = entry_new(T_BLOOM);
+    bloom_init(ent->bloom, error, (uint64_t)capacity, (uint32_t)expansion);
+    ent->key.swap(key.key);
+    ent->node.hcode = key.node.hcode;
+    db_insert(ent);
+    return out_nil(out);
+}
+
+static void bfadd_out(Buffer &out, int added) {
+    if (added < 0) {
+        return out_err(out, ERR_SYSTEM, "cannot grow the bloom filter");
+    }
+    out_int(out, added);
+}
+
+// bfadd key element; 1 if added, 0 if it may have been added already
+static void do_bfadd(std::vector<std::string> &cmd, Buffer &out) {
+    Entry *ent = expect_bloom_entry(cmd[1], out);
+    if (!ent) {
+        return;
+    }
+    bfadd_out(out, bloom_add(ent->bloom, cmd[2].data(), cmd[2].size()));
+}
+
+// bfmadd key element [element ...]
+static void do_bfmadd(std::vector<std::string> &cmd, Buffer &out) {
+    Entry *ent = expect_bloom_entry(cmd[1], out);
+    if (!ent) {
+        return;
+    }
+    out_arr(out, (uint32_t)(cmd.size() - 2));
+    for (size_t i = 2; i < cmd.size(); i++) {
+        bfadd_out(out, bloom_add(ent->bloom, cmd[i].data(), cmd[i].size()));
+    }
+}
+
+// bfexists key element; 0 means definitely not added
+static void do_bfexists(std::vector<std::string> &cmd, Buffer &out) {
+    Bloom *bf = expect_bloom(cmd[1]);
+    if (!bf) {
+        return out_err(out, ERR_BAD_TYP, "expect bloom filter");
+    }
+    return out_int(out, bloom_exists(bf, cmd[2].data(), cmd[2].size()));
+}
+
+// bfmexists key element [element ...]
+static void do_bfmexists(std::vector<std::string> &cmd, Buffer &out) {
+    Bloom *bf = expect_bloom(cmd[1]);
+    if (!bf) {
+        return out_err(out, ERR_BAD_TYP, "expect bloom filter");
+    }
+    size_t n = cmd.size() - 2;
+    std::vector<uint8_t> found(n);
+    bloom_mexists(bf, cmd.data() + 2, n, found.data());
+    out_arr(out, (uint32_t)n);
+    for (uint8_t f : found) {
+        out_int(out, f);
+    }
+}
+
+// zadd zset score name [score name ...]
+static void do_zadd(std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() % 2 != 0) {
+        return out_err(out, ERR_BAD_ARG, "expect score name pairs");
+    }
+    size_t npairs = (cmd.size() - 2) / 2;
+    std::vector<double> scores(npairs);
+    for (size_t i = 0; i < npairs; i++) {
+        if (!str2dbl(cmd[2 + i * 2], scores[i])) {
+            return out_err(out, ERR_BAD_ARG, "expect float");
+        }
+    }
+
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key.node);
+
+    Entry *ent = NULL;
+    if (!hnode) {
+        ent = entry_new(T_ZSET);
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        db_insert(ent);
+    } else {    
+        ent = container_of(hnode, Entry, node);
+        if (ent->type != T_ZSET) {
+            return out_err(out, ERR_BAD_TYP, "expect zset");
+        }
+    }
+
+    std::vector<uint64_t> hcodes(npairs);
+    for (size_t i = 0; i < npairs; i++) {
+        const std::string &name = cmd[3 + i * 2];
+        hcodes[i] = str_hash((uint8_t *)name.data(), name.size());
+    }
+
+    int64_t added = 0;
+    for (size_t i = 0; i < npairs; i += k_prefetch_group) {
+        size_t end = std::min(npairs, i + k_prefetch_group);
+        for (size_t j = i; j < end; j++) {
+            hm_prefetch_slot(&ent->zset.hmap, hcodes[j]);
+        }
+        for (size_t j = i; j < end; j++) {
+            hm_prefetch_node(&ent->zset.hmap, hcodes[j]);
+        }
+        for (size_t j = i; j < end; j++) {
+            const std::string &name = cmd[3 + j * 2];
+            added += zset_insert(&ent->zset, name.data(), name.size(), scores[j]);
+        }
+    }
+    return out_int(out, added);
+}
+
+// zload key score name [score name ...]
+//
+// Bulk loading: the members must be in (score, name) order and come after
+// the members already in the set, so that they can be built into a tree in
+// linear time and appended. Large sets are loaded with several calls.
+static void do_zload(std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() % 2 != 0) {
+        return out_err(out, ERR_BAD_ARG, "expect score name pairs");
+    }
+    std::vector<ZMember> members((cmd.size() - 2) / 2);
+    for (size_t i = 0; i < members.size(); i++) {
+        if (!str2dbl(cmd[2 + i * 2], members[i].score)) {
+            return out_err(out, ERR_BAD_ARG, "expect float");
+        }
+        members[i].name = cmd[3 + i * 2].data();
+        members[i].len = cmd[3 + i * 2].size();
+    }
+
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key.node);
+    Entry *ent = hnode ? container_of(hnode, Entry, node) : NULL;
+    if (ent && ent->type != T_ZSET) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    ZSet loaded;
+    if (!zset_load(ent ? &ent->zset : &loaded, members.data(), members.size())) {
+        zset_clear(&loaded);
+        return out_err(out, ERR_BAD_ARG, "members not sorted or not unique");
+    }
+    if (!ent && !members.empty()) {
+        ent = entry_new(T_ZSET);
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        ent->zset = loaded;
+        db_insert(ent);
+    }
+    return out_int(out, (int64_t)members.size());
+}
+
+static const ZSet k_empty_zset;
+
+static ZSet *expect_zset(std::string &s) {
+    LookupKey key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = db_lookup(&key.node);
+    if (!hnode) {
+        return (ZSet *)&k_empty_zset;
+    }
+    Entry *ent = container_of(hnode, Entry, node);
+    return ent->type == T_ZSET ? &ent->zset : NULL;
+}
+
+static void do_zrem(std::vector<std::string> &cmd, Buffer &out) {
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    const std::string &name = cmd[2];
+    ZNode *znode = zset_lookup(zset, name.data(), name.size());
+    if (znode) {
+        zset_delete(zset, znode);
+    }
+    return out_int(out, znode ? 1 : 0);
+}
+
+static void do_zscore(std::vector<std::string> &cmd, Buffer &out) {
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    const std::string &name = cmd[2];
+    ZNode *znode = zset_lookup(zset, name.data(), name.size());
+    return znode ? out_dbl(out, znode->score) : out_nil(out);
+}
+
+static Task do_zquery(Conn *conn, std::vector<std::string> cmd, Buffer &out) {
+    double score = 0;
+    if (!str2dbl(cmd[2], score)) {
+        co_return out_err(out, ERR_BAD_ARG, "expect fp number");
+    }
+    const std::string &name = cmd[3];
+    int64_t offset = 0, limit = 0;
+    if (!str2int(cmd[4], offset) || !str2int(cmd[5], limit)) {
+        co_return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) {
+        co_return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+
+    if (limit <= 0) {
+        co_return out_arr(out, 0);
+    }
+    ZNode *znode = zset_seekge(zset, score, name.data(), name.size());
+    znode = znode_offset(znode, offset);
+
+    size_t ctx = out_begin_arr(out);
+    int64_t left = limit / 2 + limit % 2;   // a name and a score each
+    int64_t n = left;
+    znode = zquery_fill(out, znode, &left, output_high());
+    if (znode) {
+        conn->task->ent = container_of(zset, Entry, zset);
+        ZNode *next = znode;
+        size_t bytes = 0;
+        int64_t rest = 0;
+        for (; znode && rest < left && bytes <= k_max_msg; znode = znode_offset(znode, +1)) {
+            bytes += member_reply_size(znode);
+            rest++;
+            co_await task_yield();
+        }
+        Stream *stream = new Stream();
+        stream->ent = conn->task->ent;
+        stream->score = next->score;
+        stream->name.assign(next->name, next->len);
+        stream->bytes = bytes;
+        stream->left = rest;
+        left -= rest;
+        stream_start(conn, stream);
+    }
+    out_end_arr(out, ctx, (uint32_t)(2 * (n - left)));
+}
+
+// a score bound, exclusive if prefixed with "(", such as "(1.5" or "-inf"
+static bool parse_score_bound(const std::string &s, double &score, bool &excl) {
+    excl = !s.empty() && s[0] == '(';
+    return str2dbl(excl ? s.substr(1) : s, score);
+}
+
+// the ranks [start, stop) of the members within the score bounds
+static bool score_range(
+    ZSet *zset, std::vector<std::string> &cmd, uint64_t &start, uint64_t &stop)
+{
+    double min = 0, max = 0;
+    bool min_excl = false, max_excl = false;
+    if (!parse_score_bound(cmd[2], min, min_excl)
+        || !parse_score_bound(cmd[3], max, max_excl))
+    {
+        return false;
+    }
+    start = zset_count_below(zset, min, min_excl);
+    stop = zset_count_below(zset, max, !max_excl);
+    stop = std::max(start, stop);
+    return true;
+}
+
+static void do_zcount(std::vector<std::string> &cmd, Buffer &out) {
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    uint64_t start = 0, stop = 0;
+    if (!score_range(zset, cmd, start, stop)) {
+        return out_err(out, ERR_BAD_ARG, "expect fp number");
+    }
+    return out_int(out, (int64_t)(stop - start));
+}
+
+// zrangebyscore key min max [rev] [limit offset count]
+static void do_zrangebyscore(std::vector<std::string> &cmd, Buffer &out) {
+    bool rev = false;
+    int64_t offset = 0, count = -1;
+    for (size_t i = 4; i < cmd.size(); i++) {
+        if (cmd[i] == "rev") {
+            rev = true;
+        } else if (cmd[i] == "limit" && i + 2 < cmd.size()) {
+            if (!str2int(cmd[i + 1], offset) || !str2int(cmd[i + 2], count)) {
+                return out_err(out, ERR_BAD_ARG, "expect int");
+            }
+            i += 2;
+        } else {
+            return out_err(out, ERR_BAD_ARG, "syntax error");
+        }
+    }
+
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    uint64_t start = 0, stop = 0;
+    if (!score_range(zset, cmd, start, stop)) {
+        return out_err(out, ERR_BAD_ARG, "expect fp number");
+    }
+
+    uint64_t n = stop - start;
+    if (offset < 0 || (uint64_t)offset >= n) {
+        return out_arr(out, 0);
+    }
+    n -= (uint64_t)offset;
+    if (count >= 0) {
+        n = std::min(n, (uint64_t)count);
+    }
+    ZNode *znode = rev ? zset_at(zset, stop - 1 - (uint64_t)offset)
+                       : zset_at(zset, start + (uint64_t)offset);
+    out_arr(out, (uint32_t)(n * 2));
+    for (uint64_t i = 0; i < n; i++) {
+        out_str(out, znode->name, znode->len);
+        out_dbl(out, znode->score);
+        znode = znode_offset(znode, rev ? -1 : +1);
+    }
+}
+
+static void zset_dispose_func(void *arg) {
+    zset_dispose((AVLNode *)arg);
+}
+
+static void zset_tree_free(void *arg) {
+    AVLNode *tree = (AVLNode *)arg;
+    if (avl_cnt(tree) > k_large_container_size) {
+        thread_pool_queue(&g_data.thread_pool, &zset_dispose_func, tree);
+    } else {
+        zset_dispose(tree);
+    }
+}
+
+// Removes the ranks [start, stop) by splitting them off the tree as a
+// whole, which keeps trimming a large set proportional to the hash table
+// work instead of one rebalance per member.
+static int64_t zset_remove_range(ZSet *zset, uint64_t start, uint64_t stop) {
+    AVLNode *tree = zset_detach_range(zset, start, stop);
+    uint64_t removed = avl_cnt(tree);
+    if (tree) {
+        ebr_retire(&g_data.ebr, &zset_tree_free, tree);
+    }
+    return (int64_t)removed;
+}
+
+static void do_zremrangebyscore(std::vector<std::string> &cmd, Buffer &out) {
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    uint64_t start = 0, stop = 0;
+    if (!score_range(zset, cmd, start, stop)) {
+        return out_err(out, ERR_BAD_ARG, "expect fp number");
+    }
+    return out_int(out, zset_remove_range(zset, start, stop));
+}
+
+// zremrangebyrank key start stop, inclusive, negative ranks count from the end
+static void do_zremrangebyrank(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    ZSet *zset = expect_zset(cmd[1]);
+    if (!zset) {
+        return out_err(out, ERR_BAD_TYP, "expect zset");
+    }
+    int64_t size = (int64_t)zset_size(zset);
+    if (start < 0) {
+        start = std::max<int64_t>(start + size, 0);
+    }
+    if (stop < 0) {
+        stop += size;
+    }
+    stop = std::min(stop, size - 1);
+    if (start > stop) {
+        return out_int(out, 0);
+    }
+    return out_int(out, zset_remove_range(zset, (uint64_t)start, (uint64_t)stop + 1));
+}
+
+enum {
+    AGG_SUM = 0,
+    AGG_MIN = 1,
+    AGG_MAX = 2,
+};
+
+// inputs smaller than this in total are combined without the thread pool
+const size_t k_zsetop_parallel_min = 10000;
+
+// A ZUNIONSTORE or ZINTERSTORE. The work is split into tasks by bucket
+// slices of the input hash tables, which run on the thread pool and only
+// read the inputs, through hm_foreach_part() and zset_find(). Each task
+// produces its own sorted run of the result.
+struct ZSetOp {
+    bool inter = false;
+    std::vector<ZSet *> inputs;
+    std::vector<double> weights;
+    uint32_t agg = AGG_SUM;
+    size_t nslices = 1;     // per input
+    std::vector<std::vector<ZMember>> runs;
+};
+
+static double zsetop_agg(uint32_t agg, double acc, double score) {
+    switch (agg) {
+    case AGG_MIN: return std::min(acc, score);
+    case AGG_MAX: return std::max(acc, score);
+    default:
+        acc += score;
+        return isnan(acc) ? 0 : acc;    // inf + -inf
+    }
+}
+
+struct ZSetOpTask {
+    ZSetOp *op = NULL;
+    size_t input = 0;       // the input being iterated
+    std::vector<ZMember> *out = NULL;
+};
+
+// Aggregates a member of the iterated input with its copies in the other
+// inputs. A union member is only emitted by the first input holding it.
+static bool cb_zsetop(HNode *node, void *arg) {
+    ZSetOpTask *task = (ZSetOpTask *)arg;
+    ZSetOp *op = task->op;
+    const ZNode *znode = container_of(node, ZNode, hmap);
+    bool seen = false;
+    double acc = 0;
+    for (size_t i = 0; i < op->inputs.size(); i++) {
+        const ZNode *found = znode;
+        if (i != task->input) {
+            found = zset_find(op->inputs[i], znode);
+            if (!found && op->inter) {
+                return true;
+            } else if (!found) {
+                continue;
+            } else if (i < task->input && !op->inter) {
+                return true;
+            }
+        }
+        double score = op->weights[i] * found->score;
+        score = isnan(score) ? 0 : score;   // 0 * inf
+        acc = seen ? zsetop_agg(op->agg, acc, score) : score;
+        seen = true;
+    }
+    ZMember m;
+    m.name = znode->name;
+    m.len = znode->len;
+    m.score = acc;
+    task->out->push_back(m);
+    return true;
+}
+
+// An intersection only iterates the smallest input, probing the others.
+static void zsetop_task(void *arg, size_t idx) {
+    ZSetOp *op = (ZSetOp *)arg;
+    ZSetOpTask task;
+    task.op = op;
+    task.input = idx / op->nslices;
+    if (op->inter) {
+        for (size_t i = 1; i < op->inputs.size(); i++) {
+            if (zset_size(op->inputs[i]) < zset_size(op->inputs[task.input])) {
+                task.input = i;
+            }
+        }
+    }
+    task.out = &op->runs[idx];
+    hm_foreach_part(&op->inputs[task.input]->hmap, idx % op->nslices, op->nslices,
+        &cb_zsetop, &task);
+    std::sort(task.out->begin(), task.out->end(), &zmember_less);
+}
+
+// merges the sorted runs pairwise, in log2(runs) linear passes
+static std::vector<ZMember> zsetop_merge(ZSetOp *op) {
+    std::vector<ZMember> all;
+    std::vector<size_t> bounds = {0};
+    for (std::vector<ZMember> &run : op->runs) {
+        all.insert(all.end(), run.begin(), run.end());
+        bounds.push_back(all.size());
+    }
+    while (bounds.size() > 2) {
+        std::vector<size_t> merged = {0};
+        for (size_t i = 0; i + 1 < bounds.size(); i += 2) {
+            size_t end = i + 2 < bounds.size() ? bounds[i + 2] : bounds[i + 1];
+            std::inplace_merge(all.begin() + bounds[i], all.begin() + bounds[i + 1],
+                all.begin() + end, &zmember_less);
+            merged.push_back(end);
+        }
+        bounds.swap(merged);
+    }
+    return all;
+}
+
+// zunionstore|zinterstore dest numkeys key [key ...]
+//     [weights weight [weight ...]] [aggregate sum|min|max]
+static void do_zsetop(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t nkeys = 0;
+    if (!str2int(cmd[2], nkeys) || nkeys < 1 || (size_t)nkeys > cmd.size() - 3) {
+        return out_err(out, ERR_BAD_ARG, "bad numkeys");
+    }
+    ZSetOp op;
+    op.inter = cmd[0] == "zinterstore";
+    op.weights.assign((size_t)nkeys, 1);
+    for (size_t i = 3 + (size_t)nkeys; i < cmd.size(); i++) {
+        if (cmd[i] == "weights" && i + (size_t)nkeys < cmd.size()) {
+            for (size_t k = 0; k < (size_t)nkeys; k++) {
+                if (!str2dbl(cmd[++i], op.weights[k])) {
+                    return out_err(out, ERR_BAD_ARG, "expect fp number");
+                }
+            }
+        } else if (cmd[i] == "aggregate" && i + 1 < cmd.size()) {
+            const std::string &agg = cmd[++i];
+            if (agg == "sum") {
+                op.agg = AGG_SUM;
+            } else if (agg == "min") {
+                op.agg = AGG_MIN;
+            } else if (agg == "max") {
+                op.agg = AGG_MAX;
+            } else {
+                return out_err(out, ERR_BAD_ARG, "syntax error");
+            }
+        } else {
+            return out_err(out, ERR_BAD_ARG, "syntax error");
+        }
+    }
+
+    size_t total = 0;
+    for (size_t k = 0; k < (size_t)nkeys; k++) {
+        ZSet *zset = expect_zset(cmd[3 + k]);
+        if (!zset) {
+            return out_err(out, ERR_BAD_TYP, "expect zset");
+        }
+        op.inputs.push_back(zset);
+        total += zset_size(zset);
+    }
+
+    if (total >= k_zsetop_parallel_min) {
+        op.nslices = 2 * (g_data.thread_pool.threads.size() + 1);
+    }
+    size_t ntasks = op.inter ? op.nslices : op.inputs.size() * op.nslices;
+    op.runs.resize(ntasks);
+    thread_pool_run(&g_data.thread_pool, ntasks, &zsetop_task, &op);
+    std::vector<ZMember> members = zsetop_merge(&op);
+
+    // the destination may be one of the inputs, so it is built before
+    // the old value is dropped
+    ZSet result;
+    zset_build(&result, members.data(), members.size());
+
+    LookupKey key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    if (HNode *node = db_delete(&key.node, &entry_eq)) {
+        entry_del(container_of(node, Entry, node));
+    }
+    if (!members.empty()) {
+        Entry *ent = entry_new(T_ZSET);
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        ent->zset = result;
+        db_insert(ent);
+    }
+    return out_int(out, (int64_t)members.size());
+}
+
+const size_t k_slowlog_max_args = 32;
+const size_t k_slowlog_max_arg_len = 128;
+
+// The arguments are only copied once a request is known to be slow, from
+// the raw request that is still in Conn::incoming, because handlers are
+// free to move the strings out of the parsed command.
+static void slowlog_add(
+    Conn *conn, const uint8_t *req, size_t len,
+    uint64_t duration_ns, size_t resp_size)
+{
+    SlowLogEntry ent;
+    ent.id = g_data.slowlog_next_id++;
+    ent.time_ms = get_realtime_msec();
+    ent.duration_ns = duration_ns;
+    ent.resp_size = resp_size;
+    ent.fd = conn->fd;
+
+    const uint8_t *end = req + len;
+    uint32_t nstr = 0;
+    read_u32(req, end, nstr);
+    ent.nargs = nstr;
+    for (uint32_t i = 0; i < nstr && i < k_slowlog_max_args; i++) {
+        uint32_t n = 0;
+        read_u32(req, end, n);
+        size_t keep = std::min((size_t)n, k_slowlog_max_arg_len);
+        ent.args.push_back(std::string((const char *)req, keep));
+        if (keep < n) {
+            ent.args.back() += "...";
+        }
+        req += n;
+    }
+
+    g_data.slowlog.push_front(std::move(ent));
+    while (g_data.slowlog.size() > g_opt.slowlog_max_len) {
+        g_data.slowlog.pop_back();
+    }
+}
+
+// slowlog get [count] | slowlog len | slowlog reset
+static void do_slowlog(std::vector<std::string> &cmd, Buffer &out) {
+    const std::string &sub = cmd[1];
+    if (sub == "len" && cmd.size() == 2) {
+        return out_int(out, (int64_t)g_data.slowlog.size());
+    } else if (sub == "reset" && cmd.size() == 2) {
+        g_data.slowlog.clear();
+        return out_nil(out);
+    } else if (sub != "get" || cmd.size() > 3) {
+        return out_err(out, ERR_BAD_ARG, "expect: slowlog get [count] | len | reset");
+    }
+
+    int64_t count = 10;
+    if (cmd.size() == 3 && (!str2int(cmd[2], count) || count < 0)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    size_t n = std::min((size_t)count, g_data.slowlog.size());
+    out_arr(out, (uint32_t)n);
+    for (size_t i = 0; i < n; i++) {
+        const SlowLogEntry &ent = g_data.slowlog[i];
+        // id, unix time (ms), duration (us), client fd, response bytes,
+        // total number of arguments, then the (truncated) arguments
+        out_arr(out, 7);
+        out_int(out, (int64_t)ent.id);
+        out_int(out, (int64_t)ent.time_ms);
+        out_int(out, (int64_t)(ent.duration_ns / 1000));
+        out_int(out, ent.fd);
+        out_int(out, (int64_t)ent.resp_size);
+        out_int(out, (int64_t)ent.nargs);
+        out_arr(out, (uint32_t)ent.args.size());
+        for (const std::string &arg : ent.args) {
+            out_str(out, arg.data(), arg.size());
+        }
+    }
+}
+
+// capture start | stop, to the file given by --capture; start truncates it
+static void do_capture(std::vector<std::string> &cmd, Buffer &out) {
+    const std::string &sub = cmd[1];
+    if (sub == "stop" && cmd.size() == 2) {
+        capture_stop();
+        return out_int(out, (int64_t)g_capture.requests);
+    } else if (sub != "start" || cmd.size() > 2) {
+        return out_err(out, ERR_BAD_ARG, "expect: capture start | stop");
+    }
+    if (g_opt.capture_path.empty()) {
+        return out_err(out, ERR_BAD_ARG, "no --capture file");
+    }
+    capture_stop();
+    if (!capture_start()) {
+        return out_err(out, ERR_SYSTEM, "cannot open the capture file");
+    }
+    out_nil(out);
+}
+
+static bool hnode_same(HNode *node, HNode *key) {
+    return node == key;
+}
+
+// Pub/sub. A published message is serialized once into a complete push
+// frame (length prefix included) held in an RcBuf, and queued by reference
+// on every subscriber. Pushes are arrays of ["message", channel, payload]
+// or ["pmessage", pattern, channel, payload].
+
+// a channel, or a pattern
+struct PubSubTarget {
+    HNode node;         // in g_data.channels or g_data.patterns
+    std::string name;
+    bool is_pattern = false;
+    DList subs;         // Subscription::target_node
+    size_t nsubs = 0;
+    // patterns only
+    struct PatGroup *group = NULL;
+    DList group_node;
+};
+
+// Patterns grouped by their literal prefix (up to the first wildcard). A
+// channel can only match the patterns in the groups keyed by one of its
+// own prefixes, so PUBLISH looks up one group per prefix length in use
+// instead of trying every pattern.
+struct PatGroup {
+    HNode node;         // in g_data.pat_groups
+    std::string prefix;
+    DList pats;         // PubSubTarget::group_node
+};
+
+struct Subscription {
+    HNode node;         // in g_data.subscriptions
+    Conn *conn = NULL;
+    PubSubTarget *target = NULL;
+    DList conn_node;
+    DList target_node;
+};
+
+static bool target_eq(HNode *node, HNode *key) {
+    PubSubTarget *t = container_of(node, PubSubTarget, node);
+    LookupKey *keydata = container_of(key, LookupKey, node);
+    return t->name == keydata->key;
+}
+
+static bool pat_group_eq(HNode *node, HNode *key) {
+    PatGroup *g = container_of(node, PatGroup, node);
+    LookupKey *keydata = container_of(key, LookupKey, node);
+    return g->prefix == keydata->key;
+}
+
+static bool sub_eq(HNode *node, HNode *key) {
+    Subscription *lhs = container_of(node, Subscription, node);
+    Subscription *rhs = container_of(key, Subscription, node);
+    return lhs->conn == rhs->conn && lhs->target == rhs->target;
+}
+
+static uint64_t sub_hash(Conn *conn, PubSubTarget *target) {
+    uintptr_t ptrs[2] = {(uintptr_t)conn, (uintptr_t)target};
+    return str_hash((uint8_t *)ptrs, sizeof(ptrs));
+}
+
+static PubSubTarget *target_lookup(HMap *map, const std::string &name) {
+    LookupKey key;
+    key.key = name;
+    key.node.hcode = str_hash((uint8_t *)name.data(), name.size());
+    HNode *node = hm_lookup(map, &key.node, &target_eq);
+    return node ? container_of(node, PubSubTarget, node) : NULL;
+}
+
+static PatGroup *pat_group_lookup(const char *prefix, size_t len) {
+    LookupKey key;
+    key.key.assign(prefix, len);
+    key.node.hcode = str_hash((uint8_t *)prefix, len);
+    HNode *node = hm_lookup(&g_data.pat_groups, &key.node, &pat_group_eq);
+    return node ? container_of(node, PatGroup, node) : NULL;
+}
+
+static size_t glob_prefix_len(const std::string &pat) {
+    size_t n = pat.find_first_of("*?[\\");
+    return n == std::string::npos ? pat.size() : n;
+}
+
+// matches the pattern element at p[i] (a char, ?, \x or a [...] class)
+// against c and moves i past it
+static bool glob_one(const std::string &p, size_t &i, char c) {
+    if (p[i] == '?') {
+        i++;
+        return true;
+    }
+    if (p[i] == '\\' && i + 1 < p.size()) {
+        i += 2;
+        return p[i - 1] == c;
+    }
+    if (p[i] != '[') {
+        return p[i++] == c;
+    }
+    size_t j = i + 1;
+    bool neg = j < p.size() && p[j] == '^';
+    j += neg;
+    bool hit = false;
+    while (j < p.size() && p[j] != ']') {
+        if (p[j] == '\\' && j + 1 < p.size()) {
+            hit |= p[j + 1] == c;
+            j += 2;
+        } else if (j + 2 < p.size() && p[j + 1] == '-' && p[j + 2] != ']') {
+            char lo = std::min(p[j], p[j + 2]);
+            char hi = std::max(p[j], p[j + 2]);
+            hit |= lo <= c && c <= hi;
+            j += 3;
+        } else {
+            hit |= p[j] == c;
+            j++;
+        }
+    }
+    i = j < p.size() ? j + 1 : j;
+    return hit != neg;
+}
+
+// glob-style matching: *, ?, [abc], [a-z], [^a] and \x
+static bool glob_match(const std::string &p, const std::string &s) {
+    size_t pi = 0;
+    size_t si = 0;
+    size_t star = std::string::npos;    // pattern position after the last *
+    size_t mark = 0;                    // where that * started matching
+    while (si < s.size()) {
+        if (pi < p.size() && p[pi] == '*') {
+            star = ++pi;
+            mark = si;
+            continue;
+        }
+        size_t next = pi;
+        if (pi < p.size() && glob_one(p, next, s[si])) {
+            pi = next;
+            si++;
+        } else if (star != std::string::npos) {
+            pi = star;      // let the last * eat one more char
+            si = ++mark;
+        } else {
+            return false;
+        }
+    }
+    while (pi < p.size() && p[pi] == '*') {
+        pi++;
+    }
+    return pi == p.size();
+}
+
+static void pat_group_add(PubSubTarget *pat) {
+    size_t len = glob_prefix_len(pat->name);
+    PatGroup *group = pat_group_lookup(pat->name.data(), len);
+    if (!group) {
+        group = new PatGroup();
+        group->prefix = pat->name.substr(0, len);
+        group->node.hcode = str_hash((uint8_t *)pat->name.data(), len);
+        dlist_init(&group->pats);
+        hm_insert(&g_data.pat_groups, &group->node);
+        if (g_data.pat_group_lens.size() <= len) {
+            g_data.pat_group_lens.resize(len + 1);
+        }
+        g_data.pat_group_lens[len]++;
+    }
+    dlist_insert_before(&group->pats, &pat->group_node);
+    pat->group = group;
+}
+
+static void pat_group_del(PubSubTarget *pat) {
+    PatGroup *group = pat->group;
+    dlist_detach(&pat->group_node);
+    if (!dlist_empty(&group->pats)) {
+        return;
+    }
+    hm_delete(&g_data.pat_groups, &group->node, &hnode_same);
+    std::vector<size_t> &lens = g_data.pat_group_lens;
+    lens[group->prefix.size()]--;
+    while (!lens.empty() && lens.back() == 0) {
+        lens.pop_back();
+    }
+    delete group;
+}
+
+static void pubsub_subscribe(Conn *conn, const std::string &name, bool is_pattern) {
+    HMap *map = is_pattern ? &g_data.patterns : &g_data.channels;
+    PubSubTarget *target = target_lookup(map, name);
+    if (!target) {
+        target = new PubSubTarget();
+        target->name = name;
+        target->is_pattern = is_pattern;
+        target->node.hcode = str_hash((uint8_t *)name.data(), name.size());
+        dlist_init(&target->subs);
+        hm_insert(map, &target->node);
+        if (is_pattern) {
+            pat_group_add(target);
+        }
+    }
+
+    Subscription key;
+    key.conn = conn;
+    key.target = target;
+    key.node.hcode = sub_hash(conn, target);
+    if (hm_lookup(&g_data.subscriptions, &key.node, &sub_eq)) {
+        return;
+    }
+    Subscription *sub = new Subscription();
+    sub->conn = conn;
+    sub->target = target;
+    sub->node.hcode = key.node.hcode;
+    hm_insert(&g_data.subscriptions, &sub->node);
+    dlist_insert_before(&conn->subs, &sub->conn_node);
+    dlist_insert_before(&target->subs, &sub->target_node);
+    target->nsubs++;
+    if (conn->nsubs++ == 0) {
+        // subscribers wait for pushes, they are not idle
+        dlist_detach(&conn->idle_node);
+        dlist_init(&conn->idle_node);
+    }
+}
+
+static void pubsub_unsubscribe(Subscription *sub) {
+    Conn *conn = sub->conn;
+    PubSubTarget *target = sub->target;
+    hm_delete(&g_data.subscriptions, &sub->node, &hnode_same);
+    dlist_detach(&sub->conn_node);
+    dlist_detach(&sub->target_node);
+    delete sub;
+
+    if (--conn->nsubs == 0) {
+        conn->last_active_ms = get_monotonic_msec();
+        dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+    }
+    if (--target->nsubs == 0) {
+        HMap *map = target->is_pattern ? &g_data.patterns : &g_data.channels;
+        hm_delete(map, &target->node, &hnode_same);
+        if (target->is_pattern) {
+            pat_group_del(target);
+        }
+        delete target;
+    }
+}
+
+static void pubsub_unsubscribe_all(Conn *conn, bool patterns) {
+    DList *node = conn->subs.next;
+    while (node != &conn->subs) {
+        Subscription *sub = container_of(node, Subscription, conn_node);
+        node = node->next;
+        if (sub->target->is_pattern == patterns) {
+            pubsub_unsubscribe(sub);
+        }
+    }
+}
+
+// queues a push frame; drops subscribers that cannot keep up
+static bool pubsub_push(Conn *conn, RcBuf *frame) {
+    if (conn->want_close) {
+        return false;
+    }
+    size_t limit = g_opt.pubsub_output_limit;
+    if (limit && buf_size(conn->outgoing) + frame->len > limit) {
+        fprintf(stderr, "subscriber %d is over the output limit\n", conn->fd);
+        conn->want_close = true;
+        g_data.stats.pubsub_dropped++;
+        return false;
+    }
+    buf_append_ref(conn->outgoing, frame);
+    conn->want_read = false;
+    conn->want_write = true;
+    return true;
+}
+
+static RcBuf *pubsub_frame(const std::string **parts, uint32_t n) {
+    Buffer out;
+    buf_append_u32(out, 0);
+    out_arr(out, n);
+    for (uint32_t i = 0; i < n; i++) {
+        out_str(out, parts[i]->data(), parts[i]->size());
+    }
+    uint32_t len = (uint32_t)(out.data.size() - 4);
+    memcpy(&out.data[0], &len, 4);
+    return rcbuf_new(out.data.data(), out.data.size());
+}
+
+static size_t pubsub_fanout(PubSubTarget *target, const std::string **parts, uint32_t n) {
+    RcBuf *frame = pubsub_frame(parts, n);
+    size_t receivers = 0;
+    for (DList *node = target->subs.next; node != &target->subs; node = node->next) {
+        Subscription *sub = container_of(node, Subscription, target_node);
+        receivers += pubsub_push(sub->conn, frame);
+    }
+    rcbuf_unref(frame);
+    return receivers;
+}
+
+// publish channel message
+static void do_publish(std::vector<std::string> &cmd, Buffer &out) {
+    static const std::string k_message = "message";
+    static const std::string k_pmessage = "pmessage";
+    const std::string &chan = cmd[1];
+    const std::string &payload = cmd[2];
+
+    size_t receivers = 0;
+    if (PubSubTarget *target = target_lookup(&g_data.channels, chan)) {
+        const std::string *parts[] = {&k_message, &chan, &payload};
+        receivers += pubsub_fanout(target, parts, 3);
+    }
+    const std::vector<size_t> &lens = g_data.pat_group_lens;
+    for (size_t len = 0; len < lens.size() && len <= chan.size(); len++) {
+        PatGroup *group = lens[len] ? pat_group_lookup(chan.data(), len) : NULL;
+        if (!group) {
+            continue;
+        }
+        for (DList *node = group->pats.next; node != &group->pats; node = node->next) {
+            PubSubTarget *pat = container_of(node, PubSubTarget, group_node);
+            if (glob_match(pat->name, chan)) {
+                const std::string *parts[] = {&k_pmessage, &pat->name, &chan, &payload};
+                receivers += pubsub_fanout(pat, parts, 4);
+            }
+        }
+    }
+    g_data.stats.pubsub_messages++;
+    out_int(out, (int64_t)receivers);
+}
+
+// subscribe channel... | psubscribe pattern...
+// The reply is the number of channels and patterns the connection is now
+// subscribed to. Until that drops back to zero, only these four commands
+// are accepted, so that a reply can never be mistaken for a push.
+static void do_subscribe(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    bool is_pattern = cmd[0] == "psubscribe";
+    for (size_t i = 1; i < cmd.size(); i++) {
+        pubsub_subscribe(conn, cmd[i], is_pattern);
+    }
+    out_int(out, (int64_t)conn->nsubs);
+}
+
+// unsubscribe [channel...] | punsubscribe [pattern...]
+// without arguments, drops all the channels (or patterns)
+static void do_unsubscribe(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    bool is_pattern = cmd[0] == "punsubscribe";
+    if (cmd.size() == 1) {
+        pubsub_unsubscribe_all(conn, is_pattern);
+    }
+    HMap *map = is_pattern ? &g_data.patterns : &g_data.channels;
+    for (size_t i = 1; i < cmd.size(); i++) {
+        PubSubTarget *target = target_lookup(map, cmd[i]);
+        if (!target) {
+            continue;
+        }
+        Subscription key;
+        key.conn = conn;
+        key.target = target;
+        key.node.hcode = sub_hash(conn, target);
+        HNode *node = hm_lookup(&g_data.subscriptions, &key.node, &sub_eq);
+        if (node) {
+            pubsub_unsubscribe(container_of(node, Subscription, node));
+        }
+    }
+    out_int(out, (int64_t)conn->nsubs);
+}
+
+// Lists, stored as a QList of packed chunks, with the key deleted along
+// with its last element. BLPOP/BRPOP park the connection on their keys
+// instead of polling: a push hands its elements straight to the clients
+// blocked on the key, oldest first.
+
+// returns the list entry of the key, creating it if missing
+static Entry *expect_list_entry(std::string &s, Buffer &out) {
+    LookupKey key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key.node);
+    if (!node) {
+        Entry *ent = entry_new(T_LIST);
+        ent->key.swap(key.key);
+        ent->node.hcode = key.node.hcode;
+        db_insert(ent);
+        return ent;
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type != T_LIST) {
+        out_err(out, ERR_BAD_TYP, "expect list");
+        return NULL;
+    }
+    return ent;
+}
+
+// false for other types; *ent is NULL if the key is missing
+static bool expect_list(std::string &s, Entry **ent) {
+    LookupKey key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = db_lookup(&key.node);
+    *ent = node ? container_of(node, Entry, node) : NULL;
+    return !*ent || (*ent)->type == T_LIST;
+}
+
+static void list_del_if_empty(Entry *ent) {
+    if (ent->list->count == 0) {
+        db_delete(&ent->node, &hnode_same);
+        entry_del(ent);
+    }
+}
+
+// the keys that clients are blocked on
+struct BlockedKey {
+    HNode node;         // in g_data.blocked_keys
+    std::string key;
+    DList waiters;      // BlockWaiter::node, oldest first
+};
+
+static bool bkey_eq(HNode *node, HNode *key) {
+    BlockedKey *bkey = container_of(node, BlockedKey, node);
+    LookupKey *keydata = container_of(key, LookupKey, node);
+    return bkey->key == keydata->key;
+}
+
+static void response_begin(Buffer &out, size_t *header);
+static void response_end(Buffer &out, size_t header, size_t rest = 0);
+
+// the reply of a blocked request: [key, element], or nil on timeout
+static void block_reply(Conn *conn, const std::string *key, const std::string *val) {
+    Buffer &out = conn->outgoing;
+    size_t header = 0;
+    response_begin(out, &header);
+    if (key) {
+        out_arr(out, 2);
+        out_str(out, key->data(), key->size());
+        out_str(out, val->data(), val->size());
+    } else {
+        out_nil(out);
+    }
+    response_end(out, header);
+}
+
+// waits on the keys cmd[1 .. n-2], with a timeout unless 0
+static void conn_block(Conn *conn, std::vector<std::string> &cmd, bool front,
+    uint64_t timeout_ms)
+{
+    conn->waits.resize(cmd.size() - 2);
+    for (size_t i = 0; i < conn->waits.size(); i++) {
+        LookupKey key;
+        key.key.swap(cmd[i + 1]);
+        key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+        HNode *node = hm_lookup(&g_data.blocked_keys, &key.node, &bkey_eq);
+        BlockedKey *bkey = node ? container_of(node, BlockedKey, node) : NULL;
+        if (!bkey) {
+            bkey = new BlockedKey();
+            bkey->key.swap(key.key);
+            bkey->node.hcode = key.node.hcode;
+            dlist_init(&bkey->waiters);
+            hm_insert(&g_data.blocked_keys, &bkey->node);
+        }
+        BlockWaiter &w = conn->waits[i];
+        w.conn = conn;
+        w.bkey = bkey;
+        dlist_insert_before(&bkey->waiters, &w.node);
+    }
+    if (timeout_ms) {
+        HeapItem item = {get_monotonic_msec() + timeout_ms, &conn->block_heap_idx};
+        heap_upsert(g_data.block_heap, conn->block_heap_idx, item);
+    }
+    conn->blocked = true;
+    conn->block_front = front;
+    // like subscribers, blocked clients are not idle
+    dlist_detach(&conn->idle_node);
+    dlist_init(&conn->idle_node);
+}
+
+// ends the wait; with `resume`, the requests behind it run again
+static void conn_unblock(Conn *conn, bool resume) {
+    assert(conn->blocked);
+    for (BlockWaiter &w : conn->waits) {
+        dlist_detach(&w.node);
+        if (dlist_empty(&w.bkey->waiters)) {
+            hm_delete(&g_data.blocked_keys, &w.bkey->node, &hnode_same);
+            delete w.bkey;
+        }
+    }
+    conn->waits.clear();
+    if (conn->block_heap_idx != (size_t)-1) {
+        heap_delete(g_data.block_heap, conn->block_heap_idx);
+        conn->block_heap_idx = -1;
+    }
+    conn->blocked = false;
+    if (resume) {
+        conn->last_active_ms = get_monotonic_msec();
+        dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+        dlist_insert_before(&g_data.resume_list, &conn->resume_node);
+    }
+}
+
+// hands the elements of a list that just grew to the clients blocked on it
+static void list_serve_blocked(Entry *ent) {
+    if (hm_size(&g_data.blocked_keys) == 0) {
+        return;
+    }
+    LookupKey key;
+    key.key = ent->key;
+    key.node.hcode = ent->node.hcode;
+    std::string val;
+    while (ent->list->count > 0) {
+        HNode *node = hm_lookup(&g_data.blocked_keys, &key.node, &bkey_eq);
+        if (!node) {
+            break;
+        }
+        BlockedKey *bkey = container_of(node, BlockedKey, node);
+        Conn *conn = container_of(bkey->waiters.next, BlockWaiter, node)->conn;
+        qlist_pop(ent->list, conn->block_front, val);
+        block_reply(conn, &ent->key, &val);
+        conn_unblock(conn, true);
+    }
+    list_del_if_empty(ent);
+}
+
+// lpush key value [value ...] | rpush ...; the length after the push
+static void do_push(std::vector<std::string> &cmd, Buffer &out) {
+    Entry *ent = expect_list_entry(cmd[1], out);
+    if (!ent) {
+        return;
+    }
+    bool front = cmd[0] == "lpush";
+    for (size_t i = 2; i < cmd.size(); i++) {
+        qlist_push(ent->list, front, cmd[i].data(), cmd[i].size());
+    }
+    out_int(out, (int64_t)ent->list->count);
+    list_serve_blocked(ent);
+}
+
+// lpop key | rpop key
+static void do_pop(std::vector<std::string> &cmd, Buffer &out) {
+    Entry *ent = NULL;
+    if (!expect_list(cmd[1], &ent)) {
+        return out_err(out, ERR_BAD_TYP, "expect list");
+    }
+    if (!ent) {
+        return out_nil(out);
+    }
+    std::string val;
+    qlist_pop(ent->list, cmd[0] == "lpop", val);
+    out_str(out, val.data(), val.size());
+    list_del_if_empty(ent);
+}
+
+// llen key
+static void do_llen(std::vector<std::string> &cmd, Buffer &out) {
+    Entry *ent = NULL;
+    if (!expect_list(cmd[1], &ent)) {
+        return out_err(out, ERR_BAD_TYP, "expect list");
+    }
+    return out_int(out, ent ? (int64_t)ent->list->count : 0);
+}
+
+// clamps the indexes (negative from the end) to the list; false if empty
+static bool list_range(size_t len, int64_t &start, int64_t &stop) {
+    if (start < 0) {
+        start += (int64_t)len;
+    }
+    if (stop < 0) {
+        stop += (int64_t)len;
+    }
+    start = std::max(start, (int64_t)0);
+    stop = std::min(stop, (int64_t)len - 1);
+    return start <= stop;
+}
+
+static bool cb_lrange(const uint8_t *val, size_t len, void *arg) {
+    out_str(*(Buffer *)arg, (const char *)val, len);
+    return true;
+}
+
+// lrange key start stop
+static void do_lrange(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    Entry *ent = NULL;
+    if (!expect_list(cmd[1], &ent)) {
+        return out_err(out, ERR_BAD_TYP, "expect list");
+    }
+    if (!ent || !list_range(ent->list->count, start, stop)) {
+        return out_arr(out, 0);
+    }
+    out_arr(out, (uint32_t)(stop - start + 1));
+    qlist_range(ent->list, (size_t)start, (size_t)stop, &cb_lrange, (void *)&out);
+}
+
+// ltrim key start stop
+static void do_ltrim(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+        return out_err(out, ERR_BAD_ARG, "expect int");
+    }
+    Entry *ent = NULL;
+    if (!expect_list(cmd[1], &ent)) {
+        return out_err(out, ERR_BAD_TYP, "expect list");
+    }
+    if (ent) {
+        if (list_range(ent->list->count, start, stop)) {
+            qlist_trim(ent->list, (size_t)start, (size_t)stop);
+        } else {
+            qlist_clear(ent->list);
+        }
+        list_del_if_empty(ent);
+    }
+    return out_nil(out);
+}
+
+// blpop key [key ...] timeout | brpop ...
+// Pops from the first non-empty list and replies [key, element]. If all
+// of them are empty, the connection waits for a push to one of them, or
+// for `timeout` seconds (0: forever) and then gets nil. Requests sent
+// after it wait too.
+static void do_blpop(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    double timeout = 0;
+    if (!str2dbl(cmd.back(), timeout) || timeout < 0) {
+        return out_err(out, ERR_BAD_ARG, "expect timeout");
+    }
+    bool front = cmd[0] == "blpop";
+    for (size_t i = 1; i + 1 < cmd.size(); i++) {
+        std::string name = cmd[i];
+        Entry *ent = NULL;
+        if (!expect_list(name, &ent)) {
+            return out_err(out, ERR_BAD_TYP, "expect list");
+        }
+        if (ent) {
+            std::string val;
+            qlist_pop(ent->list, front, val);
+            out_arr(out, 2);
+            out_str(out, ent->key.data(), ent->key.size());
+            out_str(out, val.data(), val.size());
+            list_del_if_empty(ent);
+            return;
+        }
+    }
+    // past ~30000 years is forever
+    uint64_t timeout_ms = timeout < 1e12 ? (uint64_t)ceil(timeout * 1000) : 0;
+    conn_block(conn, cmd, front, timeout_ms);
+}
+
+const size_t k_shm_default_ring = 1 << 20;
+
+// shm [ring_bytes]
+// Moves a Unix socket connection to shared-memory rings. The reply is the
+// ring size and carries, as SCM_RIGHTS, a memfd holding the rings and two
+// eventfds: the one the server sleeps on, then the one the client sleeps
+// on. Nothing may follow this request on the socket.
+static void do_shm(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    if (!conn->is_unix) {
+        return out_err(out, ERR_BAD_ARG, "shm needs a unix socket connection");
+    }
+    if (conn->shm) {
+        return out_err(out, ERR_BAD_ARG, "already using shm");
+    }
+    int64_t ring_size = k_shm_default_ring;
+    if (cmd.size() > 2 || (cmd.size() == 2 && !str2int(cmd[1], ring_size))) {
+        return out_err(out, ERR_BAD_ARG, "expect: shm [ring_bytes]");
+    }
+    if (ring_size < (int64_t)k_shm_min_ring || ring_size > (int64_t)k_shm_max_ring
+        || (ring_size & (ring_size - 1)))
+    {
+        return out_err(out, ERR_BAD_ARG, "ring size must be a power of 2 in [4KB, 64MB]");
+    }
+
+    ShmConn *shm = new ShmConn();
+    shm->map_size = shm_map_size((size_t)ring_size);
+    shm->memfd = memfd_create("in-memory-db", MFD_CLOEXEC);
+    shm->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    shm->peer_efd = eventfd(0, EFD_CLOEXEC);
+    if (shm->memfd >= 0 && ftruncate(shm->memfd, (off_t)shm->map_size) == 0) {
+        shm->base = mmap(NULL, shm->map_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, shm->memfd, 0);
+        if (shm->base == MAP_FAILED) {
+            shm->base = NULL;
+        }
+    }
+    if (!shm->base || shm->efd < 0 || shm->peer_efd < 0) {
+        msg_errno("shm setup");
+        shm_destroy(shm);
+        return out_err(out, ERR_SYSTEM, "cannot create shared memory");
+    }
+    shm_init(shm->base, (size_t)ring_size);
+    shm_end_init(&shm->req, shm->base, (size_t)ring_size, 0);
+    shm_end_init(&shm->resp, shm->base, (size_t)ring_size, 1);
+    conn->shm = shm;
+    out_int(out, ring_size);
+}
+
+static void do_info(std::vector<std::string> &cmd, Buffer &out);
+static void do_memory(std::vector<std::string> &cmd, Buffer &out);
+static bool defrag_running();
+
+typedef void (*CmdHandler)(std::vector<std::string> &cmd, Buffer &out);
+// for the few commands that act on the connection itself
+typedef void (*ConnCmdHandler)(
+    Conn *conn, std::vector<std::string> &cmd, Buffer &out);
+// for long commands, run in slices; see CmdTask
+typedef Task (*TaskCmdHandler)(
+    Conn *conn, std::vector<std::string> cmd, Buffer &out);
+
+enum {
+    CMD_PUBSUB = 1,     // allowed while subscribed
+    CMD_READONLY = 2,   // modifies no key
+};
+
+struct Command {
+    const char *name = NULL;
+    int32_t arity = 0;  // > 0: exact number of strings, < 0: at least -arity
+    CmdHandler handler = NULL;
+    ConnCmdHandler conn_handler = NULL;
+    TaskCmdHandler task_handler = NULL;
+    uint32_t flags = 0;
+    HNode node;
+    // per-command statistics
+    uint64_t calls = 0;
+    uint64_t errors = 0;
+    Hist latency;       // nanoseconds
+
+    Command(const char *name, int32_t arity, CmdHandler handler,
+            uint32_t flags = 0)
+        : name(name), arity(arity), handler(handler), flags(flags) {}
+    Command(const char *name, int32_t arity, ConnCmdHandler handler,
+            uint32_t flags = 0)
+        : name(name), arity(arity), conn_handler(handler), flags(flags) {}
+    Command(const char *name, int32_t arity, TaskCmdHandler handler,
+            uint32_t flags = 0)
+        : name(name), arity(arity), task_handler(handler), flags(flags) {}
+};
+
+static Command g_commands[] = {
+    {"get", 2, &do_get, CMD_READONLY},
+    {"set", 3, &do_set},
+    {"del", 2, &do_del},
+    {"pexpire", 3, &do_expire},
+    {"pttl", 2, &do_ttl, CMD_READONLY},
+    {"keys", 1, &do_keys, CMD_READONLY},
+    {"incr", 2, &do_incr},
+    {"decr", 2, &do_decr},
+    {"incrby", 3, &do_incrby},
+    {"decrby", 3, &do_decrby},
+    {"incrbyfloat", 3, &do_incrbyfloat},
+    {"setbit", 4, &do_setbit},
+    {"getbit", 3, &do_getbit, CMD_READONLY},
+    {"bitcount", -2, &do_bitcount, CMD_READONLY},
+    {"bitpos", -3, &do_bitpos, CMD_READONLY},
+    {"bitop", -4, &do_bitop},
+    {"mget", -2, &do_mget, CMD_READONLY},
+    {"mset", -3, &do_mset},
+    {"mdel", -2, &do_mdel},
+    {"hset", -4, &do_hset},
+    {"hget", 3, &do_hget, CMD_READONLY},
+    {"hmget", -3, &do_hmget, CMD_READONLY},
+    {"hdel", -3, &do_hdel},
+    {"hlen", 2, &do_hlen, CMD_READONLY},
+    {"hgetall", 2, &do_hgetall, CMD_READONLY},
+    {"hincrby", 4, &do_hincrby},
+    {"sadd", -3, &do_sadd},
+    {"srem", -3, &do_srem},
+    {"sismember", 3, &do_sismember, CMD_READONLY},
+    {"scard", 2, &do_scard, CMD_READONLY},
+    {"smembers", 2, &do_smembers, CMD_READONLY},
+    {"sinter", -2, &do_setop, CMD_READONLY},
+    {"sunion", -2, &do_setop, CMD_READONLY},
+    {"pfadd", -2, &do_pfadd},
+    {"pfcount", -2, &do_pfcount, CMD_READONLY},
+    {"pfmerge", -2, &do_pfmerge},
+    {"lpush", -3, &do_push},
+    {"rpush", -3, &do_push},
+    {"lpop", 2, &do_pop},
+    {"rpop", 2, &do_pop},
+    {"llen", 2, &do_llen, CMD_READONLY},
+    {"lrange", 4, &do_lrange, CMD_READONLY},
+    {"ltrim", 4, &do_ltrim},
+    {"blpop", -3, &do_blpop},
+    {"brpop", -3, &do_blpop},
+    {"tsadd", -4, &do_tsadd},
+    {"tsrange", -4, &do_tsrange, CMD_READONLY},
+    {"tsretention", 3, &do_tsretention},
+    {"tsinfo", 2, &do_tsinfo, CMD_READONLY},
+    {"bfreserve", -4, &do_bfreserve},
+    {"bfadd", 3, &do_bfadd},
+    {"bfmadd", -3, &do_bfmadd},
+    {"bfexists", 3, &do_bfexists, CMD_READONLY},
+    {"bfmexists", -3, &do_bfmexists, CMD_READONLY},
+    {"zadd", -4, &do_zadd},
+    {"zload", -2, &do_zload},
+    {"zrem", 3, &do_zrem},
+    {"zscore", 3, &do_zscore, CMD_READONLY},
+    {"zquery", 6, &do_zquery, CMD_READONLY},
+    {"zcount", 4, &do_zcount, CMD_READONLY},
+    {"zrangebyscore", -4, &do_zrangebyscore, CMD_READONLY},
+    {"zremrangebyscore", 4, &do_zremrangebyscore},
+    {"zremrangebyrank", 4, &do_zremrangebyrank},
+    {"zunionstore", -4, &do_zsetop},
+    {"zinterstore", -4, &do_zsetop},
+    {"info", -1, &do_info, CMD_READONLY},
+    {"memory", -2, &do_memory, CMD_READONLY},
+    {"slowlog", -2, &do_slowlog, CMD_READONLY},
+    {"capture", -2, &do_capture},
+    {"shm", -1, &do_shm},
+    {"publish", 3, &do_publish},
+    {"subscribe", -2, &do_subscribe, CMD_PUBSUB},
+    {"psubscribe", -2, &do_subscribe, CMD_PUBSUB},
+    {"unsubscribe", -1, &do_unsubscribe, CMD_PUBSUB},
+    {"punsubscribe", -1, &do_unsubscribe, CMD_PUBSUB},
+};
+
+struct CmdKey {
+    HNode node;
+    const char *name = NULL;
+    size_t len = 0;
+};
+
+static bool cmd_eq(HNode *node, HNode *key) {
+    Command *c = container_of(node, Command, node);
+    CmdKey *ckey = container_of(key, CmdKey, node);
+    return strlen(c->name) == ckey->len && 0 == memcmp(c->name, ckey->name, ckey->len);
+}
+
+static void commands_init() {
+    for (Command &c : g_commands) {
+        assert(!c.task_handler || (c.flags & CMD_READONLY));
+        c.node.hcode = str_hash((uint8_t *)c.name, strlen(c.name));
+        hm_insert(&g_data.commands, &c.node);
+    }
+}
+
+static Command *cmd_lookup(const std::string &name) {
+    CmdKey key;
+    key.name = name.data();
+    key.len = name.size();
+    key.node.hcode = str_hash((uint8_t *)name.data(), name.size());
+    HNode *node = hm_lookup(&g_data.commands, &key.node, &cmd_eq);
+    return node ? container_of(node, Command, node) : NULL;
+}
+
+static bool cmd_arity_ok(const Command *c, size_t nargs) {
+    return c->arity > 0 ? nargs == (size_t)c->arity : nargs >= (size_t)-c->arity;
+}
+
+static uint64_t slice_deadline(uint64_t start_ns) {
+    uint64_t slice_us = g_opt.command_slice_us;
+    return slice_us ? start_ns + slice_us * 1000 : (uint64_t)-1;
+}
+
+// runs the first slice; the command is left in conn->task if not done
+static void task_start(Conn *conn, Command *c, std::vector<std::string> &cmd,
+    Buffer &out, uint64_t start_ns)
+{
+    CmdTask *t = new CmdTask();
+    t->conn = conn;
+    t->cmd = c;
+    conn->task = t;
+    t->task = c->task_handler(conn, std::move(cmd), t->out);
+    if (!task_run(&t->task, slice_deadline(start_ns))) {
+        dlist_insert_before(&g_data.tasks, &t->node);
+        return;
+    }
+    buf_move(out, t->out);
+    task_destroy(&t->task);
+    conn->task = NULL;
+    delete t;
+}
+
+// returns the execution time in nanoseconds
+static uint64_t
+do_request(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    Command *c = cmd.empty() ? NULL : cmd_lookup(cmd[0]);
+    if (!c || !cmd_arity_ok(c, cmd.size())) {
+        out_err(out, ERR_UNKNOWN, "unknown command.");
+        return 0;
+    }
+    if (conn->nsubs && !(c->flags & CMD_PUBSUB)) {
+        out_err(out, ERR_BAD_ARG, "only (p)(un)subscribe while subscribed");
+        return 0;
+    }
+
+    size_t pos = out.data.size();
+    uint64_t start_ns = get_monotonic_nsec();
+    g_mem.tracking = !(c->flags & CMD_READONLY);
+    if (c->task_handler) {
+        task_start(conn, c, cmd, out, start_ns);
+    } else if (c->conn_handler) {
+        c->conn_handler(conn, cmd, out);
+    } else {
+        c->handler(cmd, out);
+    }
+    mem_settle();
+    g_mem.tracking = false;
+    uint64_t elapsed_ns = get_monotonic_nsec() - start_ns;
+    if (conn->task) {
+        conn->task->ns = elapsed_ns;
+        return elapsed_ns;  // counted once it is done
+    }
+    hist_add(&c->latency, elapsed_ns);
+    c->calls++;
+    // nothing is written by a request that blocks
+    c->errors += pos < out.data.size() && out.data[pos] == TAG_ERR;
+    return elapsed_ns;
+}
+
+static void out_stat(Buffer &out, const char *name, int64_t val) {
+    out_str(out, name, strlen(name));
+    out_int(out, val);
+}
+
+static bool cb_count_conn(Conn *conn) {
+    return conn != NULL;
+}
+
+// info [commandstats]
+static void do_info(std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() > 2 || (cmd.size() == 2 && cmd[1] != "commandstats")) {
+        return out_err(out, ERR_BAD_ARG, "expect: info [commandstats]");
+    }
+
+    size_t ctx = out_begin_arr(out);
+    uint32_t n = 0;
+    if (cmd.size() == 2) {
+        char name[64];
+        const char *fields[] = {
+            "calls", "errors", "nsec", "p50_nsec", "p99_nsec", "p999_nsec",
+            "max_nsec",
+        };
+        for (const Command &c : g_commands) {
+            if (!c.calls) {
+                continue;
+            }
+            const Hist *h = &c.latency;
+            int64_t vals[] = {
+                (int64_t)c.calls, (int64_t)c.errors, (int64_t)h->sum,
+                (int64_t)hist_percentile(h, 50),
+                (int64_t)hist_percentile(h, 99),
+                (int64_t)hist_percentile(h, 99.9),
+                (int64_t)h->max,
+            };
+            for (size_t i = 0; i < sizeof(vals) / sizeof(vals[0]); i++) {
+                snprintf(name, sizeof(name), "cmd_%s_%s", c.name, fields[i]);
+                out_stat(out, name, vals[i]);
+                n += 2;
+            }
+        }
+        return out_end_arr(out, ctx, n);
+    }
+
+    const HMap &db = g_data.db;
+    size_t conns = (size_t)std::count_if(
+        g_data.fd2conn.begin(), g_data.fd2conn.end(), &cb_count_conn);
+    uint64_t requests = 0;
+    for (const Command &c : g_commands) {
+        requests += c.calls;
     }
-    return out_int(out, node ? 1: 0);
+    uint64_t read_conns = 0;
+    uint64_t read_requests = 0;
+    for (const Reader *r : g_data.readers) {
+        read_conns += r->nconns.load(std::memory_order_relaxed);
+        read_requests += r->requests.load(std::memory_order_relaxed);
+    }
+    const struct {
+        const char *name;
+        int64_t val;
+    } stats[] = {
+        {"uptime_ms", (int64_t)(get_monotonic_msec() - g_data.stats.start_ms)},
+        {"connected_clients", (int64_t)conns},
+        {"total_connections", (int64_t)g_data.stats.conns_accepted},
+        {"idle_connections_closed", (int64_t)g_data.stats.conns_idle_closed},
+        {"total_requests", (int64_t)requests},
+        {"bytes_in", (int64_t)g_data.stats.bytes_in},
+        {"bytes_out", (int64_t)g_data.stats.bytes_out},
+        {"keys", (int64_t)hm_size(&g_data.db)},
+        {"keys_with_ttl", (int64_t)g_data.heap.size()},
+        {"expired_keys", (int64_t)g_data.stats.expired_keys},
+        {"db_buckets", (int64_t)(db.newer.tab ? db.newer.mask + 1 : 0)},
+        {"db_rehashing", db.older.tab != NULL},
+        {"db_rehash_pending", (int64_t)db.older.size},
+        {"db_rehash_pos", (int64_t)db.migrate_pos},
+        {"threadpool_threads", (int64_t)g_data.thread_pool.threads.size()},
+        {"threadpool_queued", (int64_t)thread_pool_pending(&g_data.thread_pool)},
+        {"pubsub_channels", (int64_t)hm_size(&g_data.channels)},
+        {"pubsub_patterns", (int64_t)hm_size(&g_data.patterns)},
+        {"pubsub_subscriptions", (int64_t)hm_size(&g_data.subscriptions)},
+        {"pubsub_messages", (int64_t)g_data.stats.pubsub_messages},
+        {"pubsub_dropped_clients", (int64_t)g_data.stats.pubsub_dropped},
+        {"stream_replies", (int64_t)g_data.stats.stream_replies},
+        {"stream_flushes", (int64_t)g_data.stats.stream_flushes},
+        {"stream_waits", (int64_t)g_data.stats.stream_waits},
+        {"task_slices", (int64_t)g_data.stats.task_slices},
+        {"task_flushes", (int64_t)g_data.stats.task_flushes},
+        {"task_waits", (int64_t)g_data.stats.task_waits},
+        {"defrag_running", defrag_running()},
+        {"defrag_cycles", (int64_t)g_data.stats.defrag_cycles},
+        {"defrag_scanned", (int64_t)g_data.stats.defrag_scanned},
+        {"defrag_moved", (int64_t)g_data.stats.defrag_moved},
+        {"defrag_moved_bytes", (int64_t)g_data.stats.defrag_moved_bytes},
+        {"defrag_kept", (int64_t)g_data.stats.defrag_kept},
+        {"defrag_time_us", (int64_t)(g_data.stats.defrag_time_ns / 1000)},
+        {"defrag_last_freed", g_data.stats.defrag_last_freed},
+        {"readers", (int64_t)g_data.readers.size()},
+        {"read_connections", (int64_t)read_conns},
+        {"read_requests", (int64_t)read_requests},
+        {"ebr_pending", (int64_t)ebr_pending(&g_data.ebr)},
+        {"capture_running", g_capture.fd >= 0},
+        {"capture_requests", (int64_t)g_capture.requests},
+        {"capture_bytes", (int64_t)(g_capture.bytes + g_capture.buf.size())},
+    };
+    for (const auto &st : stats) {
+        out_stat(out, st.name, st.val);
+        n += 2;
+    }
+    char name[64];
+    for (const Reader *r : g_data.readers) {
+        snprintf(name, sizeof(name), "reader%zu_requests", r->id);
+        out_stat(out, name, (int64_t)r->requests.load(std::memory_order_relaxed));
+        n += 2;
+    }
+    out_end_arr(out, ctx, n);
 }
 
-static void do_ttl(std::vector<std::string> &cmd, Buffer &out) {
-    LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+static const char *k_type_names[T_NTYPES] = {
+    "none", "string", "zset", "hash", "set", "hll", "list", "ts", "bloom",
+};
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!node) {
-        return out_int(out, -2);
+static size_t buf_bytes(const Buffer &buf) {
+    return mem_usable(buf.data.data()) + buf.refs.size() * sizeof(OutRef);
+}
+
+// resident set size from /proc, 0 if unavailable
+static size_t rss_bytes() {
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) {
+        return 0;
     }
+    unsigned long size = 0, resident = 0;
+    int n = fscanf(f, "%lu %lu", &size, &resident);
+    fclose(f);
+    return n == 2 ? resident * (size_t)sysconf(_SC_PAGESIZE) : 0;
+}
 
-    Entry *ent = container_of(node, Entry, node);
-    if (ent->heap_idx == (size_t)-1) {
-        return out_int(out, -1);
+static void memory_stats(Buffer &out) {
+    size_t ctx = out_begin_arr(out);
+    uint32_t n = 0;
+    char name[64];
+    size_t dataset = hm_bytes(&g_data.db);
+    out_stat(out, "keyspace_table", (int64_t)dataset);
+    n += 2;
+    for (uint32_t t = T_STR; t < T_NTYPES; t++) {
+        snprintf(name, sizeof(name), "values_%s", k_type_names[t]);
+        out_stat(out, name, (int64_t)g_mem.by_type[t]);
+        n += 2;
+        dataset += g_mem.by_type[t];
     }
 
-    uint64_t expire_at = g_data.heap[ent->heap_idx].val;
-    uint64_t now_ms = get_monotonic_msec();
-    return out_int(out, expire_at > now_ms ? (expire_at - now_ms) : 0);
+    size_t clients = 0, client_bytes = 0, client_refs = 0;
+    for (Conn *conn : g_data.fd2conn) {
+        if (conn) {
+            clients++;
+            client_bytes += mem_usable(conn) + buf_bytes(conn->incoming)
+                + buf_bytes(conn->outgoing);
+            client_refs += conn->outgoing.ref_bytes;
+        }
+    }
+    size_t ttl = mem_usable(g_data.heap.data());
+    struct mallinfo2 mi = mallinfo2();
+    size_t allocated = mi.uordblks + mi.hblkhd;
+    size_t rss = rss_bytes();
+    const struct {
+        const char *name;
+        int64_t val;
+    } stats[] = {
+        {"dataset", (int64_t)dataset},
+        {"ttl_index", (int64_t)ttl},
+        {"clients", (int64_t)clients},
+        {"client_buffers", (int64_t)client_bytes},
+        // values and pub/sub messages that responses point at
+        {"client_output_refs", (int64_t)client_refs},
+        {"allocated", (int64_t)allocated},
+        {"other", (int64_t)allocated - (int64_t)(dataset + ttl + client_bytes)},
+        {"allocator_free", (int64_t)mi.fordblks},
+        {"allocator_arenas", (int64_t)mi.arena},
+        {"rss", (int64_t)rss},
+        {"fragmentation_bytes", (int64_t)rss - (int64_t)allocated},
+    };
+    for (const auto &st : stats) {
+        out_stat(out, st.name, st.val);
+        n += 2;
+    }
+    out_str(out, "fragmentation_ratio", strlen("fragmentation_ratio"));
+    out_dbl(out, allocated ? (double)rss / (double)allocated : 0);
+    n += 2;
+    out_end_arr(out, ctx, n);
 }
 
-static bool cb_keys(HNode *node, void *arg) {
-    Buffer &out = *(Buffer *)arg;
-    const std::string &key = container_of(node, Entry, node)->key;
-    out_str(out, key.data(), key.size());
-    return true;
-}
+static uint64_t g_sample_rng = 0x9e3779b97f4a7c15ull;
 
-static void do_keys(std::vector<std::string> &, Buffer &out) {
-    out_arr(out, (uint32_t)hm_size(&g_data.db));
-    hm_foreach(&g_data.db, &cb_keys, (void *)&out);
+// xorshift64*
+static uint64_t sample_rand() {
+    g_sample_rng ^= g_sample_rng >> 12;
+    g_sample_rng ^= g_sample_rng << 25;
+    g_sample_rng ^= g_sample_rng >> 27;
+    return g_sample_rng * 0x2545f4914f6cdd1dull;
 }
 
-static bool str2dbl(const std::string &s, double &out) {
-    char *endp = NULL;
-    out = strtod(s.c_str(), &endp);
-    return endp == s.c_str() + s.size() && !isnan(out);
-}
+const size_t k_bigkeys_top = 10;
 
-// zadd zset score name
-static void do_zadd(std::vector<std::string> &cmd, Buffer &out) {
-    double score = 0;
-    if (!str2dbl(cmd[2], score)) {
-        return out_err(out, ERR_BAD_ARG, "expect float");
+// the largest keys in `samples` random buckets, as [key, type, bytes]
+static void memory_bigkeys(Buffer &out, size_t samples) {
+    std::vector<Entry *> ents;
+    for (size_t i = 0; i < samples; i++) {
+        HNode *node = hm_sample(&g_data.db, sample_rand());
+        for (; node; node = node->next) {
+            ents.push_back(container_of(node, Entry, node));
+        }
+    }
+    std::sort(ents.begin(), ents.end());
+    ents.erase(std::unique(ents.begin(), ents.end()), ents.end());
+    size_t n = std::min(k_bigkeys_top, ents.size());
+    std::partial_sort(ents.begin(), ents.begin() + n, ents.end(),
+        [](const Entry *a, const Entry *b) { return a->mem > b->mem; });
+    out_arr(out, (uint32_t)n);
+    for (size_t i = 0; i < n; i++) {
+        const Entry *ent = ents[i];
+        out_arr(out, 3);
+        out_str(out, ent->key.data(), ent->key.size());
+        out_str(out, k_type_names[ent->type], strlen(k_type_names[ent->type]));
+        out_int(out, (int64_t)ent->mem);
     }
+}
 
-    LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+// Active defragmentation. Freed entries and sorted set members leave pages
+// that are mostly empty but still resident. Once the RSS is over the
+// allocated bytes by --defrag-threshold, a cycle walks the keyspace twice,
+// a slice of --defrag-slice-us every k_defrag_period_ms: first to count the
+// live bytes of entries, keys, string values and members by page, then to
+// copy the ones on sparse pages and patch the links to them (keyspace
+// chain, TTL heap, AVL tree, member table). The copies that were not kept
+// are freed, also in slices, and malloc_trim() hands the emptied pages
+// back; that last call is not sliced. Nothing holds an entry or a member
+// across requests, so anything may move between them.
+enum {
+    DEFRAG_IDLE = 0,
+    DEFRAG_CENSUS = 1,
+    DEFRAG_MOVE = 2,
+    DEFRAG_RELEASE = 3,     // freeing the parked copies
+};
 
-    Entry *ent = NULL;
-    if (!hnode) {
-        ent = entry_new(T_ZSET);
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        hm_insert(&g_data.db, &ent->node);
-    } else {    
-        ent = container_of(hnode, Entry, node);
-        if (ent->type != T_ZSET) {
-            return out_err(out, ERR_BAD_TYP, "expect zset");
-        }
+const uint64_t k_defrag_period_ms = 10;         // between slices
+const uint64_t k_defrag_check_ms = 1000;        // between checks of the ratio
+const uint64_t k_defrag_backoff_ms = 30 * 1000; // after a cycle that moved nothing
+const size_t k_defrag_min_waste = 16 << 20;     // RSS over allocated bytes
+const size_t k_defrag_sparse = k_page_size * 3 / 4;
+const size_t k_defrag_zset_step = 64;           // larger sets are walked by rank
+
+static struct {
+    uint32_t phase = DEFRAG_IDLE;
+    uint64_t next_ms = 0;
+    PageCensus census;
+    uint64_t moved = 0;     // in this cycle
+    size_t start_rss = 0;
+    // the walk: buckets of the newer then the older table, then the large
+    // sorted sets by key and rank
+    uint32_t table = 0;
+    size_t pos = 0;
+    std::vector<std::string> zsets;
+    uint64_t rank = 0;      // in zsets.back()
+    // Copies that did not land on a denser page, held until the end of the
+    // cycle. malloc() would hand them out again right away, and holding
+    // them fills up the sparse pages, so later copies go to denser ones.
+    size_t parked_bytes = 0;
+    size_t parked_max = 0;  // the free bytes at the start of the cycle
+    std::vector<void *> parked;
+    std::vector<void *> parked_ents;
+    std::vector<std::string> parked_strs;
+} g_defrag;
+
+static bool defrag_running() {
+    return g_defrag.phase != DEFRAG_IDLE;
+}
+
+static bool defrag_wanted() {
+    if (g_opt.defrag_threshold <= 0) {
+        return false;
     }
+    struct mallinfo2 mi = mallinfo2();
+    size_t allocated = mi.uordblks + mi.hblkhd;
+    size_t rss = rss_bytes();
+    return rss >= allocated + k_defrag_min_waste
+        && (double)rss >= (double)allocated * g_opt.defrag_threshold;
+}
 
-    const std::string &name = cmd[3];
-    bool added = zset_insert(&ent->zset, name.data(), name.size(), score);
-    return out_int(out, (int64_t)added);
+static void defrag_start() {
+    g_defrag.phase = DEFRAG_CENSUS;
+    g_defrag.moved = 0;
+    g_defrag.start_rss = rss_bytes();
+    g_defrag.parked_max = mallinfo2().fordblks;
+    g_defrag.table = 0;
+    g_defrag.pos = 0;
+    g_defrag.rank = 0;
+    g_defrag.zsets.clear();
 }
 
-static const ZSet k_empty_zset;
+// whether `ptr` sits on a page that was counted and found sparse
+static bool defrag_sparse(const void *ptr) {
+    size_t bytes = census_get(&g_defrag.census, ptr);
+    return bytes > 0 && bytes < k_defrag_sparse;
+}
 
-static ZSet *expect_zset(std::string &s) {
-    LookupKey key;
-    key.key.swap(s);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!hnode) {
-        return (ZSet *)&k_empty_zset;
+// keeps the copy `to` of `from` if it landed on a denser page
+static bool defrag_keep(const void *from, const void *to) {
+    if (!census_move(&g_defrag.census, from, to)) {
+        g_data.stats.defrag_kept++;
+        g_defrag.parked_bytes += mem_usable(to);
+        return false;
     }
-    Entry *ent = container_of(hnode, Entry, node);
-    return ent->type == T_ZSET ? &ent->zset : NULL;
+    g_data.stats.defrag_moved++;
+    g_data.stats.defrag_moved_bytes += mem_usable(to);
+    g_defrag.moved++;
+    return true;
 }
 
-static void do_zrem(std::vector<std::string> &cmd, Buffer &out) {
-    ZSet *zset = expect_zset(cmd[1]);
-    if (!zset) {
-        return out_err(out, ERR_BAD_TYP, "expect zset");
+static bool defrag_str(std::string &str) {
+    if (str.capacity() <= 15 || !defrag_sparse(str.data())) {
+        return false;
     }
-
-    const std::string &name = cmd[2];
-    ZNode *znode = zset_lookup(zset, name.data(), name.size());
-    if (znode) {
-        zset_delete(zset, znode);
+    std::string copy(str);
+    if (copy.capacity() > 15 && !defrag_keep(str.data(), copy.data())) {
+        g_defrag.parked_strs.push_back(std::move(copy));
+        return false;
     }
-    return out_int(out, znode ? 1 : 0);
+    str.swap(copy);
+    return true;
 }
 
-static void do_zscore(std::vector<std::string> &cmd, Buffer &out) {
-    ZSet *zset = expect_zset(cmd[1]);
-    if (!zset) {
-        return out_err(out, ERR_BAD_TYP, "expect zset");
+static void entry_recount(Entry *ent) {
+    size_t mem = entry_mem(ent);
+    g_mem.by_type[ent->type] += mem - ent->mem;
+    ent->mem = mem;
+}
+
+static Entry *defrag_entry(Entry *ent) {
+    bool changed = defrag_str(ent->key);
+    if (ent->type == T_STR && ent->enc == ENC_RAW) {
+        changed = defrag_str(ent->str) || changed;
+    }
+    if (defrag_sparse(ent)) {
+        void *mem = ::operator new(sizeof(Entry));
+        if (defrag_keep(ent, mem)) {
+            Entry *copy = new (mem) Entry(std::move(*ent));
+            hm_move(&g_data.db, &ent->node, &copy->node);
+            if (!dlist_empty(&g_data.streams)) {
+                streams_moved(ent, copy);
+            }
+            if (copy->heap_idx != (size_t)-1) {
+                g_data.heap[copy->heap_idx].ref = &copy->heap_idx;
+            }
+            delete ent;
+            ent = copy;
+            changed = true;
+        } else {
+            g_defrag.parked_ents.push_back(mem);
+        }
     }
+    if (changed) {
+        entry_recount(ent);
+    }
+    return ent;
+}
 
-    const std::string &name = cmd[2];
-    ZNode *znode = zset_lookup(zset, name.data(), name.size());
-    return znode ? out_dbl(out, znode->score) : out_nil(out);
+static Entry *defrag_visit_entry(Entry *ent) {
+    g_data.stats.defrag_scanned++;
+    if (g_defrag.phase == DEFRAG_MOVE) {
+        return defrag_entry(ent);
+    }
+    census_add(&g_defrag.census, ent);
+    if (ent->key.capacity() > 15) {
+        census_add(&g_defrag.census, ent->key.data());
+    }
+    if (ent->type == T_STR && ent->enc == ENC_RAW && ent->str.capacity() > 15) {
+        census_add(&g_defrag.census, ent->str.data());
+    }
+    return ent;
 }
 
-static void do_zquery(std::vector<std::string> &cmd, Buffer &out) {
-    double score = 0;
-    if (!str2dbl(cmd[2], score)) {
-        return out_err(out, ERR_BAD_ARG, "expect fp number");
+// visits up to `n` members from `rank` on, returns how many there were
+static size_t defrag_visit_zset(Entry *ent, uint64_t rank, size_t n) {
+    ZSet *zset = &ent->zset;
+    ZNode *node = zset_at(zset, rank);
+    uint64_t moved = g_defrag.moved;
+    size_t i = 0;
+    for (; node && i < n; i++) {
+        ZNode *next = znode_offset(node, 1);
+        g_data.stats.defrag_scanned++;
+        if (g_defrag.phase == DEFRAG_CENSUS) {
+            census_add(&g_defrag.census, node);
+        } else if (defrag_sparse(node)) {
+            void *mem = malloc(znode_size(node));
+            assert(mem);
+            if (defrag_keep(node, mem)) {
+                zset_move(zset, node, mem);
+            } else {
+                g_defrag.parked.push_back(mem);
+            }
+        }
+        node = next;
     }
-    const std::string &name = cmd[3];
-    int64_t offset = 0, limit = 0;
-    if (!str2int(cmd[4], offset) || !str2int(cmd[5], limit)) {
-        return out_err(out, ERR_BAD_ARG, "expect int");
+    if (g_defrag.moved != moved) {
+        entry_recount(ent);
     }
+    return i;
+}
 
-    ZSet *zset = expect_zset(cmd[1]);
-    if (!zset) {
-        return out_err(out, ERR_BAD_TYP, "expect zset");
+// walks the keyspace for the current phase; false once it is done
+static bool defrag_walk(uint64_t deadline_ns) {
+    assert(g_mem.dirty.empty());
+    while (get_monotonic_nsec() < deadline_ns) {
+        if (g_defrag.parked_bytes > g_defrag.parked_max) {
+            return false;   // out of holes
+        }
+        if (g_defrag.table < 2) {
+            HTab *htab = g_defrag.table == 0 ? &g_data.db.newer : &g_data.db.older;
+            if (!htab->tab || g_defrag.pos > htab->mask) {
+                g_defrag.table++;
+                g_defrag.pos = 0;
+                continue;
+            }
+            HNode *node = htab->tab[g_defrag.pos++];
+            while (node) {
+                HNode *next = node->next;
+                Entry *ent = defrag_visit_entry(container_of(node, Entry, node));
+                if (ent->type == T_ZSET) {
+                    if (avl_cnt(ent->zset.root) > k_defrag_zset_step) {
+                        g_defrag.zsets.push_back(ent->key);
+                    } else {
+                        defrag_visit_zset(ent, 0, k_defrag_zset_step);
+                    }
+                }
+                node = next;
+            }
+            continue;
+        }
+        if (g_defrag.zsets.empty()) {
+            return false;
+        }
+        LookupKey key;
+        key.key = g_defrag.zsets.back();
+        key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+        HNode *node = hm_find(&g_data.db, &key.node, &entry_eq);
+        Entry *ent = node ? container_of(node, Entry, node) : NULL;
+        size_t n = 0;
+        if (ent && ent->type == T_ZSET) {
+            n = defrag_visit_zset(ent, g_defrag.rank, k_defrag_zset_step);
+        }
+        g_defrag.rank += n;
+        if (n < k_defrag_zset_step) {
+            g_defrag.zsets.pop_back();
+            g_defrag.rank = 0;
+        }
     }
+    return true;
+}
 
-    if (limit <= 0) {
-        return out_arr(out, 0);
+// frees the parked copies; false once they are all gone
+static bool defrag_unpark(uint64_t deadline_ns) {
+    const size_t k_batch = 256;
+    while (get_monotonic_nsec() < deadline_ns) {
+        size_t n = 0;
+        for (; n < k_batch && !g_defrag.parked.empty(); n++) {
+            free(g_defrag.parked.back());
+            g_defrag.parked.pop_back();
+        }
+        for (; n < k_batch && !g_defrag.parked_ents.empty(); n++) {
+            ::operator delete(g_defrag.parked_ents.back());
+            g_defrag.parked_ents.pop_back();
+        }
+        for (; n < k_batch && !g_defrag.parked_strs.empty(); n++) {
+            g_defrag.parked_strs.pop_back();
+        }
+        if (n == 0) {
+            std::vector<void *>().swap(g_defrag.parked);
+            std::vector<void *>().swap(g_defrag.parked_ents);
+            std::vector<std::string>().swap(g_defrag.parked_strs);
+            g_defrag.parked_bytes = 0;
+            return false;
+        }
     }
-    ZNode *znode = zset_seekge(zset, score, name.data(), name.size());
-    znode = znode_offset(znode, offset);
+    return true;
+}
 
-    size_t ctx = out_begin_arr(out);
-    int64_t n = 0;
-    while (znode && n < limit) {
-        out_str(out, znode->name, znode->len);
-        out_dbl(out, znode->score);
-        znode = znode_offset(znode, +1);
-        n += 2;
+static void defrag_slice() {
+    uint64_t start_ns = get_monotonic_nsec();
+    uint64_t deadline_ns = start_ns + g_opt.defrag_slice_us * 1000;
+    bool more = g_defrag.phase == DEFRAG_RELEASE
+        ? defrag_unpark(deadline_ns) : defrag_walk(deadline_ns);
+    if (!more && g_defrag.phase == DEFRAG_CENSUS) {
+        g_defrag.phase = DEFRAG_MOVE;
+        g_defrag.table = 0;
+        g_defrag.pos = 0;
+    } else if (!more && g_defrag.phase == DEFRAG_MOVE) {
+        g_defrag.phase = DEFRAG_RELEASE;
+        census_clear(&g_defrag.census);
+    } else if (!more) {
+        malloc_trim(0);
+        g_defrag.phase = DEFRAG_IDLE;
+        g_data.stats.defrag_cycles++;
+        g_data.stats.defrag_last_freed = (int64_t)g_defrag.start_rss - (int64_t)rss_bytes();
     }
-    out_end_arr(out, ctx, (uint32_t)n);
+    g_data.stats.defrag_time_ns += get_monotonic_nsec() - start_ns;
 }
 
-static void do_request(std::vector<std::string> &cmd, Buffer &out) {
-    if (cmd.size() == 2 && cmd[0] == "get") {
-        return do_get(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "set") {
-        return do_set(cmd, out);
-    } else if (cmd.size() == 2 && cmd[0] == "del") {
-        return do_del(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "pexpire") {
-        return do_expire(cmd, out);
-    } else if (cmd.size() == 2 && cmd[0] == "pttl") {
-        return do_ttl(cmd, out);
-    } else if (cmd.size() == 1 && cmd[0] == "keys") {
-        return do_keys(cmd, out);
-    } else if (cmd.size() == 4 && cmd[0] == "zadd") {
-        return do_zadd(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "zrem") {
-        return do_zrem(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "zscore") {
-        return do_zscore(cmd, out);
-    } else if (cmd.size() == 6 && cmd[0] == "zquery") {
-        return do_zquery(cmd, out);
+static void defrag_timer(uint64_t now_ms) {
+    if (!dlist_empty(&g_data.tasks)) {
+        // suspended commands hold pointers into the data
+        g_defrag.next_ms = now_ms + k_defrag_period_ms;
+        return;
+    }
+    if (g_defrag.phase == DEFRAG_IDLE) {
+        if (!defrag_wanted()) {
+            g_defrag.next_ms = now_ms + k_defrag_check_ms;
+            return;
+        }
+        defrag_start();
+    }
+    defrag_slice();
+    if (g_defrag.phase != DEFRAG_IDLE) {
+        g_defrag.next_ms = now_ms + k_defrag_period_ms;
     } else {
-        return out_err(out, ERR_UNKNOWN, "unknown command.");
+        g_defrag.next_ms = now_ms + (g_defrag.moved ? k_defrag_check_ms : k_defrag_backoff_ms);
     }
 }
 
+// memory usage key | stats | bigkeys [samples] | defrag
+static void do_memory(std::vector<std::string> &cmd, Buffer &out) {
+    const std::string &sub = cmd[1];
+    if (sub == "usage" && cmd.size() == 3) {
+        LookupKey key;
+        key.key.swap(cmd[2]);
+        key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+        HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+        if (!node) {
+            return out_nil(out);
+        }
+        return out_int(out, (int64_t)entry_mem(container_of(node, Entry, node)));
+    } else if (sub == "stats" && cmd.size() == 2) {
+        return memory_stats(out);
+    } else if (sub == "defrag" && cmd.size() == 2) {
+        if (g_opt.readers) {
+            return out_err(out, ERR_BAD_ARG, "no defragmentation with reader threads");
+        }
+        // starts a cycle now, whatever the ratio
+        bool idle = !defrag_running();
+        if (idle) {
+            defrag_start();
+            g_defrag.next_ms = 0;
+        }
+        return out_int(out, idle);
+    } else if (sub != "bigkeys" || cmd.size() > 3) {
+        return out_err(out, ERR_BAD_ARG,
+            "expect: memory usage key | stats | bigkeys [samples] | defrag");
+    }
+    int64_t samples = 1000;
+    if (cmd.size() == 3 && (!str2int(cmd[2], samples) || samples <= 0)) {
+        return out_err(out, ERR_BAD_ARG, "expect positive int");
+    }
+    memory_bigkeys(out, (size_t)std::min(samples, (int64_t)1000000));
+}
+
 static void response_begin(Buffer &out, size_t *header) {
-    *header = out.size();
+    *header = out.data.size();
     buf_append_u32(out, 0);
 }
 static size_t response_size(Buffer &out, size_t header) {
-    return out.size() - header - 4;
+    size_t size = out.data.size() - header - 4;
+    for (auto it = out.refs.rbegin(); it != out.refs.rend(); ++it) {
+        if (it->pos < header + 4) {
+            break;
+        }
+        size += it->buf->len;
+    }
+    return size;
 }
-static void response_end(Buffer &out, size_t header) {
-    size_t msg_size = response_size(out, header);
+// `rest`: the bytes a stream has yet to generate
+static void response_end(Buffer &out, size_t header, size_t rest) {
+    size_t msg_size = response_size(out, header) + rest;
     if (msg_size > k_max_msg) {
-        out.resize(header + 4);
+        while (!out.refs.empty() && out.refs.back().pos >= header + 4) {
+            out.ref_bytes -= out.refs.back().buf->len;
+            rcbuf_unref(out.refs.back().buf);
+            out.refs.pop_back();
+        }
+        out.data.resize(header + 4);
         out_err(out, ERR_TOO_BIG, "response is too big.");
         msg_size = response_size(out, header);
     }
     uint32_t len = (uint32_t)msg_size;
-    memcpy(&out[header], &len, 4);
+    memcpy(&out.data[header], &len, 4);
+}
+
+// ends the response at `header_pos`, the rest of which a stream may still
+// generate; returns its size
+static size_t response_finish(Conn *conn, size_t header_pos) {
+    size_t rest = 0;
+    if (conn->stream) {
+        rest = conn->stream->bytes;
+        if (response_size(conn->outgoing, header_pos) + rest > k_max_msg) {
+            stream_free(conn);  // refused by response_end()
+        } else {
+            g_data.stats.stream_replies++;
+        }
+    }
+    response_end(conn->outgoing, header_pos, rest);
+    return response_size(conn->outgoing, header_pos)
+        + (conn->stream ? conn->stream->bytes : 0);
+}
+
+static void task_free(CmdTask *t) {
+    dlist_detach(&t->node);
+    task_destroy(&t->task);
+    if (t->scan) {
+        key_scan_free(t->scan);
+    }
+    buf_clear(t->out);
+    t->conn->task = NULL;
+    delete t;
+    waiters_resume();
+}
+
+// runs a slice of the command, or all the rest; true once it is done
+static bool task_slice(CmdTask *t, bool to_end) {
+    uint64_t start_ns = get_monotonic_nsec();
+    // it may be finished in the middle of a write command
+    bool tracking = g_mem.tracking;
+    g_mem.tracking = false;
+    bool done = task_run(&t->task, to_end ? (uint64_t)-1 : slice_deadline(start_ns));
+    g_mem.tracking = tracking;
+    t->ns += get_monotonic_nsec() - start_ns;
+    return done;
+}
+
+// queues the reply of a finished command; the requests behind it run next
+static void task_done(CmdTask *t) {
+    Conn *conn = t->conn;
+    Command *c = t->cmd;
+    hist_add(&c->latency, t->ns);
+    c->calls++;
+    c->errors += !t->out.data.empty() && t->out.data[0] == TAG_ERR;
+
+    size_t header_pos = 0;
+    response_begin(conn->outgoing, &header_pos);
+    buf_move(conn->outgoing, t->out);
+    size_t resp_size = response_finish(conn, header_pos);
+    if (t->ns >= g_opt.slowlog_threshold_us * 1000) {
+        slowlog_add(conn, (const uint8_t *)t->req.data(), t->req.size(),
+            t->ns, resp_size);
+    }
+    task_free(t);
+
+    conn->last_active_ms = get_monotonic_msec();
+    dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+    dlist_insert_before(&g_data.resume_list, &conn->resume_node);
+}
+
+// runs the suspended commands reading `ent` to the end
+static void tasks_flush(Entry *ent) {
+    DList *cur = g_data.tasks.next;
+    while (cur != &g_data.tasks) {
+        CmdTask *t = container_of(cur, CmdTask, node);
+        cur = cur->next;
+        if (t->ent == ent) {
+            task_slice(t, true);
+            task_done(t);
+            g_data.stats.task_flushes++;
+        }
+    }
+}
+
+static bool streams_waited() {
+    for (DList *cur = g_data.streams.next; cur != &g_data.streams; cur = cur->next) {
+        if (container_of(cur, Stream, node)->waited) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// a slice of the suspended command at the front, which then goes last
+static void process_tasks() {
+    if (dlist_empty(&g_data.tasks)) {
+        return;
+    }
+    CmdTask *t = container_of(g_data.tasks.next, CmdTask, node);
+    g_data.stats.task_slices++;
+    if (task_slice(t, false)) {
+        task_done(t);
+    } else {
+        dlist_detach(&t->node);
+        dlist_insert_before(&g_data.tasks, &t->node);
+    }
+}
+
+// a write waits while another client's stream or suspended command reads
+// what it may change, so that the reply is never finished in its place
+static bool write_must_wait(const std::vector<std::string> &cmd) {
+    if (dlist_empty(&g_data.tasks) && dlist_empty(&g_data.streams)) {
+        return false;
+    }
+    Command *c = cmd.empty() ? NULL : cmd_lookup(cmd[0]);
+    if (!c || (c->flags & CMD_READONLY)) {
+        return false;
+    }
+    if (tasks_busy(NULL, &cmd)) {
+        g_data.stats.task_waits++;
+        return true;
+    }
+    if (streams_busy(NULL, &cmd)) {
+        g_data.stats.stream_waits++;
+        return true;
+    }
+    return false;
 }
 
 static bool try_one_request(Conn *conn) {
-    if (conn->incoming.size() < 4) {
+    if (conn->blocked || conn->task || conn->waiting) {
+        return false;   // pipelined requests wait behind a blocked or long one
+    }
+    if (conn->stream || buf_size(conn->outgoing) >= output_high()) {
+        return false;   // until the client reads what is pending
+    }
+    if (conn->shm && !conn->shm->active) {
+        if (!conn->incoming.data.empty()) {
+            msg("data after shm");
+            conn->want_close = true;
+        }
+        return false;
+    }
+    if (conn->incoming.data.size() < 4) {
         return false;
     }
     uint32_t len = 0;
-    memcpy(&len, conn->incoming.data(), 4);
+    memcpy(&len, conn->incoming.data.data(), 4);
     if (len > k_max_msg) {
         msg("too long");
         conn->want_close = true;
         return false;
     }
 
-    if (4 + len > conn->incoming.size()) {
+    if (4 + len > conn->incoming.data.size()) {
+        return false;
+    }
+    const uint8_t *request = &conn->incoming.data[4];
+
+    std::vector<std::string> cmd;
+    if (parse_req(request, len, cmd) < 0) {
+        msg("bad request");
+        conn->want_close = true;
+        return false;
+    }
+    if (write_must_wait(cmd)) {
+        // it runs once they are done (waiters_resume())
+        conn->waiting = true;
+        dlist_insert_before(&g_data.waiters, &conn->wait_node);
+        dlist_detach(&conn->idle_node);
+        dlist_init(&conn->idle_node);
+        return false;
+    }
+    if (g_capture.fd >= 0) {
+        capture_add(conn, request, len);
+    }
+    size_t header_pos = 0;
+    response_begin(conn->outgoing, &header_pos);
+    uint64_t duration_ns = do_request(conn, cmd, conn->outgoing);
+    if (conn->blocked) {
+        // the reply is queued once a push or the timeout ends the wait
+        conn->outgoing.data.resize(header_pos);
+        buf_consume(conn->incoming, 4 + len);
+        return false;
+    }
+    if (conn->task) {
+        // the reply is queued once the command is done
+        conn->outgoing.data.resize(header_pos);
+        conn->task->req.assign((const char *)request, len);
+        dlist_detach(&conn->idle_node);
+        dlist_init(&conn->idle_node);
+        buf_consume(conn->incoming, 4 + len);
         return false;
     }
-    const uint8_t *request = &conn->incoming[4];
+    size_t resp_size = response_finish(conn, header_pos);
+    if (duration_ns >= g_opt.slowlog_threshold_us * 1000) {
+        slowlog_add(conn, request, len, duration_ns, resp_size);
+    }
+
+    buf_consume(conn->incoming, 4 + len);
+    return true;
+}
+
+// IOV_MAX on Linux; a pub/sub backlog is one iovec per message
+const size_t k_max_iov = 1024;
+
+// gathers the pending bytes and the referenced buffers, in stream order
+static size_t out_iov(const Buffer &out, struct iovec *iov, size_t max_iov) {
+    size_t n = 0;
+    size_t pos = 0;
+    size_t i = 0;
+    for (; i < out.refs.size() && n + 2 <= max_iov; i++) {
+        const OutRef &r = out.refs[i];
+        if (r.pos > pos) {
+            iov[n++] = {(void *)&out.data[pos], r.pos - pos};
+            pos = r.pos;
+        }
+        size_t skip = i == 0 ? out.ref_sent : 0;
+        iov[n++] = {(void *)(r.buf->data + skip), r.buf->len - skip};
+    }
+    if (i == out.refs.size() && n < max_iov && pos < out.data.size()) {
+        iov[n++] = {(void *)&out.data[pos], out.data.size() - pos};
+    }
+    return n;
+}
+
+static void efd_signal(int efd) {
+    uint64_t one = 1;
+    (void)write(efd, &one, sizeof(one));
+}
+
+// the reply to `shm` carries the fds of the shared memory transport
+static ssize_t send_shm_fds(Conn *conn, const struct iovec *iov, size_t niov) {
+    ShmConn *shm = conn->shm;
+    int fds[3] = {shm->memfd, shm->efd, shm->peer_efd};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } ctrl = {};
+    struct msghdr mh = {};
+    mh.msg_iov = (struct iovec *)iov;
+    mh.msg_iovlen = niov;
+    mh.msg_control = ctrl.buf;
+    mh.msg_controllen = sizeof(ctrl.buf);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    ssize_t rv = sendmsg(conn->fd, &mh, 0);
+    if (rv > 0) {
+        shm->fds_sent = true;
+    }
+    return rv;
+}
 
-    std::vector<std::string> cmd;
-    if (parse_req(request, len, cmd) < 0) {
-        msg("bad request");
-        conn->want_close = true;
-        return false;
+// read(2) and writev(2) on the connection's transport
+static ssize_t conn_read(Conn *conn, uint8_t *buf, size_t len) {
+    ShmConn *shm = conn->shm;
+    if (!shm || !shm->active) {
+        return read(conn->fd, buf, len);
     }
-    size_t header_pos = 0;
-    response_begin(conn->outgoing, &header_pos);
-    do_request(cmd, conn->outgoing);
-    response_end(conn->outgoing, header_pos);
+    int64_t rv = shm_read(&shm->req, buf, len);
+    if (rv <= 0) {
+        errno = rv < 0 ? EPROTO : EAGAIN;
+        return -1;
+    }
+    if (shm_wake_writer(&shm->req)) {
+        efd_signal(shm->peer_efd);
+    }
+    return (ssize_t)rv;
+}
 
-    buf_consume(conn->incoming, 4 + len);
-    return true;
+static ssize_t conn_writev(Conn *conn, const struct iovec *iov, size_t niov) {
+    ShmConn *shm = conn->shm;
+    if (shm && !shm->fds_sent) {
+        return send_shm_fds(conn, iov, niov);
+    }
+    if (!shm) {
+        return writev(conn->fd, iov, (int)niov);
+    }
+    int64_t rv = shm_writev(&shm->resp, iov, niov);
+    if (rv <= 0) {
+        errno = rv < 0 ? EPROTO : EAGAIN;
+        return -1;
+    }
+    if (shm_wake_reader(&shm->resp)) {
+        efd_signal(shm->peer_efd);
+    }
+    return (ssize_t)rv;
 }
 
 static void handle_write(Conn *conn) {
-    assert(conn->outgoing.size() > 0);
-    ssize_t rv = write(conn->fd, &conn->outgoing[0], conn->outgoing.size());
+    assert(!buf_empty(conn->outgoing));
+    struct iovec iov[k_max_iov];
+    size_t niov = out_iov(conn->outgoing, iov, k_max_iov);
+    ssize_t rv = conn_writev(conn, iov, niov);
     if (rv < 0 && errno == EAGAIN) {
         return;
     }
@@ -663,17 +5008,33 @@ static void handle_write(Conn *conn) {
         return;
     }
 
+    g_data.stats.bytes_out += (size_t)rv;
     buf_consume(conn->outgoing, (size_t)rv);
 
-    if (conn->outgoing.size() == 0) {
+    // below the limit again: more of the stream, then the requests that
+    // waited for the client to read
+    if (buf_size(conn->outgoing) < output_high()) {
+        if (conn->stream) {
+            stream_fill(conn, output_high());
+        }
+        while (try_one_request(conn)) {}
+    }
+
+    if (buf_empty(conn->outgoing)) {
         conn->want_read = true;
         conn->want_write = false;
+        if (conn->shm && !conn->shm->active) {
+            // the client has the fds; switch over to the rings
+            conn->shm->active = true;
+            (void)close(conn->shm->memfd);
+            conn->shm->memfd = -1;
+        }
     }
 }
 
 static void handle_read(Conn *conn) {
     uint8_t buf[64 * 1024];
-    ssize_t rv = read(conn->fd, buf, sizeof(buf));
+    ssize_t rv = conn_read(conn, buf, sizeof(buf));
     if (rv < 0 && errno == EAGAIN) {
         return;
     }
@@ -684,7 +5045,7 @@ static void handle_read(Conn *conn) {
     }
 
     if (rv == 0) {
-        if (conn->incoming.size() == 0) {
+        if (conn->incoming.data.empty()) {
             msg("client closed");
         } else {
             msg("unexpected EOF");
@@ -693,11 +5054,12 @@ static void handle_read(Conn *conn) {
         return;
     }
 
+    g_data.stats.bytes_in += (size_t)rv;
     buf_append(conn->incoming, buf, (size_t)rv);
 
     while (try_one_request(conn)) {}
 
-    if (conn->outgoing.size() > 0) {
+    if (!buf_empty(conn->outgoing)) {
         conn->want_read = false;
         conn->want_write = true;
 
@@ -706,8 +5068,12 @@ static void handle_read(Conn *conn) {
 }
 
 const uint64_t k_idle_timeout_ms = 5 * 1000;
+const uint64_t k_ebr_retry_ms = 10;
 
 static uint32_t next_timer_ms() {
+    if (!dlist_empty(&g_data.tasks) || streams_waited()) {
+        return 0;   // more slices to run
+    }
     uint64_t now_ms = get_monotonic_msec();
     uint64_t next_ms = (uint64_t)-1;
 
@@ -719,6 +5085,19 @@ static uint32_t next_timer_ms() {
     if (!g_data.heap.empty() && g_data.heap[0].val < next_ms) {
         next_ms = g_data.heap[0].val;
     }
+    if (!g_data.block_heap.empty() && g_data.block_heap[0].val < next_ms) {
+        next_ms = g_data.block_heap[0].val;
+    }
+    if ((g_opt.defrag_threshold > 0 || defrag_running()) && g_defrag.next_ms < next_ms) {
+        next_ms = g_defrag.next_ms;
+    }
+    // memory retired while a reader was busy
+    if (ebr_pending(&g_data.ebr) && now_ms + k_ebr_retry_ms < next_ms) {
+        next_ms = now_ms + k_ebr_retry_ms;
+    }
+    if (!g_capture.buf.empty() && g_capture.flushed_ms + k_capture_flush_ms < next_ms) {
+        next_ms = g_capture.flushed_ms + k_capture_flush_ms;
+    }
 
     if (next_ms == (uint64_t)-1) {
         return -1;
@@ -729,10 +5108,6 @@ static uint32_t next_timer_ms() {
     return (int32_t)(next_ms - now_ms);
 }
 
-static bool hnode_same(HNode *node, HNode *key) {
-    return node == key;
-}
-
 static void process_timers() {
     uint64_t now_ms = get_monotonic_msec();
 
@@ -745,37 +5120,130 @@ static void process_timers() {
 
         fprintf(stderr, "removing idle connection: %d\n", conn->fd);
         conn_destroy(conn);
+        g_data.stats.conns_idle_closed++;
     }
 
     const size_t k_max_works = 2000;
     size_t nworks = 0;
     const std::vector<HeapItem> &heap = g_data.heap;
+    std::vector<HeapItem> held;     // expire once what reads them is done
     while (!heap.empty() && heap[0].val < now_ms) {
         Entry *ent = container_of(heap[0].ref, Entry, heap_idx);
-        HNode *node = hm_delete(&g_data.db, &ent->node, &hnode_same);
+        if (tasks_busy(ent, NULL) || streams_busy(ent, NULL)) {
+            held.push_back(heap[0]);
+            heap_delete(g_data.heap, 0);
+            ent->heap_idx = -1;
+            continue;
+        }
+        HNode *node = db_delete(&ent->node, &hnode_same);
         assert(node == &ent->node);
 
         entry_del(ent);
+        g_data.stats.expired_keys++;
         if (nworks++ >= k_max_works) {
             break;
         }
     }
+    for (const HeapItem &item : held) {
+        heap_upsert(g_data.heap, *item.ref, item);
+    }
+
+    const std::vector<HeapItem> &blocks = g_data.block_heap;
+    while (!blocks.empty() && blocks[0].val <= now_ms) {
+        Conn *conn = container_of(blocks[0].ref, Conn, block_heap_idx);
+        block_reply(conn, NULL, NULL);
+        conn_unblock(conn, true);
+    }
+
+    if ((g_opt.defrag_threshold > 0 || defrag_running()) && g_defrag.next_ms <= now_ms) {
+        defrag_timer(now_ms);
+    }
+
+    if (!g_capture.buf.empty() && g_capture.flushed_ms + k_capture_flush_ms <= now_ms) {
+        capture_flush();
+    }
 }
 
-int main() {
-    dlist_init(&g_data.idle_list);
-    thread_pool_init(&g_data.thread_pool, 4);
+// the next part of each stream something waits for, past the output
+// limit: the wait is over once it is generated, whenever its client reads
+static void process_streams() {
+    DList *cur = g_data.streams.next;
+    while (cur != &g_data.streams) {
+        Stream *stream = container_of(cur, Stream, node);
+        cur = cur->next;
+        if (!stream->waited) {
+            continue;
+        }
+        Conn *conn = stream->conn;
+        stream_fill(conn, buf_size(conn->outgoing) + output_high());
+        if (!conn->want_write) {
+            conn->want_read = false;
+            conn->want_write = true;
+            handle_write(conn);
+        }
+    }
+}
+
+// runs the requests that queued up behind a finished BLPOP
+static void process_resumed() {
+    while (!dlist_empty(&g_data.resume_list)) {
+        Conn *conn = container_of(g_data.resume_list.next, Conn, resume_node);
+        dlist_detach(&conn->resume_node);
+        dlist_init(&conn->resume_node);
+        if (conn->want_close) {
+            continue;
+        }
+        while (try_one_request(conn)) {}
+        if (!buf_empty(conn->outgoing) && !conn->want_write) {
+            conn->want_read = false;
+            conn->want_write = true;
+            handle_write(conn);
+        }
+    }
+}
 
+// Called before polling an active shm connection: asks the client to
+// signal our eventfd once there is something to do. If there already is,
+// signal it ourselves so that poll() returns right away.
+static void shm_prepare_poll(Conn *conn) {
+    ShmConn *shm = conn->shm;
+    bool sleep = true;
+    if (conn->want_read) {
+        sleep = shm_park_reader(&shm->req);
+    } else if (conn->want_write) {
+        sleep = shm_park_writer(&shm->resp);
+    }
+    if (!sleep) {
+        efd_signal(shm->efd);
+    }
+}
+
+static void handle_shm(Conn *conn) {
+    uint64_t val = 0;
+    (void)read(conn->shm->efd, &val, sizeof(val));
+    if (conn->want_read) {
+        handle_read(conn);
+    } else if (conn->want_write) {
+        handle_write(conn);
+    }
+}
+
+// with `reuse_port`, several sockets accept on the port, each getting a
+// share of the connections
+static int listen_tcp(uint16_t port, bool reuse_port) {
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0) {
         die("socket()");
     }
     int val = 1;
     setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    if (reuse_port) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+    }
 
     struct sockaddr_in addr = {};
     addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
+    addr.sin_port = ntohs(port);
     addr.sin_addr.s_addr = ntohl(0);
     int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
     if (rv) {
@@ -788,26 +5256,460 @@ int main() {
     if (rv) {
         die("listen()");
     }
+    return fd;
+}
+
+static int listen_unix(const char *path) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        msg("unix socket path is too long");
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+
+    // a socket nobody accepts on is left over from a previous run; one
+    // that still answers (or has a full backlog) belongs to another server,
+    // and anything else there is not ours to replace
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "%s exists and is not a socket\n", path);
+            exit(1);
+        }
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (probe < 0) {
+            die("socket()");
+        }
+        int rv = connect(probe, (const sockaddr *)&addr, sizeof(addr));
+        int err = errno;
+        close(probe);
+        if (rv == 0 || err == EAGAIN) {
+            fprintf(stderr, "%s is in use by another server\n", path);
+            exit(1);
+        }
+        if (err == ECONNREFUSED) {
+            (void)unlink(path);
+        }
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+    if (bind(fd, (const sockaddr *)&addr, sizeof(addr))) {
+        die("bind()");
+    }
+    fd_set_nb(fd);
+    if (listen(fd, SOMAXCONN)) {
+        die("listen()");
+    }
+    return fd;
+}
+
+// reader threads, see Reader
+static Entry *db_find_shared(std::string &s) {
+    LookupKey key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *node = hm_find_shared(&g_data.db, &key.node, &entry_eq);
+    return node ? container_of(node, Entry, node) : NULL;
+}
+
+// out_entry_str() for readers: a consistent (enc, value) pair, and a
+// reference to the RcBuf taken before it can be retired
+static void out_entry_str_shared(Buffer &out, Entry *ent) {
+    while (true) {
+        uint32_t seq = __atomic_load_n(&ent->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        uint32_t enc = __atomic_load_n(&ent->enc, __ATOMIC_RELAXED);
+        int64_t ival = __atomic_load_n(&ent->ival, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&ent->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+        if (enc == ENC_INT) {
+            char buf[32];
+            int len = snprintf(buf, sizeof(buf), "%lld", (long long)ival);
+            return out_str(out, buf, (size_t)len);
+        }
+        // no ENC_RAW values with readers, see str_ref_min()
+        assert(enc == ENC_REF);
+        return out_str_ref(out, (RcBuf *)(uintptr_t)ival);
+    }
+}
+
+static void read_request(std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() == 2 && cmd[0] == "get") {
+        Entry *ent = db_find_shared(cmd[1]);
+        if (!ent) {
+            return out_nil(out);
+        }
+        if (ent->type != T_STR) {
+            return out_err(out, ERR_BAD_TYP, "not a string value");
+        }
+        return out_entry_str_shared(out, ent);
+    } else if (cmd.size() >= 2 && cmd[0] == "mget") {
+        out_arr(out, (uint32_t)(cmd.size() - 1));
+        for (size_t i = 1; i < cmd.size(); i++) {
+            Entry *ent = db_find_shared(cmd[i]);
+            if (!ent || ent->type != T_STR) {
+                out_nil(out);
+            } else {
+                out_entry_str_shared(out, ent);
+            }
+        }
+    } else if (cmd.size() == 3 && cmd[0] == "zscore") {
+        Entry *ent = db_find_shared(cmd[1]);
+        if (!ent) {
+            return out_nil(out);
+        }
+        if (ent->type != T_ZSET) {
+            return out_err(out, ERR_BAD_TYP, "expect zset");
+        }
+        double score = 0;
+        const std::string &name = cmd[2];
+        if (!zset_score_shared(&ent->zset, name.data(), name.size(), &score)) {
+            return out_nil(out);
+        }
+        return out_dbl(out, score);
+    } else {
+        return out_err(out, ERR_UNKNOWN, "only get, mget and zscore on the read port");
+    }
+}
+
+static bool reader_try_request(Reader *r, ReadConn *conn) {
+    if (conn->incoming.data.size() < 4) {
+        return false;
+    }
+    uint32_t len = 0;
+    memcpy(&len, conn->incoming.data.data(), 4);
+    if (len > k_max_msg) {
+        msg("too long");
+        conn->want_close = true;
+        return false;
+    }
+    if (4 + len > conn->incoming.data.size()) {
+        return false;
+    }
+    std::vector<std::string> cmd;
+    if (parse_req(&conn->incoming.data[4], len, cmd) < 0) {
+        msg("bad request");
+        conn->want_close = true;
+        return false;
+    }
+    size_t header_pos = 0;
+    response_begin(conn->outgoing, &header_pos);
+    read_request(cmd, conn->outgoing);
+    response_end(conn->outgoing, header_pos);
+    buf_consume(conn->incoming, 4 + len);
+    r->requests.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+static void reader_write(ReadConn *conn) {
+    struct iovec iov[k_max_iov];
+    size_t niov = out_iov(conn->outgoing, iov, k_max_iov);
+    ssize_t rv = writev(conn->fd, iov, (int)niov);
+    if (rv < 0 && errno == EAGAIN) {
+        return;
+    }
+    if (rv < 0) {
+        msg_errno("write() error");
+        conn->want_close = true;
+        return;
+    }
+    buf_consume(conn->outgoing, (size_t)rv);
+    if (buf_empty(conn->outgoing)) {
+        conn->want_read = true;
+        conn->want_write = false;
+    }
+}
+
+static void reader_read(Reader *r, ReadConn *conn) {
+    uint8_t buf[64 * 1024];
+    ssize_t rv = read(conn->fd, buf, sizeof(buf));
+    if (rv < 0 && errno == EAGAIN) {
+        return;
+    }
+    if (rv <= 0) {
+        if (rv < 0) {
+            msg_errno("read() error");
+        }
+        conn->want_close = true;
+        return;
+    }
+    buf_append(conn->incoming, buf, (size_t)rv);
+
+    // the pipelined requests share one critical section
+    ebr_enter(&g_data.ebr, r->id);
+    while (reader_try_request(r, conn)) {}
+    ebr_exit(&g_data.ebr, r->id);
+
+    if (!buf_empty(conn->outgoing)) {
+        conn->want_read = false;
+        conn->want_write = true;
+        reader_write(conn);
+    }
+}
+
+static void reader_accept(Reader *r) {
+    int fd = accept(r->fd, NULL, NULL);
+    if (fd < 0) {
+        if (errno != EAGAIN) {
+            msg_errno("accept() error");
+        }
+        return;
+    }
+    fd_set_nb(fd);
+    ReadConn *conn = new ReadConn();
+    conn->fd = fd;
+    conn->last_active_ms = get_monotonic_msec();
+    r->conns.push_back(conn);
+    r->nconns.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void *reader_main(void *arg) {
+    Reader *r = (Reader *)arg;
+    std::vector<struct pollfd> poll_args;
+    while (true) {
+        poll_args.clear();
+        poll_args.push_back({r->fd, POLLIN, 0});
+        for (ReadConn *conn : r->conns) {
+            struct pollfd pfd = {conn->fd, POLLERR, 0};
+            if (conn->want_read) {
+                pfd.events |= POLLIN;
+            }
+            if (conn->want_write) {
+                pfd.events |= POLLOUT;
+            }
+            poll_args.push_back(pfd);
+        }
+        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), (int)k_idle_timeout_ms);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0) {
+            die("poll");
+        }
+
+        // new connections go after the polled ones
+        if (poll_args[0].revents) {
+            reader_accept(r);
+        }
+        uint64_t now_ms = get_monotonic_msec();
+        for (size_t i = 1; i < poll_args.size(); i++) {
+            ReadConn *conn = r->conns[i - 1];
+            uint32_t ready = poll_args[i].revents;
+            if (ready) {
+                conn->last_active_ms = now_ms;
+            }
+            if (ready & POLLIN) {
+                reader_read(r, conn);
+            }
+            if ((ready & POLLOUT) && !conn->want_close) {
+                reader_write(conn);
+            }
+            if ((ready & POLLERR) || conn->last_active_ms + k_idle_timeout_ms < now_ms) {
+                conn->want_close = true;
+            }
+        }
+
+        size_t n = 0;
+        for (ReadConn *conn : r->conns) {
+            if (!conn->want_close) {
+                r->conns[n++] = conn;
+                continue;
+            }
+            (void)close(conn->fd);
+            buf_clear(conn->outgoing);
+            delete conn;
+            r->nconns.fetch_sub(1, std::memory_order_relaxed);
+        }
+        r->conns.resize(n);
+    }
+    return NULL;
+}
+
+static void readers_start() {
+    ebr_init(&g_data.ebr, g_opt.readers);
+    g_data.db.free_tab = &free_shared;
+    // the defragmenter moves entries that readers may be looking at
+    g_opt.defrag_threshold = 0;
+
+    uint16_t port = g_opt.read_port ? g_opt.read_port : (uint16_t)(g_opt.port + 1);
+    for (size_t i = 0; i < g_opt.readers; i++) {
+        Reader *r = new Reader();
+        r->id = i;
+        r->fd = listen_tcp(port, true);
+        g_data.readers.push_back(r);
+        if (pthread_create(&r->thread, NULL, &reader_main, r) != 0) {
+            die("pthread_create()");
+        }
+    }
+}
+
+static void usage() {
+    fprintf(stderr,
+        "usage: server [options]\n"
+        "  --port N                   TCP port (1234)\n"
+        "  --unix-socket PATH         also listen on a Unix socket, \"\" to disable\n"
+        "                             (/tmp/in-memory-db.sock)\n"
+        "  --slowlog-threshold-us N   log requests slower than N us (10000)\n"
+        "  --slowlog-max-len N        entries kept in the slow log (128)\n"
+        "  --pubsub-output-limit N    drop subscribers with more than N bytes\n"
+        "                             of pending output, 0: no limit (32MB)\n"
+        "  --client-output-limit N    run no more requests of a client with N\n"
+        "                             bytes of pending output, and generate\n"
+        "                             larger KEYS and ZQUERY replies as it\n"
+        "                             reads, 0: no limit (1MB)\n"
+        "  --defrag-threshold F       defragment once the RSS is F times the\n"
+        "                             allocated bytes, 0: off (1.25)\n"
+        "  --defrag-slice-us N        run the defragmenter N us at a time (1000)\n"
+        "  --command-slice-us N       run KEYS and ZQUERY N us at a time, 0: at\n"
+        "                             once (1000)\n"
+        "  --readers N                serve GET, MGET and ZSCORE from N threads on\n"
+        "                             the read port, no defragmentation (0)\n"
+        "  --read-port N              the read port (--port + 1)\n"
+        "  --capture FILE             record the requests to FILE for bin/replay,\n"
+        "                             CAPTURE STOP and START end or restart it\n");
+    exit(1);
+}
+
+static void parse_args(int argc, char **argv) {
+    enum {
+        OPT_PORT = 256, OPT_UNIX_SOCKET,
+        OPT_SLOWLOG_THRESHOLD, OPT_SLOWLOG_MAX_LEN, OPT_PUBSUB_OUTPUT_LIMIT,
+        OPT_CLIENT_OUTPUT_LIMIT, OPT_COMMAND_SLICE,
+        OPT_DEFRAG_THRESHOLD, OPT_DEFRAG_SLICE, OPT_READERS, OPT_READ_PORT,
+        OPT_CAPTURE,
+    };
+    static const struct option opts[] = {
+        {"port", required_argument, NULL, OPT_PORT},
+        {"unix-socket", required_argument, NULL, OPT_UNIX_SOCKET},
+        {"slowlog-threshold-us", required_argument, NULL, OPT_SLOWLOG_THRESHOLD},
+        {"slowlog-max-len", required_argument, NULL, OPT_SLOWLOG_MAX_LEN},
+        {"pubsub-output-limit", required_argument, NULL, OPT_PUBSUB_OUTPUT_LIMIT},
+        {"client-output-limit", required_argument, NULL, OPT_CLIENT_OUTPUT_LIMIT},
+        {"command-slice-us", required_argument, NULL, OPT_COMMAND_SLICE},
+        {"defrag-threshold", required_argument, NULL, OPT_DEFRAG_THRESHOLD},
+        {"defrag-slice-us", required_argument, NULL, OPT_DEFRAG_SLICE},
+        {"readers", required_argument, NULL, OPT_READERS},
+        {"read-port", required_argument, NULL, OPT_READ_PORT},
+        {"capture", required_argument, NULL, OPT_CAPTURE},
+        {NULL, 0, NULL, 0},
+    };
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+        switch (opt) {
+        case OPT_PORT:
+            g_opt.port = (uint16_t)strtoul(optarg, NULL, 10);
+            break;
+        case OPT_UNIX_SOCKET:
+            g_opt.unix_path = optarg;
+            break;
+        case OPT_SLOWLOG_THRESHOLD:
+            g_opt.slowlog_threshold_us = strtoull(optarg, NULL, 10);
+            break;
+        case OPT_SLOWLOG_MAX_LEN:
+            g_opt.slowlog_max_len = strtoull(optarg, NULL, 10);
+            break;
+        case OPT_PUBSUB_OUTPUT_LIMIT:
+            g_opt.pubsub_output_limit = strtoull(optarg, NULL, 10);
+            break;
+        case OPT_CLIENT_OUTPUT_LIMIT:
+            g_opt.client_output_limit = strtoull(optarg, NULL, 10);
+            break;
+        case OPT_COMMAND_SLICE:
+            g_opt.command_slice_us = strtoull(optarg, NULL, 10);
+            break;
+        case OPT_DEFRAG_THRESHOLD:
+            g_opt.defrag_threshold = strtod(optarg, NULL);
+            break;
+        case OPT_DEFRAG_SLICE:
+            g_opt.defrag_slice_us = strtoull(optarg, NULL, 10);
+            break;
+        case OPT_READERS:
+            g_opt.readers = strtoull(optarg, NULL, 10);
+            break;
+        case OPT_READ_PORT:
+            g_opt.read_port = (uint16_t)strtoul(optarg, NULL, 10);
+            break;
+        case OPT_CAPTURE:
+            g_opt.capture_path = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+    // a client gone with output pending is an EPIPE from writev()
+    signal(SIGPIPE, SIG_IGN);
+    dlist_init(&g_data.idle_list);
+    dlist_init(&g_data.resume_list);
+    dlist_init(&g_data.streams);
+    dlist_init(&g_data.tasks);
+    dlist_init(&g_data.waiters);
+    dlist_init(&g_data.key_scans);
+    thread_pool_init(&g_data.thread_pool, 4);
+    commands_init();
+    g_data.stats.start_ms = get_monotonic_msec();
+
+    int listen_fds[2] = {listen_tcp(g_opt.port, false), -1};
+    if (!g_opt.unix_path.empty()) {
+        listen_fds[1] = listen_unix(g_opt.unix_path.c_str());
+    }
+    if (g_opt.readers) {
+        readers_start();
+    }
+    if (!g_opt.capture_path.empty() && !capture_start()) {
+        die("--capture");
+    }
 
     std::vector<struct pollfd> poll_args;
+    // the socket fd of the connection behind each entry of poll_args
+    std::vector<int> poll_conn_fd;
     while (true) {
         poll_args.clear();
-        struct pollfd pfd = {fd, POLLIN, 0};
-        poll_args.push_back(pfd);
+        poll_conn_fd.clear();
+        for (int lfd : listen_fds) {
+            struct pollfd pfd = {lfd, POLLIN, 0};   // ignored by poll if -1
+            poll_args.push_back(pfd);
+            poll_conn_fd.push_back(-1);
+        }
 
         for (Conn *conn : g_data.fd2conn) {
             if (!conn) {
                 continue;
             }
+            if (conn->want_close) {
+                conn_destroy(conn);     // e.g. a subscriber that fell behind
+                continue;
+            }
             struct pollfd pfd = {conn->fd, POLLERR, 0};
 
-            if (conn->want_read) {
-                pfd.events |= POLLIN;
-            }
-            if (conn->want_write) {
-                pfd.events |= POLLOUT;
+            if (conn->shm && conn->shm->active) {
+                // the socket is only watched for hangup, the rings
+                // wake us through the eventfd
+                poll_args.push_back(pfd);
+                poll_conn_fd.push_back(conn->fd);
+                pfd = {conn->shm->efd, POLLIN, 0};
+                shm_prepare_poll(conn);
+            } else {
+                if (conn->want_read) {
+                    pfd.events |= POLLIN;
+                }
+                if (conn->want_write) {
+                    pfd.events |= POLLOUT;
+                }
             }
             poll_args.push_back(pfd);
+            poll_conn_fd.push_back(conn->fd);
         }
 
         int32_t timeout_ms = next_timer_ms();
@@ -819,28 +5721,43 @@ int main() {
             die("poll");
         }
 
-        if (poll_args[0].revents) {
-            handle_accept(fd);
+        for (size_t i = 0; i < 2; i++) {
+            if (poll_args[i].revents) {
+                handle_accept(listen_fds[i], i == 1);
+            }
         }
 
-        for (size_t i = 1; i < poll_args.size(); ++i) { 
+        for (size_t i = 2; i < poll_args.size(); ++i) { 
             uint32_t ready = poll_args[i].revents;
             if (ready == 0) {
                 continue;
             }
-            Conn *conn = g_data.fd2conn[poll_args[i].fd];
-
-            conn->last_active_ms = get_monotonic_msec();
-            dlist_detach(&conn->idle_node);
-            dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+            Conn *conn = g_data.fd2conn[poll_conn_fd[i]];
+            if (!conn) {
+                continue;   // closed through its other entry
+            }
 
-            if (ready & POLLIN) {
-                assert(conn->want_read);
-                handle_read(conn);  
+            if (!conn->nsubs && !conn->blocked && !conn->task && !conn->waiting) {
+                conn->last_active_ms = get_monotonic_msec();
+                dlist_detach(&conn->idle_node);
+                dlist_insert_before(&g_data.idle_list, &conn->idle_node);
             }
-            if (ready & POLLOUT) {
-                assert(conn->want_write);
-                handle_write(conn);
+
+            if (conn->shm && conn->shm->active) {
+                if (poll_args[i].fd == conn->shm->efd) {
+                    handle_shm(conn);
+                } else if (ready & (POLLIN | POLLHUP)) {
+                    conn->want_close = true;    // EOF, or data on the socket
+                }
+            } else {
+                if (ready & POLLIN) {
+                    assert(conn->want_read);
+                    handle_read(conn);  
+                }
+                if (ready & POLLOUT) {
+                    assert(conn->want_write);
+                    handle_write(conn);
+                }
             }
 
             if ((ready & POLLERR) || conn->want_close) {
@@ -849,6 +5766,10 @@ int main() {
         }
 
         process_timers();
+        process_tasks();
+        process_streams();
+        process_resumed();
+        ebr_collect(&g_data.ebr);
     }
     return 0;
 }
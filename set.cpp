@@ -0,0 +1,777 @@
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits>
+#include <algorithm>
+#include <memory>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "set.h"
+#include "common.h"
+
+
+static SMember *smember_new(Set *set, const char *name, size_t len) {
+    SMember *node = (SMember *)malloc(sizeof(SMember) + len);
+    assert(node);
+    node->node.next = NULL;
+    node->node.hcode = str_hash((uint8_t *)name, len);
+    node->len = len;
+    memcpy(&node->name[0], name, len);
+    set->bytes += mem_usable(node);
+    return node;
+}
+
+static void smember_del(Set *set, SMember *node) {
+    set->bytes -= mem_usable(node);
+    free(node);
+}
+
+struct HKey {
+    HNode node;
+    const char *name = NULL;
+    size_t len = 0;
+};
+
+static bool hcmp(HNode *node, HNode *key) {
+    SMember *sm = container_of(node, SMember, node);
+    HKey *hkey = container_of(key, HKey, node);
+    return sm->len == hkey->len && 0 == memcmp(sm->name, hkey->name, sm->len);
+}
+
+static HNode *table_lookup(Set *set, const char *name, size_t len) {
+    HKey key;
+    key.node.hcode = str_hash((uint8_t *)name, len);
+    key.name = name;
+    key.len = len;
+    return hm_lookup(&set->hmap, &key.node, &hcmp);
+}
+
+static void table_add(Set *set, const char *name, size_t len) {
+    hm_insert(&set->hmap, &smember_new(set, name, len)->node);
+}
+
+// integer members
+
+static uint32_t int_width(int64_t v) {
+    if (v >= INT16_MIN && v <= INT16_MAX) {
+        return 2;
+    } else if (v >= INT32_MIN && v <= INT32_MAX) {
+        return 4;
+    }
+    return 8;
+}
+
+static int64_t int_load(const uint8_t *p, uint32_t width) {
+    if (width == 2) {
+        int16_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    } else if (width == 4) {
+        int32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    int64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void int_store(uint8_t *p, uint32_t width, int64_t v) {
+    if (width == 2) {
+        int16_t w = (int16_t)v;
+        memcpy(p, &w, sizeof(w));
+    } else if (width == 4) {
+        int32_t w = (int32_t)v;
+        memcpy(p, &w, sizeof(w));
+    } else {
+        memcpy(p, &v, sizeof(v));
+    }
+}
+
+static size_t ints_count(const Set *set) {
+    return set->nints;
+}
+
+static size_t chunk_count(const Set *set, const std::vector<uint8_t> &chunk) {
+    return chunk.size() / set->width;
+}
+
+static int64_t chunk_get(const Set *set, const std::vector<uint8_t> &chunk, size_t i) {
+    return int_load(chunk.data() + i * set->width, set->width);
+}
+
+static int64_t chunk_last(const Set *set, const std::vector<uint8_t> &chunk) {
+    return chunk_get(set, chunk, chunk_count(set, chunk) - 1);
+}
+
+// the index of the first member of the chunk not less than `v`
+static size_t chunk_lower_bound(const Set *set, const std::vector<uint8_t> &chunk, int64_t v) {
+    size_t lo = 0, hi = chunk_count(set, chunk);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (chunk_get(set, chunk, mid) < v) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// the chunk `v` belongs in, the first one whose last member is not less
+// than it (none past the last one), and its position there
+static bool ints_find(const Set *set, int64_t v, size_t *chunk, size_t *pos) {
+    size_t lo = 0, hi = set->ints.size();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (chunk_last(set, set->ints[mid]) < v) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *chunk = lo;
+    *pos = 0;
+    if (lo == set->ints.size()) {
+        return false;
+    }
+    *pos = chunk_lower_bound(set, set->ints[lo], v);
+    return chunk_get(set, set->ints[lo], *pos) == v;
+}
+
+static void ints_widen(Set *set, uint32_t width) {
+    for (std::vector<uint8_t> &chunk : set->ints) {
+        std::vector<uint8_t> wide(chunk_count(set, chunk) * width);
+        for (size_t i = 0; i < chunk_count(set, chunk); i++) {
+            int_store(wide.data() + i * width, width, chunk_get(set, chunk, i));
+        }
+        chunk.swap(wide);
+    }
+    set->width = width;
+}
+
+// `v` is not a member yet; a chunk over k_set_chunk_max splits in halves
+static void ints_insert(Set *set, int64_t v) {
+    if (int_width(v) > set->width) {
+        ints_widen(set, int_width(v));
+    }
+    size_t ci = 0, pos = 0;
+    ints_find(set, v, &ci, &pos);
+    if (ci == set->ints.size()) {
+        if (set->ints.empty()) {
+            set->ints.emplace_back();
+        }
+        ci = set->ints.size() - 1;
+        pos = chunk_count(set, set->ints[ci]);
+    }
+    std::vector<uint8_t> &chunk = set->ints[ci];
+    chunk.insert(chunk.begin() + pos * set->width, set->width, 0);
+    int_store(chunk.data() + pos * set->width, set->width, v);
+    set->nints++;
+    if (chunk_count(set, chunk) > k_set_chunk_max) {
+        size_t half = chunk_count(set, chunk) / 2 * set->width;
+        std::vector<uint8_t> upper(chunk.begin() + half, chunk.end());
+        chunk.resize(half);
+        set->ints.insert(set->ints.begin() + ci + 1, std::move(upper));
+    }
+}
+
+// a chunk merges into a neighbour while both fit in half a chunk, so
+// deletes do not leave the set in many small chunks
+static void ints_erase(Set *set, size_t ci, size_t pos) {
+    std::vector<uint8_t> &chunk = set->ints[ci];
+    auto it = chunk.begin() + pos * set->width;
+    chunk.erase(it, it + set->width);
+    set->nints--;
+    if (chunk.empty()) {
+        set->ints.erase(set->ints.begin() + ci);
+        return;
+    }
+    const size_t half = k_set_chunk_max / 2;
+    if (ci > 0 && chunk_count(set, set->ints[ci - 1]) + chunk_count(set, chunk) <= half) {
+        ci--;
+    } else if (ci + 1 == set->ints.size()
+        || chunk_count(set, chunk) + chunk_count(set, set->ints[ci + 1]) > half)
+    {
+        return;
+    }
+    std::vector<uint8_t> &lower = set->ints[ci];
+    lower.insert(lower.end(), set->ints[ci + 1].begin(), set->ints[ci + 1].end());
+    set->ints.erase(set->ints.begin() + ci + 1);
+}
+
+// members are appended in order to sets being built, leaving room in
+// each chunk for later adds
+const size_t k_chunk_fill = k_set_chunk_max / 4 * 3;
+
+static void ints_append(Set *set, int64_t v) {
+    if (set->ints.empty() || chunk_count(set, set->ints.back()) >= k_chunk_fill) {
+        set->ints.emplace_back();
+        set->ints.back().reserve(k_chunk_fill * set->width);
+    }
+    std::vector<uint8_t> &chunk = set->ints.back();
+    chunk.resize(chunk.size() + set->width);
+    int_store(chunk.data() + chunk.size() - set->width, set->width, v);
+    set->nints++;
+}
+
+static void ints_swap(Set *set, Set *from) {
+    set->ints.swap(from->ints);
+    std::swap(set->nints, from->nints);
+    std::swap(set->width, from->width);
+}
+
+// reads the members of a set in order
+struct IntCursor {
+    const Set *set = NULL;
+    size_t chunk = 0;
+    size_t pos = 0;
+};
+
+static bool cursor_valid(const IntCursor &cur) {
+    return cur.chunk < cur.set->ints.size();
+}
+
+static int64_t cursor_get(const IntCursor &cur) {
+    return chunk_get(cur.set, cur.set->ints[cur.chunk], cur.pos);
+}
+
+static void cursor_next(IntCursor &cur) {
+    if (++cur.pos == chunk_count(cur.set, cur.set->ints[cur.chunk])) {
+        cur.chunk++;
+        cur.pos = 0;
+    }
+}
+
+static void set_convert(Set *set) {
+    assert(set->enc == SET_INTS);
+    hm_reserve(&set->hmap, ints_count(set));
+    for (IntCursor cur{set}; cursor_valid(cur); cursor_next(cur)) {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "%lld", (long long)cursor_get(cur));
+        table_add(set, buf, (size_t)len);
+    }
+    std::vector<std::vector<uint8_t>>().swap(set->ints);
+    set->nints = 0;
+    set->enc = SET_TABLE;
+}
+
+bool set_add(Set *set, const char *name, size_t len) {
+    int64_t v = 0;
+    if (set->enc == SET_INTS && str_is_int(name, len, v)) {
+        size_t ci = 0, pos = 0;
+        if (ints_find(set, v, &ci, &pos)) {
+            return false;
+        }
+        if (ints_count(set) < k_set_ints_max) {
+            ints_insert(set, v);
+            return true;
+        }
+    }
+    if (set->enc == SET_INTS) {
+        set_convert(set);
+    }
+    if (table_lookup(set, name, len)) {
+        return false;
+    }
+    table_add(set, name, len);
+    return true;
+}
+
+size_t set_add_ints(Set *set, std::vector<int64_t> &vals) {
+    std::sort(vals.begin(), vals.end());
+    vals.erase(std::unique(vals.begin(), vals.end()), vals.end());
+    if (set->enc != SET_INTS || ints_count(set) + vals.size() > k_set_ints_max) {
+        size_t added = 0;
+        for (int64_t v : vals) {
+            char buf[32];
+            int len = snprintf(buf, sizeof(buf), "%lld", (long long)v);
+            added += set_add(set, buf, (size_t)len);
+        }
+        return added;
+    }
+    if (vals.empty()) {
+        return 0;
+    }
+    if (vals.size() * 64 < ints_count(set)) {
+        // cheaper one at a time than rewriting every chunk
+        size_t added = 0;
+        for (int64_t v : vals) {
+            size_t ci = 0, pos = 0;
+            if (!ints_find(set, v, &ci, &pos)) {
+                ints_insert(set, v);
+                added++;
+            }
+        }
+        return added;
+    }
+
+    Set merged;
+    merged.width = std::max({set->width, int_width(vals.front()), int_width(vals.back())});
+    IntCursor cur{set};
+    size_t j = 0, added = 0;
+    while (cursor_valid(cur) || j < vals.size()) {
+        int64_t v = 0;
+        if (j == vals.size() || (cursor_valid(cur) && cursor_get(cur) <= vals[j])) {
+            v = cursor_get(cur);
+            j += j < vals.size() && vals[j] == v;
+            cursor_next(cur);
+        } else {
+            v = vals[j++];
+            added++;
+        }
+        ints_append(&merged, v);
+    }
+    ints_swap(set, &merged);
+    return added;
+}
+
+bool set_del(Set *set, const char *name, size_t len) {
+    if (set->enc == SET_INTS) {
+        int64_t v = 0;
+        size_t ci = 0, pos = 0;
+        if (!str_is_int(name, len, v) || !ints_find(set, v, &ci, &pos)) {
+            return false;
+        }
+        ints_erase(set, ci, pos);
+        return true;
+    }
+    HKey key;
+    key.node.hcode = str_hash((uint8_t *)name, len);
+    key.name = name;
+    key.len = len;
+    HNode *found = hm_delete(&set->hmap, &key.node, &hcmp);
+    if (found) {
+        smember_del(set, container_of(found, SMember, node));
+    }
+    return found != NULL;
+}
+
+bool set_contains(Set *set, const char *name, size_t len) {
+    if (set->enc == SET_INTS) {
+        int64_t v = 0;
+        size_t ci = 0, pos = 0;
+        return str_is_int(name, len, v) && ints_find(set, v, &ci, &pos);
+    }
+    return table_lookup(set, name, len) != NULL;
+}
+
+size_t set_size(Set *set) {
+    return set->enc == SET_INTS ? ints_count(set) : hm_size(&set->hmap);
+}
+
+size_t set_bytes(const Set *set) {
+    size_t bytes = mem_usable(set->ints.data());
+    for (const std::vector<uint8_t> &chunk : set->ints) {
+        bytes += mem_usable(chunk.data());
+    }
+    return bytes + set->bytes + hm_bytes(&set->hmap);
+}
+
+struct SetForeachArg {
+    bool (*f)(const char *, size_t, void *) = NULL;
+    void *arg = NULL;
+};
+
+static bool cb_foreach(HNode *node, void *arg) {
+    SetForeachArg *fa = (SetForeachArg *)arg;
+    SMember *sm = container_of(node, SMember, node);
+    return fa->f(sm->name, sm->len, fa->arg);
+}
+
+void set_foreach(Set *set, bool (*f)(const char *name, size_t len, void *arg), void *arg) {
+    if (set->enc == SET_INTS) {
+        for (IntCursor cur{set}; cursor_valid(cur); cursor_next(cur)) {
+            char buf[32];
+            int len = snprintf(buf, sizeof(buf), "%lld", (long long)cursor_get(cur));
+            if (!f(buf, (size_t)len, arg)) {
+                return;
+            }
+        }
+        return;
+    }
+    SetForeachArg fa;
+    fa.f = f;
+    fa.arg = arg;
+    hm_foreach(&set->hmap, &cb_foreach, &fa);
+}
+
+static void htab_dispose(Set *set, HTab *htab) {
+    for (size_t i = 0; htab->tab && i <= htab->mask; i++) {
+        HNode *node = htab->tab[i];
+        while (node) {
+            HNode *next = node->next;
+            smember_del(set, container_of(node, SMember, node));
+            node = next;
+        }
+    }
+}
+
+void set_clear(Set *set) {
+    htab_dispose(set, &set->hmap.newer);
+    htab_dispose(set, &set->hmap.older);
+    hm_clear(&set->hmap);
+    std::vector<std::vector<uint8_t>>().swap(set->ints);
+    set->nints = 0;
+    set->enc = SET_INTS;
+    set->width = 2;
+}
+
+// sorted array intersection
+
+template <class T>
+static size_t inter_scalar(const T *a, size_t na, const T *b, size_t nb, T *out) {
+    size_t i = 0, j = 0, n = 0;
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) {
+            i++;
+        } else if (b[j] < a[i]) {
+            j++;
+        } else {
+            out[n++] = a[i];
+            i++;
+            j++;
+        }
+    }
+    return n;
+}
+
+// a binary search per member of the much smaller array
+template <class T>
+static size_t inter_gallop(const T *small, size_t ns, const T *large, size_t nl, T *out) {
+    const T *pos = large, *end = large + nl;
+    size_t n = 0;
+    for (size_t i = 0; i < ns && pos != end; i++) {
+        pos = std::lower_bound(pos, end, small[i]);
+        if (pos != end && *pos == small[i]) {
+            out[n++] = small[i];
+        }
+    }
+    return n;
+}
+
+#if defined(__x86_64__)
+
+// Block intersection: a block of `a` is compared against every rotation of
+// a block of `b`, so all pairs are compared in (lanes) instructions, then
+// whichever block ends lower is advanced (both if they end equal). The
+// matches are packed to the front of the block with a shuffle looked up by
+// the comparison mask and stored whole, so `out` needs a block of slack.
+
+// shuffle indices for each comparison mask
+struct ShuffleTables {
+    uint8_t w16[256][16];   // bytes, for pshufb
+    uint32_t w32[256][8];   // 32-bit lanes, for vpermd
+    uint32_t w64[16][8];
+
+    ShuffleTables() {
+        memset(this, 0, sizeof(*this));
+        for (uint32_t mask = 0; mask < 256; mask++) {
+            uint32_t k = 0;
+            for (uint32_t lane = 0; lane < 8; lane++) {
+                if (mask & (1u << lane)) {
+                    w16[mask][k * 2] = (uint8_t)(lane * 2);
+                    w16[mask][k * 2 + 1] = (uint8_t)(lane * 2 + 1);
+                    w32[mask][k++] = lane;
+                }
+            }
+        }
+        for (uint32_t mask = 0; mask < 16; mask++) {
+            uint32_t k = 0;
+            for (uint32_t lane = 0; lane < 4; lane++) {
+                if (mask & (1u << lane)) {
+                    w64[mask][k * 2] = lane * 2;
+                    w64[mask][k * 2 + 1] = lane * 2 + 1;
+                    k++;
+                }
+            }
+        }
+    }
+};
+
+static const ShuffleTables g_shuffle;
+
+__attribute__((target("avx2,popcnt")))
+static size_t inter_simd(const int16_t *a, size_t na, const int16_t *b, size_t nb, int16_t *out) {
+    size_t i = 0, j = 0, n = 0;
+    while (i + 8 <= na && j + 8 <= nb) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + j));
+        __m128i eq = _mm_or_si128(
+            _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi16(va, vb),
+                    _mm_cmpeq_epi16(va, _mm_alignr_epi8(vb, vb, 2))),
+                _mm_or_si128(_mm_cmpeq_epi16(va, _mm_alignr_epi8(vb, vb, 4)),
+                    _mm_cmpeq_epi16(va, _mm_alignr_epi8(vb, vb, 6)))),
+            _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi16(va, _mm_alignr_epi8(vb, vb, 8)),
+                    _mm_cmpeq_epi16(va, _mm_alignr_epi8(vb, vb, 10))),
+                _mm_or_si128(_mm_cmpeq_epi16(va, _mm_alignr_epi8(vb, vb, 12)),
+                    _mm_cmpeq_epi16(va, _mm_alignr_epi8(vb, vb, 14)))));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(eq, _mm_setzero_si128()));
+        __m128i idx = _mm_loadu_si128((const __m128i *)g_shuffle.w16[mask]);
+        _mm_storeu_si128((__m128i *)(out + n), _mm_shuffle_epi8(va, idx));
+        n += __builtin_popcount(mask);
+        int16_t amax = a[i + 7], bmax = b[j + 7];
+        i += amax <= bmax ? 8 : 0;
+        j += bmax <= amax ? 8 : 0;
+    }
+    return n + inter_scalar(a + i, na - i, b + j, nb - j, out + n);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t inter_simd(const int32_t *a, size_t na, const int32_t *b, size_t nb, int32_t *out) {
+    size_t i = 0, j = 0, n = 0;
+    while (i + 8 <= na && j + 8 <= nb) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + j));
+        __m256i eq = _mm256_cmpeq_epi32(va, vb);
+        for (int r = 1; r < 8; r++) {
+            // vpermd uses the low 3 bits of each index, so lane + r wraps around
+            __m256i rot = _mm256_add_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                _mm256_set1_epi32(r));
+            __m256i vr = _mm256_permutevar8x32_epi32(vb, rot);
+            eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(va, vr));
+        }
+        uint32_t mask = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(eq));
+        __m256i idx = _mm256_loadu_si256((const __m256i *)g_shuffle.w32[mask]);
+        _mm256_storeu_si256((__m256i *)(out + n), _mm256_permutevar8x32_epi32(va, idx));
+        n += __builtin_popcount(mask);
+        int32_t amax = a[i + 7], bmax = b[j + 7];
+        i += amax <= bmax ? 8 : 0;
+        j += bmax <= amax ? 8 : 0;
+    }
+    return n + inter_scalar(a + i, na - i, b + j, nb - j, out + n);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t inter_simd(const int64_t *a, size_t na, const int64_t *b, size_t nb, int64_t *out) {
+    size_t i = 0, j = 0, n = 0;
+    while (i + 4 <= na && j + 4 <= nb) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + j));
+        __m256i eq = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi64(va, vb),
+                _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x39))),
+            _mm256_or_si256(_mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x4e)),
+                _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x93))));
+        uint32_t mask = (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(eq));
+        __m256i idx = _mm256_loadu_si256((const __m256i *)g_shuffle.w64[mask]);
+        _mm256_storeu_si256((__m256i *)(out + n), _mm256_permutevar8x32_epi32(va, idx));
+        n += __builtin_popcount(mask);
+        int64_t amax = a[i + 3], bmax = b[j + 3];
+        i += amax <= bmax ? 4 : 0;
+        j += bmax <= amax ? 4 : 0;
+    }
+    return n + inter_scalar(a + i, na - i, b + j, nb - j, out + n);
+}
+
+static bool simd_supported() {
+    return __builtin_cpu_supports("avx2");
+}
+
+#else
+
+static bool simd_supported() {
+    return false;
+}
+
+#endif
+
+static bool g_use_simd = simd_supported();
+
+bool set_use_simd(bool on) {
+    g_use_simd = on && simd_supported();
+    return g_use_simd;
+}
+
+// elements the kernels may write past the end of the result
+const size_t k_block_slack = 8;
+
+template <class T>
+static size_t inter_sorted(const T *a, size_t na, const T *b, size_t nb, T *out) {
+    if (na > nb) {
+        std::swap(a, b);
+        std::swap(na, nb);
+    }
+    if (na * 32 < nb) {
+        return inter_gallop(a, na, b, nb, out);
+    }
+#if defined(__x86_64__)
+    if (g_use_simd) {
+        return inter_simd(a, na, b, nb, out);
+    }
+#endif
+    return inter_scalar(a, na, b, nb, out);
+}
+
+// The members of a chunk as an array of T. A wider chunk is narrowed to
+// the members within T's range, which are a contiguous run since they are
+// sorted.
+template <class T>
+static const T *chunk_as(const Set *set, const std::vector<uint8_t> &chunk,
+    std::vector<T> &tmp, size_t *n)
+{
+    if (set->width == sizeof(T)) {
+        *n = chunk_count(set, chunk);
+        return (const T *)chunk.data();
+    }
+    size_t lo = chunk_lower_bound(set, chunk, std::numeric_limits<T>::min());
+    size_t hi = chunk_lower_bound(set, chunk, std::numeric_limits<T>::max());
+    hi += hi < chunk_count(set, chunk)
+        && chunk_get(set, chunk, hi) == std::numeric_limits<T>::max();
+    tmp.resize(hi - lo);
+    for (size_t i = lo; i < hi; i++) {
+        tmp[i - lo] = (T)chunk_get(set, chunk, i);
+    }
+    *n = hi - lo;
+    return tmp.data();
+}
+
+// Walks the chunks of both sets in order, intersecting the part of each
+// pair that overlaps, then advancing whichever chunk ends lower.
+template <class T>
+static void ints_inter_as(const Set *a, const Set *b, Set *out) {
+    std::vector<T> tmp_a, tmp_b;
+    // not zeroed: only the part the kernels write is read
+    std::unique_ptr<T[]> res(new T[std::min(ints_count(a), ints_count(b)) + k_block_slack]);
+    size_t i = 0, j = 0, n = 0;
+    while (i < a->ints.size() && j < b->ints.size()) {
+        size_t na = 0, nb = 0;
+        const T *pa = chunk_as<T>(a, a->ints[i], tmp_a, &na);
+        const T *pb = chunk_as<T>(b, b->ints[j], tmp_b, &nb);
+        if (na > 0 && nb > 0) {
+            T lo = std::max(pa[0], pb[0]);
+            T hi = std::min(pa[na - 1], pb[nb - 1]);
+            const T *a0 = std::lower_bound(pa, pa + na, lo);
+            const T *a1 = std::upper_bound(a0, pa + na, hi);
+            const T *b0 = std::lower_bound(pb, pb + nb, lo);
+            const T *b1 = std::upper_bound(b0, pb + nb, hi);
+            if (a0 < a1 && b0 < b1) {
+                n += inter_sorted(a0, (size_t)(a1 - a0), b0, (size_t)(b1 - b0), res.get() + n);
+            }
+        }
+        int64_t amax = chunk_last(a, a->ints[i]), bmax = chunk_last(b, b->ints[j]);
+        i += amax <= bmax;
+        j += bmax <= amax;
+    }
+    Set result;
+    result.width = sizeof(T);
+    result.nints = n;
+    for (size_t k = 0; k < n; k += k_chunk_fill) {
+        const uint8_t *p = (const uint8_t *)(res.get() + k);
+        result.ints.emplace_back(p, p + std::min(n - k, k_chunk_fill) * sizeof(T));
+    }
+    ints_swap(out, &result);
+}
+
+// `out` may be `a` or `b`; the result has the narrower width of the two
+static void ints_inter(const Set *a, const Set *b, Set *out) {
+    switch (std::min(a->width, b->width)) {
+    case 2: return ints_inter_as<int16_t>(a, b, out);
+    case 4: return ints_inter_as<int32_t>(a, b, out);
+    default: return ints_inter_as<int64_t>(a, b, out);
+    }
+}
+
+static void ints_union(const Set *a, const Set *b, Set *out) {
+    Set merged;
+    merged.width = std::max(a->width, b->width);
+    IntCursor ca{a}, cb{b};
+    while (cursor_valid(ca) || cursor_valid(cb)) {
+        int64_t v = 0;
+        if (!cursor_valid(cb) || (cursor_valid(ca) && cursor_get(ca) <= cursor_get(cb))) {
+            v = cursor_get(ca);
+            if (cursor_valid(cb) && cursor_get(cb) == v) {
+                cursor_next(cb);
+            }
+            cursor_next(ca);
+        } else {
+            v = cursor_get(cb);
+            cursor_next(cb);
+        }
+        ints_append(&merged, v);
+    }
+    ints_swap(out, &merged);
+}
+
+static bool cb_add(const char *name, size_t len, void *arg) {
+    set_add((Set *)arg, name, len);
+    return true;
+}
+
+struct InterArg {
+    Set **sets = NULL;
+    size_t n = 0;
+    Set *out = NULL;
+};
+
+static bool cb_inter(const char *name, size_t len, void *arg) {
+    InterArg *ia = (InterArg *)arg;
+    for (size_t i = 1; i < ia->n; i++) {
+        if (!set_contains(ia->sets[i], name, len)) {
+            return true;
+        }
+    }
+    set_add(ia->out, name, len);
+    return true;
+}
+
+static bool all_ints(Set **sets, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (sets[i]->enc != SET_INTS) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Intersects the smallest sets first. Integer sets are intersected as
+// sorted arrays; otherwise the smallest set is probed against the others.
+void set_inter(Set **sets, size_t n, Set *out) {
+    assert(set_size(out) == 0);
+    if (n == 0) {
+        return;
+    }
+    std::vector<Set *> order(sets, sets + n);
+    std::sort(order.begin(), order.end(), [](Set *a, Set *b) {
+        return set_size(a) < set_size(b);
+    });
+    if (all_ints(order.data(), n)) {
+        out->ints = order[0]->ints;
+        out->nints = order[0]->nints;
+        out->width = order[0]->width;
+        for (size_t i = 1; i < n && !out->ints.empty(); i++) {
+            ints_inter(out, order[i], out);
+        }
+        return;
+    }
+    InterArg ia;
+    ia.sets = order.data();
+    ia.n = n;
+    ia.out = out;
+    set_foreach(order[0], &cb_inter, &ia);
+}
+
+void set_union(Set **sets, size_t n, Set *out) {
+    assert(set_size(out) == 0);
+    if (all_ints(sets, n)) {
+        for (size_t i = 0; i < n; i++) {
+            ints_union(out, sets[i], out);
+        }
+        if (ints_count(out) <= k_set_ints_max) {
+            return;
+        }
+        Set all;
+        ints_swap(&all, out);
+        set_clear(out);
+        set_foreach(&all, &cb_add, out);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        set_foreach(sets[i], &cb_add, out);
+    }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "hashtable.h"
+
+
+// Unordered set of strings. While every member is the canonical decimal
+// form of an int64, the members are kept sorted in the narrowest integer
+// width that holds them all (2, 4 or 8 bytes), which intersects with SIMD
+// block compares. They are split in chunks of at most k_set_chunk_max, so
+// that a single add or delete only moves the members of one chunk. Any
+// other member, or more than k_set_ints_max members, converts the set to
+// a table of SMember nodes.
+enum {
+    SET_INTS = 0,
+    SET_TABLE = 1,
+};
+
+const size_t k_set_ints_max = 1 << 22;
+const size_t k_set_chunk_max = 4096;
+
+struct Set {
+    uint32_t enc = SET_INTS;
+    uint32_t width = 2;         // SET_INTS: bytes per member
+    // SET_INTS: none empty, each above the one before
+    std::vector<std::vector<uint8_t>> ints;
+    size_t nints = 0;           // SET_INTS: in all of the chunks
+    HMap hmap;                  // SET_TABLE
+    size_t bytes = 0;           // SET_TABLE: of the SMember nodes
+};
+
+struct SMember {
+    HNode   node;
+    size_t  len = 0;
+    char    name[0];
+};
+
+bool   set_add(Set *set, const char *name, size_t len);
+// adds the integers in bulk, with one merge unless they are few next to
+// the members; returns the number added
+size_t set_add_ints(Set *set, std::vector<int64_t> &vals);
+bool   set_del(Set *set, const char *name, size_t len);
+bool   set_contains(Set *set, const char *name, size_t len);
+size_t set_size(Set *set);
+// the heap bytes of the members and the hash table
+size_t set_bytes(const Set *set);
+void   set_foreach(Set *set, bool (*f)(const char *name, size_t len, void *arg), void *arg);
+void   set_clear(Set *set);
+
+// the intersection or union of `n` sets, into the empty `out`
+void   set_inter(Set **sets, size_t n, Set *out);
+void   set_union(Set **sets, size_t n, Set *out);
+
+// the SIMD kernels are used if the CPU supports them and this is on;
+// returns whether they are used
+bool   set_use_simd(bool on);
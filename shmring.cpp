@@ -0,0 +1,122 @@
+#include <assert.h>
+#include <string.h>
+#include <new>
+#include <algorithm>
+#include "shmring.h"
+
+
+static size_t ring_stride(size_t ring_size) {
+    return sizeof(ShmRing) + ring_size;
+}
+
+size_t shm_map_size(size_t ring_size) {
+    return sizeof(ShmHeader) + 2 * ring_stride(ring_size);
+}
+
+static ShmRing *shm_ring(void *base, size_t ring_size, int ring) {
+    uint8_t *p = (uint8_t *)base + sizeof(ShmHeader);
+    return (ShmRing *)(p + (size_t)ring * ring_stride(ring_size));
+}
+
+void shm_init(void *base, size_t ring_size) {
+    assert((ring_size & (ring_size - 1)) == 0);
+    ShmHeader *hdr = new (base) ShmHeader();
+    hdr->magic = k_shm_magic;
+    hdr->version = k_shm_version;
+    hdr->ring_size = ring_size;
+    for (int i = 0; i < 2; i++) {
+        ShmRing *ring = new (shm_ring(base, ring_size, i)) ShmRing();
+        ring->head.store(0, std::memory_order_relaxed);
+        ring->tail.store(0, std::memory_order_relaxed);
+        ring->producer_waiting.store(0, std::memory_order_relaxed);
+        ring->consumer_waiting.store(0, std::memory_order_relaxed);
+    }
+}
+
+void shm_end_init(ShmEnd *end, void *base, size_t ring_size, int ring) {
+    end->ring = shm_ring(base, ring_size, ring);
+    end->data = (uint8_t *)(end->ring + 1);
+    end->cap = ring_size;
+    end->pos = 0;
+}
+
+int64_t shm_writev(ShmEnd *w, const struct iovec *iov, size_t niov) {
+    uint64_t tail = w->ring->tail.load(std::memory_order_acquire);
+    uint64_t used = w->pos - tail;
+    if (used > w->cap) {
+        return -1;
+    }
+    uint64_t head = w->pos;
+    uint64_t space = w->cap - used;
+    for (size_t i = 0; i < niov && space > 0; i++) {
+        const uint8_t *src = (const uint8_t *)iov[i].iov_base;
+        size_t n = (size_t)std::min<uint64_t>(iov[i].iov_len, space);
+        size_t off = (size_t)(head & (w->cap - 1));
+        size_t first = std::min(n, (size_t)w->cap - off);
+        memcpy(w->data + off, src, first);
+        memcpy(w->data, src + first, n - first);
+        head += n;
+        space -= n;
+    }
+    int64_t moved = (int64_t)(head - w->pos);
+    if (moved) {
+        w->pos = head;
+        w->ring->head.store(head, std::memory_order_release);
+    }
+    return moved;
+}
+
+int64_t shm_read(ShmEnd *r, void *buf, size_t len) {
+    uint64_t head = r->ring->head.load(std::memory_order_acquire);
+    uint64_t avail = head - r->pos;
+    if (avail > r->cap) {
+        return -1;
+    }
+    size_t n = (size_t)std::min<uint64_t>(avail, len);
+    size_t off = (size_t)(r->pos & (r->cap - 1));
+    size_t first = std::min(n, (size_t)r->cap - off);
+    memcpy(buf, r->data + off, first);
+    memcpy((uint8_t *)buf + first, r->data, n - first);
+    if (n) {
+        r->pos += n;
+        r->ring->tail.store(r->pos, std::memory_order_release);
+    }
+    return (int64_t)n;
+}
+
+// The waiting flag and the peer's counter form a Dekker pair: the sleeper
+// stores the flag then loads the counter, the other side stores the counter
+// then loads the flag, with a full fence in between on both sides, so at
+// least one of them sees the other's store and no wakeup is lost.
+
+bool shm_park_reader(ShmEnd *r) {
+    r->ring->consumer_waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (r->ring->head.load(std::memory_order_relaxed) != r->pos) {
+        r->ring->consumer_waiting.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+bool shm_park_writer(ShmEnd *w) {
+    w->ring->producer_waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (w->pos - w->ring->tail.load(std::memory_order_relaxed) < w->cap) {
+        w->ring->producer_waiting.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+bool shm_wake_reader(ShmEnd *w) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return w->ring->consumer_waiting.load(std::memory_order_relaxed)
+        && w->ring->consumer_waiting.exchange(0, std::memory_order_relaxed);
+}
+
+bool shm_wake_writer(ShmEnd *r) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return r->ring->producer_waiting.load(std::memory_order_relaxed)
+        && r->ring->producer_waiting.exchange(0, std::memory_order_relaxed);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <atomic>
+
+
+// Single-producer single-consumer byte ring living in memory shared by the
+// server and a co-located client. Each direction of a connection gets one
+// ring and carries exactly the same length-prefixed stream as the socket.
+//
+// The counters only ever grow; `head - tail` is the number of unread bytes.
+// A side that runs out of work sets its *_waiting flag and sleeps on an
+// eventfd; the other side checks the flag after publishing and signals.
+struct ShmRing {
+    alignas(64) std::atomic<uint64_t> head;     // bytes written, producer
+    std::atomic<uint32_t> producer_waiting;     // producer waits for space
+    alignas(64) std::atomic<uint64_t> tail;     // bytes read, consumer
+    std::atomic<uint32_t> consumer_waiting;     // consumer waits for data
+};
+
+// the start of the shared mapping, followed by the request ring (client to
+// server) and the response ring (server to client), each sizeof(ShmRing)
+// plus ring_size bytes of data
+struct ShmHeader {
+    alignas(64) uint32_t magic;
+    uint32_t version;
+    uint64_t ring_size;
+};
+
+const uint32_t k_shm_magic = 0x4d485349;  // "ISHM"
+const uint32_t k_shm_version = 1;
+const size_t k_shm_min_ring = 4 << 10;
+const size_t k_shm_max_ring = 64 << 20;
+
+// One side's process-local view of a ring. Its own counter and the ring
+// size are kept here, outside of the shared mapping, so that a misbehaving
+// peer can only corrupt the stream and not make us read or write out of
+// bounds.
+struct ShmEnd {
+    ShmRing *ring = NULL;
+    uint8_t *data = NULL;
+    uint64_t cap = 0;
+    uint64_t pos = 0;   // head for the producer, tail for the consumer
+};
+
+size_t shm_map_size(size_t ring_size);
+void   shm_init(void *base, size_t ring_size);
+// ring 0 carries requests, ring 1 responses
+void   shm_end_init(ShmEnd *end, void *base, size_t ring_size, int ring);
+
+// both return the number of bytes moved (0 if full / empty), or -1 if
+// the peer's counter is inconsistent
+int64_t shm_writev(ShmEnd *w, const struct iovec *iov, size_t niov);
+int64_t shm_read(ShmEnd *r, void *buf, size_t len);
+
+// called before sleeping: return false (and do not sleep) if the ring
+// became ready in the meantime
+bool shm_park_reader(ShmEnd *r);
+bool shm_park_writer(ShmEnd *w);
+// called after moving bytes: return true if the peer must be signaled
+bool shm_wake_reader(ShmEnd *w);
+bool shm_wake_writer(ShmEnd *r);
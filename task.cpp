@@ -0,0 +1,40 @@
+#include <assert.h>
+#include <time.h>
+
+#include "task.h"
+
+
+// the slice of the task being run; only one runs at a time
+static uint64_t g_deadline_ns = 0;
+static uint32_t g_steps = 0;
+
+// the clock is read every so many yield points
+const uint32_t k_clock_steps = 64;
+
+static uint64_t monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+bool TaskYield::await_ready() noexcept {
+    if (++g_steps % k_clock_steps != 0) {
+        return true;
+    }
+    return monotonic_nsec() < g_deadline_ns;
+}
+
+bool task_run(Task *task, uint64_t deadline_ns) {
+    assert(task->handle && !task->handle.done());
+    g_deadline_ns = deadline_ns;
+    g_steps = 0;
+    task->handle.resume();
+    return task->handle.done();
+}
+
+void task_destroy(Task *task) {
+    if (task->handle) {
+        task->handle.destroy();
+        task->handle = nullptr;
+    }
+}
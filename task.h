@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <coroutine>
+#include <exception>
+
+
+// Command handlers that may run for long are C++20 coroutines returning a
+// Task. A task starts suspended; task_run() runs it for a slice, and the
+// handler gives the rest of the slice up with `co_await task_yield()` at
+// the points where it may stop, so that the event loop can serve other
+// clients in between.
+struct Task {
+    struct promise_type {
+        Task get_return_object() {
+            return Task{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+    std::coroutine_handle<promise_type> handle;
+};
+
+struct TaskYield {
+    bool await_ready() noexcept;    // true while the slice lasts
+    void await_suspend(std::coroutine_handle<>) noexcept {}
+    void await_resume() noexcept {}
+};
+
+// a point where the task may be suspended; cheap enough to reach once per
+// node visited
+inline TaskYield task_yield() {
+    return TaskYield{};
+}
+
+// runs the task until it yields past `deadline_ns` (CLOCK_MONOTONIC) or
+// returns; true once it has returned
+bool task_run(Task *task, uint64_t deadline_ns);
+void task_destroy(Task *task);
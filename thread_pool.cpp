@@ -1,4 +1,6 @@
 #include <assert.h>
+#include <atomic>
+#include <algorithm>
 #include "thread_pool.h"
 
 
@@ -40,3 +42,79 @@ void thread_pool_queue(TheadPool *tp, void (*f)(void *), void *arg) {
     pthread_cond_signal(&tp->not_empty);
     pthread_mutex_unlock(&tp->mu);
 }
+
+size_t thread_pool_pending(TheadPool *tp) {
+    pthread_mutex_lock(&tp->mu);
+    size_t n = tp->queue.size();
+    pthread_mutex_unlock(&tp->mu);
+    return n;
+}
+
+// A thread_pool_run() call. Workers may still be stuck behind older work
+// when the caller has already finished every index on its own, so the
+// job is freed by whoever lets go of it last.
+struct ParallelJob {
+    void (*f)(void *, size_t) = NULL;
+    void *arg = NULL;
+    size_t n = 0;
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> done{0};
+    std::atomic<size_t> refs{0};
+    pthread_mutex_t mu;
+    pthread_cond_t all_done;
+};
+
+static void job_release(ParallelJob *job) {
+    if (job->refs.fetch_sub(1) == 1) {
+        pthread_cond_destroy(&job->all_done);
+        pthread_mutex_destroy(&job->mu);
+        delete job;
+    }
+}
+
+static void job_work(ParallelJob *job) {
+    size_t i = 0;
+    while ((i = job->next.fetch_add(1)) < job->n) {
+        job->f(job->arg, i);
+        if (job->done.fetch_add(1) + 1 == job->n) {
+            pthread_mutex_lock(&job->mu);
+            pthread_cond_signal(&job->all_done);
+            pthread_mutex_unlock(&job->mu);
+        }
+    }
+}
+
+static void job_helper(void *arg) {
+    ParallelJob *job = (ParallelJob *)arg;
+    job_work(job);
+    job_release(job);
+}
+
+void thread_pool_run(TheadPool *tp, size_t n, void (*f)(void *, size_t), void *arg) {
+    if (n <= 1) {
+        for (size_t i = 0; i < n; i++) {
+            f(arg, i);
+        }
+        return;
+    }
+    ParallelJob *job = new ParallelJob();
+    job->f = f;
+    job->arg = arg;
+    job->n = n;
+    pthread_mutex_init(&job->mu, NULL);
+    pthread_cond_init(&job->all_done, NULL);
+
+    size_t nhelpers = std::min(tp->threads.size(), n - 1);
+    job->refs = nhelpers + 1;
+    for (size_t i = 0; i < nhelpers; i++) {
+        thread_pool_queue(tp, &job_helper, job);
+    }
+    job_work(job);
+
+    pthread_mutex_lock(&job->mu);
+    while (job->done.load() < n) {
+        pthread_cond_wait(&job->all_done, &job->mu);
+    }
+    pthread_mutex_unlock(&job->mu);
+    job_release(job);
+}
@@ -20,3 +20,7 @@ struct TheadPool {
 
 void thread_pool_init(TheadPool *tp, size_t num_threads);
 void thread_pool_queue(TheadPool *tp, void (*f)(void *), void *arg);
+size_t thread_pool_pending(TheadPool *tp);
+// runs f(arg, 0) .. f(arg, n - 1) on the pool and the calling thread, and
+// returns once all of them are done
+void thread_pool_run(TheadPool *tp, size_t n, void (*f)(void *, size_t), void *arg);
@@ -0,0 +1,370 @@
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+#include "ts.h"
+
+
+// Bits are packed MSB first into 64-bit words.
+
+static void bits_put(TsChunk *c, uint64_t v, uint32_t n) {
+    assert(n >= 1 && n <= 64);
+    if (n < 64) {
+        v &= (1ull << n) - 1;
+    }
+    uint32_t used = (uint32_t)(c->nbits % 64);
+    if (used == 0) {
+        c->words.push_back(0);
+    }
+    uint32_t room = 64 - used;
+    if (n <= room) {
+        c->words.back() |= v << (room - n);
+    } else {
+        c->words.back() |= v >> (n - room);
+        c->words.push_back(v << (64 - (n - room)));
+    }
+    c->nbits += n;
+}
+
+struct BitReader {
+    const uint64_t *words = NULL;
+    size_t nwords = 0;
+    size_t pos = 0;
+};
+
+// the next 64 bits, zero past the end
+static uint64_t bits_peek(const BitReader &r) {
+    size_t i = r.pos / 64;
+    uint32_t used = (uint32_t)(r.pos % 64);
+    uint64_t v = r.words[i] << used;
+    if (used && i + 1 < r.nwords) {
+        v |= r.words[i + 1] >> (64 - used);
+    }
+    return v;
+}
+
+static uint64_t bits_get(BitReader &r, uint32_t n) {
+    uint64_t v = bits_peek(r) >> (64 - n);
+    r.pos += n;
+    return v;
+}
+
+static int64_t sign_extend(uint64_t v, uint32_t n) {
+    return (int64_t)(v << (64 - n)) >> (64 - n);
+}
+
+static uint64_t dbl_bits(double val) {
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    return bits;
+}
+
+static double bits_dbl(uint64_t bits) {
+    double val;
+    memcpy(&val, &bits, sizeof(val));
+    return val;
+}
+
+// delta-of-delta of the timestamps: '0' for none, then prefixes of 2 to
+// 5 bits for 7, 9, 12, 32 and 64-bit values
+static void put_dod(TsChunk *c, int64_t dod) {
+    if (dod == 0) {
+        return bits_put(c, 0, 1);
+    }
+    static const uint32_t widths[] = {7, 9, 12, 32};
+    for (uint32_t i = 0; i < 4; i++) {
+        int64_t half = (int64_t)1 << (widths[i] - 1);
+        if (dod >= -half && dod < half) {
+            // i + 1 ones then a zero
+            bits_put(c, ((1ull << (i + 2)) - 2), i + 2);
+            return bits_put(c, (uint64_t)dod, widths[i]);
+        }
+    }
+    bits_put(c, 0x1f, 5);
+    bits_put(c, (uint64_t)dod, 64);
+}
+
+// XOR with the previous value: '0' for none, '10' and the bits in the
+// previous window if they fit in it, else '11', the leading zeros and
+// the length of the window in 6 bits each, then the bits
+static void put_xor(TsChunk *c, uint64_t x) {
+    if (x == 0) {
+        return bits_put(c, 0, 1);
+    }
+    uint32_t lead = (uint32_t)__builtin_clzll(x);
+    uint32_t trail = (uint32_t)__builtin_ctzll(x);
+    if (lead >= c->lead && trail >= c->trail) {
+        bits_put(c, 2, 2);
+        return bits_put(c, x >> c->trail, 64 - c->lead - c->trail);
+    }
+    uint32_t sig = 64 - lead - trail;
+    bits_put(c, 3, 2);
+    bits_put(c, lead, 6);
+    bits_put(c, sig - 1, 6);
+    bits_put(c, x >> trail, sig);
+    c->lead = lead;
+    c->trail = trail;
+}
+
+// decodes a chunk sample by sample
+struct TsDecoder {
+    BitReader r;
+    uint32_t left = 0;
+    bool started = false;
+    int64_t ts = 0;
+    int64_t delta = 0;
+    uint64_t val = 0;
+    uint32_t lead = 0;
+    uint32_t trail = 0;
+};
+
+static void dec_init(TsDecoder &d, const TsChunk &c) {
+    d = TsDecoder();
+    d.r.words = c.words.data();
+    d.r.nwords = c.words.size();
+    d.left = c.count;
+    d.ts = c.first_ts;
+    d.val = c.first_val;
+}
+
+// Both fields of a sample are decoded from one 64-bit window: the
+// timestamp takes at most 37 bits unless it needs all 64, and the value
+// header 14 more.
+static bool dec_next(TsDecoder &d) {
+    if (d.left == 0) {
+        return false;
+    }
+    d.left--;
+    if (!d.started) {
+        d.started = true;   // the first sample is in the chunk header
+        return true;
+    }
+    uint64_t w = bits_peek(d.r);
+    uint32_t used = 1;
+    int64_t dod = 0;
+    if (w >> 63) {
+        static const uint32_t widths[] = {7, 9, 12, 32};
+        uint32_t ones = std::min((uint32_t)__builtin_clzll(~w | 1), 5u);
+        if (ones < 5) {
+            uint32_t width = widths[ones - 1];
+            dod = sign_extend((w << (ones + 1)) >> (64 - width), width);
+            used = ones + 1 + width;
+        } else {
+            d.r.pos += 5;
+            dod = (int64_t)bits_get(d.r, 64);
+            w = bits_peek(d.r);
+            used = 0;
+        }
+    }
+    // wrapping arithmetic, as when encoding
+    d.delta = (int64_t)((uint64_t)d.delta + (uint64_t)dod);
+    d.ts = (int64_t)((uint64_t)d.ts + (uint64_t)d.delta);
+
+    w <<= used;
+    if (!(w >> 63)) {
+        d.r.pos += used + 1;
+        return true;
+    }
+    if ((w >> 62) == 3) {
+        d.lead = (uint32_t)(w >> 56) & 63;
+        d.trail = 64 - d.lead - (((uint32_t)(w >> 50) & 63) + 1);
+        used += 14;
+        w <<= 14;
+    } else {
+        used += 2;
+        w <<= 2;
+    }
+    uint32_t sig = 64 - d.lead - d.trail;
+    if (used + sig <= 64) {
+        d.r.pos += used + sig;
+        d.val ^= (w >> (64 - sig)) << d.trail;
+    } else {
+        d.r.pos += used;
+        d.val ^= bits_get(d.r, sig) << d.trail;
+    }
+    return true;
+}
+
+static size_t chunk_bytes(const TsChunk &c) {
+    return sizeof(TsChunk) + c.words.capacity() * sizeof(uint64_t);
+}
+
+static void chunk_close(TimeSeries *series, TsChunk &c) {
+    series->bytes -= chunk_bytes(c);
+    c.words.shrink_to_fit();
+    series->bytes += chunk_bytes(c);
+}
+
+// the oldest timestamp still within the retention, saturating at INT64_MIN
+static int64_t retention_min(const TimeSeries *series) {
+    int64_t last = series->chunks.back().last_ts;
+    if (last < INT64_MIN + series->retention) {
+        return INT64_MIN;
+    }
+    return last - series->retention;
+}
+
+// drops the chunks that only hold expired samples
+static void ts_trim(TimeSeries *series) {
+    if (series->retention <= 0 || series->chunks.empty()) {
+        return;
+    }
+    int64_t min_ts = retention_min(series);
+    while (series->chunks.size() > 1 && series->chunks.front().last_ts < min_ts) {
+        series->count -= series->chunks.front().count;
+        series->bytes -= chunk_bytes(series->chunks.front());
+        series->chunks.pop_front();
+    }
+}
+
+bool ts_add(TimeSeries *series, int64_t ts, double val) {
+    std::deque<TsChunk> &chunks = series->chunks;
+    if (!chunks.empty() && ts <= chunks.back().last_ts) {
+        return false;
+    }
+    if (chunks.empty() || chunks.back().nbits >= k_ts_chunk_bytes * 8) {
+        if (!chunks.empty()) {
+            chunk_close(series, chunks.back());
+        }
+        chunks.emplace_back();
+        TsChunk &c = chunks.back();
+        c.first_ts = c.last_ts = ts;
+        c.first_val = c.val = dbl_bits(val);
+        c.count = 1;
+        series->bytes += chunk_bytes(c);
+    } else {
+        TsChunk &c = chunks.back();
+        size_t before = chunk_bytes(c);
+        uint64_t delta = (uint64_t)ts - (uint64_t)c.last_ts;
+        put_dod(&c, (int64_t)(delta - (uint64_t)c.delta));
+        c.delta = (int64_t)delta;
+        c.last_ts = ts;
+        uint64_t bits = dbl_bits(val);
+        put_xor(&c, bits ^ c.val);
+        c.val = bits;
+        c.count++;
+        series->bytes += chunk_bytes(c) - before;
+    }
+    series->count++;
+    ts_trim(series);
+    return true;
+}
+
+// the first chunk that may hold samples at or after `from`, with `from`
+// raised past the expired samples
+static size_t ts_seek(const TimeSeries *series, int64_t &from) {
+    const std::deque<TsChunk> &chunks = series->chunks;
+    if (series->retention > 0 && !chunks.empty()) {
+        from = std::max(from, retention_min(series));
+    }
+    auto it = std::lower_bound(chunks.begin(), chunks.end(), from,
+        [](const TsChunk &c, int64_t ts) { return c.last_ts < ts; });
+    return (size_t)(it - chunks.begin());
+}
+
+void ts_range(const TimeSeries *series, int64_t from, int64_t to,
+    std::vector<TsSample> &out)
+{
+    const std::deque<TsChunk> &chunks = series->chunks;
+    for (size_t i = ts_seek(series, from); i < chunks.size(); i++) {
+        if (chunks[i].first_ts > to) {
+            break;
+        }
+        TsDecoder d;
+        dec_init(d, chunks[i]);
+        while (dec_next(d) && d.ts <= to) {
+            if (d.ts >= from) {
+                out.push_back({d.ts, bits_dbl(d.val)});
+            }
+        }
+    }
+}
+
+// the start of the bucket holding `ts` and, in `span`, the length left of it;
+// the first bucket is cut short at INT64_MIN
+static int64_t bucket_start(int64_t ts, int64_t bucket, uint64_t &span) {
+    int64_t rem = ts % bucket;
+    uint64_t back = (uint64_t)(rem < 0 ? rem + bucket : rem);
+    uint64_t room = (uint64_t)ts - (uint64_t)INT64_MIN;
+    if (room < back) {
+        span = (uint64_t)bucket - (back - room);
+        return INT64_MIN;
+    }
+    span = (uint64_t)bucket;
+    return (int64_t)((uint64_t)ts - back);
+}
+
+struct TsAcc {
+    int64_t start = 0;
+    uint64_t span = 0;
+    double min = 0;
+    double max = 0;
+    double sum = 0;
+    uint64_t count = 0;
+};
+
+static void acc_flush(const TsAcc &acc, uint32_t agg, std::vector<TsSample> &out) {
+    double val = 0;
+    switch (agg) {
+    case TS_AGG_MIN: val = acc.min; break;
+    case TS_AGG_MAX: val = acc.max; break;
+    case TS_AGG_AVG: val = acc.sum / (double)acc.count; break;
+    case TS_AGG_SUM: val = acc.sum; break;
+    default: val = (double)acc.count; break;
+    }
+    out.push_back({acc.start, val});
+}
+
+void ts_aggregate(const TimeSeries *series, int64_t from, int64_t to,
+    int64_t bucket, uint32_t agg, std::vector<TsSample> &out)
+{
+    assert(bucket > 0);
+    const std::deque<TsChunk> &chunks = series->chunks;
+    TsAcc acc;
+    for (size_t i = ts_seek(series, from); i < chunks.size(); i++) {
+        if (chunks[i].first_ts > to) {
+            break;
+        }
+        TsDecoder d;
+        dec_init(d, chunks[i]);
+        while (dec_next(d) && d.ts <= to) {
+            if (d.ts < from) {
+                continue;
+            }
+            double val = bits_dbl(d.val);
+            // unsigned: the distance can exceed INT64_MAX
+            if (acc.count == 0 || (uint64_t)d.ts - (uint64_t)acc.start >= acc.span) {
+                if (acc.count) {
+                    acc_flush(acc, agg, out);
+                }
+                acc.start = bucket_start(d.ts, bucket, acc.span);
+                acc.min = acc.max = acc.sum = val;
+                acc.count = 1;
+                continue;
+            }
+            acc.min = std::min(acc.min, val);
+            acc.max = std::max(acc.max, val);
+            acc.sum += val;
+            acc.count++;
+        }
+    }
+    if (acc.count) {
+        acc_flush(acc, agg, out);
+    }
+}
+
+void ts_set_retention(TimeSeries *series, int64_t retention) {
+    series->retention = retention;
+    ts_trim(series);
+}
+
+size_t ts_bytes(const TimeSeries *series) {
+    return series->bytes;
+}
+
+void ts_clear(TimeSeries *series) {
+    std::deque<TsChunk>().swap(series->chunks);
+    series->count = 0;
+    series->bytes = 0;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+
+// Time series of (timestamp, double) samples in increasing timestamp
+// order, compressed Gorilla-style into chunks of about k_ts_chunk_bytes:
+// timestamps as delta-of-deltas, values XORed with the previous one. A
+// regular series with slowly changing values takes a few bits per sample.
+const size_t k_ts_chunk_bytes = 4096;
+
+struct TsChunk {
+    int64_t first_ts = 0;
+    int64_t last_ts = 0;
+    uint64_t first_val = 0;     // the bits of the double
+    uint32_t count = 0;
+    // encoder state
+    int64_t delta = 0;
+    uint64_t val = 0;
+    uint32_t lead = 64;         // the window of the previous XOR
+    uint32_t trail = 0;
+    std::vector<uint64_t> words;
+    size_t nbits = 0;
+};
+
+struct TimeSeries {
+    std::deque<TsChunk> chunks;
+    size_t count = 0;
+    int64_t retention = 0;      // in timestamp units, 0 to keep everything
+    size_t bytes = 0;           // of the chunks
+};
+
+struct TsSample {
+    int64_t ts = 0;
+    double val = 0;
+};
+
+// aggregates of a downsampled range
+enum {
+    TS_AGG_MIN = 0,
+    TS_AGG_MAX = 1,
+    TS_AGG_AVG = 2,
+    TS_AGG_SUM = 3,
+    TS_AGG_COUNT = 4,
+};
+
+// false if `ts` is not after the last sample
+bool   ts_add(TimeSeries *series, int64_t ts, double val);
+// the samples in [from, to]
+void   ts_range(const TimeSeries *series, int64_t from, int64_t to,
+    std::vector<TsSample> &out);
+// one sample per non-empty bucket of `bucket` units in [from, to],
+// stamped with the start of the bucket
+void   ts_aggregate(const TimeSeries *series, int64_t from, int64_t to,
+    int64_t bucket, uint32_t agg, std::vector<TsSample> &out);
+// samples older than the last one by more than `retention` are dropped,
+// whole chunks at a time, and never returned
+void   ts_set_retention(TimeSeries *series, int64_t retention);
+// the heap bytes of the chunks
+size_t ts_bytes(const TimeSeries *series);
+void   ts_clear(TimeSeries *series);
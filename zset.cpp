@@ -1,12 +1,14 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <vector>
+#include <algorithm>
 
 #include "zset.h"
 #include "common.h"
 
 
-static ZNode *znode_new(const char *name, size_t len, double score) {
+static ZNode *znode_new(ZSet *zset, const char *name, size_t len, double score) {
     ZNode *node = (ZNode *)malloc(sizeof(ZNode) + len);
     assert(node);
     avl_init(&node->tree);
@@ -15,11 +17,16 @@ static ZNode *znode_new(const char *name, size_t len, double score) {
     node->score = score;
     node->len = len;
     memcpy(&node->name[0], name, len);
+    zset->bytes += mem_usable(node);
     return node;
 }
 
-static void znode_del(ZNode *node) {
-    free(node);
+static void znode_del(ZSet *zset, ZNode *node) {
+    if (zset->free_node) {
+        zset->free_node(node);
+    } else {
+        free(node);
+    }
 }
 
 static size_t min(size_t lhs, size_t rhs) {
@@ -65,7 +72,8 @@ static void zset_update(ZSet *zset, ZNode *node, double score) {
     zset->root = avl_del(&node->tree);
     avl_init(&node->tree);
 
-    node->score = score;
+    // read by zset_score_shared()
+    __atomic_store(&node->score, &score, __ATOMIC_RELAXED);
     tree_insert(zset, node);
 }
 
@@ -75,7 +83,7 @@ bool zset_insert(ZSet *zset, const char *name, size_t len, double score) {
         zset_update(zset, node, score);
         return false;
     } else {
-        node = znode_new(name, len, score);
+        node = znode_new(zset, name, len, score);
         hm_insert(&zset->hmap, &node->hmap);
         tree_insert(zset, node);
         return true;
@@ -110,6 +118,31 @@ ZNode *zset_lookup(ZSet *zset, const char *name, size_t len) {
     return found ? container_of(found, ZNode, hmap) : NULL;
 }
 
+// Looks up the member named like `like` (a member of some other set) by
+// its cached hash. Nothing is modified, not even the rehashing progress,
+// so several threads may search the same set as long as nobody writes it.
+ZNode *zset_find(ZSet *zset, const ZNode *like) {
+    HKey key;
+    key.node.hcode = like->hmap.hcode;
+    key.name = like->name;
+    key.len = like->len;
+    HNode *found = hm_find(&zset->hmap, &key.node, &hcmp);
+    return found ? container_of(found, ZNode, hmap) : NULL;
+}
+
+bool zset_score_shared(ZSet *zset, const char *name, size_t len, double *score) {
+    HKey key;
+    key.node.hcode = str_hash((uint8_t *)name, len);
+    key.name = name;
+    key.len = len;
+    HNode *found = hm_find_shared(&zset->hmap, &key.node, &hcmp);
+    if (!found) {
+        return false;
+    }
+    __atomic_load(&container_of(found, ZNode, hmap)->score, score, __ATOMIC_RELAXED);
+    return true;
+}
+
 void zset_delete(ZSet *zset, ZNode *node) {
     HKey key;
     key.node.hcode = node->hmap.hcode;
@@ -120,7 +153,8 @@ void zset_delete(ZSet *zset, ZNode *node) {
 
     zset->root = avl_del(&node->tree);
 
-    znode_del(node);
+    zset->bytes -= mem_usable(node);
+    znode_del(zset, node);
 }
 
 ZNode *zset_seekge(ZSet *zset, double score, const char *name, size_t len) {
@@ -141,17 +175,223 @@ ZNode *znode_offset(ZNode *node, int64_t offset) {
     return tnode ? container_of(tnode, ZNode, tree) : NULL;
 }
 
-static void tree_dispose(AVLNode *node) {
+void zset_dispose(AVLNode *node) {
     if (!node) {
         return;
     }
-    tree_dispose(node->left);
-    tree_dispose(node->right);
-    znode_del(container_of(node, ZNode, tree));
+    zset_dispose(node->left);
+    zset_dispose(node->right);
+    free(container_of(node, ZNode, tree));
 }
 
 void zset_clear(ZSet *zset) {
     hm_clear(&zset->hmap);
-    tree_dispose(zset->root);
+    zset_dispose(zset->root);
     zset->root = NULL;
+    zset->bytes = 0;
+}
+
+size_t zset_size(ZSet *zset) {
+    return avl_cnt(zset->root);
+}
+
+size_t zset_bytes(const ZSet *zset) {
+    return zset->bytes + hm_bytes(&zset->hmap);
+}
+
+// the number of members with a score below `score`, or not above it
+uint64_t zset_count_below(ZSet *zset, double score, bool inclusive) {
+    uint64_t n = 0;
+    for (AVLNode *node = zset->root; node; ) {
+        double s = container_of(node, ZNode, tree)->score;
+        if (s < score || (inclusive && s == score)) {
+            n += avl_cnt(node->left) + 1;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    return n;
+}
+
+// the member at 0-based `rank`
+ZNode *zset_at(ZSet *zset, uint64_t rank) {
+    AVLNode *node = zset->root;
+    while (node) {
+        uint64_t left = avl_cnt(node->left);
+        if (rank == left) {
+            return container_of(node, ZNode, tree);
+        } else if (rank < left) {
+            node = node->left;
+        } else {
+            rank -= left + 1;
+            node = node->right;
+        }
+    }
+    return NULL;
+}
+
+uint64_t znode_rank(ZNode *node) {
+    return avl_rank(&node->tree);
+}
+
+static bool hnode_same(HNode *node, HNode *key) {
+    return node == key;
+}
+
+static bool hcmp_node(HNode *node, HNode *key) {
+    ZNode *lhs = container_of(node, ZNode, hmap);
+    ZNode *rhs = container_of(key, ZNode, hmap);
+    return lhs->len == rhs->len && 0 == memcmp(lhs->name, rhs->name, lhs->len);
+}
+
+static void tree_collect(AVLNode *node, std::vector<ZNode *> &out) {
+    while (node) {
+        tree_collect(node->left, out);
+        out.push_back(container_of(node, ZNode, tree));
+        node = node->right;
+    }
+}
+
+const size_t k_prefetch_group = 16;
+
+// the hash table deletions miss the cache on every member, so they are
+// issued in groups with the buckets prefetched ahead
+static void hmap_detach_tree(ZSet *zset, AVLNode *tree) {
+    HMap *hmap = &zset->hmap;
+    std::vector<ZNode *> nodes;
+    nodes.reserve(avl_cnt(tree));
+    tree_collect(tree, nodes);
+    for (size_t i = 0; i < nodes.size(); i += k_prefetch_group) {
+        size_t end = std::min(nodes.size(), i + k_prefetch_group);
+        for (size_t j = i; j < end; j++) {
+            hm_prefetch_slot(hmap, nodes[j]->hmap.hcode);
+        }
+        for (size_t j = i; j < end; j++) {
+            hm_prefetch_node(hmap, nodes[j]->hmap.hcode);
+        }
+        for (size_t j = i; j < end; j++) {
+            HNode *found = hm_delete(hmap, &nodes[j]->hmap, &hnode_same);
+            assert(found);
+            (void)found;
+            zset->bytes -= mem_usable(nodes[j]);
+        }
+    }
+}
+
+// Removes the members ranked [start, stop) in O(log n) tree operations
+// plus O(k) hash table deletions. The removed members are returned as a
+// tree for zset_dispose(), which may run on another thread.
+AVLNode *zset_detach_range(ZSet *zset, uint64_t start, uint64_t stop) {
+    if (start >= stop) {
+        return NULL;
+    }
+    AVLNode *head = NULL;
+    AVLNode *rest = NULL;
+    AVLNode *mid = NULL;
+    AVLNode *tail = NULL;
+    avl_split(zset->root, start, &head, &rest);
+    avl_split(rest, stop - start, &mid, &tail);
+    zset->root = avl_concat(head, tail);
+    hmap_detach_tree(zset, mid);
+    return mid;
+}
+
+bool zmember_less(const ZMember &lhs, const ZMember &rhs) {
+    if (lhs.score != rhs.score) {
+        return lhs.score < rhs.score;
+    }
+    int rv = memcmp(lhs.name, rhs.name, min(lhs.len, rhs.len));
+    if (rv != 0) {
+        return rv < 0;
+    }
+    return lhs.len < rhs.len;
+}
+
+static AVLNode *tree_build(ZNode **nodes, size_t n, AVLNode *parent) {
+    if (n == 0) {
+        return NULL;
+    }
+    size_t mid = n / 2;
+    AVLNode *node = &nodes[mid]->tree;
+    node->parent = parent;
+    node->left = tree_build(nodes, mid, node);
+    node->right = tree_build(nodes + mid + 1, n - mid - 1, node);
+    node->height = 1 + std::max(avl_height(node->left), avl_height(node->right));
+    node->cnt = (uint32_t)n;
+    return node;
+}
+
+// Builds the members into a balanced tree, taking the middle of each range
+// as the subtree root instead of inserting and rebalancing one member at a
+// time, then appends it to the set. With `check`, a name that is already
+// present undoes the whole batch.
+static bool zset_build_sorted(ZSet *zset, const ZMember *members, size_t n, bool check) {
+    if (n == 0) {
+        return true;
+    }
+    hm_reserve(&zset->hmap, hm_size(&zset->hmap) + n);
+    std::vector<ZNode *> nodes(n);
+    for (size_t i = 0; i < n; i++) {
+        nodes[i] = znode_new(zset, members[i].name, members[i].len, members[i].score);
+        if (check && hm_find(&zset->hmap, &nodes[i]->hmap, &hcmp_node)) {
+            for (size_t j = 0; j <= i; j++) {
+                if (j < i) {
+                    hm_delete(&zset->hmap, &nodes[j]->hmap, &hnode_same);
+                }
+                zset->bytes -= mem_usable(nodes[j]);
+                znode_del(zset, nodes[j]);
+            }
+            return false;
+        }
+        hm_insert(&zset->hmap, &nodes[i]->hmap);
+    }
+    zset->root = avl_concat(zset->root, tree_build(nodes.data(), n, NULL));
+    return true;
+}
+
+// Adds members that are unique, ordered by zmember_less() and all ordered
+// after the current last member, in O(n + log size).
+void zset_build(ZSet *zset, const ZMember *members, size_t n) {
+    bool ok = zset_build_sorted(zset, members, n, false);
+    assert(ok);
+    (void)ok;
+}
+
+// zset_build() for untrusted input: returns false and leaves the set as it
+// was if the members are out of order or a name is repeated.
+bool zset_load(ZSet *zset, const ZMember *members, size_t n) {
+    if (n == 0) {
+        return true;
+    }
+    AVLNode *last = zset->root;
+    while (last && last->right) {
+        last = last->right;
+    }
+    if (last) {
+        ZNode *znode = container_of(last, ZNode, tree);
+        ZMember m;
+        m.name = znode->name;
+        m.len = znode->len;
+        m.score = znode->score;
+        if (!zmember_less(m, members[0])) {
+            return false;
+        }
+    }
+    for (size_t i = 1; i < n; i++) {
+        if (!zmember_less(members[i - 1], members[i])) {
+            return false;
+        }
+    }
+    return zset_build_sorted(zset, members, n, true);
+}
+
+ZNode *zset_move(ZSet *zset, ZNode *node, void *mem) {
+    ZNode *copy = (ZNode *)mem;
+    memcpy(copy, node, znode_size(node));
+    avl_move(&node->tree, &copy->tree, &zset->root);
+    hm_move(&zset->hmap, &node->hmap, &copy->hmap);
+    zset->bytes += mem_usable(copy) - mem_usable(node);
+    znode_del(zset, node);
+    return copy;
 }
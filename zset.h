@@ -7,6 +7,9 @@
 struct ZSet {
     AVLNode *root = NULL;
     HMap hmap;           
+    size_t bytes = 0;    // of the nodes
+    // frees deleted members, free() if NULL
+    void (*free_node)(void *) = NULL;
 };
 
 struct ZNode {
@@ -17,9 +20,34 @@ struct ZNode {
     char    name[0];     
 };
 
+// a member for zset_build(); `name` is only borrowed
+struct ZMember {
+    const char *name = NULL;
+    size_t len = 0;
+    double score = 0;
+};
+
 bool   zset_insert(ZSet *zset, const char *name, size_t len, double score);
 ZNode *zset_lookup(ZSet *zset, const char *name, size_t len);
 void   zset_delete(ZSet *zset, ZNode *node);
 ZNode *zset_seekge(ZSet *zset, double score, const char *name, size_t len);
 void   zset_clear(ZSet *zset);
 ZNode *znode_offset(ZNode *node, int64_t offset);
+uint64_t znode_rank(ZNode *node);
+size_t   zset_size(ZSet *zset);
+// the heap bytes of the members and the hash table
+size_t   zset_bytes(const ZSet *zset);
+uint64_t zset_count_below(ZSet *zset, double score, bool inclusive);
+ZNode   *zset_at(ZSet *zset, uint64_t rank);
+AVLNode *zset_detach_range(ZSet *zset, uint64_t start, uint64_t stop);
+void     zset_dispose(AVLNode *tree);
+ZNode   *zset_find(ZSet *zset, const ZNode *like);
+// the score of a member for reader threads, see hm_find_shared()
+bool     zset_score_shared(ZSet *zset, const char *name, size_t len, double *score);
+bool     zmember_less(const ZMember &lhs, const ZMember &rhs);
+void     zset_build(ZSet *zset, const ZMember *members, size_t n);
+bool     zset_load(ZSet *zset, const ZMember *members, size_t n);
+// moves `node` into `mem`, a malloc() block of at least znode_size(node)
+// bytes, and frees the old one
+ZNode   *zset_move(ZSet *zset, ZNode *node, void *mem);
+inline size_t znode_size(const ZNode *node) { return sizeof(ZNode) + node->len; }